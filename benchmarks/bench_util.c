@@ -0,0 +1,100 @@
+/*
+ * bench_util.c
+ *
+ * Helper functions shared by the benchmark programs.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+#ifndef _FILE_OFFSET_BITS
+#  define _FILE_OFFSET_BITS 64
+#endif
+
+#include "bench_util.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Print an error message and exit.  */
+void
+fatal(const char *format, ...)
+{
+	va_list va;
+
+	va_start(va, format);
+	fprintf(stderr, "%s: ", bench_name);
+	vfprintf(stderr, format, va);
+	putc('\n', stderr);
+	va_end(va);
+	exit(1);
+}
+
+uint64_t
+current_time_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Parse the argument @arg of the option --@option, a comma-separated list of
+ * positive numbers, into @list.  */
+void
+parse_value_list(const char *arg, const char *option, struct value_list *list)
+{
+	const char *p = arg;
+	char *end;
+
+	list->num_values = 0;
+	do {
+		if (list->num_values == MAX_VALUES)
+			fatal("too many values for --%s", option);
+		errno = 0;
+		list->values[list->num_values] = strtoull(p, &end, 10);
+		if (errno || end == p || (*end != ',' && *end != '\0') ||
+		    list->values[list->num_values] == 0)
+			fatal("invalid value for --%s: \"%s\"", option, arg);
+		list->num_values++;
+		p = end + 1;
+	} while (*end == ',');
+}
+
+/* Read all the corpus files into one buffer.  */
+void *
+load_corpus(char **paths, int num_paths, size_t *size_ret)
+{
+	char *buf = NULL;
+	size_t size = 0;
+
+	for (int i = 0; i < num_paths; i++) {
+		FILE *fp = fopen(paths[i], "rb");
+		char *newbuf;
+		long file_size;
+
+		if (fp == NULL)
+			fatal("can't open \"%s\": %s", paths[i], strerror(errno));
+		if (fseek(fp, 0, SEEK_END) || (file_size = ftell(fp)) < 0 ||
+		    fseek(fp, 0, SEEK_SET))
+			fatal("can't get size of \"%s\": %s", paths[i],
+			      strerror(errno));
+		newbuf = realloc(buf, size + file_size);
+		if (newbuf == NULL && size + file_size != 0)
+			fatal("out of memory");
+		buf = newbuf;
+		if (fread(buf + size, 1, file_size, fp) != (size_t)file_size)
+			fatal("error reading \"%s\"", paths[i]);
+		size += file_size;
+		fclose(fp);
+	}
+	*size_ret = size;
+	return buf;
+}
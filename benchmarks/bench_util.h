@@ -0,0 +1,41 @@
+/*
+ * bench_util.h
+ *
+ * Helper functions shared by the benchmark programs.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#ifndef _BENCH_UTIL_H
+#define _BENCH_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_VALUES		64
+
+/* The values of an option given as a comma-separated list of numbers.  */
+struct value_list {
+	unsigned num_values;
+	uint64_t values[MAX_VALUES];
+};
+
+/* The name of the benchmark program, which fatal() prints before each message.
+ * Each benchmark program defines this.  */
+extern const char bench_name[];
+
+extern void
+fatal(const char *format, ...)
+	__attribute__((noreturn, format(printf, 1, 2)));
+
+extern uint64_t
+current_time_nsec(void);
+
+extern void
+parse_value_list(const char *arg, const char *option, struct value_list *list);
+
+extern void *
+load_corpus(char **paths, int num_paths, size_t *size_ret);
+
+#endif /* _BENCH_UTIL_H */
@@ -0,0 +1,351 @@
+/*
+ * compressbench.c
+ *
+ * Benchmark wimlib's compressors and decompressors.  The corpus files are
+ * concatenated and split into chunks, and each chunk is compressed with
+ * wimlib_compress() and decompressed again with wimlib_decompress(), for each
+ * of the XPRESS, LZX, and LZMS compression types at each chunk size the
+ * compressor accepts and each of the requested compression levels.  For each
+ * combination the compression ratio, the compression and decompression speeds,
+ * and the memory needed by the compressor (as reported by
+ * wimlib_get_compressor_needed_memory()) are printed.
+ *
+ * Build and run on the default corpus (wimlib's own source code) with:
+ *
+ *    $ make bench-compress
+ *
+ * or build with 'make benchmarks/compressbench' and run with:
+ *
+ *    $ benchmarks/compressbench [OPTION...] FILE...
+ *
+ * Options:
+ *
+ *    --ctype=TYPE[,TYPE...]   Compression types to test (xpress, lzx, lzms).
+ *                             Default: all.
+ *    --levels=N[,N...]        Compression levels to test.  Default: 10,50,100.
+ *    --chunk-sizes=N[,N...]   Chunk sizes to test.  Default: every power of 2
+ *                             from 4096 that the compressor accepts, up to the
+ *                             size of the corpus.
+ *    --repeat=N               Run each test N times and report the fastest.
+ *                             Default: 1.
+ *    --csv=FILE               Also write the results to FILE in CSV format, one
+ *                             line per test, for comparison between versions.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+#ifndef _FILE_OFFSET_BITS
+#  define _FILE_OFFSET_BITS 64
+#endif
+
+#include <wimlib.h>
+
+#include "bench_util.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_CHUNK_ORDER		12
+#define MAX_CHUNK_ORDER		30
+
+struct result {
+	uint64_t uncompressed_size;
+	uint64_t compressed_size;
+	uint64_t compress_nsec;
+	uint64_t decompress_nsec;
+};
+
+static const struct {
+	const char *name;
+	enum wimlib_compression_type ctype;
+} ctypes[] = {
+	{ "XPRESS", WIMLIB_COMPRESSION_TYPE_XPRESS, },
+	{ "LZX",    WIMLIB_COMPRESSION_TYPE_LZX,    },
+	{ "LZMS",   WIMLIB_COMPRESSION_TYPE_LZMS,   },
+};
+
+#define NUM_CTYPES	(sizeof(ctypes) / sizeof(ctypes[0]))
+
+const char bench_name[] = "compressbench";
+
+static void
+parse_ctypes(const char *arg, bool enabled[NUM_CTYPES])
+{
+	char *copy = strdup(arg);
+	char *saveptr;
+
+	if (copy == NULL)
+		fatal("out of memory");
+	memset(enabled, 0, NUM_CTYPES * sizeof(enabled[0]));
+	for (char *tok = strtok_r(copy, ",", &saveptr); tok != NULL;
+	     tok = strtok_r(NULL, ",", &saveptr))
+	{
+		size_t i;
+
+		for (i = 0; i < NUM_CTYPES; i++)
+			if (!strcasecmp(tok, ctypes[i].name))
+				break;
+		if (i == NUM_CTYPES)
+			fatal("unknown compression type \"%s\"", tok);
+		enabled[i] = true;
+	}
+	free(copy);
+}
+
+/* Compress and decompress the corpus in chunks of @chunk_size bytes with the
+ * compression type ctypes[@t].  Returns false if the compressor does not
+ * support @chunk_size.  */
+static bool
+run_test(size_t t, size_t chunk_size,
+	 unsigned level, const uint8_t *corpus, size_t corpus_size,
+	 unsigned repeat, struct result *result)
+{
+	struct wimlib_compressor *c;
+	struct wimlib_decompressor *d;
+	uint8_t *cbuf, *dbuf;
+	size_t *csizes;
+	size_t num_chunks = (corpus_size + chunk_size - 1) / chunk_size;
+	enum wimlib_compression_type ctype = ctypes[t].ctype;
+	int ret;
+
+	ret = wimlib_create_compressor(ctype, chunk_size, level, &c);
+	if (ret == WIMLIB_ERR_INVALID_PARAM)
+		return false;
+	if (ret)
+		fatal("wimlib_create_compressor(): %s",
+		      wimlib_get_error_string(ret));
+	ret = wimlib_create_decompressor(ctype, chunk_size, &d);
+	if (ret)
+		fatal("wimlib_create_decompressor(): %s",
+		      wimlib_get_error_string(ret));
+
+	/* The compressed data of each chunk is kept so that decompression can
+	 * be timed separately.  A chunk that doesn't compress to less than its
+	 * original size would be stored uncompressed.  */
+	cbuf = malloc(num_chunks * chunk_size);
+	dbuf = malloc(chunk_size);
+	csizes = malloc(num_chunks * sizeof(csizes[0]));
+	if (cbuf == NULL || dbuf == NULL || csizes == NULL)
+		fatal("out of memory");
+
+	result->uncompressed_size = corpus_size;
+	result->compressed_size = 0;
+	result->compress_nsec = UINT64_MAX;
+	result->decompress_nsec = UINT64_MAX;
+
+	for (unsigned r = 0; r < repeat; r++) {
+		uint64_t start, elapsed;
+
+		start = current_time_nsec();
+		for (size_t i = 0; i < num_chunks; i++) {
+			size_t usize = chunk_size;
+
+			if (i == num_chunks - 1)
+				usize = corpus_size - i * chunk_size;
+			csizes[i] = wimlib_compress(&corpus[i * chunk_size],
+						    usize,
+						    &cbuf[i * chunk_size],
+						    usize - 1, c);
+		}
+		elapsed = current_time_nsec() - start;
+		if (elapsed < result->compress_nsec)
+			result->compress_nsec = elapsed;
+
+		start = current_time_nsec();
+		for (size_t i = 0; i < num_chunks; i++) {
+			size_t usize = chunk_size;
+
+			if (i == num_chunks - 1)
+				usize = corpus_size - i * chunk_size;
+			if (csizes[i] == 0)
+				continue;
+			if (wimlib_decompress(&cbuf[i * chunk_size], csizes[i],
+					      dbuf, usize, d))
+				fatal("%s: decompression failed (chunk size "
+				      "%zu, level %u)", ctypes[t].name,
+				      chunk_size, level);
+			if (r == 0 && memcmp(dbuf, &corpus[i * chunk_size],
+					     usize))
+				fatal("%s: data did not round-trip (chunk "
+				      "size %zu, level %u)", ctypes[t].name,
+				      chunk_size, level);
+		}
+		elapsed = current_time_nsec() - start;
+		if (elapsed < result->decompress_nsec)
+			result->decompress_nsec = elapsed;
+	}
+
+	for (size_t i = 0; i < num_chunks; i++) {
+		size_t usize = chunk_size;
+
+		if (i == num_chunks - 1)
+			usize = corpus_size - i * chunk_size;
+		result->compressed_size += csizes[i] ? csizes[i] : usize;
+	}
+
+	free(csizes);
+	free(dbuf);
+	free(cbuf);
+	wimlib_free_decompressor(d);
+	wimlib_free_compressor(c);
+	return true;
+}
+
+static double
+mb_per_sec(uint64_t bytes, uint64_t nsec)
+{
+	if (nsec == 0)
+		nsec = 1;
+	return (double)bytes * 1000 / nsec;
+}
+
+static const struct option longopts[] = {
+	{"ctype",	required_argument, NULL, 't'},
+	{"levels",	required_argument, NULL, 'l'},
+	{"chunk-sizes",	required_argument, NULL, 's'},
+	{"repeat",	required_argument, NULL, 'r'},
+	{"csv",		required_argument, NULL, 'c'},
+	{NULL, 0, NULL, 0},
+};
+
+int
+main(int argc, char **argv)
+{
+	bool enabled[NUM_CTYPES] = { true, true, true };
+	struct value_list levels = { 3, { 10, 50, 100 } };
+	struct value_list chunk_sizes = { 0 };
+	unsigned repeat = 1;
+	const char *csv_path = NULL;
+	FILE *csv = NULL;
+	uint8_t *corpus;
+	size_t corpus_size;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			parse_ctypes(optarg, enabled);
+			break;
+		case 'l':
+			parse_value_list(optarg, "levels", &levels);
+			break;
+		case 's':
+			parse_value_list(optarg, "chunk-sizes", &chunk_sizes);
+			break;
+		case 'r':
+			repeat = strtoul(optarg, NULL, 10);
+			if (repeat == 0)
+				fatal("invalid value for --repeat");
+			break;
+		case 'c':
+			csv_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [--ctype=TYPE[,TYPE...]] "
+				"[--levels=N[,N...]]\n"
+				"       [--chunk-sizes=N[,N...]] [--repeat=N] "
+				"[--csv=FILE] FILE...\n", argv[0]);
+			return 2;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		fatal("no corpus files given");
+
+	corpus = load_corpus(argv, argc, &corpus_size);
+	if (corpus_size == 0)
+		fatal("the corpus is empty");
+
+	/* By default, test each power of 2 from the minimum up to the first
+	 * one that is at least the size of the corpus; run_test() skips those
+	 * the compressor doesn't accept.  */
+	if (chunk_sizes.num_values == 0) {
+		for (unsigned order = MIN_CHUNK_ORDER;
+		     order <= MAX_CHUNK_ORDER; order++)
+		{
+			chunk_sizes.values[chunk_sizes.num_values++] =
+				(uint64_t)1 << order;
+			if (((uint64_t)1 << order) >= corpus_size)
+				break;
+		}
+	}
+
+	if (csv_path) {
+		csv = fopen(csv_path, "w");
+		if (csv == NULL)
+			fatal("can't open \"%s\": %s", csv_path,
+			      strerror(errno));
+		fprintf(csv, "ctype,chunk_size,level,uncompressed_size,"
+			"compressed_size,ratio,compress_mb_per_sec,"
+			"decompress_mb_per_sec,compressor_memory\n");
+	}
+
+	printf("Corpus: %zu bytes in %d file(s)\n\n", corpus_size, argc);
+	printf("%-6s %10s %5s %14s %7s %11s %11s %12s\n",
+	       "Type", "Chunk size", "Level", "Compressed", "Ratio",
+	       "Comp MB/s", "Decomp MB/s", "Memory");
+
+	for (size_t t = 0; t < NUM_CTYPES; t++) {
+		if (!enabled[t])
+			continue;
+		for (unsigned s = 0; s < chunk_sizes.num_values; s++) {
+			for (unsigned l = 0; l < levels.num_values; l++) {
+				size_t chunk_size = chunk_sizes.values[s];
+				unsigned level = levels.values[l];
+				struct result res;
+				uint64_t mem;
+				double ratio;
+
+				if (!run_test(t, chunk_size,
+					      level, corpus, corpus_size,
+					      repeat, &res))
+					break;
+
+				mem = wimlib_get_compressor_needed_memory(
+						ctypes[t].ctype, chunk_size,
+						level);
+				ratio = (double)res.compressed_size /
+					res.uncompressed_size;
+
+				printf("%-6s %10zu %5u %14"PRIu64" %7.4f "
+				       "%11.2f %11.2f %12"PRIu64"\n",
+				       ctypes[t].name, chunk_size, level,
+				       res.compressed_size, ratio,
+				       mb_per_sec(res.uncompressed_size,
+						  res.compress_nsec),
+				       mb_per_sec(res.uncompressed_size,
+						  res.decompress_nsec),
+				       mem);
+				if (csv) {
+					fprintf(csv, "%s,%zu,%u,%"PRIu64","
+						"%"PRIu64",%.6f,%.3f,%.3f,"
+						"%"PRIu64"\n",
+						ctypes[t].name, chunk_size,
+						level, res.uncompressed_size,
+						res.compressed_size, ratio,
+						mb_per_sec(res.uncompressed_size,
+							   res.compress_nsec),
+						mb_per_sec(res.uncompressed_size,
+							   res.decompress_nsec),
+						mem);
+				}
+				fflush(stdout);
+			}
+		}
+	}
+
+	if (csv && fclose(csv))
+		fatal("error writing \"%s\"", csv_path);
+	free(corpus);
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * lookupbench.c
+ *
+ * Benchmark the stream lookup table, which maps SHA-1 message digests to
+ * 'struct wim_lookup_table_entry's.  For each table size, the time to insert
+ * all entries, look up each one, look up digests that are not present, and
+ * remove all entries is measured.
+ *
+ * Build with:
+ *
+ *    $ make benchmarks/lookupbench
+ *
+ * Run with:
+ *
+ *    $ benchmarks/lookupbench [NUM_STREAMS...]
+ *
+ * The default is to test 1 million and 10 million streams.  The latter needs
+ * about 2.5 GB of memory.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/lookup_table.h"
+#include "wimlib/sha1.h"
+
+#include "bench_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+const char bench_name[] = "lookupbench";
+
+static u64 rand_state = 0x9E3779B97F4A7C15;
+
+/* Generate a pseudorandom "message digest" with xorshift64*.  Real SHA-1
+ * message digests are uniformly distributed, so every byte must be too.  */
+static void
+gen_hash(u8 hash[SHA1_HASH_SIZE])
+{
+	for (int i = 0; i < SHA1_HASH_SIZE; i++) {
+		rand_state ^= rand_state >> 12;
+		rand_state ^= rand_state << 25;
+		rand_state ^= rand_state >> 27;
+		hash[i] = (rand_state * 0x2545F4914F6CDD1D) >> 56;
+	}
+}
+
+static double
+mops(size_t n, u64 start)
+{
+	return (double)n * 1000 / (current_time_nsec() - start);
+}
+
+static void
+print_rates(size_t n, const double rates[4], size_t found)
+{
+	printf("%10zu %10.2f %10.2f %10.2f %10.2f%s\n",
+	       n, rates[0], rates[1], rates[2], rates[3],
+	       (found == n) ? "" : "  (WRONG RESULTS)");
+}
+
+static int
+run_benchmark(size_t n)
+{
+	struct wim_lookup_table_entry **entries;
+	u8 (*missing)[SHA1_HASH_SIZE];
+	struct wim_lookup_table *table;
+	double rates[4];
+	size_t found;
+	u64 start;
+
+	entries = malloc(n * sizeof(entries[0]));
+	missing = malloc(n * sizeof(missing[0]));
+	if (!entries || !missing)
+		goto oom;
+	for (size_t i = 0; i < n; i++) {
+		entries[i] = new_lookup_table_entry();
+		if (!entries[i])
+			goto oom;
+		gen_hash(entries[i]->hash);
+		gen_hash(missing[i]);
+	}
+
+	/* Start at the size wimlib uses for a new WIM.  */
+	table = new_lookup_table(9001);
+	if (!table)
+		goto oom;
+
+	start = current_time_nsec();
+	for (size_t i = 0; i < n; i++)
+		lookup_table_insert(table, entries[i]);
+	rates[0] = mops(n, start);
+
+	found = 0;
+	start = current_time_nsec();
+	for (size_t i = 0; i < n; i++)
+		found += (lookup_stream(table, entries[i]->hash) == entries[i]);
+	rates[1] = mops(n, start);
+
+	start = current_time_nsec();
+	for (size_t i = 0; i < n; i++)
+		found += (lookup_stream(table, missing[i]) != NULL);
+	rates[2] = mops(n, start);
+
+	start = current_time_nsec();
+	for (size_t i = 0; i < n; i++)
+		lookup_table_unlink(table, entries[i]);
+	rates[3] = mops(n, start);
+	free_lookup_table(table);
+
+	print_rates(n, rates, found);
+
+	for (size_t i = 0; i < n; i++)
+		free_lookup_table_entry(entries[i]);
+	free(entries);
+	free(missing);
+	return 0;
+
+oom:
+	fprintf(stderr, "Out of memory testing %zu streams\n", n);
+	return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const size_t default_sizes[] = { 1000000, 10000000 };
+	int status = 0;
+
+	printf("%10s %10s %10s %10s %10s\n",
+	       "streams", "insert", "hit", "miss", "remove");
+	printf("%10s %10s %10s %10s %10s\n",
+	       "", "Mop/s", "Mop/s", "Mop/s", "Mop/s");
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++) {
+			size_t n = strtoul(argv[i], NULL, 10);
+
+			if (n == 0) {
+				fprintf(stderr, "Usage: %s [NUM_STREAMS...]\n",
+					argv[0]);
+				return 2;
+			}
+			status |= run_benchmark(n);
+		}
+	} else {
+		for (size_t i = 0; i < ARRAY_LEN(default_sizes); i++)
+			status |= run_benchmark(default_sizes[i]);
+	}
+	return status;
+}
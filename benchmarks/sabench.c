@@ -0,0 +1,267 @@
+/*
+ * sabench.c
+ *
+ * Benchmark the construction of the suffix array (SA), inverse suffix array
+ * (ISA), and longest common prefix array (LCP) used by the suffix array based
+ * match-finders, for several window sizes and numbers of threads.  The arrays
+ * built with more than one thread are checked against those built with one.
+ *
+ * Build and run on the default corpus (wimlib's own source code) with:
+ *
+ *    $ make bench-sa
+ *
+ * or build with 'make benchmarks/sabench' and run with:
+ *
+ *    $ benchmarks/sabench [OPTION...] FILE...
+ *
+ * The corpus files are concatenated, and repeated as many times as needed to
+ * fill each window.
+ *
+ * Options:
+ *
+ *    --windows=N[,N...]       Window sizes to test, in bytes.  Default:
+ *                             1 MiB, 8 MiB, and 32 MiB.
+ *    --threads=N[,N...]       Numbers of threads to test.  Default: 1, 2, 4,
+ *                             ... up to the number of processors.
+ *    --repeat=N               Run each test N times and report the fastest.
+ *                             Default: 1.
+ *    --csv=FILE               Also write the results to FILE in CSV format, one
+ *                             line per test, for comparison between versions.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/lz_suffix_array_utils.h"
+#include "wimlib/util.h"
+
+#include "bench_util.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct result {
+	u64 sa_nsec;
+	u64 isa_nsec;
+	u64 lcp_nsec;
+};
+
+const char bench_name[] = "sabench";
+
+/* Fill the window with copies of the corpus.  */
+static void
+fill_window(u8 *T, u32 n, const u8 *corpus, size_t corpus_size)
+{
+	for (u32 i = 0; i < n; ) {
+		u32 len = min(n - i, corpus_size);
+
+		memcpy(&T[i], corpus, len);
+		i += len;
+	}
+}
+
+/* Build the SA, ISA, and LCP of the window @T of @n bytes with @num_threads
+ * threads, @repeat times, recording the fastest time for each array.  */
+static void
+run_test(const u8 *T, u32 n, unsigned num_threads, unsigned repeat,
+	 u32 *SA, u32 *ISA, u32 *LCP, struct result *result)
+{
+	result->sa_nsec = UINT64_MAX;
+	result->isa_nsec = UINT64_MAX;
+	result->lcp_nsec = UINT64_MAX;
+
+	for (unsigned r = 0; r < repeat; r++) {
+		u64 start, elapsed;
+
+		/* The ISA array is free until build_ISA(), so build_SA() can
+		 * use it for its temporary space, as the match-finders do.  */
+		start = current_time_nsec();
+		build_SA(SA, T, n, ISA, num_threads);
+		elapsed = current_time_nsec() - start;
+		if (elapsed < result->sa_nsec)
+			result->sa_nsec = elapsed;
+
+		start = current_time_nsec();
+		build_ISA(ISA, SA, n, num_threads);
+		elapsed = current_time_nsec() - start;
+		if (elapsed < result->isa_nsec)
+			result->isa_nsec = elapsed;
+
+		start = current_time_nsec();
+		build_LCP(LCP, SA, ISA, T, n, num_threads);
+		elapsed = current_time_nsec() - start;
+		if (elapsed < result->lcp_nsec)
+			result->lcp_nsec = elapsed;
+	}
+}
+
+static double
+msec(u64 nsec)
+{
+	return (double)nsec / 1000000;
+}
+
+static const struct option longopts[] = {
+	{"windows",	required_argument, NULL, 'w'},
+	{"threads",	required_argument, NULL, 't'},
+	{"repeat",	required_argument, NULL, 'r'},
+	{"csv",		required_argument, NULL, 'c'},
+	{NULL, 0, NULL, 0},
+};
+
+int
+main(int argc, char **argv)
+{
+	struct value_list windows = { 3, { 1 << 20, 8 << 20, 32 << 20 } };
+	struct value_list threads = { 0 };
+	unsigned repeat = 1;
+	const char *csv_path = NULL;
+	FILE *csv = NULL;
+	u8 *corpus;
+	size_t corpus_size;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'w':
+			parse_value_list(optarg, "windows", &windows);
+			break;
+		case 't':
+			parse_value_list(optarg, "threads", &threads);
+			break;
+		case 'r':
+			repeat = strtoul(optarg, NULL, 10);
+			if (repeat == 0)
+				fatal("invalid value for --repeat");
+			break;
+		case 'c':
+			csv_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [--windows=N[,N...]] "
+				"[--threads=N[,N...]]\n"
+				"       [--repeat=N] [--csv=FILE] FILE...\n",
+				argv[0]);
+			return 2;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		fatal("no corpus files given");
+
+	corpus = load_corpus(argv, argc, &corpus_size);
+	if (corpus_size == 0)
+		fatal("the corpus is empty");
+
+	if (threads.num_values == 0) {
+		unsigned max_threads = get_default_num_threads();
+
+		for (unsigned n = 1; ; n *= 2) {
+			threads.values[threads.num_values++] = min(n, max_threads);
+			if (n >= max_threads)
+				break;
+		}
+	}
+
+	if (csv_path) {
+		csv = fopen(csv_path, "w");
+		if (csv == NULL)
+			fatal("can't open \"%s\": %s", csv_path,
+			      strerror(errno));
+		fprintf(csv, "window_size,threads,sa_msec,isa_msec,lcp_msec,"
+			"total_msec,speedup\n");
+	}
+
+	printf("Corpus: %zu bytes in %d file(s)\n\n", corpus_size, argc);
+	printf("%10s %7s %10s %10s %10s %10s %7s\n",
+	       "Window", "Threads", "SA ms", "ISA ms", "LCP ms", "Total ms",
+	       "Speedup");
+
+	for (unsigned w = 0; w < windows.num_values; w++) {
+		u32 n = windows.values[w];
+		u8 *T;
+		u32 *SA, *ISA, *LCP, *ref_SA, *ref_LCP;
+		u64 base_nsec = 0;
+
+		if (windows.values[w] > UINT32_MAX / 2)
+			fatal("window size %"PRIu64" is too large",
+			      windows.values[w]);
+
+		T = malloc(n);
+		SA = malloc(n * sizeof(u32));
+		ISA = malloc(max(n, BUILD_SA_MIN_TMP_LEN) * sizeof(u32));
+		LCP = malloc(n * sizeof(u32));
+		ref_SA = malloc(n * sizeof(u32));
+		ref_LCP = malloc(n * sizeof(u32));
+		if (!T || !SA || !ISA || !LCP || !ref_SA || !ref_LCP)
+			fatal("out of memory");
+
+		fill_window(T, n, corpus, corpus_size);
+
+		/* The reference arrays, to which those built with each number
+		 * of threads are compared.  */
+		build_SA(ref_SA, T, n, ISA, 1);
+		build_ISA(ISA, ref_SA, n, 1);
+		build_LCP(ref_LCP, ref_SA, ISA, T, n, 1);
+
+		for (unsigned t = 0; t < threads.num_values; t++) {
+			unsigned num_threads = threads.values[t];
+			struct result res;
+			u64 total_nsec;
+			double speedup;
+
+			run_test(T, n, num_threads, repeat, SA, ISA, LCP, &res);
+
+			if (memcmp(SA, ref_SA, n * sizeof(u32)))
+				fatal("suffix array built with %u threads "
+				      "differs (window size %"PRIu32")",
+				      num_threads, n);
+			/* LCP[0] is not defined.  */
+			if (memcmp(&LCP[1], &ref_LCP[1],
+				   (n - 1) * sizeof(u32)))
+				fatal("LCP array built with %u threads "
+				      "differs (window size %"PRIu32")",
+				      num_threads, n);
+
+			total_nsec = res.sa_nsec + res.isa_nsec + res.lcp_nsec;
+			if (t == 0)
+				base_nsec = total_nsec;
+			speedup = (double)base_nsec / max(total_nsec, 1);
+
+			printf("%10"PRIu32" %7u %10.1f %10.1f %10.1f %10.1f "
+			       "%7.2f\n", n, num_threads, msec(res.sa_nsec),
+			       msec(res.isa_nsec), msec(res.lcp_nsec),
+			       msec(total_nsec), speedup);
+			if (csv) {
+				fprintf(csv, "%"PRIu32",%u,%.3f,%.3f,%.3f,"
+					"%.3f,%.3f\n", n, num_threads,
+					msec(res.sa_nsec), msec(res.isa_nsec),
+					msec(res.lcp_nsec), msec(total_nsec),
+					speedup);
+			}
+			fflush(stdout);
+		}
+
+		free(ref_LCP);
+		free(ref_SA);
+		free(LCP);
+		free(ISA);
+		free(SA);
+		free(T);
+	}
+
+	if (csv && fclose(csv))
+		fatal("error writing \"%s\"", csv_path);
+	free(corpus);
+	return 0;
+}
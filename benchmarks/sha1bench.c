@@ -0,0 +1,233 @@
+/*
+ * sha1bench.c
+ *
+ * Benchmark the SHA-1 implementations built into wimlib.  Each implementation
+ * that the processor supports is checked against known answers, then timed
+ * hashing one large buffer and hashing the same data as many small messages.
+ * Finally, sha1_multi_buffer() is timed hashing the small messages.
+ *
+ * Build with:
+ *
+ *    $ make benchmarks/sha1bench
+ *
+ * Run with:
+ *
+ *    $ benchmarks/sha1bench [BUFFER_SIZE_IN_MB [MESSAGE_SIZE]]
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/sha1.h"
+
+#include "bench_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+const char bench_name[] = "sha1bench";
+
+#ifdef WITH_LIBCRYPTO
+
+int
+main(void)
+{
+	fprintf(stderr, "wimlib uses SHA-1 from libcrypto, so it has no "
+		"built-in SHA-1 implementations to benchmark.\n"
+		"Configure with --without-libcrypto to build them.\n");
+	return 77;
+}
+
+#else /* WITH_LIBCRYPTO */
+
+/* Run each benchmark for at least this long.  */
+#define MIN_BENCHMARK_NSEC	1000000000ULL
+
+static const struct {
+	const char *message;
+	const char *digest;
+} known_answers[] = {
+	{ "", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+	{ "abc", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+	  "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+	{ "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+	  "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+	  "a49b2446a02c645bf419f995b67091253a04a259" },
+};
+
+static bool
+check_known_answers(const char *impl_name)
+{
+	u8 hash[SHA1_HASH_SIZE];
+	char hashstr[SHA1_HASH_SIZE * 2 + 1];
+
+	for (size_t i = 0; i < ARRAY_LEN(known_answers); i++) {
+		sha1_buffer(known_answers[i].message,
+			    strlen(known_answers[i].message), hash);
+		sprint_hash(hash, hashstr);
+		if (strcmp(hashstr, known_answers[i].digest)) {
+			fprintf(stderr, "%s: wrong digest for \"%s\": "
+				"got %s, expected %s\n", impl_name,
+				known_answers[i].message, hashstr,
+				known_answers[i].digest);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Hash @buf as messages of @msg_size bytes, repeatedly for at least
+ * MIN_BENCHMARK_NSEC.  Return the throughput in MB/s, and the digest of the
+ * last message in @hash.  */
+static double
+benchmark(const u8 *buf, size_t size, size_t msg_size, u8 hash[SHA1_HASH_SIZE])
+{
+	u64 start = current_time_nsec();
+	u64 elapsed;
+	u64 total = 0;
+
+	do {
+		for (size_t offset = 0; offset < size; offset += msg_size) {
+			size_t len = size - offset;
+			if (len > msg_size)
+				len = msg_size;
+			sha1_buffer(&buf[offset], len, hash);
+		}
+		total += size;
+		elapsed = current_time_nsec() - start;
+	} while (elapsed < MIN_BENCHMARK_NSEC);
+
+	return (double)total * 1000 / elapsed;
+}
+
+/* Like benchmark(), but hash the messages with sha1_multi_buffer(), passing
+ * up to MULTI_BUFFER_BATCH of them at a time.  Return false in @ok_ret if any
+ * digest differed from sha1_buffer().  */
+#define MULTI_BUFFER_BATCH	64
+static double
+benchmark_multi_buffer(const u8 *buf, size_t size, size_t msg_size,
+		       bool *ok_ret)
+{
+	const void *bufs[MULTI_BUFFER_BATCH];
+	size_t lens[MULTI_BUFFER_BATCH];
+	u8 hashes[MULTI_BUFFER_BATCH][SHA1_HASH_SIZE];
+	u64 start = current_time_nsec();
+	u64 elapsed;
+	u64 total = 0;
+	bool checked = false;
+
+	*ok_ret = true;
+	do {
+		size_t offset = 0;
+
+		while (offset < size) {
+			size_t n = 0;
+
+			for (; n < MULTI_BUFFER_BATCH && offset < size; n++) {
+				bufs[n] = &buf[offset];
+				lens[n] = min(size - offset, msg_size);
+				offset += lens[n];
+			}
+			sha1_multi_buffer(bufs, lens, hashes, n);
+			if (!checked) {
+				for (size_t i = 0; i < n; i++) {
+					u8 hash[SHA1_HASH_SIZE];
+
+					sha1_buffer(bufs[i], lens[i], hash);
+					if (!hashes_equal(hash, hashes[i]))
+						*ok_ret = false;
+				}
+			}
+		}
+		checked = true;
+		total += size;
+		elapsed = current_time_nsec() - start;
+	} while (elapsed < MIN_BENCHMARK_NSEC);
+
+	return (double)total * 1000 / elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = 16 << 20;
+	size_t msg_size = 4096;
+	u8 *buf;
+	u64 x = 0x9E3779B97F4A7C15;
+	u8 ref_hash[SHA1_HASH_SIZE];
+	const char *name;
+	int status = 0;
+
+	if (argc > 1)
+		size = strtoul(argv[1], NULL, 10) << 20;
+	if (argc > 2)
+		msg_size = strtoul(argv[2], NULL, 10);
+	if (size == 0 || msg_size == 0) {
+		fprintf(stderr, "Usage: %s [BUFFER_SIZE_IN_MB [MESSAGE_SIZE]]\n",
+			argv[0]);
+		return 2;
+	}
+
+	buf = malloc(size);
+	if (!buf) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for (size_t i = 0; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = x;
+	}
+
+	/* All implementations must agree with the generic one.  */
+	sha1_select_impl("generic");
+	sha1_buffer(buf, size, ref_hash);
+
+	printf("%-12s %16s %16s\n", "impl", "1 message", "messages");
+	printf("%-12s %16zu %16zu\n", "", size, msg_size);
+	for (size_t i = 0; (name = sha1_supported_impl_name(i)); i++) {
+		u8 hash[SHA1_HASH_SIZE];
+		double large_rate, small_rate;
+
+		sha1_select_impl(name);
+		if (!check_known_answers(name)) {
+			status = 1;
+			continue;
+		}
+		large_rate = benchmark(buf, size, size, hash);
+		if (!hashes_equal(hash, ref_hash)) {
+			fprintf(stderr, "%s: digest of buffer differs from "
+				"generic implementation\n", name);
+			status = 1;
+			continue;
+		}
+		small_rate = benchmark(buf, size, msg_size, hash);
+		printf("%-12s %11.1f MB/s %11.1f MB/s\n",
+		       name, large_rate, small_rate);
+	}
+
+	sha1_select_impl(NULL);
+	{
+		bool ok;
+		double rate = benchmark_multi_buffer(buf, size, msg_size, &ok);
+
+		if (ok) {
+			printf("%-12s %16s %11.1f MB/s\n",
+			       "multi-buffer", "", rate);
+		} else {
+			fprintf(stderr, "multi-buffer: wrong digest\n");
+			status = 1;
+		}
+	}
+	printf("Default implementation: %s\n", sha1_selected_impl_name());
+	free(buf);
+	return status;
+}
+
+#endif /* !WITH_LIBCRYPTO */
@@ -0,0 +1,553 @@
+/*
+ * wimbench.c
+ *
+ * Benchmark whole WIM operations on synthetic directory trees.  Each tree is
+ * built in a scratch directory, then the following phases are timed, once for
+ * each requested number of threads:
+ *
+ *    capture   wimlib_add_image() into a new WIMStruct
+ *    write     wimlib_write() of the new WIM
+ *    verify    wimlib_verify_wim() of the written WIM
+ *    extract   wimlib_extract_image() of the written WIM
+ *    export    wimlib_export_image() into a new WIM, then wimlib_write()
+ *    append    wimlib_add_image() of the same tree again, then
+ *              wimlib_overwrite() (all file data is already present)
+ *
+ * For each phase, the elapsed time, the number of files (file names, counting
+ * each hard link) per second, and the amount of file data (again counting each
+ * hard link) per second are printed.
+ *
+ * The trees are:
+ *
+ *    tiny        many small files (0-2 KiB)
+ *    huge        a few large files
+ *    hardlinks   files that each have several hard links
+ *    dups        many files with only a few distinct contents
+ *
+ * Build and run with default settings (this is also done by 'make bench') with:
+ *
+ *    $ make benchmarks/wimbench
+ *    $ benchmarks/wimbench [OPTION...]
+ *
+ * Options:
+ *
+ *    --trees=NAME[,NAME...]   Trees to test.  Default: all.
+ *    --threads=N[,N...]       Thread counts to test.  Default: 1 and the number
+ *                             of processors.
+ *    --scale=FACTOR           Multiply the number of files in each tree, and
+ *                             the size of the files in the "huge" tree, by
+ *                             FACTOR.  Default: 1.
+ *    --compress=TYPE          Compression type: none, xpress, lzx, or lzms.
+ *                             Default: lzx.
+ *    --dir=DIR                Directory in which to create the scratch
+ *                             directory.  Default: $TMPDIR or /tmp.
+ *    --csv=FILE               Also write the results to FILE in CSV format.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+#ifndef _FILE_OFFSET_BITS
+#  define _FILE_OFFSET_BITS 64
+#endif
+
+#include <wimlib.h>
+
+#include "bench_util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILES_PER_DIR		256
+
+/* Statistics of a generated tree: the number of file names, and the total size
+ * of the data of all file names.  */
+struct tree_stats {
+	uint64_t num_files;
+	uint64_t num_bytes;
+};
+
+struct tree_type {
+	const char *name;
+	void (*build)(const char *dir, double scale, struct tree_stats *stats);
+};
+
+const char bench_name[] = "wimbench";
+
+static const char *scratch_dir;
+static FILE *csv;
+
+static void
+check(int ret, const char *what)
+{
+	if (ret)
+		fatal("%s failed: %s", what, wimlib_get_error_string(ret));
+}
+
+static uint64_t rand_state = 0x9E3779B97F4A7C15;
+
+static uint64_t
+next_rand(void)
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 0x2545F4914F6CDD1D;
+}
+
+/* Fill @buf with pseudorandom "text" that compresses about as well as typical
+ * file data.  */
+static void
+gen_data(char *buf, size_t size)
+{
+	static const char * const words[16] = {
+		"the ", "of ", "wim ", "image ", "stream ", "data ", "file ",
+		"and ", "to ", "in ", "resource ", "chunk ", "table ",
+		"compressed ", "directory ", "header ",
+	};
+	size_t pos = 0;
+
+	while (pos < size) {
+		uint64_t r = next_rand();
+
+		for (int i = 0; i < 8 && pos < size; i++, r >>= 8) {
+			const char *w;
+
+			if ((r & 0xC0) == 0) {
+				/* Some incompressible bytes too.  */
+				buf[pos++] = r >> 1;
+				continue;
+			}
+			for (w = words[r & 15]; *w && pos < size; w++)
+				buf[pos++] = *w;
+		}
+	}
+}
+
+static void
+make_dir(const char *path)
+{
+	if (mkdir(path, 0755))
+		fatal("can't create directory \"%s\": %s", path,
+		      strerror(errno));
+}
+
+static void
+write_file(const char *path, const char *data, size_t size)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
+		fatal("can't create \"%s\": %s", path, strerror(errno));
+	while (size) {
+		ssize_t n = write(fd, data, size);
+
+		if (n <= 0)
+			fatal("error writing \"%s\": %s", path, strerror(errno));
+		data += n;
+		size -= n;
+	}
+	close(fd);
+}
+
+/* Return the path of file number @i in the tree rooted at @dir, creating its
+ * parent directory if @i is the first file in it.  Files are distributed among
+ * subdirectories of FILES_PER_DIR files each.  */
+static const char *
+file_path(const char *dir, uint64_t i, const char *suffix)
+{
+	static char path[4096];
+
+	snprintf(path, sizeof(path), "%s/d%"PRIu64, dir, i / FILES_PER_DIR);
+	if (i % FILES_PER_DIR == 0 && !suffix[0])
+		make_dir(path);
+	snprintf(path, sizeof(path), "%s/d%"PRIu64"/f%"PRIu64"%s",
+		 dir, i / FILES_PER_DIR, i, suffix);
+	return path;
+}
+
+static uint64_t
+scaled(uint64_t n, double scale)
+{
+	uint64_t res = n * scale;
+
+	return res ? res : 1;
+}
+
+static void
+build_tiny(const char *dir, double scale, struct tree_stats *stats)
+{
+	uint64_t num_files = scaled(20000, scale);
+	char buf[2048];
+
+	for (uint64_t i = 0; i < num_files; i++) {
+		size_t size = next_rand() % (sizeof(buf) + 1);
+
+		gen_data(buf, size);
+		write_file(file_path(dir, i, ""), buf, size);
+		stats->num_files++;
+		stats->num_bytes += size;
+	}
+}
+
+static void
+build_huge(const char *dir, double scale, struct tree_stats *stats)
+{
+	const size_t bufsize = 1 << 20;
+	uint64_t file_size = scaled(64 << 20, scale);
+	char *buf = malloc(bufsize);
+
+	if (buf == NULL)
+		fatal("out of memory");
+	for (uint64_t i = 0; i < 4; i++) {
+		const char *path = file_path(dir, i, "");
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+		if (fd < 0)
+			fatal("can't create \"%s\": %s", path, strerror(errno));
+		for (uint64_t done = 0; done < file_size; ) {
+			size_t n = bufsize;
+
+			if (n > file_size - done)
+				n = file_size - done;
+			gen_data(buf, n);
+			if (write(fd, buf, n) != (ssize_t)n)
+				fatal("error writing \"%s\": %s", path,
+				      strerror(errno));
+			done += n;
+		}
+		close(fd);
+		stats->num_files++;
+		stats->num_bytes += file_size;
+	}
+	free(buf);
+}
+
+static void
+build_hardlinks(const char *dir, double scale, struct tree_stats *stats)
+{
+	uint64_t num_inodes = scaled(2000, scale);
+	const unsigned links_per_inode = 5;
+	char buf[16384];
+
+	for (uint64_t i = 0; i < num_inodes; i++) {
+		size_t size = next_rand() % (sizeof(buf) + 1);
+		char target[4096];
+
+		gen_data(buf, size);
+		snprintf(target, sizeof(target), "%s", file_path(dir, i, ""));
+		write_file(target, buf, size);
+		for (unsigned j = 1; j < links_per_inode; j++) {
+			char suffix[16];
+
+			snprintf(suffix, sizeof(suffix), ".link%u", j);
+			if (link(target, file_path(dir, i, suffix)))
+				fatal("can't create hard link to \"%s\": %s",
+				      target, strerror(errno));
+		}
+		stats->num_files += links_per_inode;
+		stats->num_bytes += (uint64_t)size * links_per_inode;
+	}
+}
+
+static void
+build_dups(const char *dir, double scale, struct tree_stats *stats)
+{
+	uint64_t num_files = scaled(8000, scale);
+	const unsigned num_contents = 200;
+	const size_t size = 16384;
+	char *contents = malloc(num_contents * size);
+
+	if (contents == NULL)
+		fatal("out of memory");
+	gen_data(contents, num_contents * size);
+	for (uint64_t i = 0; i < num_files; i++) {
+		write_file(file_path(dir, i, ""),
+			   &contents[(next_rand() % num_contents) * size], size);
+		stats->num_files++;
+		stats->num_bytes += size;
+	}
+	free(contents);
+}
+
+static const struct tree_type tree_types[] = {
+	{ "tiny",	build_tiny,	 },
+	{ "huge",	build_huge,	 },
+	{ "hardlinks",	build_hardlinks, },
+	{ "dups",	build_dups,	 },
+};
+
+#define NUM_TREE_TYPES	(sizeof(tree_types) / sizeof(tree_types[0]))
+
+static int
+remove_cb(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	if (remove(path))
+		fatal("can't remove \"%s\": %s", path, strerror(errno));
+	return 0;
+}
+
+static void
+remove_tree(const char *path)
+{
+	if (access(path, F_OK) == 0 &&
+	    nftw(path, remove_cb, 64, FTW_DEPTH | FTW_PHYS))
+		fatal("can't remove \"%s\"", path);
+}
+
+static void
+report(const char *tree, unsigned num_threads, const char *phase,
+       const struct tree_stats *stats, uint64_t nsec)
+{
+	double sec = (nsec ? nsec : 1) / 1e9;
+	double files_per_sec = stats->num_files / sec;
+	double mb_per_sec = stats->num_bytes / sec / 1e6;
+
+	printf("%-10s %7u %-8s %9.3f %12.0f %10.2f\n",
+	       tree, num_threads, phase, sec, files_per_sec, mb_per_sec);
+	fflush(stdout);
+	if (csv) {
+		fprintf(csv, "%s,%u,%s,%"PRIu64",%"PRIu64",%.6f,%.1f,%.3f\n",
+			tree, num_threads, phase, stats->num_files,
+			stats->num_bytes, sec, files_per_sec, mb_per_sec);
+	}
+}
+
+/* Run all the phases on the tree at @src_dir.  */
+static void
+run_phases(const char *tree, const char *src_dir,
+	   const struct tree_stats *stats, unsigned num_threads, int ctype)
+{
+	char wim_path[4096], export_path[4096], extract_dir[4096];
+	WIMStruct *wim, *dest_wim;
+	uint64_t start;
+
+	snprintf(wim_path, sizeof(wim_path), "%s/%s.wim", scratch_dir, tree);
+	snprintf(export_path, sizeof(export_path), "%s/%s-export.wim",
+		 scratch_dir, tree);
+	snprintf(extract_dir, sizeof(extract_dir), "%s/%s-extract",
+		 scratch_dir, tree);
+	unlink(wim_path);
+	unlink(export_path);
+	remove_tree(extract_dir);
+
+	start = current_time_nsec();
+	check(wimlib_create_new_wim(ctype, &wim), "wimlib_create_new_wim()");
+	wimlib_set_capture_threads(wim, num_threads);
+	check(wimlib_add_image(wim, src_dir, tree, NULL, 0),
+	      "wimlib_add_image()");
+	report(tree, num_threads, "capture", stats, current_time_nsec() - start);
+
+	start = current_time_nsec();
+	check(wimlib_write(wim, wim_path, WIMLIB_ALL_IMAGES, 0, num_threads),
+	      "wimlib_write()");
+	report(tree, num_threads, "write", stats, current_time_nsec() - start);
+	wimlib_free(wim);
+
+	start = current_time_nsec();
+	check(wimlib_open_wim(wim_path, 0, &wim), "wimlib_open_wim()");
+	wimlib_set_decompression_threads(wim, num_threads);
+	check(wimlib_verify_wim(wim, 0), "wimlib_verify_wim()");
+	report(tree, num_threads, "verify", stats, current_time_nsec() - start);
+	wimlib_free(wim);
+
+	start = current_time_nsec();
+	check(wimlib_open_wim(wim_path, 0, &wim), "wimlib_open_wim()");
+	wimlib_set_extraction_threads(wim, num_threads);
+	check(wimlib_extract_image(wim, 1, extract_dir, 0),
+	      "wimlib_extract_image()");
+	report(tree, num_threads, "extract", stats, current_time_nsec() - start);
+	wimlib_free(wim);
+	remove_tree(extract_dir);
+
+	start = current_time_nsec();
+	check(wimlib_open_wim(wim_path, 0, &wim), "wimlib_open_wim()");
+	check(wimlib_create_new_wim(ctype, &dest_wim),
+	      "wimlib_create_new_wim()");
+	check(wimlib_export_image(wim, 1, dest_wim, NULL, NULL, 0),
+	      "wimlib_export_image()");
+	check(wimlib_write(dest_wim, export_path, WIMLIB_ALL_IMAGES,
+			   WIMLIB_WRITE_FLAG_RECOMPRESS, num_threads),
+	      "wimlib_write()");
+	report(tree, num_threads, "export", stats, current_time_nsec() - start);
+	wimlib_free(dest_wim);
+	wimlib_free(wim);
+	unlink(export_path);
+
+	start = current_time_nsec();
+	check(wimlib_open_wim(wim_path, WIMLIB_OPEN_FLAG_WRITE_ACCESS, &wim),
+	      "wimlib_open_wim()");
+	wimlib_set_capture_threads(wim, num_threads);
+	check(wimlib_add_image(wim, src_dir, "append", NULL, 0),
+	      "wimlib_add_image()");
+	check(wimlib_overwrite(wim, 0, num_threads), "wimlib_overwrite()");
+	report(tree, num_threads, "append", stats, current_time_nsec() - start);
+	wimlib_free(wim);
+	unlink(wim_path);
+}
+
+static void
+parse_trees(const char *arg, bool enabled[NUM_TREE_TYPES])
+{
+	char *copy = strdup(arg);
+	char *saveptr;
+
+	if (copy == NULL)
+		fatal("out of memory");
+	memset(enabled, 0, NUM_TREE_TYPES * sizeof(enabled[0]));
+	for (char *tok = strtok_r(copy, ",", &saveptr); tok != NULL;
+	     tok = strtok_r(NULL, ",", &saveptr))
+	{
+		size_t i;
+
+		for (i = 0; i < NUM_TREE_TYPES; i++)
+			if (!strcmp(tok, tree_types[i].name))
+				break;
+		if (i == NUM_TREE_TYPES)
+			fatal("unknown tree \"%s\"", tok);
+		enabled[i] = true;
+	}
+	free(copy);
+}
+
+static int
+parse_ctype(const char *arg)
+{
+	if (!strcasecmp(arg, "none"))
+		return WIMLIB_COMPRESSION_TYPE_NONE;
+	if (!strcasecmp(arg, "xpress"))
+		return WIMLIB_COMPRESSION_TYPE_XPRESS;
+	if (!strcasecmp(arg, "lzx"))
+		return WIMLIB_COMPRESSION_TYPE_LZX;
+	if (!strcasecmp(arg, "lzms"))
+		return WIMLIB_COMPRESSION_TYPE_LZMS;
+	fatal("unknown compression type \"%s\"", arg);
+	return -1;
+}
+
+static const struct option longopts[] = {
+	{"trees",	required_argument, NULL, 't'},
+	{"threads",	required_argument, NULL, 'n'},
+	{"scale",	required_argument, NULL, 's'},
+	{"compress",	required_argument, NULL, 'c'},
+	{"dir",		required_argument, NULL, 'd'},
+	{"csv",		required_argument, NULL, 'o'},
+	{NULL, 0, NULL, 0},
+};
+
+int
+main(int argc, char **argv)
+{
+	bool enabled[NUM_TREE_TYPES] = { true, true, true, true };
+	struct value_list threads = { 0 };
+	double scale = 1;
+	int ctype = WIMLIB_COMPRESSION_TYPE_LZX;
+	const char *parent_dir = getenv("TMPDIR");
+	const char *csv_path = NULL;
+	char *template;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			parse_trees(optarg, enabled);
+			break;
+		case 'n':
+			parse_value_list(optarg, "threads", &threads);
+			break;
+		case 's':
+			scale = strtod(optarg, NULL);
+			if (!(scale > 0))
+				fatal("invalid value for --scale");
+			break;
+		case 'c':
+			ctype = parse_ctype(optarg);
+			break;
+		case 'd':
+			parent_dir = optarg;
+			break;
+		case 'o':
+			csv_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [--trees=NAME[,NAME...]] "
+				"[--threads=N[,N...]] [--scale=FACTOR]\n"
+				"       [--compress=TYPE] [--dir=DIR] "
+				"[--csv=FILE]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc)
+		fatal("unexpected argument \"%s\"", argv[optind]);
+
+	if (threads.num_values == 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads.values[threads.num_values++] = 1;
+		if (ncpus > 1)
+			threads.values[threads.num_values++] = ncpus;
+	}
+
+	if (parent_dir == NULL || !parent_dir[0])
+		parent_dir = "/tmp";
+	if (asprintf(&template, "%s/wimbench.XXXXXX", parent_dir) < 0)
+		fatal("out of memory");
+	scratch_dir = mkdtemp(template);
+	if (scratch_dir == NULL)
+		fatal("can't create scratch directory in \"%s\": %s",
+		      parent_dir, strerror(errno));
+
+	check(wimlib_global_init(0), "wimlib_global_init()");
+	wimlib_set_print_errors(true);
+
+	if (csv_path) {
+		csv = fopen(csv_path, "w");
+		if (csv == NULL)
+			fatal("can't open \"%s\": %s", csv_path,
+			      strerror(errno));
+		fprintf(csv, "tree,threads,phase,files,bytes,seconds,"
+			"files_per_sec,mb_per_sec\n");
+	}
+
+	printf("%-10s %7s %-8s %9s %12s %10s\n",
+	       "Tree", "Threads", "Phase", "Seconds", "Files/s", "MB/s");
+
+	for (size_t t = 0; t < NUM_TREE_TYPES; t++) {
+		struct tree_stats stats = { 0, 0 };
+		char src_dir[4096];
+
+		if (!enabled[t])
+			continue;
+
+		snprintf(src_dir, sizeof(src_dir), "%s/%s",
+			 scratch_dir, tree_types[t].name);
+		make_dir(src_dir);
+		tree_types[t].build(src_dir, scale, &stats);
+
+		for (unsigned i = 0; i < threads.num_values; i++)
+			run_phases(tree_types[t].name, src_dir, &stats,
+				   threads.values[i], ctype);
+
+		remove_tree(src_dir);
+	}
+
+	remove_tree(scratch_dir);
+	free(template);
+	wimlib_global_cleanup();
+
+	if (csv && fclose(csv))
+		fatal("error writing \"%s\"", csv_path);
+	return 0;
+}
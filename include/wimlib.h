@@ -179,7 +179,8 @@
  *   they must use different ::WIMStruct's.
  * - You must call wimlib_global_init() in one thread before calling any other
  *   functions.
- * - wimlib_set_print_errors() and wimlib_set_memory_allocator() both apply globally.
+ * - wimlib_set_print_errors(), wimlib_set_memory_allocator(), and
+ *   wimlib_set_integrity_check_threads() apply globally.
  * - wimlib_mount_image(), while it can be used to mount multiple WIMs
  *   concurrently in the same process, will daemonize the entire process when it
  *   does so for the first time.  This includes changing the working directory
@@ -757,6 +758,19 @@ union wimlib_progress_info {
 
 		/** This is currently broken and will always be 0.  */
 		uint32_t completed_parts;
+
+		/** Total time, in nanoseconds, that the writing thread has
+		 * spent so far waiting for the compressor threads to finish
+		 * compressing data.  Always 0 if @p num_threads is 1.  A large
+		 * value means that compression is the bottleneck.  */
+		uint64_t compress_wait_nsec;
+
+		/** Total time, in nanoseconds, that the compressor threads
+		 * have spent so far waiting for data to compress, summed over
+		 * all threads.  Always 0 if @p num_threads is 1.  A large
+		 * value means that reading or writing data is the bottleneck.
+		 */
+		uint64_t compress_idle_nsec;
 	} write_streams;
 
 	/** Valid on messages ::WIMLIB_PROGRESS_MSG_SCAN_BEGIN,
@@ -856,6 +870,19 @@ union wimlib_progress_info {
 		 * counted, not their unencrypted size; however, compressed
 		 * files have their uncompressed size counted.  */
 		uint64_t num_bytes_scanned;
+
+		/** Number of paths that were checked against the exclusion
+		 * patterns of the capture configuration.  Only valid on
+		 * ::WIMLIB_PROGRESS_MSG_SCAN_END; 0 if the capture
+		 * configuration has no exclusion patterns.  */
+		uint64_t num_exclusion_checks;
+
+		/** Total time, in nanoseconds, spent checking paths against
+		 * the exclusion patterns of the capture configuration.  Only
+		 * valid on ::WIMLIB_PROGRESS_MSG_SCAN_END.  If the directory
+		 * tree was scanned by multiple threads, this is the sum over
+		 * all threads.  */
+		uint64_t exclusion_check_nsec;
 	} scan;
 
 	/** Valid on messages
@@ -1291,7 +1318,12 @@ struct wimlib_resource_entry {
 	 * other streams (all compressed together) as well.  */
 	uint32_t packed : 1;
 
-	uint32_t reserved_flags : 26;
+	/** 1 if this stream is stored as a list of pieces that are themselves
+	 * streams, as written with ::WIMLIB_WRITE_FLAG_PIECE_DEDUP.  The
+	 * offset and compressed size are those of the piece list.  */
+	uint32_t is_piece_list : 1;
+
+	uint32_t reserved_flags : 25;
 
 	/** If @p packed is 1, then this will specify the offset of the packed
 	 * resource in the WIM.  */
@@ -1572,6 +1604,27 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  */
 #define WIMLIB_ADD_FLAG_NO_REPLACE		0x00002000
 
+/**
+ * Pipelined capture: while the directory tree is being scanned, read and
+ * checksum the data of the files found so far on background threads.  When
+ * the scan ends, the files that have been checksummed are deduplicated right
+ * away, so the data of duplicate files is not read again when the WIM is
+ * written, and the data of other files is likely to still be in the operating
+ * system's cache.  The scan itself never waits for the background threads;
+ * files that have not been checksummed when it ends are handled as usual when
+ * the WIM is written.  As without this flag, files whose size no other file
+ * has are only checksummed as they are written, so a file modified after the
+ * scan is captured with its new contents.  The number of background threads is
+ * set by wimlib_set_capture_threads().
+ *
+ * This is most useful when scanning is slow, e.g. for large directory trees or
+ * network filesystems, and the data of the files fits in memory.  Compression
+ * still only happens when the WIM is written.  This flag has no effect when
+ * capturing an NTFS volume with ::WIMLIB_ADD_FLAG_NTFS, or if wimlib was
+ * compiled with <c>--disable-multithreaded-compression</c>.
+ */
+#define WIMLIB_ADD_FLAG_PIPELINE		0x00004000
+
 #define WIMLIB_ADD_IMAGE_FLAG_NTFS		WIMLIB_ADD_FLAG_NTFS
 #define WIMLIB_ADD_IMAGE_FLAG_DEREFERENCE	WIMLIB_ADD_FLAG_DEREFERENCE
 #define WIMLIB_ADD_IMAGE_FLAG_VERBOSE		WIMLIB_ADD_FLAG_VERBOSE
@@ -1788,7 +1841,8 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * checksummed and checked against the SHA1 message digests specified in the
  * integrity table.  If there are any mismatches, ::WIMLIB_ERR_INTEGRITY is
  * issued.  If the WIM file does not contain an integrity table, this flag has
- * no effect.  */
+ * no effect.  The number of threads used to checksum the chunks is set by
+ * wimlib_set_integrity_check_threads().  */
 #define WIMLIB_OPEN_FLAG_CHECK_INTEGRITY		0x00000001
 
 /** Issue an error (::WIMLIB_ERR_IS_SPLIT_WIM) if the WIM is part of a split
@@ -1805,6 +1859,27 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * later.  */
 #define WIMLIB_OPEN_FLAG_WRITE_ACCESS			0x00000004
 
+/** Load each image's directory tree on demand.  Normally, the first operation
+ * on an image reads its entire directory tree into memory.  With this flag,
+ * wimlib_iterate_dir_tree() and wimlib_extract_paths() (and functions built on
+ * it, such as wimlib_extract_pathlist()) instead keep the image's metadata
+ * resource in memory and only read the directories that are actually
+ * visited, which is much faster when only a few files are accessed in a large
+ * image.  Any other operation on the image reads the rest of its directory
+ * tree first, as does wimlib_iterate_dir_tree() when it reaches a file that
+ * has hard links, so that wimlib_dir_entry::num_links counts all of them.  */
+#define WIMLIB_OPEN_FLAG_LAZY_METADATA			0x00000008
+
+/** If the WIM file has an up-to-date index file, as written by
+ * wimlib_write_index_file(), memory-map it and read the images' metadata
+ * resources from it instead of decompressing them from the WIM file.  An index
+ * file that does not exist is silently ignored, and one that is out of date or
+ * corrupted is ignored with a warning.  Each metadata resource read from the
+ * index file is still checked against the SHA-1 message digest recorded in the
+ * WIM file.  Combined with ::WIMLIB_OPEN_FLAG_LAZY_METADATA, this
+ * makes looking up a few paths in a large image nearly free.  */
+#define WIMLIB_OPEN_FLAG_USE_INDEX_FILE			0x00000010
+
 /** @} */
 /** @addtogroup G_mounting_wim_images
  * @{ */
@@ -2032,6 +2107,20 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  */
 #define WIMLIB_WRITE_FLAG_SEND_DONE_WITH_FILE_MESSAGES	0x00002000
 
+/**
+ * Split large file streams into variable-size pieces at boundaries chosen from
+ * their contents, and store each such stream as a list of its pieces, so that
+ * pieces shared by different versions of a large file (such as a virtual disk
+ * image or database) are stored only once.  Only streams at least 1 MiB in
+ * size are split, and the pieces average about 64 KiB.  Streams already split
+ * into pieces stay that way even if this flag is not given.
+ *
+ * Note: this is a wimlib extension to the WIM format.  WIM files written with
+ * this flag can only be read by wimlib v1.7.1 or later, and not by Microsoft's
+ * software.  This flag cannot be combined with ::WIMLIB_WRITE_FLAG_PIPABLE.
+ */
+#define WIMLIB_WRITE_FLAG_PIECE_DEDUP			0x00004000
+
 /** @} */
 /** @addtogroup G_general
  * @{ */
@@ -2348,6 +2437,9 @@ wimlib_add_empty_image(WIMStruct *wim,
  * messages ::WIMLIB_PROGRESS_MSG_SCAN_BEGIN and ::WIMLIB_PROGRESS_MSG_SCAN_END.
  * In addition, if ::WIMLIB_ADD_FLAG_VERBOSE is specified in @p add_flags, it
  * will receive ::WIMLIB_PROGRESS_MSG_SCAN_DENTRY.
+ *
+ * The number of threads used to scan @p source can be set with
+ * wimlib_set_capture_threads().
  */
 extern int
 wimlib_add_image(WIMStruct *wim,
@@ -2384,6 +2476,92 @@ wimlib_add_image_multisource(WIMStruct *wim,
 			     const wimlib_tchar *config_file,
 			     int add_flags);
 
+/**
+ * @ingroup G_modifying_wims
+ *
+ * Adds an image to a WIM file from an on-disk directory tree that has changed
+ * only in known places since it was captured as an existing image.
+ *
+ * Instead of scanning all of @p source, the new image starts as a copy of the
+ * directory tree of @p template_image in @p template_wim, and only the paths
+ * listed in @p changed_paths are scanned again.  Each changed path is first
+ * removed from the new image, including everything below it if it is a
+ * directory.  Then, if it still exists in @p source, it is scanned as it would
+ * be by wimlib_add_image(), including everything below it.  Files that were
+ * scanned again but whose size and timestamps match the same path in the
+ * template image are not checksummed again, as with
+ * wimlib_reference_template_image().
+ *
+ * The resulting image is the same as one captured from all of @p source with
+ * wimlib_add_image(), as long as @p changed_paths includes every file or
+ * directory that was created, deleted, or modified since the template image
+ * was captured.  A path below another changed path need not be listed
+ * separately.  Since listing a directory scans all of it again, a file created
+ * in or deleted from a directory should be listed itself, rather than its
+ * directory; the directory's own metadata, such as its last write time, is
+ * then kept from the template image.
+ *
+ * @param wim
+ * 	Pointer to the ::WIMStruct to which to add the image.
+ * @param source
+ * 	Path to the directory tree that was captured as the template image.
+ * @param name
+ *	Name to give the new image, as for wimlib_add_image().
+ * @param template_wim
+ *	Pointer to the ::WIMStruct containing the template image.  This may be
+ *	the same as @p wim.  If it is not, it must remain valid until @p wim has
+ *	been written.
+ * @param template_image
+ *	Index of the template image in @p template_wim.
+ * @param changed_paths
+ *	Array of @p num_changed_paths paths of files or directories that have
+ *	changed, relative to @p source.  Either kind of slash is accepted as a
+ *	path separator, and a leading slash is optional.  An empty path or
+ *	"/" means that everything has changed.  The paths may not contain "."
+ *	or ".." components.
+ * @param num_changed_paths
+ *	Number of entries in @p changed_paths.
+ * @param config_file
+ *	Path to capture configuration file, or @c NULL, as for
+ *	wimlib_add_image().  Its patterns are matched against paths relative to
+ *	@p source, not relative to each changed path.
+ * @param add_flags
+ * 	Bitwise OR of flags prefixed with WIMLIB_ADD_FLAG, as for
+ * 	wimlib_add_image().  ::WIMLIB_ADD_FLAG_NTFS,
+ * 	::WIMLIB_ADD_FLAG_RPFIX, and ::WIMLIB_ADD_FLAG_WIMBOOT are not
+ * 	supported; symbolic links and junctions that are scanned again are
+ * 	stored without reparse point fixups.
+ *
+ * @return 0 on success; nonzero on error.  On error, changes to @p wim are
+ * discarded so that it appears to be in the same state as when this function
+ * was called.  In addition to the error codes that wimlib_add_image() can
+ * return:
+ *
+ * @retval ::WIMLIB_ERR_INVALID_IMAGE
+ *	@p template_image does not exist in @p template_wim.
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p template_wim was @c NULL, @p add_flags contained an unsupported
+ *	flag, or a changed path contained a "." or ".." component.
+ * @retval ::WIMLIB_ERR_RESOURCE_NOT_FOUND
+ *	A stream of the template image is not in @p template_wim.
+ * @retval ::WIMLIB_ERR_STAT
+ *	A changed path in @p source exists but could not be checked.
+ *
+ * If a progress function is registered with @p wim, it will receive the
+ * messages ::WIMLIB_PROGRESS_MSG_SCAN_BEGIN and ::WIMLIB_PROGRESS_MSG_SCAN_END
+ * for each changed path that still exists.
+ */
+extern int
+wimlib_add_image_incremental(WIMStruct *wim,
+			     const wimlib_tchar *source,
+			     const wimlib_tchar *name,
+			     WIMStruct *template_wim,
+			     int template_image,
+			     const wimlib_tchar * const *changed_paths,
+			     size_t num_changed_paths,
+			     const wimlib_tchar *config_file,
+			     int add_flags);
+
 /**
  * @ingroup G_modifying_wims
  *
@@ -3724,6 +3902,126 @@ extern int
 wimlib_resolve_image(WIMStruct *wim,
 		     const wimlib_tchar *image_name_or_num);
 
+/**
+ * @ingroup G_modifying_wims
+ *
+ * Set the number of threads to use when scanning directory trees to add to an
+ * image of a WIM.
+ *
+ * This affects wimlib_add_image(), wimlib_add_image_multisource(), and add
+ * commands passed to wimlib_update_image().  With more than one thread, the
+ * directories are read and the metadata of the files is retrieved on several
+ * threads at once, which can make scanning large directory trees much faster,
+ * especially on network filesystems.  The resulting image, and the progress
+ * messages sent to the progress function, are the same as when scanning on one
+ * thread.  In particular, progress messages are still sent from the calling
+ * thread.
+ *
+ * @param wim
+ *	::WIMStruct for a WIM.
+ * @param num_threads
+ *	Number of threads to use for scanning.  If 0, the number of threads is
+ *	taken to be the number of online processors.  The default is 1, which
+ *	means that directory trees are scanned on the calling thread only.
+ *
+ * Note: this setting currently only has an effect on UNIX-like systems, and not
+ * when capturing an NTFS volume with ::WIMLIB_ADD_FLAG_NTFS.  It also has no
+ * effect if wimlib was compiled with
+ * <c>--disable-multithreaded-compression</c>.
+ */
+extern void
+wimlib_set_capture_threads(WIMStruct *wim, unsigned num_threads);
+
+/**
+ * @ingroup G_general
+ *
+ * Set the number of threads to use when decompressing data from a WIM.
+ *
+ * This affects all operations that read file data from the WIM, including
+ * extraction with wimlib_extract_image() and related functions, verification
+ * with wimlib_verify_wim(), and exporting with wimlib_export_image() followed
+ * by wimlib_write() when the data must be recompressed.  Multiple threads are
+ * only used for reads that span several compressed chunks, such as large files
+ * and packed streams (solid blocks); data is still passed to the caller in
+ * order.  The setting also applies to any WIMs that have been or will be
+ * referenced from @p wim with wimlib_reference_resource_files().
+ *
+ * When an image from @p wim is mounted with wimlib_mount_image(), this is
+ * instead the number of background threads that decompress data ahead of
+ * programs reading files sequentially from the mounted image.  There is always
+ * at least one such thread unless caching has been disabled with
+ * wimlib_set_mount_cache_size().
+ *
+ * @param wim
+ *	::WIMStruct for a WIM.
+ * @param num_threads
+ *	Number of threads to use for decompressing data.  If 0, the number of
+ *	threads is taken to be the number of online processors.  The default is
+ *	1, which means that all data is decompressed on the calling thread.
+ *
+ * Note: this setting has no effect if wimlib was compiled with
+ * <c>--disable-multithreaded-compression</c>.
+ */
+extern void
+wimlib_set_decompression_threads(WIMStruct *wim, unsigned num_threads);
+
+/**
+ * @ingroup G_general
+ *
+ * Set the number of threads to use when checking the integrity table of a WIM
+ * that is opened with ::WIMLIB_OPEN_FLAG_CHECK_INTEGRITY.
+ *
+ * The check is done by wimlib_open_wim() and wimlib_open_wim_with_progress()
+ * before there is a ::WIMStruct to configure, so unlike
+ * wimlib_set_decompression_threads(), this setting is global and not per-WIM.
+ * It applies to WIMs opened afterwards, including those opened by
+ * wimlib_reference_resource_files().  The number of threads used to compute a
+ * new integrity table when writing a WIM is instead the @p num_threads
+ * argument of wimlib_write() or wimlib_overwrite().
+ *
+ * @param num_threads
+ *	Number of threads to use for checksumming the WIM.  If 0, the number of
+ *	threads is taken to be the number of online processors, which is the
+ *	default.
+ *
+ * Note: this setting has no effect if wimlib was compiled with
+ * <c>--disable-multithreaded-compression</c>.
+ */
+extern void
+wimlib_set_integrity_check_threads(unsigned num_threads);
+
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Set the number of threads to use for creating files and setting their
+ * metadata when extracting an image from a WIM.
+ *
+ * This affects wimlib_extract_image() and related functions.  With more than
+ * one thread, directories, empty files, hard links and small files are created,
+ * and their metadata (owner, mode and timestamps) set, on several threads at
+ * once, while the file data is still read from the WIM in order on the calling
+ * thread.  This can make extracting many small files much faster, especially
+ * to SSDs and network filesystems, where the time is mostly spent on the system
+ * calls for each file.  The extracted files are the same as when extracting on
+ * one thread, and progress messages are still sent from the calling thread.
+ *
+ * @param wim
+ *	::WIMStruct for a WIM.
+ * @param num_threads
+ *	Number of threads to use for extraction.  If 0, the number of threads is
+ *	taken to be the number of online processors.  The default is 1, which
+ *	means that files are extracted on the calling thread only.
+ *
+ * Note: this setting currently only has an effect on UNIX-like systems, and not
+ * when extracting to an NTFS volume with ::WIMLIB_EXTRACT_FLAG_NTFS.  It also
+ * has no effect if wimlib was compiled with
+ * <c>--disable-multithreaded-compression</c>.  If a queue depth greater than 1
+ * has been set with wimlib_set_io_queue_depth(), that takes precedence, and
+ * files are extracted on the calling thread in batches instead.
+ */
+extern void
+wimlib_set_extraction_threads(WIMStruct *wim, unsigned num_threads);
+
 /**
  * @ingroup G_general
  *
@@ -3788,6 +4086,102 @@ extern int
 wimlib_set_image_descripton(WIMStruct *wim, int image,
 			    const wimlib_tchar *description);
 
+/**
+ * @ingroup G_general
+ *
+ * Set the number of file operations to submit to the operating system at once
+ * when reading or writing many small files.
+ *
+ * This affects the reading of files from disk when a WIM is written with
+ * wimlib_write() or wimlib_overwrite() after images were added with
+ * wimlib_add_image(), wimlib_add_image_multisource(), or wimlib_update_image();
+ * and the writing of files when an image from @p wim is extracted with
+ * wimlib_extract_image() or related functions.  With a queue depth greater than
+ * 1, the opening, reading or writing, and closing of up to that many small
+ * files are each submitted to the kernel with a single system call using Linux
+ * io_uring, rather than with one system call per file.  This greatly reduces
+ * the system call overhead when there are hundreds of thousands of small files.
+ * Larger files are still read and written with ordinary system calls.
+ *
+ * @param wim
+ *	::WIMStruct for a WIM.
+ * @param queue_depth
+ *	Maximum number of file operations to submit at once.  The default is 0,
+ *	which means that files are read and written with ordinary blocking
+ *	system calls only.  Values larger than 4096 are reduced to 4096.
+ *
+ * Note: this setting only has an effect on Linux 5.6 and later, and only if
+ * wimlib was not compiled with <c>--disable-io-uring</c>.  If io_uring is
+ * unavailable at runtime, for example because it has been disabled by the
+ * administrator, wimlib silently falls back to ordinary system calls.
+ */
+extern void
+wimlib_set_io_queue_depth(WIMStruct *wim, unsigned queue_depth);
+
+/**
+ * @ingroup G_general
+ *
+ * Set the maximum amount of memory to use when compressing or decompressing
+ * data from the WIM on multiple threads.
+ *
+ * The limit covers the compressors or decompressors of all threads, including
+ * the match-finders of the compressors, as well as the buffers holding data
+ * that has been read and is waiting to be compressed or decompressed.  When
+ * the number of threads requested with the @p num_threads argument of
+ * wimlib_write() or with wimlib_set_decompression_threads() would need more
+ * memory than this, fewer buffers and then fewer threads are used.  A single
+ * thread is always used if even two would not fit.
+ *
+ * By default, the limit is the amount of physical memory in the system.  On
+ * Linux, it is further reduced to the amount of memory that the memory
+ * cgroup(s) of the process, and their ancestors, allow it to use beyond what
+ * they already use, so that containers with a memory limit are respected.
+ * The limit is determined when compression or decompression begins.
+ *
+ * The setting also applies to any WIMs that have been or will be referenced
+ * from @p wim with wimlib_reference_resource_files().
+ *
+ * @param wim
+ *	::WIMStruct for a WIM.
+ * @param max_bytes
+ *	Maximum number of bytes of memory to use, or 0 to use the default limit
+ *	described above.
+ *
+ * Note: this setting has no effect if wimlib was compiled with
+ * <c>--disable-multithreaded-compression</c>.
+ */
+extern void
+wimlib_set_memory_limit(WIMStruct *wim, uint64_t max_bytes);
+
+/**
+ * @ingroup G_mounting_wim_images
+ *
+ * Set the maximum amount of memory to use for caching decompressed data when
+ * an image from the WIM is mounted with wimlib_mount_image().
+ *
+ * Reads from a mounted image usually arrive in pieces much smaller than the
+ * compression chunk size, especially for packed streams (solid blocks) where
+ * the chunk size may be tens of megabytes.  Caching recently decompressed
+ * chunks avoids decompressing the same chunk once per read.  Chunks are
+ * discarded in least-recently-used order when the cache is full.  Statistics
+ * about the cache can be retrieved from a mounted image as the text of the
+ * extended attribute "wimfs.cache_stats" of the mount point.  The cache also
+ * holds data decompressed ahead of time for sequential readers; see
+ * wimlib_set_decompression_threads().
+ *
+ * @param wim
+ *	::WIMStruct for a WIM.
+ * @param max_bytes
+ *	Maximum number of bytes of decompressed data to cache, or 0 to disable
+ *	caching.  The default is 64 MiB.  Chunks larger than this limit are
+ *	never cached.
+ *
+ * This setting must be made before calling wimlib_mount_image() to have any
+ * effect.
+ */
+extern void
+wimlib_set_mount_cache_size(WIMStruct *wim, uint64_t max_bytes);
+
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
@@ -4274,7 +4668,8 @@ wimlib_update_image(WIMStruct *wim,
  * 	regardless of this parameter (e.g. if writing an uncompressed WIM, or
  * 	exporting an image from a compressed WIM to another WIM of the same
  * 	compression type without ::WIMLIB_WRITE_FLAG_RECOMPRESS specified in @p
- * 	write_flags).
+ * 	write_flags).  This is also the number of threads used to checksum
+ * 	the WIM file when an integrity table is being written.
  *
  * @return 0 on success; nonzero on error.
  *
@@ -4353,6 +4748,48 @@ wimlib_write_to_fd(WIMStruct *wim,
 		   int write_flags,
 		   unsigned num_threads);
 
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Since wimlib v1.7.1:  Write an index file for the on-disk WIM file that has
+ * been opened as @p wim.  The index file is named by appending ".idx" to the
+ * name of the WIM file, and it contains the uncompressed metadata resource of
+ * each image, so that later opens of the WIM with
+ * ::WIMLIB_OPEN_FLAG_USE_INDEX_FILE do not need to decompress them.  An
+ * existing index file is replaced atomically.
+ *
+ * The index file only describes the WIM file as it is on disk; changes that
+ * have not been written with wimlib_overwrite() are not included.  Once the WIM
+ * file is modified, the index file becomes out of date and is ignored.
+ *
+ * @param wim
+ *	Pointer to the ::WIMStruct for a WIM file opened with wimlib_open_wim().
+ * @param flags
+ *	Reserved; must be 0.
+ *
+ * @return 0 on success; nonzero on error.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p flags was not 0.
+ * @retval ::WIMLIB_ERR_NO_FILENAME
+ *	@p wim does not correspond to an on-disk WIM file.
+ * @retval ::WIMLIB_ERR_METADATA_NOT_FOUND
+ *	@p wim is part 2 or later of a split WIM.
+ * @retval ::WIMLIB_ERR_OPEN
+ *	The index file could not be created.
+ * @retval ::WIMLIB_ERR_WRITE
+ *	An error occurred when writing the index file.
+ * @retval ::WIMLIB_ERR_RENAME
+ *	The index file could not be renamed into place.
+ *
+ * This function can additionally return ::WIMLIB_ERR_DECOMPRESSION,
+ * ::WIMLIB_ERR_INVALID_METADATA_RESOURCE, ::WIMLIB_ERR_READ, or
+ * ::WIMLIB_ERR_UNEXPECTED_END_OF_FILE, all of which indicate failure when
+ * reading a metadata resource from the WIM file.
+ */
+extern int
+wimlib_write_index_file(WIMStruct *wim, int flags);
+
 /**
  * @defgroup G_compression Compression and decompression functions
  *
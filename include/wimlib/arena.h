@@ -0,0 +1,28 @@
+/*
+ * arena.h
+ *
+ * Arena allocator for the many small, similarly long-lived structures (dentries,
+ * inodes, and lookup table entries) created when reading a WIM.
+ */
+
+#ifndef _WIMLIB_ARENA_H
+#define _WIMLIB_ARENA_H
+
+#include "wimlib/compiler.h"
+#include "wimlib/types.h"
+
+struct arena;
+
+extern struct arena *
+new_arena(void);
+
+extern void
+free_arena(struct arena *arena);
+
+extern void *
+arena_calloc(struct arena *arena, size_t size) _malloc_attribute;
+
+extern void
+arena_free(void *p);
+
+#endif /* _WIMLIB_ARENA_H */
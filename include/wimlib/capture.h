@@ -11,11 +11,31 @@
 struct wim_lookup_table;
 struct wim_dentry;
 struct wim_inode;
+struct capture_pipeline;
+
+struct pattern_index;
+
+/* Number of paths checked with should_exclude_path(), and the total time spent
+ * doing so in nanoseconds.  */
+struct exclusion_stats {
+	u64 num_checks;
+	u64 nsec;
+};
 
 struct capture_config {
 	struct string_set exclusion_pats;
 	struct string_set exclusion_exception_pats;
 	void *buf;
+
+	/* Both lists of patterns, compiled for should_exclude_path(), or NULL
+	 * if there are no exclusion patterns.  */
+	struct pattern_index *exclusion_index;
+
+	/* Statistics for the paths checked on the thread that called
+	 * wimlib_add_image() or wimlib_update_image().  Threads that scan files
+	 * in parallel keep their own, which are added to these once the scan is
+	 * done.  */
+	struct exclusion_stats exclusion_stats;
 };
 
 /* Common parameters to implementations of building an in-memory dentry tree
@@ -41,6 +61,14 @@ struct add_image_params {
 	/* Flags that affect the capture operation (WIMLIB_ADD_FLAG_*) */
 	int add_flags;
 
+	/* Number of threads the capture implementation may use to scan the
+	 * directory tree, or 0 to use the number of processors.  */
+	unsigned num_threads;
+
+	/* If non-NULL, the streams found by the scan are checksummed in the
+	 * background (WIMLIB_ADD_FLAG_PIPELINE).  */
+	struct capture_pipeline *pipeline;
+
 	/* Extra argument; set to point to a pointer to the ntfs_volume for
 	 * libntfs-3g capture.  */
 	void *extra_arg;
@@ -56,8 +84,26 @@ struct add_image_params {
 	u64 capture_root_ino;
 	u64 capture_root_dev;
 	size_t capture_root_nchars;
+
+	/* Number of characters at the end of the path of the directory tree
+	 * being captured that are matched against the capture configuration
+	 * as part of each path (WIMLIB_ADD_FLAG_CONFIG_FROM_TARGET).  */
+	size_t capture_root_suffix_nchars;
 };
 
+/* capture_pipeline.c */
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+extern int
+start_capture_pipeline(struct add_image_params *params);
+
+extern void
+feed_capture_pipeline(struct capture_pipeline *pipeline);
+
+extern void
+end_capture_pipeline(struct add_image_params *params, bool scan_succeeded);
+#endif
+
 /* capture_common.c */
 
 extern int
@@ -79,8 +125,17 @@ match_pattern_list(const tchar *path, size_t path_nchars,
 		   const struct string_set *list);
 
 extern bool
+should_exclude_path_stats(const tchar *path, size_t path_nchars,
+			  const struct capture_config *config,
+			  struct exclusion_stats *stats);
+
+static inline bool
 should_exclude_path(const tchar *path, size_t path_nchars,
-		    const struct capture_config *config);
+		    struct capture_config *config)
+{
+	return should_exclude_path_stats(path, path_nchars, config,
+					 config ? &config->exclusion_stats : NULL);
+}
 
 typedef int (*capture_tree_t)(struct wim_dentry **, const tchar *,
 			      struct add_image_params *);
@@ -111,4 +166,21 @@ unix_build_dentry_tree(struct wim_dentry **root_ret,
 
 #define WIMLIB_ADD_FLAG_ROOT	0x80000000
 
+/* Match the capture configuration against the paths that the files will have
+ * in the image, rather than against paths relative to the directory tree being
+ * captured.  The path of the directory tree must end with the target path.  */
+#define WIMLIB_ADD_FLAG_CONFIG_FROM_TARGET	0x40000000
+
+/* update_image.c */
+extern int
+update_image(WIMStruct *wim, int image,
+	     const struct wimlib_update_command *cmds, size_t num_cmds,
+	     int update_flags, int internal_add_flags);
+
+/* template.c */
+extern int
+reference_template_branches(WIMStruct *wim, struct wim_dentry **branches,
+			    size_t num_branches, WIMStruct *template_wim,
+			    int template_image);
+
 #endif /* _WIMLIB_CAPTURE_H */
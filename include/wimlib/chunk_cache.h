@@ -0,0 +1,74 @@
+/*
+ * chunk_cache.h
+ *
+ * Cache of decompressed chunks of WIM resources, with readahead.  This is
+ * currently only used for mounted WIM images.
+ */
+
+#ifndef _WIMLIB_CHUNK_CACHE_H
+#define _WIMLIB_CHUNK_CACHE_H
+
+#include "wimlib/types.h"
+
+struct wim_lookup_table_entry;
+struct wim_resource_spec;
+struct chunk_cache;
+
+/* Default maximum amount of decompressed data, in bytes, to cache for a mounted
+ * WIM image.  This is large enough to hold a couple of LZMS solid-block chunks
+ * or a couple thousand chunks of a non-solid resource.  */
+#define DEFAULT_MOUNT_CACHE_SIZE	(64ULL << 20)
+
+/* Statistics about a chunk cache.  */
+struct chunk_cache_stats {
+	/* Number of chunk lookups satisfied from the cache.  */
+	u64 hits;
+
+	/* Number of chunk lookups that required decompressing the chunk.  */
+	u64 misses;
+
+	/* Number of chunks evicted to stay within the memory limit.  */
+	u64 evictions;
+
+	/* Number of chunks decompressed ahead of time by the readahead
+	 * threads.  */
+	u64 readahead_chunks;
+
+	/* Number of times a read had to wait for a readahead thread to finish
+	 * decompressing the chunk it needed.  */
+	u64 readahead_waits;
+
+	/* Number of chunks, and total uncompressed bytes, currently cached.  */
+	u64 num_chunks;
+	u64 cur_size;
+
+	/* Maximum number of uncompressed bytes the cache may hold.  */
+	u64 max_size;
+};
+
+extern int
+new_chunk_cache(u64 max_size, struct chunk_cache **cache_ret);
+
+extern void
+chunk_cache_start_readahead(struct chunk_cache *cache, unsigned num_threads);
+
+extern void
+free_chunk_cache(struct chunk_cache *cache);
+
+extern int
+read_partial_wim_stream_cached(struct chunk_cache *cache,
+			       const struct wim_lookup_table_entry *lte,
+			       size_t size, u64 offset, void *buf);
+
+extern void
+chunk_cache_readahead(struct chunk_cache *cache,
+		      const struct wim_lookup_table_entry *lte, u64 offset);
+
+extern void
+chunk_cache_drop_rspec(const struct wim_resource_spec *rspec);
+
+extern void
+chunk_cache_get_stats(struct chunk_cache *cache,
+		      struct chunk_cache_stats *stats);
+
+#endif /* _WIMLIB_CHUNK_CACHE_H */
@@ -20,6 +20,14 @@ struct chunk_compressor {
 	u32 out_chunk_size;
 	unsigned num_threads;
 
+	/* Statistics kept by the parallel chunk compressor: the total time, in
+	 * nanoseconds, that the calling thread has spent waiting in
+	 * get_chunk() for chunks to be compressed, and that the compressor
+	 * threads have spent waiting for chunks to compress.  The latter is
+	 * updated by the compressor threads and must be read atomically.  */
+	u64 wait_nsec;
+	u64 idle_nsec;
+
 	/* Free the chunk compressor.  */
 	void (*destroy)(struct chunk_compressor *);
 
@@ -63,11 +71,13 @@ struct chunk_compressor {
 int
 new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 			      unsigned num_threads, u64 max_memory,
+			      u64 max_num_chunks,
 			      struct chunk_compressor **compressor_ret);
 #endif
 
 int
 new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			    unsigned num_threads,
 			    struct chunk_compressor **compressor_ret);
 
 #endif /* _WIMLIB_CHUNK_COMPRESSOR_H  */
@@ -0,0 +1,64 @@
+/*
+ * chunk_decompressor.h
+ *
+ * Interface for parallel chunk decompression.
+ */
+
+#ifndef _WIMLIB_CHUNK_DECOMPRESSOR_H
+#define _WIMLIB_CHUNK_DECOMPRESSOR_H
+
+#include <wimlib/types.h>
+
+/* Interface for chunk decompression.  This is the read-side counterpart of
+ * 'struct chunk_compressor'.  Users can submit chunks of compressed data to be
+ * decompressed, then retrieve the uncompressed data later in order.  There is
+ * currently only a parallel implementation; the serial case is handled
+ * directly by read_compressed_wim_resource().  */
+struct chunk_decompressor {
+	/* Variables set by the chunk decompressor when it is created.  */
+	int in_ctype;
+	u32 in_chunk_size;
+	unsigned num_threads;
+
+	/* Free the chunk decompressor.  */
+	void (*destroy)(struct chunk_decompressor *);
+
+	/* Submit a chunk of data for decompression.
+	 *
+	 * The uncompressed size of the chunk must be greater than 0 and less
+	 * than or equal to @in_chunk_size.  The compressed size must be greater
+	 * than 0 and less than or equal to the uncompressed size.  If the two
+	 * sizes are equal, the chunk is taken to be stored uncompressed.
+	 *
+	 * The return value is %true if the chunk was successfully submitted, or
+	 * %false if the chunk decompressor does not have space for the chunk at
+	 * the present time.  In the latter case, get_chunk() must be called to
+	 * retrieve an uncompressed chunk before trying again.  */
+	bool (*submit_chunk)(struct chunk_decompressor *,
+			     const void *, u32, u32);
+
+	/* Get the next chunk of uncompressed data.
+	 *
+	 * The uncompressed data and its size are returned in the locations
+	 * pointed to by arguments 2-3.  The data is in storage internal to the
+	 * chunk decompressor, and it cannot be accessed beyond any subsequent
+	 * calls to the chunk decompressor.  If the chunk could not be
+	 * decompressed because the compressed data was invalid, the returned
+	 * data pointer is NULL.
+	 *
+	 * Chunks will be returned in the same order in which they were
+	 * submitted for decompression.
+	 *
+	 * The return value is %true if a chunk was retrieved, or %false if there
+	 * are no chunks currently being decompressed.  */
+	bool (*get_chunk)(struct chunk_decompressor *, const void **, u32 *);
+};
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+int
+new_parallel_chunk_decompressor(int in_ctype, u32 in_chunk_size,
+				unsigned num_threads, u64 max_memory,
+				struct chunk_decompressor **decompressor_ret);
+#endif
+
+#endif /* _WIMLIB_CHUNK_DECOMPRESSOR_H */
@@ -18,6 +18,10 @@ struct compressor_ops {
 				 unsigned int compression_level,
 				 void **private_ret);
 
+	/* Optional: allow up to @num_threads threads, including the calling
+	 * thread, to be used to compress each block.  */
+	void (*set_num_threads)(void *private, unsigned num_threads);
+
 	size_t (*compress)(const void *uncompressed_data,
 			   size_t uncompressed_size,
 			   void *compressed_data,
@@ -27,6 +31,11 @@ struct compressor_ops {
 	void (*free_compressor)(void *private);
 };
 
+struct wimlib_compressor;
+
+extern void
+set_compressor_num_threads(struct wimlib_compressor *c, unsigned num_threads);
+
 extern const struct compressor_ops lzx_compressor_ops;
 extern const struct compressor_ops xpress_compressor_ops;
 extern const struct compressor_ops lzms_compressor_ops;
@@ -0,0 +1,59 @@
+/*
+ * cpu_features.h
+ *
+ * Runtime detection of CPU features, used to select optimized implementations
+ * of performance-critical code.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#ifndef _WIMLIB_CPU_FEATURES_H
+#define _WIMLIB_CPU_FEATURES_H
+
+#include "wimlib/compiler.h"
+#include "wimlib/types.h"
+
+/* Can we compile functions for specific x86 instruction set extensions with
+ * __attribute__((target(...))) and use the corresponding intrinsics from
+ * <immintrin.h>?  This requires gcc 4.9 or later, or clang 3.8 or later.  */
+#if (defined(__i386__) || defined(__x86_64__)) &&			\
+	((defined(__clang__) &&						\
+	  (__clang_major__ > 3 ||					\
+	   (__clang_major__ == 3 && __clang_minor__ >= 8))) ||		\
+	 (!defined(__clang__) && defined(__GNUC__) &&			\
+	  (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#  define X86_CPU_FEATURES_ENABLED 1
+#else
+#  define X86_CPU_FEATURES_ENABLED 0
+#endif
+
+#if X86_CPU_FEATURES_ENABLED
+
+#define X86_CPU_FEATURE_SSSE3		0x00000001
+#define X86_CPU_FEATURE_SSE4_1		0x00000002
+#define X86_CPU_FEATURE_AVX		0x00000004
+#define X86_CPU_FEATURE_AVX2		0x00000008
+#define X86_CPU_FEATURE_SHA		0x00000010
+
+/* Set once the features have been detected, so that 0 means "unknown".  */
+#define X86_CPU_FEATURES_KNOWN		0x80000000
+
+extern u32 _x86_cpu_features;
+
+extern void
+x86_setup_cpu_features(void);
+
+/* Does the processor we are running on support all of the specified
+ * X86_CPU_FEATURE_* flags?  */
+static inline bool
+x86_have_cpu_features(u32 features)
+{
+	if (unlikely(_x86_cpu_features == 0))
+		x86_setup_cpu_features();
+	return (_x86_cpu_features & features) == features;
+}
+
+#endif /* X86_CPU_FEATURES_ENABLED */
+
+#endif /* _WIMLIB_CPU_FEATURES_H */
@@ -8,6 +8,7 @@
 #include "wimlib/list.h"
 #include "wimlib/types.h"
 
+struct arena;
 struct wim_inode;
 struct wim_lookup_table;
 
@@ -97,6 +98,11 @@ struct wim_dentry {
 	/* Used by wimlib_update_image()  */
 	u8 is_orphan : 1;
 
+	/* Set on a directory whose children have not yet been read from the
+	 * metadata resource; see load_dentry_children().  This only remains
+	 * set on images whose metadata is being loaded on demand.  */
+	u8 children_not_loaded : 1;
+
 	union {
 		/* 'subdir_offset' is only used while reading and writing this
 		 * dentry.  See the corresponding field in `struct
@@ -256,8 +262,12 @@ rename_wim_path(WIMStruct *wim, const tchar *from, const tchar *to,
 
 
 extern int
-read_dentry_tree(const u8 *buf, size_t buf_len,
-		 u64 root_offset, struct wim_dentry **root_ret);
+read_dentry_tree(const u8 *buf, size_t buf_len, u64 root_offset, bool lazy,
+		 struct arena *arena, struct wim_dentry **root_ret);
+
+extern int
+read_dentry_children(const u8 *buf, size_t buf_len, struct wim_dentry *dir,
+		     struct arena *arena);
 
 extern u8 *
 write_dentry_tree(struct wim_dentry *root, u8 *p);
@@ -4,7 +4,8 @@
 #include "wimlib/types.h"
 
 extern void
-divsufsort(const u8 *T, u32 *SA, u32 n, u32 *bucket_A, u32 *bucket_B);
+divsufsort(const u8 *T, u32 *SA, u32 n, u32 *bucket_A, u32 *bucket_B,
+	   unsigned num_threads);
 
 #define DIVSUFSORT_TMP1_LEN (256)	   	/* bucket_A  */
 #define DIVSUFSORT_TMP2_LEN (256 * 256)		/* bucket_B  */
@@ -0,0 +1,28 @@
+/*
+ * index_file.h
+ *
+ * Optional sidecar file that caches the uncompressed metadata resources of a
+ * WIM file, so that they need not be decompressed each time the WIM is opened.
+ */
+
+#ifndef _WIMLIB_INDEX_FILE_H
+#define _WIMLIB_INDEX_FILE_H
+
+#include "wimlib/types.h"
+
+struct wim_lookup_table_entry;
+
+/* Suffix appended to the WIM filename to get the name of its index file.  */
+#define WIM_INDEX_FILE_SUFFIX	T(".idx")
+
+extern int
+open_wim_index_file(WIMStruct *wim);
+
+extern void
+close_wim_index_file(WIMStruct *wim);
+
+extern const void *
+wim_index_file_get_metadata(WIMStruct *wim,
+			    const struct wim_lookup_table_entry *metadata_lte);
+
+#endif /* _WIMLIB_INDEX_FILE_H */
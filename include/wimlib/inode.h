@@ -8,6 +8,7 @@
 
 #include <string.h>
 
+struct arena;
 struct wim_ads_entry;
 struct wim_dentry;
 struct wim_security_data;
@@ -303,7 +304,7 @@ extern struct wim_inode *
 new_inode(void) _malloc_attribute;
 
 extern struct wim_inode *
-new_timeless_inode(void) _malloc_attribute;
+new_timeless_inode(struct arena *arena) _malloc_attribute;
 
 extern void
 put_inode(struct wim_inode *inode);
@@ -540,7 +541,22 @@ inode_unref_streams(struct wim_inode *inode,
 		    struct wim_lookup_table *lookup_table);
 
 /* inode_fixup.c  */
+struct inode_fixup_params;
+
 extern int
 dentry_tree_fix_inodes(struct wim_dentry *root, struct list_head *inode_list);
 
+extern int
+inode_fixup_begin(struct inode_fixup_params **params_ret);
+
+extern void
+inode_fixup_add_dentry(struct wim_dentry *dentry,
+		       struct inode_fixup_params *params);
+
+extern void
+inode_fixup_end(struct inode_fixup_params *params, struct list_head *inode_list);
+
+extern void
+inode_fixup_abort(struct inode_fixup_params *params);
+
 #endif /* _WIMLIB_INODE_H  */
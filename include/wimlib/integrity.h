@@ -20,9 +20,10 @@ extern int
 write_integrity_table(WIMStruct *wim,
 		      off_t new_lookup_table_end,
 		      off_t old_lookup_table_end,
-		      struct integrity_table *old_table);
+		      struct integrity_table *old_table,
+		      unsigned num_threads);
 
 extern int
-check_wim_integrity(WIMStruct *wim);
+check_wim_integrity(WIMStruct *wim, unsigned num_threads);
 
 #endif /* _WIMLIB_INTEGRITY_H */
@@ -0,0 +1,54 @@
+/*
+ * io_ring.h
+ *
+ * Minimal interface to the Linux io_uring facility, used to batch the system
+ * calls needed to read or write many small files.
+ */
+
+#ifndef _WIMLIB_IO_RING_H
+#define _WIMLIB_IO_RING_H
+
+#ifdef ENABLE_IO_URING
+
+#include "wimlib/types.h"
+
+struct io_ring;
+
+/* Maximum queue depth; larger requested depths are reduced to this.  */
+#define IO_RING_MAX_DEPTH	4096
+
+/* Called by io_ring_run() with the @user_data and result of each operation
+ * that has completed.  The result is a nonnegative value on success (e.g. the
+ * number of bytes transferred) or a negated errno value on failure.  */
+typedef void (*io_ring_completion_t)(u64 user_data, s32 res, void *ctx);
+
+extern struct io_ring *
+io_ring_new(unsigned queue_depth);
+
+extern void
+io_ring_free(struct io_ring *ring);
+
+extern unsigned
+io_ring_depth(const struct io_ring *ring);
+
+extern void
+io_ring_prep_openat(struct io_ring *ring, const char *path, int flags,
+		    u64 user_data);
+
+extern void
+io_ring_prep_read(struct io_ring *ring, int fd, void *buf, u32 len,
+		  u64 offset, bool link_next, u64 user_data);
+
+extern void
+io_ring_prep_write(struct io_ring *ring, int fd, const void *buf, u32 len,
+		   u64 offset, u64 user_data);
+
+extern void
+io_ring_prep_close(struct io_ring *ring, int fd, u64 user_data);
+
+extern int
+io_ring_run(struct io_ring *ring, io_ring_completion_t complete, void *ctx);
+
+#endif /* ENABLE_IO_URING */
+
+#endif /* _WIMLIB_IO_RING_H */
@@ -6,6 +6,8 @@
 #include "wimlib/sha1.h"
 #include "wimlib/types.h"
 
+struct piece_list;
+
 /* An enumerated type that identifies where the stream corresponding to this
  * lookup table entry is actually located.
  *
@@ -35,6 +37,17 @@ enum resource_location {
 	 * @attached_buffer.  */
 	RESOURCE_IN_ATTACHED_BUFFER,
 
+	/* The stream has been split into pieces, each of which is a stream in
+	 * the lookup table @piece_list->table; @piece_list gives the SHA1
+	 * message digests of the pieces in order.  */
+	RESOURCE_IN_PIECES,
+
+	/* The stream is a piece of another stream: it consists of the @size
+	 * bytes at offset @offset_in_parent in the stream @parent.  @parent is
+	 * a private copy of the split stream that is not in any lookup table;
+	 * its @refcnt is the number of pieces referring to it.  */
+	RESOURCE_IN_PARENT_STREAM,
+
 #ifdef WITH_FUSE
 	/* The stream is located in the external file named by
 	 * @staging_file_name, located in the staging directory for a read-write
@@ -168,6 +181,11 @@ struct wim_lookup_table_entry {
 		};
 		tchar *file_on_disk;
 		void *attached_buffer;
+		struct piece_list *piece_list;
+		struct {
+			struct wim_lookup_table_entry *parent;
+			u64 offset_in_parent;
+		};
 	#ifdef WITH_FUSE
 		struct {
 			char *staging_file_name;
@@ -344,6 +362,17 @@ lte_zero_out_refcnt(struct wim_lookup_table_entry *lte, void *ignore);
 extern int
 lte_zero_real_refcnt(struct wim_lookup_table_entry *lte, void *ignore);
 
+/* export_image.c */
+
+extern int
+inode_export_streams(struct wim_inode *inode,
+		     struct wim_lookup_table *src_lookup_table,
+		     struct wim_lookup_table *dest_lookup_table,
+		     bool gift);
+
+extern int
+lte_unexport(struct wim_lookup_table_entry *lte, void *_lookup_table);
+
 static inline bool
 lte_is_partial(const struct wim_lookup_table_entry * lte)
 {
@@ -400,6 +429,12 @@ hash_unhashed_stream(struct wim_lookup_table_entry *lte,
 		     struct wim_lookup_table *lookup_table,
 		     struct wim_lookup_table_entry **lte_ret);
 
+extern void
+set_unhashed_stream_hash(struct wim_lookup_table_entry *lte,
+			 const u8 hash[SHA1_HASH_SIZE],
+			 struct wim_lookup_table *lookup_table,
+			 struct wim_lookup_table_entry **lte_ret);
+
 extern struct wim_lookup_table_entry **
 retrieve_lte_pointer(struct wim_lookup_table_entry *lte);
 
@@ -275,6 +275,25 @@ struct lz_mf_params {
 	 * default value.
 	 */
 	u32 nice_match_len;
+
+	/*
+	 * The maximum number of threads, including the calling thread, that
+	 * lz_mf_load_window() may use.
+	 *
+	 * The suffix array-based match-finding algorithms use the threads to
+	 * build the suffix array, the inverse suffix array, and the LCP array.
+	 * When building the suffix array, the buckets of suffixes sorted by
+	 * their first two characters are sorted on all the threads at once;
+	 * the rest of the construction uses only the calling thread.  The
+	 * results do not depend on the number of threads.  The other
+	 * match-finding algorithms ignore this parameter, as do all
+	 * algorithms if wimlib was built without multithreaded compression
+	 * support.
+	 *
+	 * 0 is the same as 1.  This can be changed after the match-finder has
+	 * been allocated with lz_mf_set_num_threads().
+	 */
+	u32 num_threads;
 };
 
 /*
@@ -376,6 +395,16 @@ lz_mf_get_position(const struct lz_mf *mf)
 	return mf->cur_window_pos;
 }
 
+/*
+ * Sets the maximum number of threads that lz_mf_load_window() may use.  See
+ * 'struct lz_mf_params' for details.
+ */
+static inline void
+lz_mf_set_num_threads(struct lz_mf *mf, u32 num_threads)
+{
+	mf->params.num_threads = num_threads;
+}
+
 /*
  * Returns the number of bytes remaining in the window.
  */
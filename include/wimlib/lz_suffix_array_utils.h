@@ -6,12 +6,13 @@
 #define BUILD_SA_MIN_TMP_LEN (65536 + 256)
 
 extern void
-build_SA(u32 *SA, const u8 *T, u32 n, u32 *tmp);
+build_SA(u32 *SA, const u8 *T, u32 n, u32 *tmp, unsigned num_threads);
 
 extern void
-build_ISA(u32 *ISA, const u32 *SA, u32 n);
+build_ISA(u32 *ISA, const u32 *SA, u32 n, unsigned num_threads);
 
 extern void
-build_LCP(u32 *LCP, const u32 *SA, const u32 *ISA, const u8 *T, u32 n);
+build_LCP(u32 *LCP, const u32 *SA, const u32 *ISA, const u8 *T, u32 n,
+	  unsigned num_threads);
 
 #endif /* _WIMLIB_LZ_SUFFIX_ARRAY_UTILS_H */
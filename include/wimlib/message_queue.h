@@ -0,0 +1,41 @@
+/*
+ * message_queue.h
+ *
+ * Simple blocking queue for passing work between threads.
+ */
+
+#ifndef _WIMLIB_MESSAGE_QUEUE_H
+#define _WIMLIB_MESSAGE_QUEUE_H
+
+#include "wimlib/list.h"
+#include "wimlib/types.h"
+
+#include <pthread.h>
+
+/* A queue of messages, each of which is identified by an embedded
+ * 'struct list_head'.  Any number of threads may put messages into the queue
+ * and any number of threads may wait for messages to arrive.  */
+struct message_queue {
+	struct list_head list;
+	pthread_mutex_t lock;
+	pthread_cond_t msg_avail_cond;
+	pthread_cond_t space_avail_cond;
+	bool terminating;
+};
+
+extern int
+message_queue_init(struct message_queue *q);
+
+extern void
+message_queue_destroy(struct message_queue *q);
+
+extern void
+message_queue_put(struct message_queue *q, struct list_head *msg);
+
+extern struct list_head *
+message_queue_get(struct message_queue *q);
+
+extern void
+message_queue_terminate(struct message_queue *q);
+
+#endif /* _WIMLIB_MESSAGE_QUEUE_H */
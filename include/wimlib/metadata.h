@@ -1,6 +1,7 @@
 #ifndef _WIMLIB_METADATA_H
 #define _WIMLIB_METADATA_H
 
+#include "wimlib/dentry.h"
 #include "wimlib/list.h"
 #include "wimlib/types.h"
 #include "wimlib/wim.h"
@@ -9,6 +10,9 @@
 struct _ntfs_volume;
 #endif
 
+struct arena;
+struct wim_lazy_metadata;
+
 /* Metadata for a WIM image  */
 struct wim_image_metadata {
 
@@ -41,6 +45,16 @@ struct wim_image_metadata {
 	 * different WIM image. */
 	u8 modified : 1;
 
+	/* If not NULL, the dentry tree has only been partially read from the
+	 * metadata resource, and this holds the state needed to read the rest
+	 * of it on demand.  See load_dentry_children().  */
+	struct wim_lazy_metadata *lazy;
+
+	/* Arena from which the dentries and inodes read from the metadata
+	 * resource are allocated, or NULL if the image was not read from a
+	 * metadata resource.  */
+	struct arena *arena;
+
 #ifdef WITH_NTFS_3G
 	struct _ntfs_volume *ntfs_vol;
 #endif
@@ -83,6 +97,31 @@ wim_get_current_security_data(WIMStruct *wim)
 #define image_for_each_unhashed_stream_safe(lte, tmp, imd) \
 	list_for_each_entry_safe(lte, tmp, &(imd)->unhashed_streams, unhashed_list)
 
+extern int
+do_load_dentry_children(struct wim_image_metadata *imd,
+			struct wim_dentry *dir);
+
+/* Make sure the children of the directory @dir, which must be in the image of
+ * @wim currently selected with select_wim_image_lazy(), have been read from
+ * the metadata resource.  */
+static inline int
+load_dentry_children(WIMStruct *wim, struct wim_dentry *dir)
+{
+	if (likely(!dir->children_not_loaded))
+		return 0;
+	return do_load_dentry_children(wim_get_current_image_metadata(wim),
+				       dir);
+}
+
+extern int
+load_dentry_subtree(WIMStruct *wim, struct wim_dentry *dentry);
+
+extern int
+finish_lazy_metadata(struct wim_image_metadata *imd);
+
+extern void
+free_lazy_metadata(struct wim_image_metadata *imd);
+
 extern void
 put_image_metadata(struct wim_image_metadata *imd,
 		   struct wim_lookup_table *table);
@@ -0,0 +1,28 @@
+/*
+ * pattern_index.h
+ *
+ * Index of wildcard path patterns, used to match each path against all the
+ * patterns of a capture configuration at once.
+ */
+
+#ifndef _WIMLIB_PATTERN_INDEX_H
+#define _WIMLIB_PATTERN_INDEX_H
+
+#include "wimlib/types.h"
+
+struct pattern_index;
+
+extern struct pattern_index *
+new_pattern_index(bool ignore_case);
+
+extern int
+pattern_index_add(struct pattern_index *index, const tchar *pat, u32 flags);
+
+extern u32
+pattern_index_match(const struct pattern_index *index,
+		    const tchar *path, size_t path_nchars);
+
+extern void
+free_pattern_index(struct pattern_index *index);
+
+#endif /* _WIMLIB_PATTERN_INDEX_H */
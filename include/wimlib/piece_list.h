@@ -0,0 +1,73 @@
+/*
+ * piece_list.h
+ *
+ * Content-defined splitting of large streams into pieces, and the piece lists
+ * that describe a stream as a sequence of other streams.
+ */
+
+#ifndef _WIMLIB_PIECE_LIST_H
+#define _WIMLIB_PIECE_LIST_H
+
+#include "wimlib/resource.h"
+#include "wimlib/sha1.h"
+#include "wimlib/types.h"
+
+struct wim_lookup_table;
+struct wim_lookup_table_entry;
+
+/* Streams smaller than this are never split into pieces.  */
+#define PIECE_DEDUP_MIN_STREAM_SIZE	(1U << 20)
+
+/* Minimum, target average, and maximum sizes of the pieces a stream is split
+ * into.  Only the last piece of a stream may be smaller than the minimum.  */
+#define PIECE_MIN_SIZE			(16U << 10)
+#define PIECE_AVG_SIZE			(64U << 10)
+#define PIECE_MAX_SIZE			(256U << 10)
+
+/* A stream stored as a list of pieces (location RESOURCE_IN_PIECES).  The data
+ * of the stream is the concatenation of the data of the pieces, each of which
+ * is a stream in its own right, identified by its SHA1 message digest.  */
+struct piece_list {
+	/* Lookup table in which the pieces are looked up.  */
+	struct wim_lookup_table *table;
+
+	/* WIM file from which the piece list was read, or NULL if the piece
+	 * list has not been written to any WIM file yet.  */
+	WIMStruct *wim;
+
+	/* Location of the piece list in @wim (only valid if @wim != NULL).  */
+	struct wim_reshdr reshdr;
+
+	/* Number of pieces, and the SHA1 message digest of each, in order.  */
+	u32 num_pieces;
+	u8 hashes[][SHA1_HASH_SIZE];
+};
+
+extern struct piece_list *
+new_piece_list(u32 num_pieces);
+
+extern struct piece_list *
+clone_piece_list(const struct piece_list *pl);
+
+extern void *
+serialize_piece_list(const struct piece_list *pl, u64 stream_size,
+		     size_t *size_ret);
+
+extern int
+lte_load_piece_list(struct wim_lookup_table_entry *lte, WIMStruct *wim,
+		    struct wim_lookup_table *table);
+
+extern void
+piece_list_put_pieces(const struct piece_list *pl,
+		      struct wim_lookup_table *table);
+
+extern void
+piece_list_tally_refcnts(const struct piece_list *pl,
+			 const struct wim_lookup_table *table);
+
+extern int
+split_stream_into_pieces(const struct wim_lookup_table_entry *lte,
+			 u8 stream_hash[SHA1_HASH_SIZE],
+			 struct piece_list **pl_ret, u64 **offsets_ret);
+
+#endif /* _WIMLIB_PIECE_LIST_H */
@@ -0,0 +1,30 @@
+/*
+ * read_thread.h
+ *
+ * Read a list of streams from a separate thread.
+ */
+
+#ifndef _WIMLIB_READ_THREAD_H
+#define _WIMLIB_READ_THREAD_H
+
+#include "wimlib/resource.h"
+
+/* Size of each buffer of stream data passed from the reader thread.  */
+#define READ_THREAD_BUF_SIZE		(1 << 18)
+
+/* Number of buffers of stream data the reader thread can fill ahead of the
+ * calling thread.  */
+#define READ_THREAD_NUM_BUFS		16
+
+/* Memory used by the reader thread for its buffers.  */
+#define READ_THREAD_MAX_MEMORY		\
+	((u64)READ_THREAD_NUM_BUFS * READ_THREAD_BUF_SIZE)
+
+extern int
+read_stream_list_in_thread(struct list_head *stream_list,
+			   size_t list_head_offset,
+			   const struct read_stream_list_callbacks *cbs,
+			   int flags,
+			   struct io_ring *ring);
+
+#endif /* _WIMLIB_READ_THREAD_H */
@@ -9,6 +9,7 @@
 
 struct wim_lookup_table_entry;
 struct wim_image_metadata;
+struct io_ring;
 
 /* Specification of a resource in a WIM file.
  *
@@ -111,6 +112,12 @@ struct wim_reshdr {
  * should be WIM_VERSION_PACKED_STREAMS.  */
 #define WIM_RESHDR_FLAG_PACKED_STREAMS	0x10
 
+/* wimlib extension: the resource does not contain the data of the stream, but
+ * rather a piece list giving the SHA1 message digests of the streams whose
+ * concatenation is the stream's data (see piece_list.c).  Microsoft's software
+ * does not understand this flag.  */
+#define WIM_RESHDR_FLAG_PIECE_LIST	0x20
+
 /* Magic number in the 'uncompressed_size' field of the resource header that
  * identifies the main entry for a pack.  */
 #define WIM_PACK_MAGIC_NUMBER		0x100000000ULL
@@ -186,12 +193,38 @@ get_chunk_entry_size(u64 res_size, bool is_alt)
 		return 8;
 }
 
+/* A decompressor owned by a reader of a WIM rather than by the WIMStruct.  This
+ * allows multiple threads to read resources from the same WIM at once.  It
+ * must be zero-initialized before first use.  */
+struct private_decompressor {
+	struct wimlib_decompressor *decompressor;
+	int ctype;
+	u32 max_block_size;
+};
+
 /* Functions to read streams  */
 
+extern int
+read_partial_wim_resource_into_buf(const struct wim_resource_spec *rspec,
+				   size_t size, u64 offset, void *buf,
+				   struct private_decompressor *pd);
+
+extern void
+free_private_decompressor(struct private_decompressor *pd);
+
 extern int
 read_partial_wim_stream_into_buf(const struct wim_lookup_table_entry *lte,
 				 size_t size, u64 offset, void *buf);
 
+extern int
+read_stream_range(const struct wim_lookup_table_entry *lte,
+		  u64 offset, u64 size,
+		  consume_data_callback_t cb, void *cb_ctx);
+
+extern int
+read_partial_stream_into_buf(const struct wim_lookup_table_entry *lte,
+			     size_t size, u64 offset, void *buf);
+
 extern int
 read_full_stream_into_buf(const struct wim_lookup_table_entry *lte, void *buf);
 
@@ -280,7 +313,22 @@ extern int
 read_stream_list(struct list_head *stream_list,
 		 size_t list_head_offset,
 		 const struct read_stream_list_callbacks *cbs,
-		 int flags);
+		 int flags,
+		 struct io_ring *ring);
+
+/* Streams in files on disk no larger than this are read in batches when an
+ * io_ring is available.  */
+#define RING_READ_MAX_FILE_SIZE		65536
+
+/* Maximum number of files to have open at once while reading a batch.  */
+#define RING_READ_MAX_OPEN_FILES	128
+
+/* Maximum number of streams read_stream_list() reads in one batch.  */
+#define RING_READ_MAX_BATCH_STREAMS	RING_READ_MAX_OPEN_FILES
+
+/* Maximum size of the buffer read_stream_list() allocates for one batch.  */
+#define RING_READ_MAX_BATCH_SIZE	\
+	((u64)RING_READ_MAX_BATCH_STREAMS * RING_READ_MAX_FILE_SIZE)
 
 /* Functions to extract streams.  */
 
@@ -303,15 +351,31 @@ extract_full_stream_to_fd(struct wim_lookup_table_entry *lte,
 extern int
 sha1_stream(struct wim_lookup_table_entry *lte);
 
+/* Streams no larger than this many bytes are small enough to be checksummed in
+ * batches with sha1_small_streams().  */
+#define SHA1_BATCH_MAX_STREAM_SIZE	65536
+
+/* Maximum number of streams that can be passed to sha1_small_streams().  */
+#define SHA1_BATCH_MAX_STREAMS		32
+
+extern int
+sha1_small_streams(struct wim_lookup_table_entry * const ltes[],
+		   size_t num_streams, u8 hashes[][SHA1_HASH_SIZE],
+		   struct io_ring *ring);
+
 /* Functions to read/write metadata resources.  */
 
 extern int
 read_metadata_resource(WIMStruct *wim,
-		       struct wim_image_metadata *image_metadata);
+		       struct wim_image_metadata *image_metadata, bool lazy);
 
 extern int
 write_metadata_resource(WIMStruct *wim, int image, int write_resource_flags);
 
+extern int
+clone_image_metadata(WIMStruct *wim, int image,
+		     struct wim_image_metadata *imd);
+
 /* Definitions specific to pipable WIM resources.  */
 
 /* Arbitrary number to begin each stream in the pipable WIM, used for sanity
@@ -70,6 +70,14 @@ sha1_buffer(const void *buffer, size_t len, u8 hash[SHA1_HASH_SIZE])
 	SHA1(buffer, len, hash);
 }
 
+static inline void
+sha1_multi_buffer(const void * const bufs[], const size_t lens[],
+		  u8 hashes[][SHA1_HASH_SIZE], size_t num_bufs)
+{
+	for (size_t i = 0; i < num_bufs; i++)
+		SHA1(bufs[i], lens[i], hashes[i]);
+}
+
 #else /* WITH_LIBCRYPTO */
 
 typedef struct {
@@ -90,6 +98,19 @@ sha1_final(u8 hash[SHA1_HASH_SIZE], SHA_CTX *ctx);
 extern void
 sha1_buffer(const void *buffer, size_t len, u8 hash[SHA1_HASH_SIZE]);
 
+extern void
+sha1_multi_buffer(const void * const bufs[], const size_t lens[],
+		  u8 hashes[][SHA1_HASH_SIZE], size_t num_bufs);
+
+extern const char *
+sha1_supported_impl_name(size_t idx);
+
+extern bool
+sha1_select_impl(const char *name);
+
+extern const char *
+sha1_selected_impl_name(void);
+
 #endif /* !WITH_LIBCRYPTO */
 
 #endif /* _WIMLIB_SHA1_H */
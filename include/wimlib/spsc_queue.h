@@ -0,0 +1,59 @@
+/*
+ * spsc_queue.h
+ *
+ * Lock-free single-producer, single-consumer queue for passing work between
+ * two threads.
+ */
+
+#ifndef _WIMLIB_SPSC_QUEUE_H
+#define _WIMLIB_SPSC_QUEUE_H
+
+#include "wimlib/compiler.h"
+#include "wimlib/types.h"
+
+#include <pthread.h>
+
+/* A bounded ring of pointers with exactly one thread putting items into it and
+ * exactly one thread taking them out.  Neither side takes a lock as long as the
+ * consumer finds an item waiting; only a consumer that finds the queue empty
+ * after spinning for a while goes to sleep on the condition variable, and only
+ * then does the producer have to take the lock to wake it up.
+ *
+ * The producer never waits: the caller must ensure that the queue never holds
+ * more than the capacity given to spsc_queue_init().  */
+struct spsc_queue {
+	void **slots;
+	u32 mask;
+	unsigned max_spins;
+
+	/* Index of the next slot to fill; written only by the producer.  */
+	u32 head _aligned_attribute(64);
+
+	/* Index of the next slot to empty; written only by the consumer.  */
+	u32 tail _aligned_attribute(64);
+
+	/* Set while the consumer is asleep, or about to go to sleep, waiting
+	 * for the producer.  */
+	int consumer_sleeping;
+
+	bool terminating;
+	pthread_mutex_t lock;
+	pthread_cond_t item_avail_cond;
+};
+
+extern int
+spsc_queue_init(struct spsc_queue *q, size_t capacity);
+
+extern void
+spsc_queue_destroy(struct spsc_queue *q);
+
+extern void
+spsc_queue_put(struct spsc_queue *q, void *item);
+
+extern void *
+spsc_queue_get(struct spsc_queue *q, u64 *wait_nsec_ret);
+
+extern void
+spsc_queue_terminate(struct spsc_queue *q);
+
+#endif /* _WIMLIB_SPSC_QUEUE_H */
@@ -71,6 +71,9 @@ wim_timestamp_to_timespec(u64 timestamp)
 extern u64
 get_wim_timestamp(void);
 
+extern u64
+get_monotonic_time_nsec(void);
+
 extern void
 wim_timestamp_to_str(u64 timestamp, tchar *buf, size_t len);
 
@@ -107,6 +107,12 @@ randomize_char_array_with_alnum(tchar p[], size_t n);
 extern void
 print_byte_field(const u8 field[], size_t len, FILE *out);
 
+extern unsigned
+get_default_num_threads(void);
+
+extern u64
+get_avail_memory(void);
+
 static inline u32
 bsr32(u32 n)
 {
@@ -16,6 +16,11 @@ expand_wildcard(WIMStruct *wim,
 		void *consume_dentry_ctx,
 		u32 flags);
 
+extern bool
+match_wildcard(const tchar *string, size_t string_len,
+	       const tchar *wildcard, size_t wildcard_len,
+	       bool ignore_case);
+
 extern bool
 match_path(const tchar *path, size_t path_nchars,
 	   const tchar *wildcard, tchar path_sep, bool prefix_ok);
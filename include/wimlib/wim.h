@@ -47,6 +47,41 @@ struct WIMStruct {
 	u8 decompressor_ctype;
 	u32 decompressor_max_block_size;
 
+	/* Cached parallel chunk decompressor, used when reading many chunks
+	 * from a compressed resource (or NULL if none has been created).  */
+	struct chunk_decompressor *chunk_decompressor;
+
+	/* Number of threads to use for decompressing resources.  Set by
+	 * wimlib_set_decompression_threads(); 0 means use the number of
+	 * processors and 1 means decompress on the calling thread only.  */
+	unsigned num_decompression_threads;
+
+	/* Number of threads to use for scanning directory trees when adding
+	 * files to an image.  Set by wimlib_set_capture_threads(); 0 means use
+	 * the number of processors.  */
+	unsigned num_capture_threads;
+
+	/* Number of threads to use for creating files and setting their
+	 * metadata when extracting an image.  Set by
+	 * wimlib_set_extraction_threads(); 0 means use the number of
+	 * processors.  */
+	unsigned num_extraction_threads;
+
+	/* Number of small-file operations to submit at once with io_uring when
+	 * reading files to write to the WIM or writing extracted files.  Set by
+	 * wimlib_set_io_queue_depth(); 0 means not to use io_uring.  */
+	unsigned io_queue_depth;
+
+	/* Maximum number of bytes of decompressed data to cache while an image
+	 * from this WIM is mounted.  Set by wimlib_set_mount_cache_size().  */
+	u64 mount_cache_size;
+
+	/* Maximum number of bytes of memory to use for compressing or
+	 * decompressing data on multiple threads, including the buffers for
+	 * reading data.  Set by wimlib_set_memory_limit(); 0 means to use the
+	 * amount of memory available to the process.  */
+	u64 max_memory;
+
 	struct list_head subwims;
 
 	struct list_head subwim_node;
@@ -69,6 +104,13 @@ struct WIMStruct {
 	/* Has the underlying WIM file been locked for appending?  */
 	u8 locked_for_append : 1;
 
+	/* Was the WIM opened with WIMLIB_OPEN_FLAG_LAZY_METADATA?  */
+	u8 lazy_metadata : 1;
+
+	/* If not NULL, the WIM's index file, opened because of
+	 * WIMLIB_OPEN_FLAG_USE_INDEX_FILE.  See index_file.c.  */
+	struct wim_index_file *index_file;
+
 	/* One of WIMLIB_COMPRESSION_TYPE_*, cached from the header flags. */
 	u8 compression_type;
 
@@ -140,9 +182,15 @@ write_wim_header_flags(u32 hdr_flags, struct filedes *out_fd);
 extern int
 select_wim_image(WIMStruct *wim, int image);
 
+extern int
+select_wim_image_lazy(WIMStruct *wim, int image);
+
 extern int
 for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *));
 
+extern int
+for_image_lazy(WIMStruct *wim, int image, int (*visitor)(WIMStruct *));
+
 extern int
 wim_checksum_unhashed_streams(WIMStruct *wim);
 
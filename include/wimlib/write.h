@@ -28,7 +28,8 @@
 	WIMLIB_WRITE_FLAG_STREAMS_OK			| \
 	WIMLIB_WRITE_FLAG_RETAIN_GUID			| \
 	WIMLIB_WRITE_FLAG_PACK_STREAMS			| \
-	WIMLIB_WRITE_FLAG_SEND_DONE_WITH_FILE_MESSAGES)
+	WIMLIB_WRITE_FLAG_SEND_DONE_WITH_FILE_MESSAGES	| \
+	WIMLIB_WRITE_FLAG_PIECE_DEDUP)
 
 #if defined(HAVE_SYS_FILE_H) && defined(HAVE_FLOCK)
 extern int
@@ -0,0 +1,42 @@
+/*
+ * write_behind.h
+ *
+ * Write data to the output file from a separate thread.
+ */
+
+#ifndef _WIMLIB_WRITE_BEHIND_H
+#define _WIMLIB_WRITE_BEHIND_H
+
+#include "wimlib/file_io.h"
+#include "wimlib/types.h"
+
+struct write_behind;
+
+/* Size of each buffer of data waiting to be written.  */
+#define WRITE_BEHIND_BUF_SIZE		(1 << 20)
+
+/* Maximum number of buffers of data waiting to be written.  When all are in
+ * use, writing more data waits for the oldest buffer to be written.  */
+#define WRITE_BEHIND_NUM_BUFS		8
+
+/* Maximum memory used by a write_behind for its buffers.  */
+#define WRITE_BEHIND_MAX_MEMORY		\
+	((u64)WRITE_BEHIND_NUM_BUFS * WRITE_BEHIND_BUF_SIZE)
+
+extern int
+write_behind_start(struct filedes *out_fd, struct write_behind **wb_ret);
+
+extern int
+write_behind_write(struct write_behind *wb, const void *buf, size_t count);
+
+extern int
+write_behind_pwrite(struct write_behind *wb, const void *buf, size_t count,
+		    off_t offset);
+
+extern int
+write_behind_flush(struct write_behind *wb);
+
+extern int
+write_behind_finish(struct write_behind *wb);
+
+#endif /* _WIMLIB_WRITE_BEHIND_H */
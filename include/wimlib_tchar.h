@@ -45,6 +45,7 @@ typedef wchar_t tchar;
 #  define tfopen	_wfopen
 #  define topen		_wopen
 #  define tstat		_wstati64
+#  define tlstat	_wstati64
 #  define tstrtol	wcstol
 #  define tstrtod	wcstod
 #  define tstrtoul	wcstoul
@@ -103,6 +104,7 @@ typedef char tchar;
 #  define tfopen	fopen
 #  define topen		open
 #  define tstat		stat
+#  define tlstat	lstat
 #  define tunlink	unlink
 #  define tstrerror	strerror
 #  define tstrtol	strtol
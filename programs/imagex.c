@@ -142,6 +142,8 @@ static FILE *imagex_info_file;
 enum {
 	IMAGEX_ALLOW_OTHER_OPTION,
 	IMAGEX_BOOT_OPTION,
+	IMAGEX_CACHE_SIZE_OPTION,
+	IMAGEX_CHANGED_PATHS_OPTION,
 	IMAGEX_CHECK_OPTION,
 	IMAGEX_CHUNK_SIZE_OPTION,
 	IMAGEX_COMMAND_OPTION,
@@ -149,6 +151,7 @@ enum {
 	IMAGEX_COMPRESS_OPTION,
 	IMAGEX_COMPRESS_SLOW_OPTION,
 	IMAGEX_CONFIG_OPTION,
+	IMAGEX_CREATE_INDEX_OPTION,
 	IMAGEX_DEBUG_OPTION,
 	IMAGEX_DELTA_FROM_OPTION,
 	IMAGEX_DEREFERENCE_OPTION,
@@ -159,8 +162,10 @@ enum {
 	IMAGEX_FORCE_OPTION,
 	IMAGEX_HEADER_OPTION,
 	IMAGEX_INCLUDE_INVALID_NAMES_OPTION,
+	IMAGEX_IO_QUEUE_DEPTH_OPTION,
 	IMAGEX_LAZY_OPTION,
 	IMAGEX_LOOKUP_TABLE_OPTION,
+	IMAGEX_MEMORY_LIMIT_OPTION,
 	IMAGEX_METADATA_OPTION,
 	IMAGEX_NEW_IMAGE_OPTION,
 	IMAGEX_NOCHECK_OPTION,
@@ -173,7 +178,9 @@ enum {
 	IMAGEX_NULLGLOB_OPTION,
 	IMAGEX_ONE_FILE_ONLY_OPTION,
 	IMAGEX_PATH_OPTION,
+	IMAGEX_PIECE_DEDUP_OPTION,
 	IMAGEX_PIPABLE_OPTION,
+	IMAGEX_PIPELINE_OPTION,
 	IMAGEX_PRESERVE_DIR_STRUCTURE_OPTION,
 	IMAGEX_REBUILD_OPTION,
 	IMAGEX_RECOMPRESS_OPTION,
@@ -211,6 +218,8 @@ static const struct option apply_options[] = {
 	{T("rpfix"),       no_argument,       NULL, IMAGEX_RPFIX_OPTION},
 	{T("norpfix"),     no_argument,       NULL, IMAGEX_NORPFIX_OPTION},
 	{T("include-invalid-names"), no_argument,       NULL, IMAGEX_INCLUDE_INVALID_NAMES_OPTION},
+	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("io-queue-depth"), required_argument, NULL, IMAGEX_IO_QUEUE_DEPTH_OPTION},
 
 	/* --resume is undocumented for now as it needs improvement.  */
 	{T("resume"),      no_argument,       NULL, IMAGEX_RESUME_OPTION},
@@ -232,14 +241,19 @@ static const struct option capture_or_append_options[] = {
 	{T("pack-compress"), required_argument, NULL, IMAGEX_SOLID_COMPRESS_OPTION},
 	{T("solid-chunk-size"),required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
 	{T("pack-chunk-size"), required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
+	{T("piece-dedup"), no_argument,       NULL, IMAGEX_PIECE_DEDUP_OPTION},
 	{T("config"),      required_argument, NULL, IMAGEX_CONFIG_OPTION},
 	{T("dereference"), no_argument,       NULL, IMAGEX_DEREFERENCE_OPTION},
+	{T("pipeline"),    no_argument,       NULL, IMAGEX_PIPELINE_OPTION},
 	{T("flags"),       required_argument, NULL, IMAGEX_FLAGS_OPTION},
 	{T("verbose"),     no_argument,       NULL, IMAGEX_VERBOSE_OPTION},
 	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("io-queue-depth"), required_argument, NULL, IMAGEX_IO_QUEUE_DEPTH_OPTION},
+	{T("memory-limit"), required_argument, NULL, IMAGEX_MEMORY_LIMIT_OPTION},
 	{T("rebuild"),     no_argument,       NULL, IMAGEX_REBUILD_OPTION},
 	{T("unix-data"),   no_argument,       NULL, IMAGEX_UNIX_DATA_OPTION},
 	{T("source-list"), no_argument,       NULL, IMAGEX_SOURCE_LIST_OPTION},
+	{T("changed-paths"), required_argument, NULL, IMAGEX_CHANGED_PATHS_OPTION},
 	{T("noacls"),      no_argument,       NULL, IMAGEX_NO_ACLS_OPTION},
 	{T("no-acls"),     no_argument,       NULL, IMAGEX_NO_ACLS_OPTION},
 	{T("strict-acls"), no_argument,       NULL, IMAGEX_STRICT_ACLS_OPTION},
@@ -281,8 +295,10 @@ static const struct option export_options[] = {
 	{T("pack-compress"), required_argument, NULL, IMAGEX_SOLID_COMPRESS_OPTION},
 	{T("solid-chunk-size"),required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
 	{T("pack-chunk-size"), required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
+	{T("piece-dedup"), no_argument,       NULL, IMAGEX_PIECE_DEDUP_OPTION},
 	{T("ref"),         required_argument, NULL, IMAGEX_REF_OPTION},
 	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("memory-limit"), required_argument, NULL, IMAGEX_MEMORY_LIMIT_OPTION},
 	{T("rebuild"),     no_argument,       NULL, IMAGEX_REBUILD_OPTION},
 	{T("pipable"),     no_argument,       NULL, IMAGEX_PIPABLE_OPTION},
 	{T("not-pipable"), no_argument,       NULL, IMAGEX_NOT_PIPABLE_OPTION},
@@ -306,6 +322,8 @@ static const struct option extract_options[] = {
 	{T("no-globs"),     no_argument,      NULL, IMAGEX_NO_GLOBS_OPTION},
 	{T("nullglob"),     no_argument,      NULL, IMAGEX_NULLGLOB_OPTION},
 	{T("preserve-dir-structure"), no_argument, NULL, IMAGEX_PRESERVE_DIR_STRUCTURE_OPTION},
+	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("io-queue-depth"), required_argument, NULL, IMAGEX_IO_QUEUE_DEPTH_OPTION},
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{NULL, 0, NULL, 0},
 };
@@ -315,6 +333,7 @@ static const struct option info_options[] = {
 	{T("check"),        no_argument,       NULL, IMAGEX_CHECK_OPTION},
 	{T("nocheck"),      no_argument,       NULL, IMAGEX_NOCHECK_OPTION},
 	{T("no-check"),     no_argument,       NULL, IMAGEX_NOCHECK_OPTION},
+	{T("create-index"), no_argument,       NULL, IMAGEX_CREATE_INDEX_OPTION},
 	{T("extract-xml"),  required_argument, NULL, IMAGEX_EXTRACT_XML_OPTION},
 	{T("header"),       no_argument,       NULL, IMAGEX_HEADER_OPTION},
 	{T("lookup-table"), no_argument,       NULL, IMAGEX_LOOKUP_TABLE_OPTION},
@@ -329,6 +348,7 @@ static const struct option join_options[] = {
 };
 
 static const struct option mount_options[] = {
+	{T("cache-size"),        required_argument, NULL, IMAGEX_CACHE_SIZE_OPTION},
 	{T("check"),             no_argument,       NULL, IMAGEX_CHECK_OPTION},
 	{T("debug"),             no_argument,       NULL, IMAGEX_DEBUG_OPTION},
 	{T("streams-interface"), required_argument, NULL, IMAGEX_STREAMS_INTERFACE_OPTION},
@@ -336,6 +356,7 @@ static const struct option mount_options[] = {
 	{T("staging-dir"),       required_argument, NULL, IMAGEX_STAGING_DIR_OPTION},
 	{T("unix-data"),         no_argument,       NULL, IMAGEX_UNIX_DATA_OPTION},
 	{T("allow-other"),       no_argument,       NULL, IMAGEX_ALLOW_OTHER_OPTION},
+	{T("threads"),           required_argument, NULL, IMAGEX_THREADS_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -354,7 +375,9 @@ static const struct option optimize_options[] = {
 	{T("pack-compress"), required_argument, NULL, IMAGEX_SOLID_COMPRESS_OPTION},
 	{T("solid-chunk-size"),required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
 	{T("pack-chunk-size"), required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
+	{T("piece-dedup"), no_argument,       NULL, IMAGEX_PIECE_DEDUP_OPTION},
 	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("memory-limit"), required_argument, NULL, IMAGEX_MEMORY_LIMIT_OPTION},
 	{T("pipable"),     no_argument,       NULL, IMAGEX_PIPABLE_OPTION},
 	{T("not-pipable"), no_argument,       NULL, IMAGEX_NOT_PIPABLE_OPTION},
 	{NULL, 0, NULL, 0},
@@ -381,6 +404,7 @@ static const struct option update_options[] = {
 	 * `imagex update' itself are also handled in
 	 * update_command_add_option().  */
 	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("io-queue-depth"), required_argument, NULL, IMAGEX_IO_QUEUE_DEPTH_OPTION},
 	{T("check"),       no_argument,       NULL, IMAGEX_CHECK_OPTION},
 	{T("rebuild"),     no_argument,       NULL, IMAGEX_REBUILD_OPTION},
 	{T("command"),     required_argument, NULL, IMAGEX_COMMAND_OPTION},
@@ -401,12 +425,14 @@ static const struct option update_options[] = {
 	{T("no-acls"),     no_argument,       NULL, IMAGEX_NO_ACLS_OPTION},
 	{T("strict-acls"), no_argument,       NULL, IMAGEX_STRICT_ACLS_OPTION},
 	{T("no-replace"),  no_argument,       NULL, IMAGEX_NO_REPLACE_OPTION},
+	{T("pipeline"),    no_argument,       NULL, IMAGEX_PIPELINE_OPTION},
 
 	{NULL, 0, NULL, 0},
 };
 
 static const struct option verify_options[] = {
 	{T("ref"), required_argument, NULL, IMAGEX_REF_OPTION},
+	{T("threads"), required_argument, NULL, IMAGEX_THREADS_OPTION},
 
 	{NULL, 0, NULL, 0},
 };
@@ -838,6 +864,45 @@ parse_source_list(tchar **source_list_contents_p, size_t source_list_nchars,
 	return sources;
 }
 
+/* Parses a list of changed paths, one per line, as given to the
+ * '--changed-paths' option of 'wimlib-imagex capture' and 'wimlib-imagex
+ * append'.  Like parse_source_list(), this modifies the buffer, and the
+ * returned array points into it.  Comment lines and blank lines are ignored.  */
+static const tchar **
+parse_changed_paths(tchar **contents_p, size_t nchars, size_t *npaths_ret)
+{
+	ssize_t nlines;
+	tchar *p;
+	const tchar **paths;
+	size_t i, j;
+
+	nlines = text_file_count_lines(contents_p, &nchars);
+	if (nlines < 0)
+		return NULL;
+
+	paths = calloc(nlines ?: 1, sizeof(*paths));
+	if (!paths) {
+		imagex_error(T("out of memory"));
+		return NULL;
+	}
+	p = *contents_p;
+	j = 0;
+	for (i = 0; i < nlines; i++) {
+		tchar *endp = tmemchr(p, T('\n'), nchars);
+		size_t len = endp - p + 1;
+		*endp = T('\0');
+		if (!is_comment_line(p, len)) {
+			/* Strip trailing carriage return, if present.  */
+			if (endp != p && *(endp - 1) == T('\r'))
+				*(endp - 1) = T('\0');
+			paths[j++] = p;
+		}
+		p = endp + 1;
+	}
+	*npaths_ret = j;
+	return paths;
+}
+
 /* Reads the contents of a file into memory. */
 static char *
 file_get_contents(const tchar *filename, size_t *len_ret)
@@ -1073,8 +1138,16 @@ imagex_progress_func(enum wimlib_progress_msg msg,
 			info->write_streams.total_bytes >> unit_shift,
 			unit_name,
 			percent_done);
-		if (info->write_streams.completed_bytes >= info->write_streams.total_bytes)
+		if (info->write_streams.completed_bytes >= info->write_streams.total_bytes) {
 			imagex_printf(T("\n"));
+			if (info->write_streams.num_threads > 1) {
+				imagex_printf(T("Waited %.2f ms for compressed "
+						"data; compressor threads idle "
+						"for %.2f ms\n"),
+					      info->write_streams.compress_wait_nsec / 1e6,
+					      info->write_streams.compress_idle_nsec / 1e6);
+			}
+		}
 		break;
 	case WIMLIB_PROGRESS_MSG_SCAN_BEGIN:
 		imagex_printf(T("Scanning \"%"TS"\""), info->scan.source);
@@ -1120,6 +1193,12 @@ imagex_progress_func(enum wimlib_progress_msg msg,
 	case WIMLIB_PROGRESS_MSG_SCAN_END:
 		report_scan_progress(&info->scan, true);
 		imagex_printf(T("\n"));
+		if (info->scan.num_exclusion_checks) {
+			imagex_printf(T("Checked %"PRIu64" paths against the "
+					"capture configuration in %.2f ms\n"),
+				      info->scan.num_exclusion_checks,
+				      info->scan.exclusion_check_nsec / 1e6);
+		}
 		break;
 	case WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY:
 		unit_shift = get_unit(info->integrity.total_bytes, &unit_name);
@@ -1280,6 +1359,35 @@ parse_num_threads(const tchar *optarg)
 	}
 }
 
+static unsigned
+parse_io_queue_depth(const tchar *optarg)
+{
+	tchar *tmp;
+	unsigned long depth = tstrtoul(optarg, &tmp, 10);
+	if (depth >= UINT_MAX || *tmp || tmp == optarg) {
+		imagex_error(T("I/O queue depth must be a non-negative integer!"));
+		return UINT_MAX;
+	} else {
+		return depth;
+	}
+}
+
+/* Parse a size given in mebibytes and return it in bytes, or return UINT64_MAX
+ * on error.  */
+static uint64_t
+parse_size_in_mebibytes(const tchar *optarg)
+{
+	tchar *tmp;
+	unsigned long mebibytes = tstrtoul(optarg, &tmp, 10);
+	if (mebibytes >= (UINT64_MAX >> 20) || *tmp || tmp == optarg) {
+		imagex_error(T("Size must be a non-negative integer number "
+			       "of megabytes!"));
+		return UINT64_MAX;
+	} else {
+		return (uint64_t)mebibytes << 20;
+	}
+}
+
 static uint32_t parse_chunk_size(const tchar *optarg)
 {
        tchar *tmp;
@@ -1325,6 +1433,8 @@ update_command_add_option(int op, const tchar *option,
 			cmd->add.add_flags |= WIMLIB_ADD_FLAG_DEREFERENCE;
 		else if (!tstrcmp(option, T("--no-replace")))
 			cmd->add.add_flags |= WIMLIB_ADD_FLAG_NO_REPLACE;
+		else if (!tstrcmp(option, T("--pipeline")))
+			cmd->add.add_flags |= WIMLIB_ADD_FLAG_PIPELINE;
 		else
 			recognized = false;
 		break;
@@ -1509,7 +1619,7 @@ static int
 imagex_apply(int argc, tchar **argv, int cmd)
 {
 	int c;
-	int open_flags = 0;
+	int open_flags = WIMLIB_OPEN_FLAG_USE_INDEX_FILE;
 	int image = WIMLIB_NO_IMAGE;
 	WIMStruct *wim;
 	struct wimlib_wim_info info;
@@ -1518,6 +1628,8 @@ imagex_apply(int argc, tchar **argv, int cmd)
 	const tchar *target;
 	const tchar *image_num_or_name = NULL;
 	int extract_flags = 0;
+	unsigned num_threads = 0;
+	unsigned io_queue_depth = 0;
 
 	STRING_SET(refglobs);
 
@@ -1556,6 +1668,16 @@ imagex_apply(int argc, tchar **argv, int cmd)
 			extract_flags |= WIMLIB_EXTRACT_FLAG_REPLACE_INVALID_FILENAMES;
 			extract_flags |= WIMLIB_EXTRACT_FLAG_ALL_CASE_CONFLICTS;
 			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				goto out_err;
+			break;
+		case IMAGEX_IO_QUEUE_DEPTH_OPTION:
+			io_queue_depth = parse_io_queue_depth(optarg);
+			if (io_queue_depth == UINT_MAX)
+				goto out_err;
+			break;
 		case IMAGEX_RESUME_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_RESUME;
 			break;
@@ -1584,11 +1706,16 @@ imagex_apply(int argc, tchar **argv, int cmd)
 		}
 		wim = NULL;
 	} else {
+		wimlib_set_integrity_check_threads(num_threads);
 		ret = wimlib_open_wim_with_progress(wimfile, open_flags, &wim,
 						    imagex_progress_func, NULL);
 		if (ret)
 			goto out_free_refglobs;
 
+		wimlib_set_decompression_threads(wim, num_threads);
+		wimlib_set_extraction_threads(wim, num_threads);
+		wimlib_set_io_queue_depth(wim, io_queue_depth);
+
 		wimlib_get_wim_info(wim, &info);
 
 		if (argc >= 3) {
@@ -1678,6 +1805,7 @@ out_free_refglobs:
 
 out_usage:
 	usage(CMD_APPLY, stderr);
+out_err:
 	ret = -1;
 	goto out_free_refglobs;
 }
@@ -1716,6 +1844,8 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 
 	int ret;
 	unsigned num_threads = 0;
+	unsigned io_queue_depth = 0;
+	uint64_t memory_limit = 0;
 
 	tchar *source;
 	tchar *source_copy;
@@ -1724,6 +1854,11 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 
 	bool source_list = false;
 	size_t source_list_nchars = 0;
+	const tchar *changed_paths_file = NULL;
+	tchar *changed_paths_contents = NULL;
+	size_t changed_paths_nchars = 0;
+	const tchar **changed_paths = NULL;
+	size_t num_changed_paths = 0;
 	tchar *source_list_contents;
 	bool capture_sources_malloced;
 	struct wimlib_capture_source *capture_sources;
@@ -1772,12 +1907,18 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		case IMAGEX_SOLID_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_PACK_STREAMS;
 			break;
+		case IMAGEX_PIECE_DEDUP_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_PIECE_DEDUP;
+			break;
 		case IMAGEX_FLAGS_OPTION:
 			flags_element = optarg;
 			break;
 		case IMAGEX_DEREFERENCE_OPTION:
 			add_image_flags |= WIMLIB_ADD_IMAGE_FLAG_DEREFERENCE;
 			break;
+		case IMAGEX_PIPELINE_OPTION:
+			add_image_flags |= WIMLIB_ADD_FLAG_PIPELINE;
+			break;
 		case IMAGEX_VERBOSE_OPTION:
 			/* No longer does anything.  */
 			break;
@@ -1786,6 +1927,16 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 			if (num_threads == UINT_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_IO_QUEUE_DEPTH_OPTION:
+			io_queue_depth = parse_io_queue_depth(optarg);
+			if (io_queue_depth == UINT_MAX)
+				goto out_err;
+			break;
+		case IMAGEX_MEMORY_LIMIT_OPTION:
+			memory_limit = parse_size_in_mebibytes(optarg);
+			if (memory_limit == UINT64_MAX)
+				goto out_err;
+			break;
 		case IMAGEX_REBUILD_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_REBUILD;
 			break;
@@ -1795,6 +1946,9 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		case IMAGEX_SOURCE_LIST_OPTION:
 			source_list = true;
 			break;
+		case IMAGEX_CHANGED_PATHS_OPTION:
+			changed_paths_file = optarg;
+			break;
 		case IMAGEX_NO_ACLS_OPTION:
 			add_image_flags |= WIMLIB_ADD_IMAGE_FLAG_NO_ACLS;
 			break;
@@ -1859,6 +2013,19 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 	source = argv[0];
 	wimfile = argv[1];
 
+	if (changed_paths_file) {
+		if (!template_image_name_or_num) {
+			imagex_error(T("'--changed-paths' requires "
+				       "'--update-of'!"));
+			goto out_usage;
+		}
+		if (source_list) {
+			imagex_error(T("'--changed-paths' cannot be used "
+				       "with '--source-list'!"));
+			goto out_usage;
+		}
+	}
+
 	/* Set default compression type and parameters.  */
 
 
@@ -1982,19 +2149,53 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		source_list_contents = NULL;
 	}
 
+	if (changed_paths_file) {
+		/* Read the list of paths that changed since the template image
+		 * was captured.  */
+		if (!tstrcmp(changed_paths_file, T("-"))) {
+			changed_paths_contents =
+				stdin_get_text_contents(&changed_paths_nchars);
+		} else {
+			changed_paths_contents =
+				file_get_text_contents(changed_paths_file,
+						       &changed_paths_nchars);
+		}
+		if (!changed_paths_contents) {
+			ret = -1;
+			goto out_free_capture_sources;
+		}
+		changed_paths = parse_changed_paths(&changed_paths_contents,
+						    changed_paths_nchars,
+						    &num_changed_paths);
+		if (!changed_paths) {
+			ret = -1;
+			goto out_free_changed_paths;
+		}
+	}
+
+	wimlib_set_integrity_check_threads(num_threads);
+
 	/* Open the existing WIM, or create a new one.  */
 	if (cmd == CMD_APPEND) {
 		ret = wimlib_open_wim_with_progress(wimfile, open_flags, &wim,
 						    imagex_progress_func, NULL);
 		if (ret)
-			goto out_free_capture_sources;
+			goto out_free_changed_paths;
 	} else {
 		ret = wimlib_create_new_wim(compression_type, &wim);
 		if (ret)
-			goto out_free_capture_sources;
+			goto out_free_changed_paths;
 		wimlib_register_progress_function(wim, imagex_progress_func, NULL);
 	}
 
+	/* Scan the source directory trees with the same number of threads that
+	 * will be used for compression.  */
+	wimlib_set_capture_threads(wim, num_threads);
+
+	wimlib_set_io_queue_depth(wim, io_queue_depth);
+
+	wimlib_set_memory_limit(wim, memory_limit);
+
 	/* Set chunk size if non-default.  */
 	if (chunk_size != UINT32_MAX) {
 		ret = wimlib_set_output_chunk_size(wim, chunk_size);
@@ -2138,12 +2339,30 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		template_wim = NULL;
 	}
 
-	ret = wimlib_add_image_multisource(wim,
-					   capture_sources,
-					   num_sources,
-					   name,
-					   config_file,
-					   add_image_flags);
+	if (changed_paths) {
+		/* Rescan only the changed paths; take everything else from the
+		 * template image.  */
+		imagex_printf(T("Updating image %d from \"%"TS"\" "
+				"using %zu changed paths\n"),
+			      template_image, template_wimfile,
+			      num_changed_paths);
+		ret = wimlib_add_image_incremental(wim,
+						   source,
+						   name,
+						   template_wim,
+						   template_image,
+						   changed_paths,
+						   num_changed_paths,
+						   config_file,
+						   add_image_flags);
+	} else {
+		ret = wimlib_add_image_multisource(wim,
+						   capture_sources,
+						   num_sources,
+						   name,
+						   config_file,
+						   add_image_flags);
+	}
 	if (ret)
 		goto out_free_template_wim;
 
@@ -2171,8 +2390,9 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 				goto out_free_template_wim;
 		}
 
-		/* Reference template image if the user provided one.  */
-		if (template_image_name_or_num) {
+		/* Reference template image if the user provided one.  This
+		 * was already done for an incremental capture.  */
+		if (template_image_name_or_num && !changed_paths) {
 			imagex_printf(T("Using image %d "
 					"from \"%"TS"\" as template\n"),
 					template_image, template_wimfile);
@@ -2208,6 +2428,9 @@ out_free_base_wims:
 	free(base_wims);
 out_free_wim:
 	wimlib_free(wim);
+out_free_changed_paths:
+	free(changed_paths);
+	free(changed_paths_contents);
 out_free_capture_sources:
 	if (capture_sources_malloced)
 		free(capture_sources);
@@ -2425,6 +2648,8 @@ print_resource(const struct wimlib_resource_entry *resource,
 			tprintf(T("WIM_RESHDR_FLAG_SPANNED  "));
 		if (resource->packed)
 			tprintf(T("WIM_RESHDR_FLAG_PACKED_STREAMS  "));
+		if (resource->is_piece_list)
+			tprintf(T("WIM_RESHDR_FLAG_PIECE_LIST  "));
 		tputchar(T('\n'));
 	}
 	tputchar(T('\n'));
@@ -2548,8 +2773,10 @@ imagex_dir(int argc, tchar **argv, int cmd)
 	}
 
 	wimfile = argv[0];
-	ret = wimlib_open_wim_with_progress(wimfile, 0, &wim,
-					    imagex_progress_func, NULL);
+	ret = wimlib_open_wim_with_progress(wimfile,
+					    WIMLIB_OPEN_FLAG_LAZY_METADATA |
+						WIMLIB_OPEN_FLAG_USE_INDEX_FILE,
+					    &wim, imagex_progress_func, NULL);
 	if (ret)
 		goto out;
 
@@ -2613,6 +2840,7 @@ imagex_export(int argc, tchar **argv, int cmd)
 	bool wim_is_new;
 	STRING_SET(refglobs);
 	unsigned num_threads = 0;
+	uint64_t memory_limit = 0;
 	uint32_t chunk_size = UINT32_MAX;
 	uint32_t solid_chunk_size = UINT32_MAX;
 	int solid_ctype = WIMLIB_COMPRESSION_TYPE_INVALID;
@@ -2644,6 +2872,9 @@ imagex_export(int argc, tchar **argv, int cmd)
 		case IMAGEX_SOLID_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_PACK_STREAMS;
 			break;
+		case IMAGEX_PIECE_DEDUP_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_PIECE_DEDUP;
+			break;
 		case IMAGEX_CHUNK_SIZE_OPTION:
 			chunk_size = parse_chunk_size(optarg);
 			if (chunk_size == UINT32_MAX)
@@ -2669,6 +2900,11 @@ imagex_export(int argc, tchar **argv, int cmd)
 			if (num_threads == UINT_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_MEMORY_LIMIT_OPTION:
+			memory_limit = parse_size_in_mebibytes(optarg);
+			if (memory_limit == UINT64_MAX)
+				goto out_err;
+			break;
 		case IMAGEX_REBUILD_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_REBUILD;
 			break;
@@ -2694,11 +2930,15 @@ imagex_export(int argc, tchar **argv, int cmd)
 	dest_wimfile          = argv[2];
 	dest_name             = (argc >= 4) ? argv[3] : NULL;
 	dest_desc             = (argc >= 5) ? argv[4] : NULL;
+	wimlib_set_integrity_check_threads(num_threads);
 	ret = wimlib_open_wim_with_progress(src_wimfile, open_flags, &src_wim,
 					    imagex_progress_func, NULL);
 	if (ret)
 		goto out_free_refglobs;
 
+	wimlib_set_decompression_threads(src_wim, num_threads);
+	wimlib_set_memory_limit(src_wim, memory_limit);
+
 	wimlib_get_wim_info(src_wim, &src_info);
 
 	/* Determine if the destination is an existing file or not.  If so, we
@@ -2804,6 +3044,8 @@ imagex_export(int argc, tchar **argv, int cmd)
 		}
 	}
 
+	wimlib_set_memory_limit(dest_wim, memory_limit);
+
 	if (chunk_size != UINT32_MAX) {
 		/* Set destination chunk size.  */
 		ret = wimlib_set_output_chunk_size(dest_wim, chunk_size);
@@ -2880,7 +3122,8 @@ static int
 imagex_extract(int argc, tchar **argv, int cmd)
 {
 	int c;
-	int open_flags = 0;
+	int open_flags = WIMLIB_OPEN_FLAG_LAZY_METADATA |
+			 WIMLIB_OPEN_FLAG_USE_INDEX_FILE;
 	int image;
 	WIMStruct *wim;
 	int ret;
@@ -2891,6 +3134,8 @@ imagex_extract(int argc, tchar **argv, int cmd)
 			    WIMLIB_EXTRACT_FLAG_GLOB_PATHS |
 			    WIMLIB_EXTRACT_FLAG_STRICT_GLOB;
 	int notlist_extract_flags = WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE;
+	unsigned num_threads = 0;
+	unsigned io_queue_depth = 0;
 
 	STRING_SET(refglobs);
 
@@ -2943,6 +3188,16 @@ imagex_extract(int argc, tchar **argv, int cmd)
 		case IMAGEX_PRESERVE_DIR_STRUCTURE_OPTION:
 			notlist_extract_flags &= ~WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE;
 			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				goto out_err;
+			break;
+		case IMAGEX_IO_QUEUE_DEPTH_OPTION:
+			io_queue_depth = parse_io_queue_depth(optarg);
+			if (io_queue_depth == UINT_MAX)
+				goto out_err;
+			break;
 		case IMAGEX_WIMBOOT_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_WIMBOOT;
 			break;
@@ -2969,11 +3224,16 @@ imagex_extract(int argc, tchar **argv, int cmd)
 	argc -= 2;
 	argv += 2;
 
+	wimlib_set_integrity_check_threads(num_threads);
 	ret = wimlib_open_wim_with_progress(wimfile, open_flags, &wim,
 					    imagex_progress_func, NULL);
 	if (ret)
 		goto out_free_refglobs;
 
+	wimlib_set_decompression_threads(wim, num_threads);
+	wimlib_set_extraction_threads(wim, num_threads);
+	wimlib_set_io_queue_depth(wim, io_queue_depth);
+
 	image = wimlib_resolve_image(wim, image_num_or_name);
 	ret = verify_image_exists_and_is_single(image,
 						image_num_or_name,
@@ -3062,6 +3322,7 @@ imagex_info(int argc, tchar **argv, int cmd)
 	bool boot         = false;
 	bool check        = false;
 	bool nocheck      = false;
+	bool create_index = false;
 	bool header       = false;
 	bool lookup_table = false;
 	bool xml          = false;
@@ -3088,6 +3349,10 @@ imagex_info(int argc, tchar **argv, int cmd)
 		case IMAGEX_NOCHECK_OPTION:
 			nocheck = true;
 			break;
+		case IMAGEX_CREATE_INDEX_OPTION:
+			create_index = true;
+			short_header = false;
+			break;
 		case IMAGEX_HEADER_OPTION:
 			header = true;
 			short_header = false;
@@ -3226,6 +3491,14 @@ imagex_info(int argc, tchar **argv, int cmd)
 				goto out_wimlib_free;
 		}
 
+		if (create_index) {
+			ret = wimlib_write_index_file(wim, 0);
+			if (ret)
+				goto out_wimlib_free;
+			imagex_printf(T("Wrote index file \"%"TS".idx\".\n"),
+				      wimfile);
+		}
+
 		if (short_header)
 			wimlib_print_available_images(wim, image);
 
@@ -3383,6 +3656,8 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 	struct wimlib_wim_info info;
 	int image;
 	int ret;
+	uint64_t cache_size = UINT64_MAX;
+	unsigned num_threads = 0;
 
 	STRING_SET(refglobs);
 
@@ -3396,6 +3671,11 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 		case IMAGEX_ALLOW_OTHER_OPTION:
 			mount_flags |= WIMLIB_MOUNT_FLAG_ALLOW_OTHER;
 			break;
+		case IMAGEX_CACHE_SIZE_OPTION:
+			cache_size = parse_size_in_mebibytes(optarg);
+			if (cache_size == UINT64_MAX)
+				goto out_err;
+			break;
 		case IMAGEX_CHECK_OPTION:
 			open_flags |= WIMLIB_OPEN_FLAG_CHECK_INTEGRITY;
 			break;
@@ -3426,6 +3706,11 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 		case IMAGEX_UNIX_DATA_OPTION:
 			mount_flags |= WIMLIB_MOUNT_FLAG_UNIX_DATA;
 			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				goto out_err;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -3437,6 +3722,7 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 
 	wimfile = argv[0];
 
+	wimlib_set_integrity_check_threads(num_threads);
 	ret = wimlib_open_wim_with_progress(wimfile, open_flags, &wim,
 					    imagex_progress_func, NULL);
 	if (ret)
@@ -3471,6 +3757,10 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 			goto out_free_wim;
 	}
 
+	if (cache_size != UINT64_MAX)
+		wimlib_set_mount_cache_size(wim, cache_size);
+	wimlib_set_decompression_threads(wim, num_threads);
+
 	ret = wimlib_mount_image(wim, image, dir, mount_flags, staging_dir);
 	if (ret) {
 		imagex_error(T("Failed to mount image %d from \"%"TS"\" "
@@ -3485,6 +3775,7 @@ out_free_refglobs:
 
 out_usage:
 	usage(cmd, stderr);
+out_err:
 	ret = -1;
 	goto out_free_refglobs;
 }
@@ -3507,6 +3798,7 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 	off_t old_size;
 	off_t new_size;
 	unsigned num_threads = 0;
+	uint64_t memory_limit = 0;
 
 	for_opt(c, optimize_options) {
 		switch (c) {
@@ -3549,11 +3841,19 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 			write_flags |= WIMLIB_WRITE_FLAG_PACK_STREAMS;
 			write_flags |= WIMLIB_WRITE_FLAG_RECOMPRESS;
 			break;
+		case IMAGEX_PIECE_DEDUP_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_PIECE_DEDUP;
+			break;
 		case IMAGEX_THREADS_OPTION:
 			num_threads = parse_num_threads(optarg);
 			if (num_threads == UINT_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_MEMORY_LIMIT_OPTION:
+			memory_limit = parse_size_in_mebibytes(optarg);
+			if (memory_limit == UINT64_MAX)
+				goto out_err;
+			break;
 		case IMAGEX_PIPABLE_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_PIPABLE;
 			break;
@@ -3572,11 +3872,14 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 
 	wimfile = argv[0];
 
+	wimlib_set_integrity_check_threads(num_threads);
 	ret = wimlib_open_wim_with_progress(wimfile, open_flags, &wim,
 					    imagex_progress_func, NULL);
 	if (ret)
 		goto out;
 
+	wimlib_set_memory_limit(wim, memory_limit);
+
 	if (compression_type != WIMLIB_COMPRESSION_TYPE_INVALID) {
 		/* Change compression type.  */
 		ret = wimlib_set_output_compression_type(wim, compression_type);
@@ -3783,6 +4086,7 @@ imagex_update(int argc, tchar **argv, int cmd)
 				WIMLIB_ADD_FLAG_WINCONFIG;
 	int default_delete_flags = 0;
 	unsigned num_threads = 0;
+	unsigned io_queue_depth = 0;
 	int c;
 	tchar *cmd_file_contents;
 	size_t cmd_file_nchars;
@@ -3800,6 +4104,11 @@ imagex_update(int argc, tchar **argv, int cmd)
 			if (num_threads == UINT_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_IO_QUEUE_DEPTH_OPTION:
+			io_queue_depth = parse_io_queue_depth(optarg);
+			if (io_queue_depth == UINT_MAX)
+				goto out_err;
+			break;
 		case IMAGEX_CHECK_OPTION:
 			open_flags |= WIMLIB_OPEN_FLAG_CHECK_INTEGRITY;
 			write_flags |= WIMLIB_WRITE_FLAG_CHECK_INTEGRITY;
@@ -3857,6 +4166,9 @@ imagex_update(int argc, tchar **argv, int cmd)
 		case IMAGEX_NO_REPLACE_OPTION:
 			default_add_flags |= WIMLIB_ADD_FLAG_NO_REPLACE;
 			break;
+		case IMAGEX_PIPELINE_OPTION:
+			default_add_flags |= WIMLIB_ADD_FLAG_PIPELINE;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -3868,11 +4180,15 @@ imagex_update(int argc, tchar **argv, int cmd)
 		goto out_usage;
 	wimfile = argv[0];
 
+	wimlib_set_integrity_check_threads(num_threads);
 	ret = wimlib_open_wim_with_progress(wimfile, open_flags, &wim,
 					    imagex_progress_func, NULL);
 	if (ret)
 		goto out_free_command_str;
 
+	wimlib_set_capture_threads(wim, num_threads);
+	wimlib_set_io_queue_depth(wim, io_queue_depth);
+
 	if (argc >= 2) {
 		/* Image explicitly specified.  */
 		image = wimlib_resolve_image(wim, argv[1]);
@@ -3994,6 +4310,7 @@ imagex_verify(int argc, tchar **argv, int cmd)
 	WIMStruct *wim;
 	int open_flags = WIMLIB_OPEN_FLAG_CHECK_INTEGRITY;
 	int verify_flags = 0;
+	unsigned num_threads = 0;
 	STRING_SET(refglobs);
 	int c;
 
@@ -4004,6 +4321,11 @@ imagex_verify(int argc, tchar **argv, int cmd)
 			if (ret)
 				goto out_free_refglobs;
 			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				goto out_err;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -4022,6 +4344,7 @@ imagex_verify(int argc, tchar **argv, int cmd)
 
 	wimfile = argv[0];
 
+	wimlib_set_integrity_check_threads(num_threads);
 	ret = wimlib_open_wim_with_progress(wimfile,
 					    open_flags,
 					    &wim,
@@ -4030,6 +4353,8 @@ imagex_verify(int argc, tchar **argv, int cmd)
 	if (ret)
 		goto out_free_refglobs;
 
+	wimlib_set_decompression_threads(wim, num_threads);
+
 	ret = wim_reference_globs(wim, &refglobs, open_flags);
 	if (ret)
 		goto out_wimlib_free;
@@ -4058,6 +4383,7 @@ out_free_refglobs:
 
 out_usage:
 	usage(CMD_VERIFY, stderr);
+out_err:
 	ret = -1;
 	goto out_free_refglobs;
 }
@@ -4115,7 +4441,9 @@ T(
 "                    [--boot] [--check] [--nocheck] [--config=FILE]\n"
 "                    [--threads=NUM_THREADS] [--no-acls] [--strict-acls]\n"
 "                    [--rpfix] [--norpfix] [--update-of=[WIMFILE:]IMAGE]\n"
-"                    [--wimboot] [--unix-data] [--dereference]\n"
+"                    [--wimboot] [--unix-data] [--dereference] [--pipeline]\n"
+"                    [--io-queue-depth=DEPTH] [--changed-paths=LISTFILE]\n"
+"                    [--piece-dedup] [--memory-limit=MB]\n"
 ),
 [CMD_APPLY] =
 T(
@@ -4123,6 +4451,7 @@ T(
 "                    [--check] [--ref=\"GLOB\"] [--no-acls] [--strict-acls]\n"
 "                    [--no-attributes] [--rpfix] [--norpfix]\n"
 "                    [--include-invalid-names] [--wimboot] [--unix-data]\n"
+"                    [--threads=NUM_THREADS] [--io-queue-depth=DEPTH]\n"
 ),
 [CMD_CAPTURE] =
 T(
@@ -4132,6 +4461,9 @@ T(
 "                    [--no-acls] [--strict-acls] [--rpfix] [--norpfix]\n"
 "                    [--update-of=[WIMFILE:]IMAGE] [--delta-from=WIMFILE]\n"
 "                    [--wimboot] [--unix-data] [--dereference] [--solid]\n"
+"                    [--pipeline] [--io-queue-depth=DEPTH]\n"
+"                    [--changed-paths=LISTFILE] [--piece-dedup]\n"
+"                    [--memory-limit=MB]\n"
 ),
 [CMD_DELETE] =
 T(
@@ -4147,7 +4479,7 @@ T(
 "                        [DEST_IMAGE_NAME [DEST_IMAGE_DESC]]\n"
 "                    [--boot] [--check] [--nocheck] [--compress=TYPE]\n"
 "                    [--ref=\"GLOB\"] [--threads=NUM_THREADS] [--rebuild]\n"
-"                    [--wimboot]\n"
+"                    [--wimboot] [--piece-dedup] [--memory-limit=MB]\n"
 ),
 [CMD_EXTRACT] =
 T(
@@ -4156,12 +4488,14 @@ T(
 "                    [--to-stdout] [--no-acls] [--strict-acls]\n"
 "                    [--no-attributes] [--include-invalid-names]\n"
 "                    [--no-globs] [--nullglob] [--preserve-dir-structure]\n"
+"                    [--threads=NUM_THREADS] [--io-queue-depth=DEPTH]\n"
 ),
 [CMD_INFO] =
 T(
 "    %"TS" WIMFILE [IMAGE [NEW_NAME [NEW_DESC]]]\n"
 "                    [--boot] [--check] [--nocheck] [--xml]\n"
 "                    [--extract-xml FILE] [--header] [--lookup-table]\n"
+"                    [--create-index]\n"
 ),
 [CMD_JOIN] =
 T(
@@ -4173,12 +4507,14 @@ T(
 "    %"TS" WIMFILE [IMAGE] DIRECTORY\n"
 "                    [--check] [--streams-interface=INTERFACE]\n"
 "                    [--ref=\"GLOB\"] [--allow-other] [--unix-data]\n"
+"                    [--cache-size=MB] [--threads=NUM_THREADS]\n"
 ),
 [CMD_MOUNTRW] =
 T(
 "    %"TS" WIMFILE [IMAGE] DIRECTORY\n"
 "                    [--check] [--streams-interface=INTERFACE]\n"
 "                    [--staging-dir=CMD_DIR] [--allow-other] [--unix-data]\n"
+"                    [--cache-size=MB] [--threads=NUM_THREADS]\n"
 ),
 #endif
 [CMD_OPTIMIZE] =
@@ -4186,6 +4522,7 @@ T(
 "    %"TS" WIMFILE\n"
 "                    [--recompress] [--compress=TYPE]\n"
 "                    [--threads=NUM_THREADS] [--check] [--nocheck]\n"
+"                    [--piece-dedup] [--memory-limit=MB]\n"
 "\n"
 ),
 [CMD_SPLIT] =
@@ -4203,13 +4540,14 @@ T(
 T(
 "    %"TS" WIMFILE [IMAGE]\n"
 "                    [--check] [--rebuild] [--threads=NUM_THREADS]\n"
+"                    [--io-queue-depth=DEPTH]\n"
 "                    [DEFAULT_ADD_OPTIONS] [DEFAULT_DELETE_OPTIONS]\n"
 "                    [--command=STRING] [--wimboot-config=FILE]\n"
 "                    [< CMDFILE]\n"
 ),
 [CMD_VERIFY] =
 T(
-"    %"TS" WIMFILE [--ref=\"GLOB\"]\n"
+"    %"TS" WIMFILE [--ref=\"GLOB\"] [--threads=NUM_THREADS]\n"
 ),
 };
 
@@ -26,12 +26,21 @@
 #endif
 
 #include "wimlib.h"
+#include "wimlib/capture.h"
+#include "wimlib/dentry.h"
 #include "wimlib/error.h"
 #include "wimlib/lookup_table.h"
 #include "wimlib/metadata.h"
+#include "wimlib/paths.h"
+#include "wimlib/resource.h"
 #include "wimlib/security.h"
+#include "wimlib/wim.h"
 #include "wimlib/xml.h"
 
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
 /* Creates and appends a 'struct wim_image_metadata' for an empty image.
  *
  * The resulting image will be the last in the WIM, so its index will be
@@ -225,3 +234,372 @@ wimlib_add_image(WIMStruct *wim,
 	return wimlib_add_image_multisource(wim, &capture_src, 1, name,
 					    config_file, add_flags);
 }
+
+/* A path passed to wimlib_add_image_incremental().  */
+struct changed_path {
+	/* Canonical path in the image, e.g. "/dir/file"  */
+	tchar *wim_path;
+
+	/* Path on disk, which ends with @wim_path unless it is the root  */
+	tchar *fs_path;
+
+	/* Whether the path still exists on disk  */
+	bool exists;
+};
+
+/* Order in which changed paths are sorted: the path separator comes before
+ * any other character, so each path is directly followed by the paths below
+ * it.  */
+static u64
+changed_path_sort_key(tchar c)
+{
+	if (c == T('\0'))
+		return 0;
+	if (c == WIM_PATH_SEPARATOR)
+		return 1;
+	return (u64)(u32)c + 2;
+}
+
+static int
+compare_changed_paths(const void *p1, const void *p2)
+{
+	const tchar *s1 = ((const struct changed_path *)p1)->wim_path;
+	const tchar *s2 = ((const struct changed_path *)p2)->wim_path;
+	u64 k1, k2;
+
+	do {
+		k1 = changed_path_sort_key(*s1++);
+		k2 = changed_path_sort_key(*s2++);
+	} while (k1 == k2 && k1 != 0);
+
+	return (k1 < k2) ? -1 : (k1 > k2) ? 1 : 0;
+}
+
+/* Is @path, or an ancestor of it, the path @ancestor?  Both paths must be
+ * canonical.  */
+static bool
+is_same_or_below(const tchar *path, const tchar *ancestor)
+{
+	size_t len;
+
+	if (WIMLIB_IS_WIM_ROOT_PATH(ancestor))
+		return true;
+	len = tstrlen(ancestor);
+	return !tmemcmp(path, ancestor, len) &&
+	       (path[len] == T('\0') || path[len] == WIM_PATH_SEPARATOR);
+}
+
+/* Return true if the canonical WIM path @path has a "." or ".." component.
+ * These would name a file outside the changed path, or outside @source.  */
+static bool
+has_dot_component(const tchar *path)
+{
+	const tchar *p = path;
+
+	for (;;) {
+		const tchar *end;
+
+		while (*p == WIM_PATH_SEPARATOR)
+			p++;
+		if (*p == T('\0'))
+			return false;
+		end = p;
+		while (*end != T('\0') && *end != WIM_PATH_SEPARATOR)
+			end++;
+		if (p[0] == T('.') &&
+		    (end - p == 1 || (end - p == 2 && p[1] == T('.'))))
+			return true;
+		p = end;
+	}
+}
+
+static void
+free_changed_paths(struct changed_path *paths, size_t num_paths)
+{
+	for (size_t i = 0; i < num_paths; i++) {
+		FREE(paths[i].wim_path);
+		FREE(paths[i].fs_path);
+	}
+	FREE(paths);
+}
+
+/*
+ * Canonicalize the changed paths passed to wimlib_add_image_incremental(), drop
+ * the ones that are below other changed paths, and check which of them still
+ * exist under @source.
+ */
+static int
+prepare_changed_paths(const tchar *source,
+		      const tchar * const *changed_paths, size_t num_changed_paths,
+		      struct changed_path **paths_ret, size_t *num_paths_ret)
+{
+	struct changed_path *paths;
+	size_t source_nchars = tstrlen(source);
+	size_t num_paths;
+	int ret;
+
+	paths = CALLOC(max(num_changed_paths, 1), sizeof(paths[0]));
+	if (!paths)
+		return WIMLIB_ERR_NOMEM;
+
+	for (size_t i = 0; i < num_changed_paths; i++) {
+		paths[i].wim_path = canonicalize_wim_path(changed_paths[i]);
+		if (!paths[i].wim_path) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto err;
+		}
+		if (has_dot_component(paths[i].wim_path)) {
+			ERROR("Changed path \"%"TS"\" contains a "
+			      "\".\" or \"..\" component", changed_paths[i]);
+			ret = WIMLIB_ERR_INVALID_PARAM;
+			goto err;
+		}
+	}
+
+	qsort(paths, num_changed_paths, sizeof(paths[0]),
+	      compare_changed_paths);
+
+	/* Drop duplicates and paths below other changed paths.  */
+	num_paths = 0;
+	for (size_t i = 0; i < num_changed_paths; i++) {
+		tchar *wim_path = paths[i].wim_path;
+
+		paths[i].wim_path = NULL;
+		if (num_paths &&
+		    is_same_or_below(wim_path, paths[num_paths - 1].wim_path))
+			FREE(wim_path);
+		else
+			paths[num_paths++].wim_path = wim_path;
+	}
+
+	for (size_t i = 0; i < num_paths; i++) {
+		struct changed_path *path = &paths[i];
+		size_t wim_path_nchars = tstrlen(path->wim_path);
+		struct stat stbuf;
+
+		if (WIMLIB_IS_WIM_ROOT_PATH(path->wim_path))
+			wim_path_nchars = 0;
+
+		path->fs_path = MALLOC((source_nchars + wim_path_nchars + 1) *
+				       sizeof(tchar));
+		if (!path->fs_path) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto err;
+		}
+		tmemcpy(path->fs_path, source, source_nchars);
+		tmemcpy(&path->fs_path[source_nchars], path->wim_path,
+			wim_path_nchars + 1);
+		if (wim_path_nchars == 0)
+			path->fs_path[source_nchars] = T('\0');
+
+		if (!tlstat(path->fs_path, &stbuf)) {
+			path->exists = true;
+		} else if (errno == ENOENT || errno == ENOTDIR) {
+			path->exists = false;
+		} else {
+			ERROR_WITH_ERRNO("Can't stat \"%"TS"\"",
+					 path->fs_path);
+			ret = WIMLIB_ERR_STAT;
+			goto err;
+		}
+	}
+
+	*paths_ret = paths;
+	*num_paths_ret = num_paths;
+	return 0;
+
+err:
+	free_changed_paths(paths, num_changed_paths);
+	return ret;
+}
+
+/*
+ * Build the update commands that bring the copy of the template image up to
+ * date: delete each changed path, then add it again if it still exists.
+ */
+static struct wimlib_update_command *
+changed_paths_to_update_cmds(const struct changed_path *paths, size_t num_paths,
+			     const tchar *config_file, int add_flags,
+			     size_t *num_cmds_ret)
+{
+	struct wimlib_update_command *cmds;
+	size_t num_cmds = 0;
+
+	cmds = CALLOC(max(2 * num_paths, 1), sizeof(cmds[0]));
+	if (!cmds)
+		return NULL;
+
+	for (size_t i = 0; i < num_paths; i++) {
+		cmds[num_cmds].op = WIMLIB_UPDATE_OP_DELETE;
+		cmds[num_cmds].delete_.wim_path = paths[i].wim_path;
+		cmds[num_cmds].delete_.delete_flags =
+			WIMLIB_DELETE_FLAG_FORCE | WIMLIB_DELETE_FLAG_RECURSIVE;
+		num_cmds++;
+
+		if (!paths[i].exists)
+			continue;
+
+		cmds[num_cmds].op = WIMLIB_UPDATE_OP_ADD;
+		cmds[num_cmds].add.fs_source_path = paths[i].fs_path;
+		cmds[num_cmds].add.wim_target_path = paths[i].wim_path;
+		cmds[num_cmds].add.config_file = (tchar *)config_file;
+		cmds[num_cmds].add.add_flags = add_flags;
+		num_cmds++;
+	}
+	*num_cmds_ret = num_cmds;
+	return cmds;
+}
+
+/* Take the checksums of the files that were scanned again, but did not change,
+ * from the template image.  */
+static int
+reference_template_for_changed_paths(WIMStruct *wim,
+				     const struct changed_path *paths,
+				     size_t num_paths,
+				     WIMStruct *template_wim,
+				     int template_image)
+{
+	struct wim_dentry **branches;
+	size_t num_branches = 0;
+	int ret;
+
+	branches = MALLOC(max(num_paths, 1) * sizeof(branches[0]));
+	if (!branches)
+		return WIMLIB_ERR_NOMEM;
+
+	/* The new image is still selected after the update.  */
+	for (size_t i = 0; i < num_paths; i++) {
+		struct wim_dentry *branch;
+
+		if (!paths[i].exists)
+			continue;
+		branch = get_dentry(wim, paths[i].wim_path,
+				    WIMLIB_CASE_PLATFORM_DEFAULT);
+		if (branch)  /* NULL if excluded  */
+			branches[num_branches++] = branch;
+	}
+
+	ret = reference_template_branches(wim, branches, num_branches,
+					  template_wim, template_image);
+	FREE(branches);
+	return ret;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_add_image_incremental(WIMStruct *wim,
+			     const tchar *source,
+			     const tchar *name,
+			     WIMStruct *template_wim,
+			     int template_image,
+			     const tchar * const *changed_paths,
+			     size_t num_changed_paths,
+			     const tchar *config_file,
+			     int add_flags)
+{
+	int ret;
+	struct changed_path *paths;
+	size_t num_paths;
+	struct wimlib_update_command *cmds;
+	size_t num_cmds;
+	struct wim_image_metadata *imd;
+	struct wim_inode *inode;
+	int image;
+
+	if (!wim || !source || !template_wim ||
+	    (num_changed_paths && !changed_paths))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	/* NTFS capture mode and WIMBoot mode only make sense for whole volumes
+	 * or images, and reparse point fixups are relative to the directory
+	 * being scanned, which here is each changed path.  */
+	if (add_flags & (WIMLIB_ADD_FLAG_NTFS |
+			 WIMLIB_ADD_FLAG_RPFIX |
+			 WIMLIB_ADD_FLAG_WIMBOOT))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (template_image < 1 || template_image > template_wim->hdr.image_count)
+		return WIMLIB_ERR_INVALID_IMAGE;
+
+	/* The template image is copied by way of its metadata resource, which
+	 * refers to streams by checksum.  */
+	ret = wim_checksum_unhashed_streams(template_wim);
+	if (ret)
+		return ret;
+
+	ret = prepare_changed_paths(source, changed_paths, num_changed_paths,
+				    &paths, &num_paths);
+	if (ret)
+		return ret;
+
+	ret = WIMLIB_ERR_NOMEM;
+	cmds = changed_paths_to_update_cmds(paths, num_paths, config_file,
+					    (add_flags & ~WIMLIB_ADD_FLAG_BOOT) |
+						WIMLIB_ADD_FLAG_NORPFIX,
+					    &num_cmds);
+	if (!cmds)
+		goto out_free_paths;
+
+	ret = wimlib_add_empty_image(wim, name, &image);
+	if (ret)
+		goto out_free_cmds;
+
+	/* Copy the template image into the new image.  */
+	imd = wim->image_metadata[image - 1];
+	free_wim_security_data(imd->security_data);
+	imd->security_data = NULL;
+	ret = clone_image_metadata(template_wim, template_image, imd);
+	if (ret)
+		goto out_delete_image;
+
+	/* Reference the streams of the copy, as for an exported image.  */
+	for_lookup_table_entry(wim->lookup_table, lte_zero_out_refcnt, NULL);
+	image_for_each_inode(inode, imd) {
+		ret = inode_export_streams(inode, template_wim->lookup_table,
+					   wim->lookup_table, false);
+		if (ret) {
+			for_lookup_table_entry(wim->lookup_table, lte_unexport,
+					       wim->lookup_table);
+			goto out_delete_image;
+		}
+	}
+	if (template_wim->hdr.flags & WIM_HDR_FLAG_RP_FIX)
+		wim->hdr.flags |= WIM_HDR_FLAG_RP_FIX;
+
+	/* Scan the changed paths again.  */
+	ret = update_image(wim, image, cmds, num_cmds, 0,
+			   WIMLIB_ADD_FLAG_CONFIG_FROM_TARGET);
+	if (ret)
+		goto out_unref_image;
+
+	ret = reference_template_for_changed_paths(wim, paths, num_paths,
+						   template_wim,
+						   template_image);
+	if (ret)
+		goto out_unref_image;
+
+	if (add_flags & WIMLIB_ADD_FLAG_BOOT)
+		wim->hdr.boot_idx = image;
+
+	ret = 0;
+	goto out_free_cmds;
+
+out_unref_image:
+	/* The streams of the image are now referenced, so drop the references
+	 * while freeing it.  */
+	put_image_metadata(imd, wim->lookup_table);
+	goto out_remove_image;
+out_delete_image:
+	put_image_metadata(imd, NULL);
+out_remove_image:
+	xml_delete_image(&wim->wim_info, image);
+	wim->hdr.image_count--;
+	if (wim->current_image == image)
+		wim->current_image = WIMLIB_NO_IMAGE;
+out_free_cmds:
+	FREE(cmds);
+out_free_paths:
+	free_changed_paths(paths, num_paths);
+	return ret;
+}
+
@@ -0,0 +1,183 @@
+/*
+ * arena.c
+ *
+ * Arena allocator for the dentries, inodes, and lookup table entries created
+ * when reading a WIM.
+ *
+ * Reading the metadata resource of an image with millions of files creates
+ * millions of small structures that are usually all freed together, when the
+ * image is freed.  An arena carves them out of large chunks instead, so loading
+ * the image makes few calls to the memory allocator, objects that are used
+ * together are close together in memory, and freeing the image releases memory
+ * a chunk at a time.
+ *
+ * Objects from an arena can still be freed individually, in any order, from
+ * any thread, with arena_free().  To make this possible, each object is
+ * preceded by a pointer to its chunk, and each chunk counts its live objects;
+ * a chunk is freed when its last object is freed.  The memory of an individual
+ * object is not reused, so arenas are only used for structures that are
+ * normally kept until the whole image or WIM is freed.
+ *
+ * The arena itself holds a reference to the chunk it is currently allocating
+ * from, and free_arena() only drops that reference.  Therefore, objects may
+ * outlive the arena they were allocated from; for example, lookup table entries
+ * may be moved to the lookup table of another WIM.
+ *
+ * arena_calloc() with a NULL arena allocates the object on its own with
+ * MALLOC(), so code that creates these structures need not care where they come
+ * from.  Allocating from a given arena is not thread-safe.
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/arena.h"
+#include "wimlib/util.h"
+
+#include <string.h>
+
+/* Size of the first chunk allocated by an arena.  Each following chunk is
+ * twice as large as the previous one, up to ARENA_MAX_CHUNK_SIZE, so that
+ * small images do not waste much memory.  */
+#define ARENA_MIN_CHUNK_SIZE	4096
+#define ARENA_MAX_CHUNK_SIZE	(1 << 20)
+
+/* Larger objects are allocated on their own.  */
+#define ARENA_MAX_OBJECT_SIZE	1024
+
+struct arena_chunk {
+	/* Number of objects in the chunk that have not been freed, plus 1 if
+	 * this is the chunk an arena is currently allocating from.  */
+	size_t refcnt;
+};
+
+/* Header that precedes each object.  */
+struct arena_object {
+	/* Chunk containing the object, or NULL if the object was allocated on
+	 * its own.  */
+	struct arena_chunk *chunk;
+};
+
+struct arena {
+	struct arena_chunk *cur_chunk;
+	u8 *next;
+	u8 *end;
+	size_t next_chunk_size;
+};
+
+static void
+put_arena_chunk(struct arena_chunk *chunk)
+{
+	if (__atomic_sub_fetch(&chunk->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		FREE(chunk);
+}
+
+/* Create a new, empty arena.  Returns NULL if out of memory.  */
+struct arena *
+new_arena(void)
+{
+	struct arena *arena;
+
+	arena = CALLOC(1, sizeof(struct arena));
+	if (arena)
+		arena->next_chunk_size = ARENA_MIN_CHUNK_SIZE;
+	return arena;
+}
+
+/* Free an arena.  Objects allocated from it remain valid until they are freed
+ * with arena_free().  */
+void
+free_arena(struct arena *arena)
+{
+	if (arena) {
+		if (arena->cur_chunk)
+			put_arena_chunk(arena->cur_chunk);
+		FREE(arena);
+	}
+}
+
+static bool
+arena_new_chunk(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	chunk = MALLOC(arena->next_chunk_size);
+	if (!chunk)
+		return false;
+	chunk->refcnt = 1;
+
+	if (arena->cur_chunk)
+		put_arena_chunk(arena->cur_chunk);
+	arena->cur_chunk = chunk;
+	arena->next = (u8 *)(chunk + 1);
+	arena->end = (u8 *)chunk + arena->next_chunk_size;
+	if (arena->next_chunk_size < ARENA_MAX_CHUNK_SIZE)
+		arena->next_chunk_size *= 2;
+	return true;
+}
+
+/* Allocate a zeroed object of @size bytes from @arena, or on its own if @arena
+ * is NULL.  Returns NULL if out of memory.  The object must be freed with
+ * arena_free().  */
+void *
+arena_calloc(struct arena *arena, size_t size)
+{
+	struct arena_object *obj;
+	size_t total_size;
+
+	BUILD_BUG_ON(sizeof(struct arena_chunk) % sizeof(void *) != 0);
+	BUILD_BUG_ON(sizeof(struct arena_object) % sizeof(void *) != 0);
+
+	total_size = sizeof(struct arena_object) +
+		     ((size + sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+
+	if (!arena || size > ARENA_MAX_OBJECT_SIZE) {
+		obj = MALLOC(total_size);
+		if (!obj)
+			return NULL;
+		obj->chunk = NULL;
+	} else {
+		if (unlikely((size_t)(arena->end - arena->next) < total_size) &&
+		    !arena_new_chunk(arena))
+			return NULL;
+		obj = (struct arena_object *)arena->next;
+		arena->next += total_size;
+		obj->chunk = arena->cur_chunk;
+		__atomic_add_fetch(&obj->chunk->refcnt, 1, __ATOMIC_RELAXED);
+	}
+	return memset(obj + 1, 0, size);
+}
+
+/* Free an object allocated with arena_calloc().  */
+void
+arena_free(void *p)
+{
+	struct arena_object *obj;
+
+	if (!p)
+		return;
+	obj = (struct arena_object *)p - 1;
+	if (obj->chunk)
+		put_arena_chunk(obj->chunk);
+	else
+		FREE(obj);
+}
@@ -26,12 +26,15 @@
 #endif
 
 #include "wimlib/capture.h"
+#include "wimlib/case.h"
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
 #include "wimlib/lookup_table.h"
 #include "wimlib/paths.h"
+#include "wimlib/pattern_index.h"
 #include "wimlib/progress.h"
 #include "wimlib/textfile.h"
+#include "wimlib/timestamp.h"
 #include "wimlib/wildcard.h"
 
 #include <string.h>
@@ -55,6 +58,13 @@ int
 do_capture_progress(struct add_image_params *params, int status,
 		    const struct wim_inode *inode)
 {
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	/* This is called for each file scanned, so it's a convenient place to
+	 * hand newly found streams to the pipeline.  */
+	if (params->pipeline)
+		feed_capture_pipeline(params->pipeline);
+#endif
+
 	switch (status) {
 	case WIMLIB_SCAN_DENTRY_OK:
 		if (!(params->add_flags & WIMLIB_ADD_FLAG_VERBOSE))
@@ -153,6 +163,49 @@ mangle_pat(tchar *pat, const tchar *path, unsigned long line_no)
 	return 0;
 }
 
+/* Flags that tag the patterns in the exclusion index.  */
+#define EXCLUSION_PATTERN		0x1
+#define EXCLUSION_EXCEPTION_PATTERN	0x2
+
+/* Build the index used by should_exclude_path(), so that each path can be
+ * matched against all the patterns at once rather than against each pattern in
+ * turn.  */
+static int
+compile_exclusion_patterns(struct capture_config *config)
+{
+	struct pattern_index *index;
+	int ret;
+
+	/* If nothing is excluded, there are no exceptions either.  */
+	if (config->exclusion_pats.num_strings == 0)
+		return 0;
+
+	index = new_pattern_index(default_ignore_case);
+	if (!index)
+		return WIMLIB_ERR_NOMEM;
+
+	for (size_t i = 0; i < config->exclusion_pats.num_strings; i++) {
+		ret = pattern_index_add(index,
+					config->exclusion_pats.strings[i],
+					EXCLUSION_PATTERN);
+		if (ret)
+			goto err;
+	}
+	for (size_t i = 0; i < config->exclusion_exception_pats.num_strings; i++) {
+		ret = pattern_index_add(index,
+					config->exclusion_exception_pats.strings[i],
+					EXCLUSION_EXCEPTION_PATTERN);
+		if (ret)
+			goto err;
+	}
+	config->exclusion_index = index;
+	return 0;
+
+err:
+	free_pattern_index(index);
+	return ret;
+}
+
 /*
  * Read, parse, and validate a capture configuration file from either an on-disk
  * file or an in-memory buffer.
@@ -198,12 +251,20 @@ read_capture_config(const tchar *config_file, const void *buf,
 	FREE(prepopulate_pats.strings);
 
 	config->buf = mem;
-	return 0;
+	config->exclusion_index = NULL;
+	config->exclusion_stats.num_checks = 0;
+	config->exclusion_stats.nsec = 0;
+
+	ret = compile_exclusion_patterns(config);
+	if (ret)
+		destroy_capture_config(config);
+	return ret;
 }
 
 void
 destroy_capture_config(struct capture_config *config)
 {
+	free_pattern_index(config->exclusion_index);
 	FREE(config->exclusion_pats.strings);
 	FREE(config->exclusion_exception_pats.strings);
 	FREE(config->buf);
@@ -239,14 +300,20 @@ match_pattern_list(const tchar *path, size_t path_nchars,
  *
  * As a special case, the empty string will be interpreted as a single path
  * separator (which means the root of capture itself).
+ *
+ * The check is counted in @stats, which must not be shared with other threads.
+ * should_exclude_path() uses the statistics in @config itself.
  */
 bool
-should_exclude_path(const tchar *path, size_t path_nchars,
-		    const struct capture_config *config)
+should_exclude_path_stats(const tchar *path, size_t path_nchars,
+			  const struct capture_config *config,
+			  struct exclusion_stats *stats)
 {
 	tchar dummy[2];
+	u64 start_time;
+	u32 flags;
 
-	if (!config)
+	if (!config || !config->exclusion_index)
 		return false;
 
 	if (!*path) {
@@ -256,7 +323,11 @@ should_exclude_path(const tchar *path, size_t path_nchars,
 		path_nchars = 1;
 	}
 
-	return match_pattern_list(path, path_nchars, &config->exclusion_pats) &&
-	      !match_pattern_list(path, path_nchars, &config->exclusion_exception_pats);
+	start_time = get_monotonic_time_nsec();
+	flags = pattern_index_match(config->exclusion_index, path, path_nchars);
+	stats->num_checks++;
+	stats->nsec += get_monotonic_time_nsec() - start_time;
 
+	return (flags & EXCLUSION_PATTERN) &&
+	       !(flags & EXCLUSION_EXCEPTION_PATTERN);
 }
@@ -0,0 +1,455 @@
+/*
+ * capture_pipeline.c
+ *
+ * Pipelined capture: checksum file data on background threads while the
+ * directory tree is still being scanned.
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+/*
+ * When an image is captured, the scan only records where the data of each file
+ * is; the data is first read when the WIM is written, at which point each
+ * stream is read, checksummed, and compressed in a single pass.  Scanning a
+ * large directory tree can take a long time, especially on network
+ * filesystems, during which the disk and processors are otherwise idle.
+ *
+ * In pipelined mode (WIMLIB_ADD_FLAG_PIPELINE), the streams found by the scan
+ * are handed to background threads, which read and checksum them while the scan
+ * continues.  When the scan ends, the streams that have been checksummed are
+ * moved from the list of unhashed streams into the lookup table, just as
+ * wim_checksum_unhashed_streams() would do.  Duplicate files are thereby
+ * detected before writing begins, so they are never read again, and the data
+ * of the other files has likely been left in the page cache.  Compression still
+ * happens when the WIM is written, since the output format is not known until
+ * then.
+ *
+ * Only the checksums of streams that share their size with another stream are
+ * applied.  The write path would have to checksum those before writing anyway
+ * to find duplicates, but it leaves streams with a unique size unhashed until
+ * they are actually written, so that a file modified after the scan is captured
+ * with its new contents rather than failing the write with a checksum
+ * mismatch.  Streams with a unique size are therefore left unhashed here too.
+ *
+ * The background threads never touch the lookup table entries themselves:
+ * those can be freed by the scan if it fails.  Instead, each stream is
+ * described by a job that holds a private copy of its location, and the
+ * results are applied by the thread that ran the scan, only if the scan
+ * succeeded.  The scan is never made to wait for checksumming: streams that
+ * have not been checksummed when the scan ends are simply left unhashed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+#include "wimlib/capture.h"
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/lookup_table.h"
+#include "wimlib/resource.h"
+#include "wimlib/sha1.h"
+#include "wimlib/util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Maximum number of streams that may be waiting to be checksummed.  When the
+ * scan gets this far ahead, further streams are handed over only as the queue
+ * drains.  */
+#define MAX_QUEUED_JOBS		65536
+
+/* A stream to checksum in the background.  */
+struct prehash_job {
+	/* The stream.  Only dereferenced by the thread running the scan.  */
+	struct wim_lookup_table_entry *lte;
+
+	/* Copy of the location of the stream, for the background threads.  */
+	enum resource_location resource_location;
+	tchar *file_on_disk;
+	u64 size;
+
+	/* Set by a background thread if the stream was checksummed.  */
+	bool hashed;
+	u8 hash[SHA1_HASH_SIZE];
+
+	/* Link in the pipeline's list of all jobs, in the order the streams
+	 * were found.  */
+	struct list_head all_list;
+
+	/* Link in the pipeline's queue of jobs waiting to be processed.  */
+	struct list_head queue_list;
+};
+
+struct capture_pipeline {
+	/* The list of unhashed streams being appended to by the scan, and the
+	 * last entry in it that has been handed to the background threads.  */
+	struct list_head *unhashed_streams;
+	struct list_head *last_fed;
+
+	/* All jobs created so far.  Only accessed by the thread running the
+	 * scan.  */
+	struct list_head all_jobs;
+
+	/* Protects the fields below.  */
+	pthread_mutex_t lock;
+	pthread_cond_t queue_cond;
+	struct list_head queue;
+	size_t num_queued;
+	bool terminating;
+
+	pthread_t *threads;
+	unsigned num_threads;
+};
+
+static bool
+can_prehash_stream(const struct wim_lookup_table_entry *lte)
+{
+	switch (lte->resource_location) {
+	case RESOURCE_IN_FILE_ON_DISK:
+#ifdef __WIN32__
+	case RESOURCE_IN_WINNT_FILE_ON_DISK:
+#endif
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Set up a lookup table entry for reading the stream of @job without touching
+ * the real one.  */
+static void
+init_job_lte(struct wim_lookup_table_entry *lte, const struct prehash_job *job)
+{
+	memset(lte, 0, sizeof(*lte));
+	lte->resource_location = job->resource_location;
+	lte->file_on_disk = job->file_on_disk;
+	lte->size = job->size;
+	lte->unhashed = 1;
+}
+
+/* Checksum the jobs in @batch.  Either there is one job, or all the jobs are
+ * small enough to be checksummed together with sha1_small_streams().  Failures
+ * are ignored; the streams are then just checksummed later when they are
+ * written.  */
+static void
+prehash_batch(struct prehash_job *batch[], size_t num_jobs)
+{
+	struct wim_lookup_table_entry ltes[SHA1_BATCH_MAX_STREAMS];
+	struct wim_lookup_table_entry *lte_ptrs[SHA1_BATCH_MAX_STREAMS];
+	u8 hashes[SHA1_BATCH_MAX_STREAMS][SHA1_HASH_SIZE];
+
+	for (size_t i = 0; i < num_jobs; i++) {
+		init_job_lte(&ltes[i], batch[i]);
+		lte_ptrs[i] = &ltes[i];
+	}
+
+	if (num_jobs == 1 && batch[0]->size > SHA1_BATCH_MAX_STREAM_SIZE) {
+		if (sha1_stream(&ltes[0]))
+			return;
+		copy_hash(hashes[0], ltes[0].hash);
+	} else {
+		if (sha1_small_streams(lte_ptrs, num_jobs, hashes, NULL))
+			return;
+	}
+
+	for (size_t i = 0; i < num_jobs; i++) {
+		copy_hash(batch[i]->hash, hashes[i]);
+		batch[i]->hashed = true;
+	}
+}
+
+static void *
+prehash_thread_proc(void *arg)
+{
+	struct capture_pipeline *pipeline = arg;
+	struct prehash_job *batch[SHA1_BATCH_MAX_STREAMS];
+	size_t num_jobs;
+
+	for (;;) {
+		pthread_mutex_lock(&pipeline->lock);
+		while (list_empty(&pipeline->queue) && !pipeline->terminating)
+			pthread_cond_wait(&pipeline->queue_cond, &pipeline->lock);
+		if (pipeline->terminating) {
+			pthread_mutex_unlock(&pipeline->lock);
+			break;
+		}
+
+		/* Take one large stream, or a run of small ones.  */
+		num_jobs = 0;
+		do {
+			struct prehash_job *job;
+
+			job = list_first_entry(&pipeline->queue,
+					       struct prehash_job, queue_list);
+			if (job->size > SHA1_BATCH_MAX_STREAM_SIZE &&
+			    num_jobs != 0)
+				break;
+			list_del(&job->queue_list);
+			pipeline->num_queued--;
+			batch[num_jobs++] = job;
+			if (job->size > SHA1_BATCH_MAX_STREAM_SIZE)
+				break;
+		} while (num_jobs < SHA1_BATCH_MAX_STREAMS &&
+			 !list_empty(&pipeline->queue));
+		pthread_mutex_unlock(&pipeline->lock);
+
+		prehash_batch(batch, num_jobs);
+	}
+	return NULL;
+}
+
+/* Hand the streams that the scan has added since the last call to the
+ * background threads.  This is called by do_capture_progress() for each file
+ * scanned.  */
+void
+feed_capture_pipeline(struct capture_pipeline *pipeline)
+{
+	LIST_HEAD(new_jobs);
+	size_t num_new_jobs = 0;
+	struct list_head *pos;
+
+	if (pipeline->last_fed->next == pipeline->unhashed_streams)
+		return;
+
+	pthread_mutex_lock(&pipeline->lock);
+	for (pos = pipeline->last_fed->next;
+	     pos != pipeline->unhashed_streams &&
+		pipeline->num_queued + num_new_jobs < MAX_QUEUED_JOBS;
+	     pos = pos->next)
+	{
+		struct wim_lookup_table_entry *lte;
+		struct prehash_job *job;
+
+		lte = list_entry(pos, struct wim_lookup_table_entry,
+				 unhashed_list);
+		pipeline->last_fed = pos;
+		if (!can_prehash_stream(lte))
+			continue;
+
+		job = CALLOC(1, sizeof(*job));
+		if (!job)
+			break;
+		job->file_on_disk = TSTRDUP(lte->file_on_disk);
+		if (!job->file_on_disk) {
+			FREE(job);
+			break;
+		}
+		job->lte = lte;
+		job->resource_location = lte->resource_location;
+		job->size = lte->size;
+		list_add_tail(&job->all_list, &pipeline->all_jobs);
+		list_add_tail(&job->queue_list, &new_jobs);
+		num_new_jobs++;
+	}
+	if (num_new_jobs) {
+		list_splice_tail(&new_jobs, &pipeline->queue);
+		pipeline->num_queued += num_new_jobs;
+		pthread_cond_broadcast(&pipeline->queue_cond);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/* Start checksumming, on background threads, the streams that will be added to
+ * @params->unhashed_streams by the scan.  The number of threads is taken from
+ * @params->num_threads.  On success, @params->pipeline is set; it must be
+ * passed to end_capture_pipeline() when the scan ends.  */
+int
+start_capture_pipeline(struct add_image_params *params)
+{
+	struct capture_pipeline *pipeline;
+	unsigned num_threads;
+
+	num_threads = params->num_threads;
+	if (num_threads == 0)
+		num_threads = get_default_num_threads();
+
+	pipeline = CALLOC(1, sizeof(*pipeline));
+	if (!pipeline)
+		goto oom;
+	pipeline->threads = CALLOC(num_threads, sizeof(pipeline->threads[0]));
+	if (!pipeline->threads)
+		goto oom_free_pipeline;
+	if (pthread_mutex_init(&pipeline->lock, NULL))
+		goto oom_free_threads;
+	if (pthread_cond_init(&pipeline->queue_cond, NULL))
+		goto oom_destroy_lock;
+
+	pipeline->unhashed_streams = params->unhashed_streams;
+	pipeline->last_fed = params->unhashed_streams->prev;
+	INIT_LIST_HEAD(&pipeline->all_jobs);
+	INIT_LIST_HEAD(&pipeline->queue);
+
+	while (pipeline->num_threads < num_threads) {
+		if (pthread_create(&pipeline->threads[pipeline->num_threads],
+				   NULL, prehash_thread_proc, pipeline))
+		{
+			WARNING_WITH_ERRNO("Failed to create checksumming "
+					   "thread");
+			break;
+		}
+		pipeline->num_threads++;
+	}
+
+	/* Without any threads, just capture normally.  */
+	if (pipeline->num_threads == 0) {
+		pthread_cond_destroy(&pipeline->queue_cond);
+		pthread_mutex_destroy(&pipeline->lock);
+		FREE(pipeline->threads);
+		FREE(pipeline);
+		return 0;
+	}
+
+	params->pipeline = pipeline;
+	return 0;
+
+oom_destroy_lock:
+	pthread_mutex_destroy(&pipeline->lock);
+oom_free_threads:
+	FREE(pipeline->threads);
+oom_free_pipeline:
+	FREE(pipeline);
+oom:
+	return WIMLIB_ERR_NOMEM;
+}
+
+static int
+cmp_stream_sizes(const void *p1, const void *p2)
+{
+	return cmp_u64(*(const u64 *)p1, *(const u64 *)p2);
+}
+
+struct stream_sizes {
+	u64 *sizes;
+	size_t num_sizes;
+};
+
+static int
+count_stream_size(struct wim_lookup_table_entry *lte, void *_num_sizes)
+{
+	(*(size_t *)_num_sizes)++;
+	return 0;
+}
+
+static int
+add_stream_size(struct wim_lookup_table_entry *lte, void *_ss)
+{
+	struct stream_sizes *ss = _ss;
+
+	ss->sizes[ss->num_sizes++] = lte->size;
+	return 0;
+}
+
+/* Collect, in sorted order, the sizes of the streams in the lookup table and of
+ * the unhashed streams found by the scan.  */
+static int
+collect_stream_sizes(const struct add_image_params *params,
+		     struct stream_sizes *ss)
+{
+	struct wim_lookup_table_entry *lte;
+	size_t max_sizes = 0;
+
+	for_lookup_table_entry(params->lookup_table, count_stream_size,
+			       &max_sizes);
+	list_for_each_entry(lte, params->unhashed_streams, unhashed_list)
+		max_sizes++;
+
+	ss->sizes = MALLOC(max(max_sizes, 1) * sizeof(ss->sizes[0]));
+	if (!ss->sizes)
+		return WIMLIB_ERR_NOMEM;
+
+	ss->num_sizes = 0;
+	for_lookup_table_entry(params->lookup_table, add_stream_size, ss);
+	list_for_each_entry(lte, params->unhashed_streams, unhashed_list)
+		ss->sizes[ss->num_sizes++] = lte->size;
+
+	qsort(ss->sizes, ss->num_sizes, sizeof(ss->sizes[0]),
+	      cmp_stream_sizes);
+	return 0;
+}
+
+/* Does any stream other than the one of size @size itself have that size?  */
+static bool
+size_is_shared(const struct stream_sizes *ss, u64 size)
+{
+	size_t lo = 0, hi = ss->num_sizes;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ss->sizes[mid] < size)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo + 1 < ss->num_sizes && ss->sizes[lo + 1] == size;
+}
+
+/* Stop the background threads started by start_capture_pipeline(), abandoning
+ * the streams they have not started on.  If @scan_succeeded, move the streams
+ * that were checksummed and share their size with another stream into the
+ * lookup table, merging duplicates.  Otherwise, some of the streams may already
+ * have been freed, so just discard the results.  */
+void
+end_capture_pipeline(struct add_image_params *params, bool scan_succeeded)
+{
+	struct capture_pipeline *pipeline = params->pipeline;
+	struct prehash_job *job, *tmp;
+	struct stream_sizes ss = { .sizes = NULL };
+
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->terminating = true;
+	pthread_cond_broadcast(&pipeline->queue_cond);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	for (unsigned i = 0; i < pipeline->num_threads; i++)
+		pthread_join(pipeline->threads[i], NULL);
+
+	/* If the sizes can't be collected, leave every stream unhashed, as
+	 * though none had been checksummed yet.  */
+	if (scan_succeeded && collect_stream_sizes(params, &ss))
+		scan_succeeded = false;
+
+	list_for_each_entry_safe(job, tmp, &pipeline->all_jobs, all_list) {
+		if (scan_succeeded && job->hashed &&
+		    size_is_shared(&ss, job->size))
+		{
+			struct wim_lookup_table_entry *new_lte;
+
+			set_unhashed_stream_hash(job->lte, job->hash,
+						 params->lookup_table, &new_lte);
+			if (new_lte != job->lte)
+				free_lookup_table_entry(job->lte);
+		}
+		FREE(job->file_on_disk);
+		FREE(job);
+	}
+	FREE(ss.sizes);
+
+	pthread_cond_destroy(&pipeline->queue_cond);
+	pthread_mutex_destroy(&pipeline->lock);
+	FREE(pipeline->threads);
+	FREE(pipeline);
+	params->pipeline = NULL;
+}
+
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
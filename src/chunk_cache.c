@@ -0,0 +1,623 @@
+/*
+ * chunk_cache.c
+ *
+ * Cache of decompressed chunks of WIM resources.  This is used when reading
+ * from a mounted WIM image, where the kernel tends to issue many small reads
+ * that each fall within a single (possibly very large) compressed chunk.
+ * Without the cache, each such read would decompress the entire enclosing
+ * chunk again.
+ *
+ * The cache can also read ahead: when a stream is being read sequentially,
+ * chunks beyond the current read position are decompressed on background
+ * threads so that they are already available when the reads reach them.
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef WITH_FUSE
+
+#include "wimlib/assert.h"
+#include "wimlib/chunk_cache.h"
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/lookup_table.h"
+#include "wimlib/resource.h"
+#include "wimlib/util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+enum chunk_state {
+	/* The chunk's data is valid.  */
+	CHUNK_READY,
+
+	/* The chunk is waiting in the readahead queue to be decompressed by a
+	 * background thread.  */
+	CHUNK_QUEUED,
+
+	/* The chunk is being decompressed.  */
+	CHUNK_LOADING,
+};
+
+/* A decompressed chunk of a WIM resource.  */
+struct cached_chunk {
+	/* Link in the hash table bucket.  */
+	struct hlist_node hash_node;
+
+	/* Link in the LRU list.  The most recently used chunk is at the
+	 * front.  */
+	struct list_head lru_list;
+
+	/* Link in the readahead queue; only valid in state CHUNK_QUEUED.  */
+	struct list_head queue_list;
+
+	/* The resource this chunk belongs to, and the 0-based index of the
+	 * chunk within that resource's uncompressed data.  */
+	const struct wim_resource_spec *rspec;
+	u64 chunk_idx;
+
+	/* Uncompressed size of this chunk.  */
+	u32 size;
+
+	enum chunk_state state;
+
+	/* The uncompressed data.  */
+	u8 data[];
+};
+
+struct chunk_cache {
+	/* Link in the list of all chunk caches in the process.  */
+	struct list_head all_caches_list;
+
+	/* Hash table of cached chunks, indexed by (rspec, chunk_idx).  The
+	 * number of buckets is 2**table_order.  */
+	struct hlist_head *table;
+	unsigned table_order;
+
+	/* List of all cached chunks in order of most recent use.  */
+	struct list_head lru_list;
+
+	/* Chunks waiting to be decompressed by the readahead threads.  */
+	struct list_head readahead_queue;
+
+	/* Protects everything in this structure, including the chunks.  The
+	 * data of a chunk may be accessed without the lock only by the thread
+	 * that moved it into state CHUNK_LOADING.  */
+	pthread_mutex_t lock;
+
+	/* Signaled when a chunk is added to the readahead queue.  */
+	pthread_cond_t queue_cond;
+
+	/* Signaled when a chunk leaves state CHUNK_LOADING.  */
+	pthread_cond_t loaded_cond;
+
+	pthread_t *threads;
+	unsigned num_threads;
+	bool terminating;
+
+	struct chunk_cache_stats stats;
+};
+
+/* Assume chunks of at least this size when sizing the hash table.  This is
+ * the smallest chunk size allowed in WIM files.  */
+#define MIN_CHUNK_ORDER		15
+
+#define MIN_TABLE_ORDER		4
+#define MAX_TABLE_ORDER		16
+
+/* Read at least this many bytes ahead of a sequential reader, or at least one
+ * chunk per readahead thread if that is more.  */
+#define READAHEAD_BYTES		(1U << 20)
+
+/* All chunk caches in the process, so that chunks can be dropped when the
+ * resource they came from is freed, no matter which WIMStruct the resource
+ * belongs to.  */
+static LIST_HEAD(all_caches);
+static pthread_mutex_t all_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct hlist_head *
+chunk_bucket(const struct chunk_cache *cache,
+	     const struct wim_resource_spec *rspec, u64 chunk_idx)
+{
+	u64 hash = hash_u64((uintptr_t)rspec + chunk_idx);
+
+	/* The multiplicative hash leaves the low bits poorly mixed, so use
+	 * the high bits.  */
+	return &cache->table[hash >> (64 - cache->table_order)];
+}
+
+static struct cached_chunk *
+lookup_chunk(const struct chunk_cache *cache,
+	     const struct wim_resource_spec *rspec, u64 chunk_idx)
+{
+	struct hlist_node *cur;
+	struct cached_chunk *chunk;
+
+	hlist_for_each_entry(chunk, cur, chunk_bucket(cache, rspec, chunk_idx),
+			     hash_node)
+		if (chunk->rspec == rspec && chunk->chunk_idx == chunk_idx)
+			return chunk;
+	return NULL;
+}
+
+static void
+remove_chunk(struct chunk_cache *cache, struct cached_chunk *chunk)
+{
+	hlist_del(&chunk->hash_node);
+	list_del(&chunk->lru_list);
+	if (chunk->state == CHUNK_QUEUED)
+		list_del(&chunk->queue_list);
+	cache->stats.cur_size -= chunk->size;
+	cache->stats.num_chunks--;
+	FREE(chunk);
+}
+
+/* Evict least recently used chunks until there is room for @size more bytes.
+ * Chunks that are being decompressed are skipped.  Returns %false if enough
+ * room could not be made.  */
+static bool
+make_room(struct chunk_cache *cache, u32 size)
+{
+	struct list_head *cur, *prev;
+	struct cached_chunk *chunk;
+
+	for (cur = cache->lru_list.prev; cur != &cache->lru_list; cur = prev) {
+		if (cache->stats.cur_size + size <= cache->stats.max_size)
+			break;
+		prev = cur->prev;
+		chunk = list_entry(cur, struct cached_chunk, lru_list);
+		if (chunk->state != CHUNK_LOADING) {
+			remove_chunk(cache, chunk);
+			cache->stats.evictions++;
+		}
+	}
+	return cache->stats.cur_size + size <= cache->stats.max_size;
+}
+
+/* Allocate a new chunk and add it to the cache in the specified state.  */
+static struct cached_chunk *
+new_chunk(struct chunk_cache *cache, const struct wim_resource_spec *rspec,
+	  u64 chunk_idx, u32 chunk_order, enum chunk_state state)
+{
+	u64 chunk_start = chunk_idx << chunk_order;
+	u32 chunk_usize = min(rspec->uncompressed_size - chunk_start,
+			      (u64)1 << chunk_order);
+	struct cached_chunk *chunk;
+
+	if (!make_room(cache, chunk_usize) && state == CHUNK_QUEUED)
+		return NULL;
+
+	chunk = MALLOC(sizeof(*chunk) + chunk_usize);
+	if (!chunk)
+		return NULL;
+
+	chunk->rspec = rspec;
+	chunk->chunk_idx = chunk_idx;
+	chunk->size = chunk_usize;
+	chunk->state = state;
+	hlist_add_head(&chunk->hash_node,
+		       chunk_bucket(cache, rspec, chunk_idx));
+	list_add(&chunk->lru_list, &cache->lru_list);
+	if (state == CHUNK_QUEUED)
+		list_add_tail(&chunk->queue_list, &cache->readahead_queue);
+	cache->stats.cur_size += chunk_usize;
+	cache->stats.num_chunks++;
+	return chunk;
+}
+
+/* Decompress a chunk that the calling thread has put in state CHUNK_LOADING,
+ * then make it available to other threads.  Called with the cache locked, but
+ * the lock is released while decompressing.  On failure the chunk is freed.  */
+static int
+load_chunk(struct chunk_cache *cache, struct cached_chunk *chunk,
+	   struct private_decompressor *pd)
+{
+	u64 chunk_start = chunk->chunk_idx << bsr32(chunk->rspec->chunk_size);
+	int ret;
+
+	pthread_mutex_unlock(&cache->lock);
+	ret = read_partial_wim_resource_into_buf(chunk->rspec, chunk->size,
+						 chunk_start, chunk->data, pd);
+	pthread_mutex_lock(&cache->lock);
+
+	if (ret)
+		remove_chunk(cache, chunk);
+	else
+		chunk->state = CHUNK_READY;
+	pthread_cond_broadcast(&cache->loaded_cond);
+	return ret;
+}
+
+static void *
+readahead_thread_proc(void *arg)
+{
+	struct chunk_cache *cache = arg;
+	struct private_decompressor pd = { .decompressor = NULL };
+	struct cached_chunk *chunk;
+
+	pthread_mutex_lock(&cache->lock);
+	for (;;) {
+		while (list_empty(&cache->readahead_queue) &&
+		       !cache->terminating)
+			pthread_cond_wait(&cache->queue_cond, &cache->lock);
+		if (cache->terminating)
+			break;
+		chunk = list_entry(cache->readahead_queue.next,
+				   struct cached_chunk, queue_list);
+		list_del(&chunk->queue_list);
+		chunk->state = CHUNK_LOADING;
+		if (!load_chunk(cache, chunk, &pd))
+			cache->stats.readahead_chunks++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	free_private_decompressor(&pd);
+	return NULL;
+}
+
+/* Create a chunk cache that holds at most @max_size bytes of uncompressed data.
+ * Readahead is disabled until chunk_cache_start_readahead() is called.  */
+int
+new_chunk_cache(u64 max_size, struct chunk_cache **cache_ret)
+{
+	struct chunk_cache *cache;
+	unsigned table_order;
+	int ret;
+
+	table_order = MIN_TABLE_ORDER;
+	while (table_order < MAX_TABLE_ORDER &&
+	       ((u64)1 << (table_order + MIN_CHUNK_ORDER)) < max_size)
+		table_order++;
+
+	ret = WIMLIB_ERR_NOMEM;
+	cache = CALLOC(1, sizeof(*cache));
+	if (!cache)
+		goto err;
+
+	cache->table = CALLOC((size_t)1 << table_order,
+			      sizeof(cache->table[0]));
+	if (!cache->table)
+		goto err_free_cache;
+
+	if (pthread_mutex_init(&cache->lock, NULL))
+		goto err_free_table;
+	if (pthread_cond_init(&cache->queue_cond, NULL))
+		goto err_destroy_lock;
+	if (pthread_cond_init(&cache->loaded_cond, NULL))
+		goto err_destroy_queue_cond;
+
+	cache->table_order = table_order;
+	INIT_LIST_HEAD(&cache->lru_list);
+	INIT_LIST_HEAD(&cache->readahead_queue);
+	cache->stats.max_size = max_size;
+
+	pthread_mutex_lock(&all_caches_lock);
+	list_add(&cache->all_caches_list, &all_caches);
+	pthread_mutex_unlock(&all_caches_lock);
+
+	*cache_ret = cache;
+	return 0;
+
+err_destroy_queue_cond:
+	pthread_cond_destroy(&cache->queue_cond);
+err_destroy_lock:
+	pthread_mutex_destroy(&cache->lock);
+err_free_table:
+	FREE(cache->table);
+err_free_cache:
+	FREE(cache);
+err:
+	return ret;
+}
+
+/* Start @num_threads background threads to decompress chunks queued by
+ * chunk_cache_readahead().  This must be called at most once, from the process
+ * that will use the cache.  Failure to create threads is not fatal; readahead
+ * just won't happen, or will happen on fewer threads.  */
+void
+chunk_cache_start_readahead(struct chunk_cache *cache, unsigned num_threads)
+{
+	cache->threads = CALLOC(num_threads, sizeof(cache->threads[0]));
+	if (!cache->threads) {
+		WARNING("Not enough memory to start readahead threads");
+		return;
+	}
+
+	for (cache->num_threads = 0;
+	     cache->num_threads < num_threads;
+	     cache->num_threads++)
+	{
+		if (pthread_create(&cache->threads[cache->num_threads], NULL,
+				   readahead_thread_proc, cache))
+		{
+			WARNING_WITH_ERRNO("Failed to create readahead thread");
+			break;
+		}
+	}
+}
+
+void
+free_chunk_cache(struct chunk_cache *cache)
+{
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&all_caches_lock);
+	list_del(&cache->all_caches_list);
+	pthread_mutex_unlock(&all_caches_lock);
+
+	pthread_mutex_lock(&cache->lock);
+	cache->terminating = true;
+	pthread_cond_broadcast(&cache->queue_cond);
+	pthread_mutex_unlock(&cache->lock);
+
+	for (unsigned i = 0; i < cache->num_threads; i++)
+		pthread_join(cache->threads[i], NULL);
+
+	while (!list_empty(&cache->lru_list))
+		remove_chunk(cache, list_entry(cache->lru_list.next,
+					       struct cached_chunk, lru_list));
+	pthread_cond_destroy(&cache->loaded_cond);
+	pthread_cond_destroy(&cache->queue_cond);
+	pthread_mutex_destroy(&cache->lock);
+	FREE(cache->threads);
+	FREE(cache->table);
+	FREE(cache);
+}
+
+/* Return the requested chunk in state CHUNK_READY, decompressing it if it's
+ * not already cached.  Called with the cache locked.  */
+static int
+get_chunk(struct chunk_cache *cache, const struct wim_resource_spec *rspec,
+	  u64 chunk_idx, u32 chunk_order, struct cached_chunk **chunk_ret)
+{
+	struct cached_chunk *chunk;
+	int ret;
+
+	while ((chunk = lookup_chunk(cache, rspec, chunk_idx)) &&
+	       chunk->state == CHUNK_LOADING)
+	{
+		/* A readahead thread is already decompressing this chunk.  */
+		cache->stats.readahead_waits++;
+		pthread_cond_wait(&cache->loaded_cond, &cache->lock);
+	}
+
+	if (chunk && chunk->state == CHUNK_READY) {
+		list_move(&chunk->lru_list, &cache->lru_list);
+		cache->stats.hits++;
+		*chunk_ret = chunk;
+		return 0;
+	}
+
+	cache->stats.misses++;
+
+	if (chunk) {
+		/* Queued for readahead but not yet started; take it over.  */
+		list_del(&chunk->queue_list);
+		chunk->state = CHUNK_LOADING;
+	} else {
+		chunk = new_chunk(cache, rspec, chunk_idx, chunk_order,
+				  CHUNK_LOADING);
+		if (!chunk) {
+			errno = ENOMEM;
+			return WIMLIB_ERR_NOMEM;
+		}
+	}
+
+	ret = load_chunk(cache, chunk, NULL);
+	if (ret)
+		return ret;
+
+	*chunk_ret = chunk;
+	return 0;
+}
+
+static bool
+resource_is_cacheable(const struct chunk_cache *cache,
+		      const struct wim_resource_spec *rspec)
+{
+	return resource_is_compressed(rspec) &&
+		is_power_of_2(rspec->chunk_size) &&
+		rspec->chunk_size <= cache->stats.max_size;
+}
+
+/* Like read_partial_wim_stream_into_buf(), but go through the specified chunk
+ * cache.  @cache may be NULL, in which case no caching is done.  Uncompressed
+ * resources, and resources whose chunks would not fit in the cache at all,
+ * are also read directly.
+ *
+ * This must only be called from the thread that owns the WIMStruct.  */
+int
+read_partial_wim_stream_cached(struct chunk_cache *cache,
+			       const struct wim_lookup_table_entry *lte,
+			       size_t size, u64 offset, void *_buf)
+{
+	const struct wim_resource_spec *rspec;
+	u8 *buf = _buf;
+	u64 cur_offset;
+	u64 end_offset;
+	u32 chunk_order;
+	int ret;
+
+	wimlib_assert(lte->resource_location == RESOURCE_IN_WIM);
+
+	rspec = lte->rspec;
+
+	if (!cache || !resource_is_cacheable(cache, rspec))
+		return read_partial_wim_stream_into_buf(lte, size, offset, buf);
+
+	chunk_order = bsr32(rspec->chunk_size);
+	cur_offset = lte->offset_in_res + offset;
+	end_offset = cur_offset + size;
+
+	ret = 0;
+	pthread_mutex_lock(&cache->lock);
+	while (cur_offset != end_offset) {
+		u64 chunk_idx = cur_offset >> chunk_order;
+		u32 offset_in_chunk = cur_offset - (chunk_idx << chunk_order);
+		struct cached_chunk *chunk;
+		u32 len;
+
+		ret = get_chunk(cache, rspec, chunk_idx, chunk_order, &chunk);
+		if (ret)
+			break;
+
+		len = min(end_offset - cur_offset,
+			  (u64)(chunk->size - offset_in_chunk));
+		memcpy(buf, &chunk->data[offset_in_chunk], len);
+		buf += len;
+		cur_offset += len;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+/* Queue the chunks of the specified stream that follow offset @offset for
+ * decompression on the readahead threads, if they are not already cached.
+ * This does nothing if the cache has no readahead threads.  */
+void
+chunk_cache_readahead(struct chunk_cache *cache,
+		      const struct wim_lookup_table_entry *lte, u64 offset)
+{
+	const struct wim_resource_spec *rspec;
+	u32 chunk_order;
+	u64 chunk_idx;
+	u64 end_chunk_idx;
+	u64 num_chunks;
+	bool queued = false;
+
+	wimlib_assert(lte->resource_location == RESOURCE_IN_WIM);
+
+	rspec = lte->rspec;
+
+	if (!cache || !cache->num_threads ||
+	    !resource_is_cacheable(cache, rspec) || offset >= lte->size)
+		return;
+
+	chunk_order = bsr32(rspec->chunk_size);
+
+	/* Don't read so far ahead that chunks still to be read would be
+	 * evicted to make room for later ones.  Using at most half the cache
+	 * leaves room for the chunks other readers are using.  */
+	num_chunks = max(cache->num_threads, READAHEAD_BYTES >> chunk_order);
+	num_chunks = min(num_chunks,
+			 cache->stats.max_size >> (chunk_order + 1));
+
+	chunk_idx = (lte->offset_in_res + offset) >> chunk_order;
+	end_chunk_idx = min(chunk_idx + num_chunks,
+			    ((lte->offset_in_res + lte->size - 1) >>
+			     chunk_order) + 1);
+
+	pthread_mutex_lock(&cache->lock);
+	for (; chunk_idx < end_chunk_idx; chunk_idx++) {
+		if (lookup_chunk(cache, rspec, chunk_idx))
+			continue;
+		if (!new_chunk(cache, rspec, chunk_idx, chunk_order,
+			       CHUNK_QUEUED))
+			break;
+		queued = true;
+	}
+	if (queued)
+		pthread_cond_broadcast(&cache->queue_cond);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Remove all chunks of @rspec from @cache.  Chunks still waiting for readahead
+ * are dequeued, and chunks being decompressed are waited for.  */
+static void
+drop_rspec(struct chunk_cache *cache, const struct wim_resource_spec *rspec)
+{
+	struct list_head *cur, *next;
+	struct cached_chunk *chunk;
+	u32 chunk_order;
+	u64 num_chunks;
+	u64 chunk_idx;
+
+	if (!resource_is_cacheable(cache, rspec))
+		return;
+
+	chunk_order = bsr32(rspec->chunk_size);
+	num_chunks = DIV_ROUND_UP(rspec->uncompressed_size,
+				  (u64)1 << chunk_order);
+
+	pthread_mutex_lock(&cache->lock);
+retry:
+	if (num_chunks <= cache->stats.num_chunks) {
+		/* Look up each chunk of the resource.  */
+		for (chunk_idx = 0; chunk_idx < num_chunks; chunk_idx++) {
+			chunk = lookup_chunk(cache, rspec, chunk_idx);
+			if (!chunk)
+				continue;
+			if (chunk->state == CHUNK_LOADING) {
+				pthread_cond_wait(&cache->loaded_cond,
+						  &cache->lock);
+				goto retry;
+			}
+			remove_chunk(cache, chunk);
+		}
+	} else {
+		/* The resource has more chunks than the cache holds, so it's
+		 * cheaper to check every cached chunk.  */
+		for (cur = cache->lru_list.next; cur != &cache->lru_list;
+		     cur = next)
+		{
+			next = cur->next;
+			chunk = list_entry(cur, struct cached_chunk, lru_list);
+			if (chunk->rspec != rspec)
+				continue;
+			if (chunk->state == CHUNK_LOADING) {
+				pthread_cond_wait(&cache->loaded_cond,
+						  &cache->lock);
+				goto retry;
+			}
+			remove_chunk(cache, chunk);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Forget any chunks of @rspec held by any chunk cache.  This must be called
+ * before @rspec is freed, since otherwise the readahead threads could still
+ * read from it, and a new resource allocated at the same address could be
+ * served the old resource's data.  */
+void
+chunk_cache_drop_rspec(const struct wim_resource_spec *rspec)
+{
+	struct chunk_cache *cache;
+
+	pthread_mutex_lock(&all_caches_lock);
+	list_for_each_entry(cache, &all_caches, all_caches_list)
+		drop_rspec(cache, rspec);
+	pthread_mutex_unlock(&all_caches_lock);
+}
+
+void
+chunk_cache_get_stats(struct chunk_cache *cache,
+		      struct chunk_cache_stats *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+#endif /* WITH_FUSE */
@@ -147,6 +147,20 @@ wimlib_create_compressor(enum wimlib_compression_type ctype,
 	return 0;
 }
 
+/*
+ * Allow the compressor @c to use up to @num_threads threads, including the
+ * calling thread, in each call to wimlib_compress().  This only has an effect
+ * on compressors that can split up the work of compressing a single block,
+ * which currently means the LZMS compressor with large blocks.  The compressed
+ * data does not depend on the number of threads.
+ */
+void
+set_compressor_num_threads(struct wimlib_compressor *c, unsigned num_threads)
+{
+	if (c->ops->set_num_threads)
+		c->ops->set_num_threads(c->private, max(num_threads, 1));
+}
+
 WIMLIBAPI size_t
 wimlib_compress(const void *uncompressed_data, size_t uncompressed_size,
 		void *compressed_data, size_t compressed_size_avail,
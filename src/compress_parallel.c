@@ -30,39 +30,47 @@
 
 #include "wimlib/assert.h"
 #include "wimlib/chunk_compressor.h"
+#include "wimlib/compressor_ops.h"
 #include "wimlib/error.h"
 #include "wimlib/list.h"
+#include "wimlib/spsc_queue.h"
 #include "wimlib/util.h"
-#ifdef __WIN32__
-#  include "wimlib/win32.h" /* win32_get_number_of_processors() */
-#endif
 
 #include <errno.h>
-#include <limits.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#ifdef HAVE_SYS_SYSCTL_H
-#  include <sys/sysctl.h>
-#endif
 
-struct message_queue {
-	struct list_head list;
-	pthread_mutex_t lock;
-	pthread_cond_t msg_avail_cond;
-	pthread_cond_t space_avail_cond;
-	bool terminating;
-};
+/*
+ * Each compressor thread has its own pair of single-producer, single-consumer
+ * queues: one through which the main thread hands it messages of chunks to
+ * compress, and one through which it hands them back.  The main thread assigns
+ * each message to the thread with the fewest messages outstanding.  Since each
+ * thread compresses its messages in the order it receives them and the main
+ * thread retrieves messages in the order it submitted them, the next message
+ * the main thread needs is always the next one in the "compressed" queue of the
+ * thread it was assigned to.  No lock is shared by all the threads, and a lock
+ * is only taken at all when a thread has to sleep because its queue is empty.
+ */
 
 struct compressor_thread_data {
 	pthread_t thread;
-	struct message_queue *chunks_to_compress_queue;
-	struct message_queue *compressed_chunks_queue;
+	struct parallel_chunk_compressor *ctx;
+	struct spsc_queue chunks_to_compress_queue;
+	struct spsc_queue compressed_chunks_queue;
 	struct wimlib_compressor *compressor;
+
+	/* Number of messages assigned to this thread that the main thread has
+	 * not yet retrieved.  Only accessed by the main thread.  */
+	size_t num_outstanding_msgs;
 };
 
-#define MAX_CHUNKS_PER_MSG 2
+#define MAX_CHUNKS_PER_MSG 16
+
+/* The number of chunks per message is chosen so that compressing a message
+ * takes roughly this long; fewer, bigger messages mean fewer queue operations
+ * and wakeups, but coarser load balancing.  */
+#define TARGET_MSG_COMPRESS_USEC 4000
 
 struct message {
 	u8 *uncompressed_chunks[MAX_CHUNKS_PER_MSG];
@@ -72,18 +80,17 @@ struct message {
 	size_t num_filled_chunks;
 	size_t num_alloc_chunks;
 	struct list_head list;
-	bool complete;
+	struct compressor_thread_data *thread;
 	struct list_head submission_list;
 };
 
 struct parallel_chunk_compressor {
 	struct chunk_compressor base;
 
-	struct message_queue chunks_to_compress_queue;
-	struct message_queue compressed_chunks_queue;
 	struct compressor_thread_data *thread_data;
 	unsigned num_thread_data;
 	unsigned num_started_threads;
+	unsigned next_thread_idx;
 
 	struct message *msgs;
 	size_t num_messages;
@@ -95,121 +102,6 @@ struct parallel_chunk_compressor {
 	size_t next_chunk_idx;
 };
 
-static unsigned
-get_default_num_threads(void)
-{
-	long n;
-#ifdef __WIN32__
-	n = win32_get_number_of_processors();
-#else
-	n = sysconf(_SC_NPROCESSORS_ONLN);
-#endif
-	if (n < 1 || n >= UINT_MAX) {
-		WARNING("Failed to determine number of processors; assuming 1.");
-		return 1;
-	}
-	return n;
-}
-
-static u64
-get_avail_memory(void)
-{
-#ifdef __WIN32__
-	u64 phys_bytes = win32_get_avail_memory();
-	if (phys_bytes == 0)
-		goto default_size;
-	return phys_bytes;
-#elif defined(_SC_PAGESIZE) && defined(_SC_PHYS_PAGES)
-	long page_size = sysconf(_SC_PAGESIZE);
-	long num_pages = sysconf(_SC_PHYS_PAGES);
-	if (page_size <= 0 || num_pages <= 0)
-		goto default_size;
-	return ((u64)page_size * (u64)num_pages);
-#else
-	int mib[2] = {CTL_HW, HW_MEMSIZE};
-	u64 memsize;
-	size_t len = sizeof(memsize);
-	if (sysctl(mib, ARRAY_LEN(mib), &memsize, &len, NULL, 0) < 0 || len != 8)
-		goto default_size;
-	return memsize;
-#endif
-
-default_size:
-	WARNING("Failed to determine available memory; assuming 1 GiB");
-	return 1ULL << 30;
-}
-
-static int
-message_queue_init(struct message_queue *q)
-{
-	if (pthread_mutex_init(&q->lock, NULL)) {
-		ERROR_WITH_ERRNO("Failed to initialize mutex");
-		goto err;
-	}
-	if (pthread_cond_init(&q->msg_avail_cond, NULL)) {
-		ERROR_WITH_ERRNO("Failed to initialize condition variable");
-		goto err_destroy_lock;
-	}
-	if (pthread_cond_init(&q->space_avail_cond, NULL)) {
-		ERROR_WITH_ERRNO("Failed to initialize condition variable");
-		goto err_destroy_msg_avail_cond;
-	}
-	INIT_LIST_HEAD(&q->list);
-	return 0;
-
-err_destroy_msg_avail_cond:
-	pthread_cond_destroy(&q->msg_avail_cond);
-err_destroy_lock:
-	pthread_mutex_destroy(&q->lock);
-err:
-	return WIMLIB_ERR_NOMEM;
-}
-
-static void
-message_queue_destroy(struct message_queue *q)
-{
-	if (q->list.next != NULL) {
-		pthread_mutex_destroy(&q->lock);
-		pthread_cond_destroy(&q->msg_avail_cond);
-		pthread_cond_destroy(&q->space_avail_cond);
-	}
-}
-
-static void
-message_queue_put(struct message_queue *q, struct message *msg)
-{
-	pthread_mutex_lock(&q->lock);
-	list_add_tail(&msg->list, &q->list);
-	pthread_cond_signal(&q->msg_avail_cond);
-	pthread_mutex_unlock(&q->lock);
-}
-
-static struct message *
-message_queue_get(struct message_queue *q)
-{
-	struct message *msg;
-
-	pthread_mutex_lock(&q->lock);
-	while (list_empty(&q->list) && !q->terminating)
-		pthread_cond_wait(&q->msg_avail_cond, &q->lock);
-	if (!q->terminating) {
-		msg = list_entry(q->list.next, struct message, list);
-		list_del(&msg->list);
-	} else
-		msg = NULL;
-	pthread_mutex_unlock(&q->lock);
-	return msg;
-}
-
-static void
-message_queue_terminate(struct message_queue *q)
-{
-	pthread_mutex_lock(&q->lock);
-	q->terminating = true;
-	pthread_cond_broadcast(&q->msg_avail_cond);
-	pthread_mutex_unlock(&q->lock);
-}
-
 static int
 init_message(struct message *msg, size_t num_chunks, u32 out_chunk_size)
 {
@@ -260,6 +152,22 @@ allocate_messages(size_t count, size_t chunks_per_msg, u32 out_chunk_size)
 	return msgs;
 }
 
+/* Return the approximate number of bytes per millisecond that one thread
+ * compresses with the specified compression format at its default level.  */
+static u32
+approx_compress_speed(int ctype)
+{
+	switch (ctype) {
+	case WIMLIB_COMPRESSION_TYPE_XPRESS:
+		return 50000;
+	case WIMLIB_COMPRESSION_TYPE_LZX:
+	case WIMLIB_COMPRESSION_TYPE_LZMS:
+		return 5000;
+	default:
+		return 50000;
+	}
+}
+
 static void
 compress_chunks(struct message *msg, struct wimlib_compressor *compressor)
 {
@@ -280,10 +188,16 @@ compressor_thread_proc(void *arg)
 {
 	struct compressor_thread_data *params = arg;
 	struct message *msg;
+	u64 wait_nsec;
 
-	while ((msg = message_queue_get(params->chunks_to_compress_queue)) != NULL) {
+	while ((msg = spsc_queue_get(&params->chunks_to_compress_queue,
+				     &wait_nsec)) != NULL)
+	{
+		if (wait_nsec)
+			__atomic_add_fetch(&params->ctx->base.idle_nsec,
+					   wait_nsec, __ATOMIC_RELAXED);
 		compress_chunks(msg, params->compressor);
-		message_queue_put(params->compressed_chunks_queue, msg);
+		spsc_queue_put(&params->compressed_chunks_queue, msg);
 	}
 	return NULL;
 }
@@ -299,18 +213,20 @@ parallel_chunk_compressor_destroy(struct chunk_compressor *_ctx)
 
 	if (ctx->num_started_threads != 0) {
 		DEBUG("Terminating %u compressor threads", ctx->num_started_threads);
-		message_queue_terminate(&ctx->chunks_to_compress_queue);
+		for (i = 0; i < ctx->num_started_threads; i++)
+			spsc_queue_terminate(&ctx->thread_data[i].chunks_to_compress_queue);
 
 		for (i = 0; i < ctx->num_started_threads; i++)
 			pthread_join(ctx->thread_data[i].thread, NULL);
 	}
 
-	message_queue_destroy(&ctx->chunks_to_compress_queue);
-	message_queue_destroy(&ctx->compressed_chunks_queue);
-
-	if (ctx->thread_data != NULL)
-		for (i = 0; i < ctx->num_thread_data; i++)
+	if (ctx->thread_data != NULL) {
+		for (i = 0; i < ctx->num_thread_data; i++) {
+			spsc_queue_destroy(&ctx->thread_data[i].chunks_to_compress_queue);
+			spsc_queue_destroy(&ctx->thread_data[i].compressed_chunks_queue);
 			wimlib_free_compressor(ctx->thread_data[i].compressor);
+		}
+	}
 
 	FREE(ctx->thread_data);
 
@@ -323,10 +239,27 @@ static void
 submit_compression_msg(struct parallel_chunk_compressor *ctx)
 {
 	struct message *msg = ctx->next_submit_msg;
+	struct compressor_thread_data *thread = NULL;
+	unsigned i;
+
+	/* Give the message to the least busy thread, preferring threads in
+	 * round-robin order in case of a tie.  */
+	for (i = 0; i < ctx->num_started_threads; i++) {
+		struct compressor_thread_data *t;
 
-	msg->complete = false;
+		t = &ctx->thread_data[(ctx->next_thread_idx + i) %
+				      ctx->num_started_threads];
+		if (thread == NULL ||
+		    t->num_outstanding_msgs < thread->num_outstanding_msgs)
+			thread = t;
+	}
+	ctx->next_thread_idx = (thread - ctx->thread_data + 1) %
+				ctx->num_started_threads;
+
+	msg->thread = thread;
+	thread->num_outstanding_msgs++;
 	list_add_tail(&msg->submission_list, &ctx->submitted_msgs);
-	message_queue_put(&ctx->chunks_to_compress_queue, msg);
+	spsc_queue_put(&thread->chunks_to_compress_queue, msg);
 	ctx->next_submit_msg = NULL;
 }
 
@@ -374,13 +307,20 @@ parallel_chunk_compressor_get_chunk(struct chunk_compressor *_ctx,
 	if (ctx->next_ready_msg) {
 		msg = ctx->next_ready_msg;
 	} else {
+		struct message *done_msg;
+		u64 wait_nsec;
+
 		if (list_empty(&ctx->submitted_msgs))
 			return false;
 
-		while (!(msg = list_entry(ctx->submitted_msgs.next,
-					  struct message,
-					  submission_list))->complete)
-			message_queue_get(&ctx->compressed_chunks_queue)->complete = true;
+		msg = list_entry(ctx->submitted_msgs.next, struct message,
+				 submission_list);
+
+		done_msg = spsc_queue_get(&msg->thread->compressed_chunks_queue,
+					  &wait_nsec);
+		wimlib_assert(done_msg == msg);
+		ctx->base.wait_nsec += wait_nsec;
+		msg->thread->num_outstanding_msgs--;
 
 		ctx->next_ready_msg = msg;
 		ctx->next_chunk_idx = 0;
@@ -406,6 +346,7 @@ parallel_chunk_compressor_get_chunk(struct chunk_compressor *_ctx,
 int
 new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 			      unsigned num_threads, u64 max_memory,
+			      u64 max_num_chunks,
 			      struct chunk_compressor **compressor_ret)
 {
 	u64 approx_mem_required;
@@ -415,12 +356,23 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 	unsigned i;
 	int ret;
 	unsigned desired_num_threads;
+	unsigned total_num_threads;
+	unsigned threads_per_compressor;
 
 	wimlib_assert(out_chunk_size > 0);
 
 	if (num_threads == 0)
 		num_threads = get_default_num_threads();
 
+	/* If there will be fewer chunks than threads, as there can be with
+	 * solid resources and their large chunks, the extra compressor threads
+	 * would have nothing to do.  Instead, the threads are shared out among
+	 * the compressors, which may be able to use more than one thread on
+	 * each chunk.  */
+	total_num_threads = num_threads;
+	if (max_num_chunks != 0 && num_threads > max_num_chunks)
+		num_threads = max_num_chunks;
+
 	if (num_threads == 1) {
 		DEBUG("Only 1 thread; Not bothering with "
 		      "parallel chunk compressor.");
@@ -433,7 +385,10 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 	desired_num_threads = num_threads;
 
 	if (out_chunk_size < ((u32)1 << 23)) {
-		chunks_per_msg = MAX_CHUNKS_PER_MSG;
+		chunks_per_msg = (u64)approx_compress_speed(out_ctype) *
+				 TARGET_MSG_COMPRESS_USEC / 1000 / out_chunk_size;
+		chunks_per_msg = max(chunks_per_msg, 1);
+		chunks_per_msg = min(chunks_per_msg, MAX_CHUNKS_PER_MSG);
 		msgs_per_thread = 2;
 	} else {
 		/* Big chunks: Just have one buffer per thread --- more would
@@ -441,6 +396,10 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 		chunks_per_msg = 1;
 		msgs_per_thread = 1;
 	}
+	/* The budget covers the message buffers, the caller's buffer for the
+	 * chunk being filled, some slack for bookkeeping, and each thread's
+	 * compressor including its match-finder.  Give up buffering before
+	 * giving up threads.  */
 	for (;;) {
 		approx_mem_required =
 			(u64)chunks_per_msg *
@@ -477,6 +436,8 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 		return -2;
 	}
 
+	threads_per_compressor = total_num_threads / num_threads;
+
 	ret = WIMLIB_ERR_NOMEM;
 	ctx = CALLOC(1, sizeof(*ctx));
 	if (ctx == NULL)
@@ -488,32 +449,36 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 	ctx->base.submit_chunk = parallel_chunk_compressor_submit_chunk;
 	ctx->base.get_chunk = parallel_chunk_compressor_get_chunk;
 
-	ctx->num_thread_data = num_threads;
-
-	ret = message_queue_init(&ctx->chunks_to_compress_queue);
-	if (ret)
-		goto err;
-
-	ret = message_queue_init(&ctx->compressed_chunks_queue);
-	if (ret)
-		goto err;
-
 	ret = WIMLIB_ERR_NOMEM;
 	ctx->thread_data = CALLOC(num_threads, sizeof(ctx->thread_data[0]));
 	if (ctx->thread_data == NULL)
 		goto err;
 
+	ctx->num_thread_data = num_threads;
+
 	for (i = 0; i < num_threads; i++) {
 		struct compressor_thread_data *dat;
 
 		dat = &ctx->thread_data[i];
 
-		dat->chunks_to_compress_queue = &ctx->chunks_to_compress_queue;
-		dat->compressed_chunks_queue = &ctx->compressed_chunks_queue;
+		dat->ctx = ctx;
+
+		/* A thread may have every message outstanding at once.  */
+		ret = spsc_queue_init(&dat->chunks_to_compress_queue,
+				      num_threads * msgs_per_thread);
+		if (ret)
+			goto err;
+		ret = spsc_queue_init(&dat->compressed_chunks_queue,
+				      num_threads * msgs_per_thread);
+		if (ret)
+			goto err;
+
 		ret = wimlib_create_compressor(out_ctype, out_chunk_size, 0,
 					       &dat->compressor);
 		if (ret)
 			goto err;
+		set_compressor_num_threads(dat->compressor,
+					   threads_per_compressor);
 	}
 
 	for (ctx->num_started_threads = 0;
@@ -29,6 +29,7 @@
 #include "wimlib.h"
 #include "wimlib/assert.h"
 #include "wimlib/chunk_compressor.h"
+#include "wimlib/compressor_ops.h"
 #include "wimlib/util.h"
 
 #include <string.h>
@@ -100,8 +101,11 @@ serial_chunk_compressor_get_chunk(struct chunk_compressor *_ctx,
 	return true;
 }
 
+/* Chunks are compressed one at a time, but the compressor may use up to
+ * @num_threads threads (0 meaning the default) for each chunk, if it can.  */
 int
 new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			    unsigned num_threads,
 			    struct chunk_compressor **compressor_ret)
 {
 	struct serial_chunk_compressor *ctx;
@@ -125,6 +129,10 @@ new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size,
 	if (ret)
 		goto err;
 
+	if (num_threads == 0)
+		num_threads = get_default_num_threads();
+	set_compressor_num_threads(ctx->compressor, num_threads);
+
 	ctx->udata = MALLOC(out_chunk_size);
 	ctx->cdata = MALLOC(out_chunk_size - 1);
 	ctx->ulen = 0;
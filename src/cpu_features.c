@@ -0,0 +1,77 @@
+/*
+ * cpu_features.c
+ *
+ * Runtime detection of CPU features.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/cpu_features.h"
+
+#if X86_CPU_FEATURES_ENABLED
+
+#include <cpuid.h>
+
+u32 _x86_cpu_features;
+
+/* Read an extended control register.  The xgetbv instruction is emitted
+ * directly so that this works even with assemblers that don't know it.  */
+static u64
+read_xcr(u32 index)
+{
+	u32 edx, eax;
+
+	__asm__ (".byte 0x0f, 0x01, 0xd0" /* xgetbv */
+		 : "=d" (edx), "=a" (eax) : "c" (index));
+
+	return ((u64)edx << 32) | eax;
+}
+
+/* Detect the features of the processor we are running on and save them in
+ * _x86_cpu_features.  It doesn't matter if multiple threads do this at the
+ * same time, since they will all store the same value.  */
+void
+x86_setup_cpu_features(void)
+{
+	u32 max_leaf, eax, ebx, ecx, edx;
+	u32 features = X86_CPU_FEATURES_KNOWN;
+	bool os_saves_ymm = false;
+
+	max_leaf = __get_cpuid_max(0, NULL);
+	if (max_leaf < 1)
+		goto out;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+
+	if (ecx & (1 << 9))
+		features |= X86_CPU_FEATURE_SSSE3;
+	if (ecx & (1 << 19))
+		features |= X86_CPU_FEATURE_SSE4_1;
+
+	/* AVX registers are only usable if the operating system saves them on
+	 * context switches.  */
+	if (ecx & (1 << 27)) /* OSXSAVE */
+		os_saves_ymm = ((read_xcr(0) & 0x6) == 0x6);
+
+	if ((ecx & (1 << 28)) && os_saves_ymm)
+		features |= X86_CPU_FEATURE_AVX;
+
+	if (max_leaf < 7)
+		goto out;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	if ((ebx & (1 << 5)) && os_saves_ymm)
+		features |= X86_CPU_FEATURE_AVX2;
+	if (ebx & (1 << 29))
+		features |= X86_CPU_FEATURE_SHA;
+out:
+	_x86_cpu_features = features;
+}
+
+#endif /* X86_CPU_FEATURES_ENABLED */
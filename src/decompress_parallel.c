@@ -0,0 +1,447 @@
+/*
+ * decompress_parallel.c
+ *
+ * Decompress chunks of data (parallel version).
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+#include "wimlib.h"
+#include "wimlib/assert.h"
+#include "wimlib/chunk_decompressor.h"
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/message_queue.h"
+#include "wimlib/util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct decompressor_thread_data {
+	pthread_t thread;
+	struct message_queue *chunks_to_decompress_queue;
+	struct message_queue *decompressed_chunks_queue;
+	struct wimlib_decompressor *decompressor;
+};
+
+#define MAX_CHUNKS_PER_MSG 4
+
+struct message {
+	u8 *compressed_chunks[MAX_CHUNKS_PER_MSG];
+	u8 *uncompressed_chunks[MAX_CHUNKS_PER_MSG];
+	u32 compressed_chunk_sizes[MAX_CHUNKS_PER_MSG];
+	u32 uncompressed_chunk_sizes[MAX_CHUNKS_PER_MSG];
+
+	/* Set by the decompressor thread: pointer to the uncompressed data of
+	 * each chunk, or NULL if the chunk was invalid.  */
+	const u8 *result_chunks[MAX_CHUNKS_PER_MSG];
+
+	size_t num_filled_chunks;
+	size_t num_alloc_chunks;
+	struct list_head list;
+	bool complete;
+	struct list_head submission_list;
+};
+
+struct parallel_chunk_decompressor {
+	struct chunk_decompressor base;
+
+	struct message_queue chunks_to_decompress_queue;
+	struct message_queue decompressed_chunks_queue;
+	struct decompressor_thread_data *thread_data;
+	unsigned num_thread_data;
+	unsigned num_started_threads;
+
+	struct message *msgs;
+	size_t num_messages;
+
+	struct list_head available_msgs;
+	struct list_head submitted_msgs;
+	struct message *next_submit_msg;
+	struct message *next_ready_msg;
+	size_t next_chunk_idx;
+};
+
+static int
+init_message(struct message *msg, size_t num_chunks, u32 in_chunk_size)
+{
+	msg->num_alloc_chunks = num_chunks;
+	for (size_t i = 0; i < num_chunks; i++) {
+		/* The compressed buffer must be able to hold a full chunk, since
+		 * chunks that did not compress are stored uncompressed.  */
+		msg->compressed_chunks[i] = MALLOC(in_chunk_size);
+		msg->uncompressed_chunks[i] = MALLOC(in_chunk_size);
+		if (msg->compressed_chunks[i] == NULL ||
+		    msg->uncompressed_chunks[i] == NULL)
+			return WIMLIB_ERR_NOMEM;
+	}
+	return 0;
+}
+
+static void
+destroy_message(struct message *msg)
+{
+	for (size_t i = 0; i < msg->num_alloc_chunks; i++) {
+		FREE(msg->compressed_chunks[i]);
+		FREE(msg->uncompressed_chunks[i]);
+	}
+}
+
+static void
+free_messages(struct message *msgs, size_t num_messages)
+{
+	if (msgs) {
+		for (size_t i = 0; i < num_messages; i++)
+			destroy_message(&msgs[i]);
+		FREE(msgs);
+	}
+}
+
+static struct message *
+allocate_messages(size_t count, size_t chunks_per_msg, u32 in_chunk_size)
+{
+	struct message *msgs;
+
+	msgs = CALLOC(count, sizeof(struct message));
+	if (msgs == NULL)
+		return NULL;
+	for (size_t i = 0; i < count; i++) {
+		if (init_message(&msgs[i], chunks_per_msg, in_chunk_size)) {
+			free_messages(msgs, count);
+			return NULL;
+		}
+	}
+	return msgs;
+}
+
+static void
+decompress_chunks(struct message *msg, struct wimlib_decompressor *decompressor)
+{
+	for (size_t i = 0; i < msg->num_filled_chunks; i++) {
+		u32 csize = msg->compressed_chunk_sizes[i];
+		u32 usize = msg->uncompressed_chunk_sizes[i];
+
+		if (csize == usize) {
+			msg->result_chunks[i] = msg->compressed_chunks[i];
+		} else if (wimlib_decompress(msg->compressed_chunks[i], csize,
+					     msg->uncompressed_chunks[i], usize,
+					     decompressor))
+		{
+			msg->result_chunks[i] = NULL;
+		} else {
+			msg->result_chunks[i] = msg->uncompressed_chunks[i];
+		}
+	}
+}
+
+static void *
+decompressor_thread_proc(void *arg)
+{
+	struct decompressor_thread_data *params = arg;
+	struct list_head *node;
+	struct message *msg;
+
+	while ((node = message_queue_get(params->chunks_to_decompress_queue)) != NULL) {
+		msg = list_entry(node, struct message, list);
+		decompress_chunks(msg, params->decompressor);
+		message_queue_put(params->decompressed_chunks_queue, &msg->list);
+	}
+	return NULL;
+}
+
+static void
+parallel_chunk_decompressor_destroy(struct chunk_decompressor *_ctx)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	unsigned i;
+
+	if (ctx == NULL)
+		return;
+
+	if (ctx->num_started_threads != 0) {
+		DEBUG("Terminating %u decompressor threads", ctx->num_started_threads);
+		message_queue_terminate(&ctx->chunks_to_decompress_queue);
+
+		for (i = 0; i < ctx->num_started_threads; i++)
+			pthread_join(ctx->thread_data[i].thread, NULL);
+	}
+
+	message_queue_destroy(&ctx->chunks_to_decompress_queue);
+	message_queue_destroy(&ctx->decompressed_chunks_queue);
+
+	if (ctx->thread_data != NULL)
+		for (i = 0; i < ctx->num_thread_data; i++)
+			wimlib_free_decompressor(ctx->thread_data[i].decompressor);
+
+	FREE(ctx->thread_data);
+
+	free_messages(ctx->msgs, ctx->num_messages);
+
+	FREE(ctx);
+}
+
+static void
+submit_decompression_msg(struct parallel_chunk_decompressor *ctx)
+{
+	struct message *msg = ctx->next_submit_msg;
+
+	msg->complete = false;
+	list_add_tail(&msg->submission_list, &ctx->submitted_msgs);
+	message_queue_put(&ctx->chunks_to_decompress_queue, &msg->list);
+	ctx->next_submit_msg = NULL;
+}
+
+static bool
+parallel_chunk_decompressor_submit_chunk(struct chunk_decompressor *_ctx,
+					 const void *cdata, u32 csize, u32 usize)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	struct message *msg;
+
+	wimlib_assert(usize > 0);
+	wimlib_assert(usize <= ctx->base.in_chunk_size);
+	wimlib_assert(csize > 0);
+	wimlib_assert(csize <= usize);
+
+	if (ctx->next_submit_msg) {
+		msg = ctx->next_submit_msg;
+	} else {
+		if (list_empty(&ctx->available_msgs))
+			return false;
+
+		msg = list_entry(ctx->available_msgs.next, struct message, list);
+		list_del(&msg->list);
+		ctx->next_submit_msg = msg;
+		msg->num_filled_chunks = 0;
+	}
+
+	memcpy(msg->compressed_chunks[msg->num_filled_chunks], cdata, csize);
+	msg->compressed_chunk_sizes[msg->num_filled_chunks] = csize;
+	msg->uncompressed_chunk_sizes[msg->num_filled_chunks] = usize;
+	if (++msg->num_filled_chunks == msg->num_alloc_chunks)
+		submit_decompression_msg(ctx);
+	return true;
+}
+
+static bool
+parallel_chunk_decompressor_get_chunk(struct chunk_decompressor *_ctx,
+				      const void **udata_ret, u32 *usize_ret)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	struct message *msg;
+
+	if (ctx->next_submit_msg)
+		submit_decompression_msg(ctx);
+
+	if (ctx->next_ready_msg) {
+		msg = ctx->next_ready_msg;
+	} else {
+		if (list_empty(&ctx->submitted_msgs))
+			return false;
+
+		while (!(msg = list_entry(ctx->submitted_msgs.next,
+					  struct message,
+					  submission_list))->complete)
+			list_entry(message_queue_get(&ctx->decompressed_chunks_queue),
+				   struct message, list)->complete = true;
+
+		ctx->next_ready_msg = msg;
+		ctx->next_chunk_idx = 0;
+	}
+
+	*udata_ret = msg->result_chunks[ctx->next_chunk_idx];
+	*usize_ret = msg->uncompressed_chunk_sizes[ctx->next_chunk_idx];
+
+	if (++ctx->next_chunk_idx == msg->num_filled_chunks) {
+		list_del(&msg->submission_list);
+		list_add_tail(&msg->list, &ctx->available_msgs);
+		ctx->next_ready_msg = NULL;
+	}
+	return true;
+}
+
+int
+new_parallel_chunk_decompressor(int in_ctype, u32 in_chunk_size,
+				unsigned num_threads, u64 max_memory,
+				struct chunk_decompressor **decompressor_ret)
+{
+	u64 approx_mem_required;
+	size_t chunks_per_msg;
+	size_t msgs_per_thread;
+	struct parallel_chunk_decompressor *ctx;
+	unsigned i;
+	int ret;
+	unsigned desired_num_threads;
+
+	wimlib_assert(in_chunk_size > 0);
+
+	if (num_threads == 0)
+		num_threads = get_default_num_threads();
+
+	if (num_threads == 1) {
+		DEBUG("Only 1 thread; Not bothering with "
+		      "parallel chunk decompressor.");
+		return -1;
+	}
+
+	if (max_memory == 0)
+		max_memory = get_avail_memory();
+
+	desired_num_threads = num_threads;
+
+	if (in_chunk_size < ((u32)1 << 23)) {
+		/* Decompression is much faster than compression, so batch more
+		 * chunks per message to keep the queue overhead low.  */
+		chunks_per_msg = MAX_CHUNKS_PER_MSG;
+		msgs_per_thread = 2;
+	} else {
+		/* Big chunks: Just have one buffer per thread --- more would
+		 * just waste memory.  */
+		chunks_per_msg = 1;
+		msgs_per_thread = 1;
+	}
+	for (;;) {
+		/* Each chunk buffered needs space for both its compressed and
+		 * uncompressed data, and each thread needs a decompressor whose
+		 * memory usage is bounded above by about one chunk.  */
+		approx_mem_required =
+			(u64)chunks_per_msg *
+			(u64)msgs_per_thread *
+			(u64)num_threads *
+			(u64)in_chunk_size * 2
+			+ 1000000
+			+ (u64)num_threads * in_chunk_size;
+		if (approx_mem_required <= max_memory)
+			break;
+
+		if (chunks_per_msg > 1)
+			chunks_per_msg--;
+		else if (msgs_per_thread > 1)
+			msgs_per_thread--;
+		else if (num_threads > 1)
+			num_threads--;
+		else
+			break;
+	}
+
+	if (num_threads < desired_num_threads) {
+		WARNING("Wanted to use %u decompressor threads, but limiting "
+			"to %u to fit in available memory!",
+			desired_num_threads, num_threads);
+	}
+
+	if (num_threads == 1) {
+		DEBUG("Only 1 thread; Not bothering with "
+		      "parallel chunk decompressor.");
+		return -2;
+	}
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx = CALLOC(1, sizeof(*ctx));
+	if (ctx == NULL)
+		goto err;
+
+	ctx->base.in_ctype = in_ctype;
+	ctx->base.in_chunk_size = in_chunk_size;
+	ctx->base.destroy = parallel_chunk_decompressor_destroy;
+	ctx->base.submit_chunk = parallel_chunk_decompressor_submit_chunk;
+	ctx->base.get_chunk = parallel_chunk_decompressor_get_chunk;
+
+	ctx->num_thread_data = num_threads;
+
+	ret = message_queue_init(&ctx->chunks_to_decompress_queue);
+	if (ret)
+		goto err;
+
+	ret = message_queue_init(&ctx->decompressed_chunks_queue);
+	if (ret)
+		goto err;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx->thread_data = CALLOC(num_threads, sizeof(ctx->thread_data[0]));
+	if (ctx->thread_data == NULL)
+		goto err;
+
+	for (i = 0; i < num_threads; i++) {
+		struct decompressor_thread_data *dat;
+
+		dat = &ctx->thread_data[i];
+
+		dat->chunks_to_decompress_queue = &ctx->chunks_to_decompress_queue;
+		dat->decompressed_chunks_queue = &ctx->decompressed_chunks_queue;
+		ret = wimlib_create_decompressor(in_ctype, in_chunk_size,
+						 &dat->decompressor);
+		if (ret)
+			goto err;
+	}
+
+	for (ctx->num_started_threads = 0;
+	     ctx->num_started_threads < num_threads;
+	     ctx->num_started_threads++)
+	{
+		DEBUG("pthread_create thread %u of %u",
+		      ctx->num_started_threads + 1, num_threads);
+		ret = pthread_create(&ctx->thread_data[ctx->num_started_threads].thread,
+				     NULL,
+				     decompressor_thread_proc,
+				     &ctx->thread_data[ctx->num_started_threads]);
+		if (ret) {
+			errno = ret;
+			WARNING_WITH_ERRNO("Failed to create decompressor thread %u of %u",
+					   ctx->num_started_threads + 1,
+					   num_threads);
+			ret = WIMLIB_ERR_NOMEM;
+			if (ctx->num_started_threads >= 2)
+				break;
+			goto err;
+		}
+	}
+
+	ctx->base.num_threads = ctx->num_started_threads;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx->num_messages = ctx->num_started_threads * msgs_per_thread;
+	ctx->msgs = allocate_messages(ctx->num_messages,
+				      chunks_per_msg, in_chunk_size);
+	if (ctx->msgs == NULL)
+		goto err;
+
+	INIT_LIST_HEAD(&ctx->available_msgs);
+	for (size_t i = 0; i < ctx->num_messages; i++)
+		list_add_tail(&ctx->msgs[i].list, &ctx->available_msgs);
+
+	INIT_LIST_HEAD(&ctx->submitted_msgs);
+
+	*decompressor_ret = &ctx->base;
+	return 0;
+
+err:
+	parallel_chunk_decompressor_destroy(&ctx->base);
+	return ret;
+}
+
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
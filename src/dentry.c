@@ -59,6 +59,7 @@
 #  include "config.h"
 #endif
 
+#include "wimlib/arena.h"
 #include "wimlib/assert.h"
 #include "wimlib/dentry.h"
 #include "wimlib/inode.h"
@@ -745,6 +746,7 @@ get_dentry_utf16le(WIMStruct *wim, const utf16lechar *path,
 {
 	struct wim_dentry *cur_dentry;
 	const utf16lechar *name_start, *name_end;
+	int ret;
 
 	/* Start with the root directory of the image.  Note: this will be NULL
 	 * if an image has been added directly with wimlib_add_empty_image() but
@@ -774,6 +776,15 @@ get_dentry_utf16le(WIMStruct *wim, const utf16lechar *path,
 			++name_end;
 		} while (*name_end != cpu_to_le16(WIM_PATH_SEPARATOR) && *name_end);
 
+		/* The image may be loaded on demand; in that case, a
+		 * failure to read the directory is reported as ENOMEM or EIO.
+		 */
+		ret = load_dentry_children(wim, cur_dentry);
+		if (unlikely(ret)) {
+			errno = (ret == WIMLIB_ERR_NOMEM) ? ENOMEM : EIO;
+			return NULL;
+		}
+
 		cur_dentry = get_dentry_child_with_utf16le_name(cur_dentry,
 								name_start,
 								(u8*)name_end - (u8*)name_start,
@@ -892,26 +903,28 @@ get_parent_dentry(WIMStruct *wim, const tchar *path,
  * @name specifies the long name to give the new dentry.  If NULL or empty, the
  * new dentry will be given no long name.
  *
- * The new dentry will have no short name and no associated inode.
+ * The new dentry will have no short name and no associated inode.  It is
+ * allocated from @arena, or on its own if @arena is NULL.
  *
  * On success, returns 0 and a pointer to the new, allocated dentry is stored in
  * *dentry_ret.  On failure, returns WIMLIB_ERR_NOMEM or an error code resulting
  * from a failed string conversion.
  */
-int
-new_dentry(const tchar *name, struct wim_dentry **dentry_ret)
+static int
+_new_dentry(const tchar *name, struct wim_dentry **dentry_ret,
+	    struct arena *arena)
 {
 	struct wim_dentry *dentry;
 	int ret;
 
-	dentry = CALLOC(1, sizeof(struct wim_dentry));
+	dentry = arena_calloc(arena, sizeof(struct wim_dentry));
 	if (!dentry)
 		return WIMLIB_ERR_NOMEM;
 
 	if (name && *name) {
 		ret = dentry_set_name(dentry, name);
 		if (ret) {
-			FREE(dentry);
+			arena_free(dentry);
 			return ret;
 		}
 	}
@@ -920,19 +933,25 @@ new_dentry(const tchar *name, struct wim_dentry **dentry_ret)
 	return 0;
 }
 
+int
+new_dentry(const tchar *name, struct wim_dentry **dentry_ret)
+{
+	return _new_dentry(name, dentry_ret, NULL);
+}
+
 static int
 _new_dentry_with_inode(const tchar *name, struct wim_dentry **dentry_ret,
-		       bool timeless)
+		       bool timeless, struct arena *arena)
 {
 	struct wim_dentry *dentry;
 	int ret;
 
-	ret = new_dentry(name, &dentry);
+	ret = _new_dentry(name, &dentry, arena);
 	if (ret)
 		return ret;
 
 	if (timeless)
-		dentry->d_inode = new_timeless_inode();
+		dentry->d_inode = new_timeless_inode(arena);
 	else
 		dentry->d_inode = new_inode();
 	if (dentry->d_inode == NULL) {
@@ -950,7 +969,7 @@ _new_dentry_with_inode(const tchar *name, struct wim_dentry **dentry_ret,
 int
 new_dentry_with_inode(const tchar *name, struct wim_dentry **dentry_ret)
 {
-	return _new_dentry_with_inode(name, dentry_ret, false);
+	return _new_dentry_with_inode(name, dentry_ret, false, NULL);
 }
 
 /* Like new_dentry_with_inode(), but don't bother setting the timestamps for the
@@ -959,7 +978,7 @@ new_dentry_with_inode(const tchar *name, struct wim_dentry **dentry_ret)
 int
 new_dentry_with_timeless_inode(const tchar *name, struct wim_dentry **dentry_ret)
 {
-	return _new_dentry_with_inode(name, dentry_ret, true);
+	return _new_dentry_with_inode(name, dentry_ret, true, NULL);
 }
 
 /* Create an unnamed dentry with a new inode for a directory with the default
@@ -1010,7 +1029,7 @@ free_dentry(struct wim_dentry *dentry)
 		FREE(dentry->_full_path);
 		if (dentry->d_inode)
 			put_inode(dentry->d_inode);
-		FREE(dentry);
+		arena_free(dentry);
 	}
 }
 
@@ -1210,10 +1229,11 @@ read_extra_data(const u8 *p, const u8 *end, struct wim_inode *inode)
 }
 
 /* Read a dentry, including all alternate data stream entries that follow it,
- * from an uncompressed metadata resource buffer.  */
+ * from an uncompressed metadata resource buffer.  The dentry and its inode are
+ * allocated from @arena.  */
 static int
-read_dentry(const u8 * restrict buf, size_t buf_len,
-	    u64 *offset_p, struct wim_dentry **dentry_ret)
+read_dentry(const u8 * restrict buf, size_t buf_len, u64 *offset_p,
+	    struct arena *arena, struct wim_dentry **dentry_ret)
 {
 	u64 offset = *offset_p;
 	u64 length;
@@ -1273,7 +1293,7 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 	}
 
 	/* Allocate new dentry structure, along with a preliminary inode.  */
-	ret = new_dentry_with_timeless_inode(NULL, &dentry);
+	ret = _new_dentry_with_inode(NULL, &dentry, true, arena);
 	if (ret)
 		return ret;
 
@@ -1425,9 +1445,22 @@ dentry_is_dot_or_dotdot(const struct wim_dentry *dentry)
 	return false;
 }
 
-static int
-read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
-			   struct wim_dentry * restrict dir)
+/*
+ * Read the children of the directory @dir from a WIM metadata resource and link
+ * them into @dir.  The children that are themselves directories with children
+ * are marked with 'children_not_loaded'; their own children are not read.
+ *
+ * @buf and @buf_len specify the uncompressed metadata resource.  The new
+ * dentries and inodes are allocated from @arena, which may be NULL.
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS (0)
+ *	WIMLIB_ERR_INVALID_METADATA_RESOURCE
+ *	WIMLIB_ERR_NOMEM
+ */
+int
+read_dentry_children(const u8 *buf, size_t buf_len, struct wim_dentry *dir,
+		     struct arena *arena)
 {
 	u64 cur_offset = dir->subdir_offset;
 
@@ -1444,13 +1477,15 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
 		}
 	}
 
+	dir->children_not_loaded = 0;
+
 	for (;;) {
 		struct wim_dentry *child;
 		struct wim_dentry *duplicate;
 		int ret;
 
 		/* Read next child of @dir.  */
-		ret = read_dentry(buf, buf_len, &cur_offset, &child);
+		ret = read_dentry(buf, buf_len, &cur_offset, arena, &child);
 		if (ret)
 			return ret;
 
@@ -1488,15 +1523,11 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
 			continue;
 		}
 
-		/* If this child is a directory that itself has children, call
-		 * this procedure recursively.  */
+		/* If this child is a directory that itself has children, its
+		 * children must be read later.  */
 		if (child->subdir_offset != 0) {
 			if (likely(dentry_is_directory(child))) {
-				ret = read_dentry_tree_recursive(buf,
-								 buf_len,
-								 child);
-				if (ret)
-					return ret;
+				child->children_not_loaded = 1;
 			} else {
 				WARNING("Ignoring children of "
 					"non-directory file \"%"TS"\"",
@@ -1506,6 +1537,29 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
 	}
 }
 
+static int
+read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
+			   struct wim_dentry * restrict dir,
+			   struct arena *arena)
+{
+	struct wim_dentry *child;
+	int ret;
+
+	ret = read_dentry_children(buf, buf_len, dir, arena);
+	if (ret)
+		return ret;
+
+	for_dentry_child(child, dir) {
+		if (child->children_not_loaded) {
+			ret = read_dentry_tree_recursive(buf, buf_len, child,
+							 arena);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
 /*
  * Read a tree of dentries from a WIM metadata resource.
  *
@@ -1518,6 +1572,15 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
  * @root_offset
  *	Offset in the metadata resource of the root of the dentry tree.
  *
+ * @lazy:
+ *	If true, only read the root dentry, and mark it with
+ *	'children_not_loaded' if it has children.  The rest of the tree can be
+ *	read later with read_dentry_children(), as long as @buf is kept.
+ *
+ * @arena:
+ *	Arena from which to allocate the dentries and inodes, or NULL to
+ *	allocate each one on its own.
+ *
  * @root_ret:
  *	On success, either NULL or a pointer to the root dentry is written to
  *	this location.  The former case only occurs in the unexpected case that
@@ -1529,15 +1592,15 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
  *	WIMLIB_ERR_NOMEM
  */
 int
-read_dentry_tree(const u8 *buf, size_t buf_len,
-		 u64 root_offset, struct wim_dentry **root_ret)
+read_dentry_tree(const u8 *buf, size_t buf_len, u64 root_offset, bool lazy,
+		 struct arena *arena, struct wim_dentry **root_ret)
 {
 	int ret;
 	struct wim_dentry *root;
 
 	DEBUG("Reading dentry tree (root_offset=%"PRIu64")", root_offset);
 
-	ret = read_dentry(buf, buf_len, &root_offset, &root);
+	ret = read_dentry(buf, buf_len, &root_offset, arena, &root);
 	if (ret)
 		return ret;
 
@@ -1557,9 +1620,14 @@ read_dentry_tree(const u8 *buf, size_t buf_len,
 		}
 
 		if (likely(root->subdir_offset != 0)) {
-			ret = read_dentry_tree_recursive(buf, buf_len, root);
-			if (ret)
-				goto err_free_dentry_tree;
+			if (lazy) {
+				root->children_not_loaded = 1;
+			} else {
+				ret = read_dentry_tree_recursive(buf, buf_len,
+								 root, arena);
+				if (ret)
+					goto err_free_dentry_tree;
+			}
 		}
 	} else {
 		WARNING("The metadata resource has no directory entries; "
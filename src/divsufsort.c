@@ -32,6 +32,10 @@
 #include "wimlib/lz_mf.h"
 #include "wimlib/util.h"
 
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+#  include <pthread.h>
+#endif
+
 /*- Constants -*/
 #define ALPHABET_SIZE 256
 #define BUCKET_A_SIZE (ALPHABET_SIZE)
@@ -1390,12 +1394,116 @@ trsort(int *ISA, int *SA, int n, int depth) {
 
 /*---------------------------------------------------------------------------*/
 
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+/* XXX Modified from original: the original sorts the type B* substrings on
+ * multiple threads using OpenMP.  Do the same using pthreads.  Each thread
+ * repeatedly takes the next bucket that needs sorting and sorts it with its own
+ * part of the free space in the suffix array as buffer.  */
+
+#define SSSORT_MIN_THREAD_BUFSIZE (SS_BLOCKSIZE * 16)
+
+struct sssort_shared {
+  const unsigned char *T;
+  const int *PAb;
+  int *SA;
+  int *bucket_B;
+  int n, m;
+
+  /* The next bucket to sort: the buckets before index j of SA, starting
+     with the bucket of (c0, c1), remain to be sorted. */
+  pthread_mutex_t lock;
+  int c0, c1, j;
+};
+
+struct sssort_thread {
+  struct sssort_shared *shared;
+  int *buf;
+  int bufsize;
+  pthread_t thread;
+};
+
+static
+void *
+sssort_thread_proc(void *arg) {
+  struct sssort_thread *thr = arg;
+  struct sssort_shared *sh = thr->shared;
+  int *bucket_B = sh->bucket_B;
+  int k, l, d0, d1;
+
+  k = 0;
+  for(;;) {
+    pthread_mutex_lock(&sh->lock);
+    if(0 < (l = sh->j)) {
+      d0 = sh->c0, d1 = sh->c1;
+      do {
+        k = BUCKET_BSTAR(d0, d1);
+        if(--d1 <= d0) {
+          d1 = ALPHABET_SIZE - 1;
+          if(--d0 < 0) { break; }
+        }
+      } while(((l - k) <= 1) && (0 < (l = k)));
+      sh->c0 = d0, sh->c1 = d1, sh->j = k;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    if(l == 0) { break; }
+    sssort(sh->T, sh->PAb, sh->SA + k, sh->SA + l,
+           thr->buf, thr->bufsize, 2, sh->n, *(sh->SA + k) == (sh->m - 1));
+  }
+  return NULL;
+}
+
+/* Sorts the type B* substrings on up to num_threads threads, including the
+   calling thread.  Returns 0 if no other thread could be started, in which
+   case nothing has been done. */
+static
+int
+sssort_parallel(const unsigned char *T, const int *PAb, int *SA,
+                int *bucket_B, int n, int m, unsigned num_threads) {
+  struct sssort_shared sh;
+  struct sssort_thread *thr;
+  int *buf, bufsize;
+  unsigned i, num_started;
+
+  buf = SA + m, bufsize = (n - (2 * m)) / num_threads;
+
+  sh.T = T, sh.PAb = PAb, sh.SA = SA, sh.bucket_B = bucket_B;
+  sh.n = n, sh.m = m;
+  sh.c0 = ALPHABET_SIZE - 2, sh.c1 = ALPHABET_SIZE - 1, sh.j = m;
+
+  thr = MALLOC(num_threads * sizeof(thr[0]));
+  if(thr == NULL) { return 0; }
+  if(pthread_mutex_init(&sh.lock, NULL)) {
+    FREE(thr);
+    return 0;
+  }
+
+  for(i = 0; i < num_threads; ++i) {
+    thr[i].shared = &sh;
+    thr[i].buf = buf + i * bufsize;
+    thr[i].bufsize = bufsize;
+  }
+  for(num_started = 1; num_started < num_threads; ++num_started) {
+    if(pthread_create(&thr[num_started].thread, NULL,
+                      sssort_thread_proc, &thr[num_started])) { break; }
+  }
+  if(num_started != 1) {
+    sssort_thread_proc(&thr[0]);
+    for(i = 1; i < num_started; ++i) { pthread_join(thr[i].thread, NULL); }
+  }
+  pthread_mutex_destroy(&sh.lock);
+  FREE(thr);
+  return num_started != 1;
+}
+
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
+
 /* Sorts suffixes of type B*. */
 static
 int
 sort_typeBstar(const unsigned char *T, int *SA,
                int *bucket_A, int *bucket_B,
-               int n) {
+               int n, unsigned num_threads) {
   int *PAb, *ISAb, *buf;
   int i, j, k, t, m, bufsize;
   int c0, c1;
@@ -1450,13 +1558,22 @@ note:
     SA[--BUCKET_BSTAR(c0, c1)] = m - 1;
 
     /* Sort the type B* substrings using sssort. */
-    buf = SA + m, bufsize = n - (2 * m);
-    for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
-      for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
-        i = BUCKET_BSTAR(c0, c1);
-        if(1 < (j - i)) {
-          sssort(T, PAb, SA + i, SA + j,
-                 buf, bufsize, 2, n, *(SA + i) == (m - 1));
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+    /* Don't use so many threads that their buffers get too small. */
+    num_threads = MIN(num_threads,
+                      (n - (2 * m)) / SSSORT_MIN_THREAD_BUFSIZE);
+    if((num_threads <= 1) ||
+       !sssort_parallel(T, PAb, SA, bucket_B, n, m, num_threads))
+#endif
+    {
+      buf = SA + m, bufsize = n - (2 * m);
+      for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
+        for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
+          i = BUCKET_BSTAR(c0, c1);
+          if(1 < (j - i)) {
+            sssort(T, PAb, SA + i, SA + j,
+                   buf, bufsize, 2, n, *(SA + i) == (m - 1));
+          }
         }
       }
     }
@@ -1576,9 +1693,11 @@ construct_SA(const unsigned char *T, int *SA,
 /*- Function -*/
 
 /* XXX Modified from original: use provided temporary space instead of
- * allocating it.  */
+ * allocating it, and take the maximum number of threads to use as a parameter.
+ * Threads are only used if built with multithreaded compression support.  */
 void
-divsufsort(const u8 *T, u32 *SA, u32 n, u32 *bucket_A, u32 *bucket_B)
+divsufsort(const u8 *T, u32 *SA, u32 n, u32 *bucket_A, u32 *bucket_B,
+	   unsigned num_threads)
 {
   u32 m;
 
@@ -1597,7 +1716,7 @@ divsufsort(const u8 *T, u32 *SA, u32 n, u32 *bucket_A, u32 *bucket_B)
       break;
 
     default:
-      m = sort_typeBstar(T, SA, bucket_A, bucket_B, n);
+      m = sort_typeBstar(T, SA, bucket_A, bucket_B, n, num_threads);
       construct_SA(T, SA, bucket_A, bucket_B, n, m);
       break;
   }
@@ -31,10 +31,86 @@
 #include "wimlib/inode.h"
 #include "wimlib/lookup_table.h"
 #include "wimlib/metadata.h"
+#include "wimlib/piece_list.h"
 #include "wimlib/xml.h"
 #include <stdlib.h>
 
+/* Add @nref references to the stream with SHA1 message digest @hash, which is
+ * being copied from a WIM whose lookup table is @src_lookup_table, to
+ * @dest_lookup_table, copying (or if @gift, moving) the entry for the stream if
+ * it is not already there.  The references are also counted in 'out_refcnt',
+ * so that lte_unexport() can undo them.  @inode is the inode referencing the
+ * stream, or NULL if the stream is a piece of another stream.  */
 static int
+export_stream(const u8 *hash, const struct wim_inode *inode,
+	      struct wim_lookup_table *src_lookup_table,
+	      struct wim_lookup_table *dest_lookup_table,
+	      bool gift, u32 nref)
+{
+	struct wim_lookup_table_entry *src_lte, *dest_lte;
+	struct piece_list *pl;
+	int ret;
+
+	/* Search for the stream (via SHA1 message digest) in the destination
+	 * WIM.  */
+	dest_lte = lookup_stream(dest_lookup_table, hash);
+	if (dest_lte) {
+		/* Stream is present in destination WIM (either pre-existing or
+		 * already exported).  Increment its reference count
+		 * appropriately.   Note: we use 'refcnt' for the raw reference
+		 * count, but 'out_refcnt' for references arising just from the
+		 * export operation; this is used to roll back a failed export
+		 * if needed.  */
+		dest_lte->refcnt += nref;
+		dest_lte->out_refcnt += nref;
+		return 0;
+	}
+
+	/* Stream not yet present in destination WIM.  Search for it in the
+	 * source WIM, then export it into the destination WIM.  */
+	src_lte = lookup_stream(src_lookup_table, hash);
+	if (!src_lte) {
+		if (inode)
+			return stream_not_found_error(inode, hash);
+		ERROR("A piece of a stream split into pieces is missing");
+		return WIMLIB_ERR_RESOURCE_NOT_FOUND;
+	}
+
+	if (gift) {
+		dest_lte = src_lte;
+		lookup_table_unlink(src_lookup_table, src_lte);
+	} else {
+		dest_lte = clone_lookup_table_entry(src_lte);
+		if (!dest_lte)
+			return WIMLIB_ERR_NOMEM;
+	}
+	dest_lte->refcnt = nref;
+	dest_lte->out_refcnt = nref;
+	lookup_table_insert(dest_lookup_table, dest_lte);
+
+	/* A stream split into pieces references its pieces, so export them as
+	 * well.  */
+	if (dest_lte->resource_location == RESOURCE_IN_PIECES &&
+	    dest_lte->piece_list->table == src_lookup_table)
+	{
+		pl = dest_lte->piece_list;
+		pl->table = dest_lookup_table;
+		for (u32 i = 0; i < pl->num_pieces; i++) {
+			ret = export_stream(pl->hashes[i], NULL,
+					    src_lookup_table, dest_lookup_table,
+					    gift, 1);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/* Add references to the streams of @inode, which is being copied from a WIM
+ * whose lookup table is @src_lookup_table, to @dest_lookup_table, copying (or
+ * if @gift, moving) the entries for streams not already there.  The references
+ * are also counted in 'out_refcnt', so that lte_unexport() can undo them.  */
+int
 inode_export_streams(struct wim_inode *inode,
 		     struct wim_lookup_table *src_lookup_table,
 		     struct wim_lookup_table *dest_lookup_table,
@@ -42,7 +118,7 @@ inode_export_streams(struct wim_inode *inode,
 {
 	unsigned i;
 	const u8 *hash;
-	struct wim_lookup_table_entry *src_lte, *dest_lte;
+	int ret;
 
 	inode_unresolve_streams(inode);
 	for (i = 0; i <= inode->i_num_ads; i++) {
@@ -52,43 +128,16 @@ inode_export_streams(struct wim_inode *inode,
 		if (is_zero_hash(hash))  /* Empty stream?  */
 			continue;
 
-		/* Search for the stream (via SHA1 message digest) in the
-		 * destination WIM.  */
-		dest_lte = lookup_stream(dest_lookup_table, hash);
-		if (!dest_lte) {
-			/* Stream not yet present in destination WIM.  Search
-			 * for it in the source WIM, then export it into the
-			 * destination WIM.  */
-			src_lte = lookup_stream(src_lookup_table, hash);
-			if (!src_lte)
-				return stream_not_found_error(inode, hash);
-
-			if (gift) {
-				dest_lte = src_lte;
-				lookup_table_unlink(src_lookup_table, src_lte);
-			} else {
-				dest_lte = clone_lookup_table_entry(src_lte);
-				if (!dest_lte)
-					return WIMLIB_ERR_NOMEM;
-			}
-			dest_lte->refcnt = 0;
-			dest_lte->out_refcnt = 0;
-			lookup_table_insert(dest_lookup_table, dest_lte);
-		}
-
-		/* Stream is present in destination WIM (either pre-existing,
-		 * already exported, or just exported above).  Increment its
-		 * reference count appropriately.   Note: we use 'refcnt' for
-		 * the raw reference count, but 'out_refcnt' for references
-		 * arising just from the export operation; this is used to roll
-		 * back a failed export if needed.  */
-		dest_lte->refcnt += inode->i_nlink;
-		dest_lte->out_refcnt += inode->i_nlink;
+		ret = export_stream(hash, inode, src_lookup_table,
+				    dest_lookup_table, gift, inode->i_nlink);
+		if (ret)
+			return ret;
 	}
 	return 0;
 }
 
-static int
+/* Drop the references counted in 'out_refcnt' by inode_export_streams().  */
+int
 lte_unexport(struct wim_lookup_table_entry *lte, void *_lookup_table)
 {
 	struct wim_lookup_table *lookup_table = _lookup_table;
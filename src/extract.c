@@ -519,7 +519,8 @@ extract_stream_list(struct apply_ctx *ctx,
 		return read_stream_list(&ctx->stream_list,
 					offsetof(struct wim_lookup_table_entry,
 						 extraction_list),
-					&wrapper_cbs, VERIFY_STREAM_HASHES);
+					&wrapper_cbs, VERIFY_STREAM_HASHES,
+					NULL);
 	}
 }
 
@@ -1615,7 +1616,13 @@ do_wimlib_extract_paths(WIMStruct *wim, int image, const tchar *target,
 	if (ret)
 		return ret;
 
-	ret = select_wim_image(wim, image);
+	/* Unless the full image is being extracted, only the directories
+	 * leading to and contained in the paths being extracted need to be
+	 * loaded.  */
+	if (extract_flags & WIMLIB_EXTRACT_FLAG_IMAGEMODE)
+		ret = select_wim_image(wim, image);
+	else
+		ret = select_wim_image_lazy(wim, image);
 	if (ret)
 		return ret;
 
@@ -1678,6 +1685,14 @@ do_wimlib_extract_paths(WIMStruct *wim, int image, const tchar *target,
 					      WIMLIB_CASE_PLATFORM_DEFAULT);
 			FREE(path);
 			if (trees[i] == NULL) {
+				if (errno == ENOMEM) {
+					ret = WIMLIB_ERR_NOMEM;
+					goto out_free_trees;
+				}
+				if (errno == EIO) {
+					ret = WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+					goto out_free_trees;
+				}
 				  ERROR("Path \"%"TS"\" does not exist "
 					"in WIM image %d",
 					paths[i], wim->current_image);
@@ -1693,6 +1708,12 @@ do_wimlib_extract_paths(WIMStruct *wim, int image, const tchar *target,
 		goto out_free_trees;
 	}
 
+	for (size_t i = 0; i < num_trees; i++) {
+		ret = load_dentry_subtree(wim, trees[i]);
+		if (ret)
+			goto out_free_trees;
+	}
+
 	ret = extract_trees(wim, trees, num_trees, target, extract_flags);
 out_free_trees:
 	FREE(trees);
@@ -1961,7 +1982,7 @@ wimlib_extract_image_from_pipe_with_progress(int pipe_fd,
 		if (i == image) {
 			/* Metadata resource is for the image being extracted.
 			 * Parse it and save the metadata in memory.  */
-			ret = read_metadata_resource(pwm, imd);
+			ret = read_metadata_resource(pwm, imd, false);
 			if (ret)
 				goto out_wimlib_free;
 			imd->modified = 1;
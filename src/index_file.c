@@ -0,0 +1,477 @@
+/*
+ * index_file.c
+ *
+ * A WIM index file is an optional file, stored next to a WIM file with the
+ * suffix ".idx" appended to its name, that caches the uncompressed metadata
+ * resource of each image in the WIM.  The uncompressed metadata resource
+ * contains the image's directory tree in a form where each directory's
+ * children can be located directly from the directory (via its subdir_offset),
+ * so when the index file is memory-mapped it serves as a path index: opening
+ * the WIM with WIMLIB_OPEN_FLAG_USE_INDEX_FILE and looking up paths with
+ * WIMLIB_OPEN_FLAG_LAZY_METADATA only touches the directories along the paths,
+ * without decompressing anything.
+ *
+ * The index file records the GUID and size of the WIM file it was created
+ * from, and it is ignored if these do not match.  In addition, each metadata
+ * resource in it is keyed by its SHA-1 message digest, so it is only used if
+ * the WIM's lookup table still refers to the same metadata resource, and its
+ * data is checked against that message digest before it is used, just like
+ * data read from the WIM file.
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/endianness.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/index_file.h"
+#include "wimlib/lookup_table.h"
+#include "wimlib/metadata.h"
+#include "wimlib/resource.h"
+#include "wimlib/sha1.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef __WIN32__
+#  include <sys/mman.h>
+#endif
+#include <unistd.h>
+
+#define WIM_INDEX_MAGIC		"WLIMIDX\0"
+#define WIM_INDEX_VERSION	1
+
+/* On-disk header of a WIM index file.  It is followed by @num_entries
+ * 'struct wim_index_entry_disk', then by the metadata resources themselves,
+ * each aligned on an 8-byte boundary.  */
+struct wim_index_hdr_disk {
+	u8 magic[8];
+	le32 version;
+	le32 num_entries;
+
+	/* GUID and size of the WIM file from which the index file was made  */
+	u8 guid[WIM_GUID_LEN];
+	le64 wim_size;
+} _packed_attribute;
+
+struct wim_index_entry_disk {
+	/* SHA-1 message digest of the uncompressed metadata resource  */
+	u8 hash[SHA1_HASH_SIZE];
+	le32 reserved;
+
+	/* Offset and size of the uncompressed metadata resource in the index
+	 * file  */
+	le64 offset;
+	le64 size;
+} _packed_attribute;
+
+/* An index file that has been opened for a WIMStruct.  */
+struct wim_index_file {
+	void *map;
+	size_t map_size;
+	const struct wim_index_entry_disk *entries;
+	u32 num_entries;
+};
+
+static int
+get_wim_size(WIMStruct *wim, u64 *size_ret)
+{
+	struct stat st;
+
+	if (fstat(wim->in_fd.fd, &st)) {
+		ERROR_WITH_ERRNO("Can't stat \"%"TS"\"", wim->filename);
+		return WIMLIB_ERR_STAT;
+	}
+	*size_ret = st.st_size;
+	return 0;
+}
+
+/* Get the name of the index file for @wim into @buf, which must have space for
+ * tstrlen(wim->filename) + 5 characters.  */
+static void
+get_index_file_name(const WIMStruct *wim, tchar *buf)
+{
+	size_t len = tstrlen(wim->filename);
+
+	tmemcpy(buf, wim->filename, len);
+	tstrcpy(buf + len, WIM_INDEX_FILE_SUFFIX);
+}
+
+static void *
+map_index_file(int raw_fd, size_t size)
+{
+#ifdef __WIN32__
+	struct filedes fd;
+	void *map;
+
+	map = MALLOC(size);
+	if (!map)
+		return NULL;
+	filedes_init(&fd, raw_fd);
+	if (full_pread(&fd, map, size, 0)) {
+		FREE(map);
+		return NULL;
+	}
+	return map;
+#else
+	void *map;
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, raw_fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	return map;
+#endif
+}
+
+static void
+unmap_index_file(void *map, size_t size)
+{
+#ifdef __WIN32__
+	FREE(map);
+#else
+	munmap(map, size);
+#endif
+}
+
+/* Check that the mapped index file @map of @size bytes is well-formed and was
+ * made from @wim in its current state.  */
+static bool
+index_file_is_valid(WIMStruct *wim, const void *map, size_t size)
+{
+	const struct wim_index_hdr_disk *hdr = map;
+	const struct wim_index_entry_disk *entries;
+	u32 num_entries;
+	u64 wim_size;
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, WIM_INDEX_MAGIC, sizeof(hdr->magic)) ||
+	    le32_to_cpu(hdr->version) != WIM_INDEX_VERSION)
+		return false;
+
+	if (memcmp(hdr->guid, wim->hdr.guid, WIM_GUID_LEN))
+		return false;
+
+	if (get_wim_size(wim, &wim_size) ||
+	    le64_to_cpu(hdr->wim_size) != wim_size)
+		return false;
+
+	num_entries = le32_to_cpu(hdr->num_entries);
+	if (num_entries > (size - sizeof(*hdr)) / sizeof(entries[0]))
+		return false;
+
+	entries = (const struct wim_index_entry_disk *)(hdr + 1);
+	for (u32 i = 0; i < num_entries; i++) {
+		u64 offset = le64_to_cpu(entries[i].offset);
+		u64 res_size = le64_to_cpu(entries[i].size);
+
+		if (offset > size || res_size > size - offset)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Open and map the index file of the WIM file that has been opened as @wim, if
+ * it exists and is up to date.  An index file that does not exist, or that
+ * cannot be used, is not an error.
+ *
+ * Returns 0 or WIMLIB_ERR_NOMEM.
+ */
+int
+open_wim_index_file(WIMStruct *wim)
+{
+	tchar index_name[tstrlen(wim->filename) + 5];
+	struct wim_index_file *index;
+	struct stat st;
+	int raw_fd;
+	void *map;
+
+	get_index_file_name(wim, index_name);
+
+	raw_fd = topen(index_name, O_RDONLY | O_BINARY);
+	if (raw_fd < 0) {
+		if (errno != ENOENT)
+			WARNING_WITH_ERRNO("Can't open \"%"TS"\"", index_name);
+		return 0;
+	}
+
+	map = NULL;
+	if (fstat(raw_fd, &st) == 0 && st.st_size > 0 &&
+	    (u64)st.st_size <= SIZE_MAX)
+		map = map_index_file(raw_fd, st.st_size);
+	close(raw_fd);
+	if (!map) {
+		WARNING("Can't read \"%"TS"\"", index_name);
+		return 0;
+	}
+
+	if (!index_file_is_valid(wim, map, st.st_size)) {
+		WARNING("Ignoring out-of-date or invalid index file \"%"TS"\"",
+			index_name);
+		unmap_index_file(map, st.st_size);
+		return 0;
+	}
+
+	index = MALLOC(sizeof(*index));
+	if (!index) {
+		unmap_index_file(map, st.st_size);
+		return WIMLIB_ERR_NOMEM;
+	}
+	index->map = map;
+	index->map_size = st.st_size;
+	index->entries = (const struct wim_index_entry_disk *)
+			((const struct wim_index_hdr_disk *)map + 1);
+	index->num_entries =
+		le32_to_cpu(((const struct wim_index_hdr_disk *)map)->num_entries);
+	wim->index_file = index;
+	DEBUG("Using index file \"%"TS"\"", index_name);
+	return 0;
+}
+
+void
+close_wim_index_file(WIMStruct *wim)
+{
+	struct wim_index_file *index = wim->index_file;
+
+	if (index) {
+		unmap_index_file(index->map, index->map_size);
+		FREE(index);
+		wim->index_file = NULL;
+	}
+}
+
+/* Return a pointer to the uncompressed data of the metadata resource
+ * @metadata_lte in the index file of @wim, or NULL if it is not available or
+ * its data does not have the SHA-1 message digest of the metadata resource in
+ * the WIM.  The data remains valid until the WIMStruct is freed.  */
+const void *
+wim_index_file_get_metadata(WIMStruct *wim,
+			    const struct wim_lookup_table_entry *metadata_lte)
+{
+	const struct wim_index_file *index = wim->index_file;
+
+	if (!index)
+		return NULL;
+
+	for (u32 i = 0; i < index->num_entries; i++) {
+		const struct wim_index_entry_disk *entry = &index->entries[i];
+		const u8 *buf;
+
+		if (!hashes_equal(entry->hash, metadata_lte->hash) ||
+		    le64_to_cpu(entry->size) != metadata_lte->size)
+			continue;
+
+		buf = (const u8 *)index->map + le64_to_cpu(entry->offset);
+		if (!metadata_lte->dont_check_metadata_hash) {
+			u8 hash[SHA1_HASH_SIZE];
+
+			sha1_buffer(buf, metadata_lte->size, hash);
+			if (!hashes_equal(metadata_lte->hash, hash)) {
+				WARNING("Ignoring corrupted metadata resource "
+					"in index file of \"%"TS"\"",
+					wim->filename);
+				return NULL;
+			}
+		}
+		return buf;
+	}
+	return NULL;
+}
+
+/* Append the uncompressed metadata resource @metadata_lte to the index file
+ * being written to @out_fd, and fill in @entry for it.  */
+static int
+write_index_entry(const struct wim_lookup_table_entry *metadata_lte,
+		  struct filedes *out_fd, struct wim_index_entry_disk *entry)
+{
+	void *buf;
+	u64 offset;
+	int ret;
+
+	ret = read_full_stream_into_alloc_buf(metadata_lte, &buf);
+	if (ret)
+		return ret;
+
+	if (!metadata_lte->dont_check_metadata_hash) {
+		u8 hash[SHA1_HASH_SIZE];
+
+		sha1_buffer(buf, metadata_lte->size, hash);
+		if (!hashes_equal(metadata_lte->hash, hash)) {
+			ERROR("Metadata resource is corrupted "
+			      "(invalid SHA-1 message digest)!");
+			ret = WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+			goto out_free_buf;
+		}
+	}
+
+	offset = (out_fd->offset + 7) & ~7;
+	ret = full_pwrite(out_fd, buf, metadata_lte->size, offset);
+	if (ret) {
+		ERROR_WITH_ERRNO("Error writing index file");
+		goto out_free_buf;
+	}
+	out_fd->offset = offset + metadata_lte->size;
+
+	copy_hash(entry->hash, metadata_lte->hash);
+	entry->reserved = cpu_to_le32(0);
+	entry->offset = cpu_to_le64(offset);
+	entry->size = cpu_to_le64(metadata_lte->size);
+	ret = 0;
+out_free_buf:
+	FREE(buf);
+	return ret;
+}
+
+/* Does the WIM file opened as @wim contain the metadata resource of the 0-based
+ * image @i?  */
+static bool
+image_metadata_in_wim(WIMStruct *wim, int i)
+{
+	const struct wim_lookup_table_entry *metadata_lte;
+
+	metadata_lte = wim->image_metadata[i]->metadata_lte;
+	return metadata_lte->resource_location == RESOURCE_IN_WIM &&
+	       metadata_lte->rspec->wim == wim;
+}
+
+static int
+write_index_file(WIMStruct *wim, struct filedes *out_fd)
+{
+	struct wim_index_hdr_disk hdr;
+	struct wim_index_entry_disk *entries;
+	u32 num_entries;
+	u64 wim_size;
+	size_t entries_size;
+	int ret;
+
+	ret = get_wim_size(wim, &wim_size);
+	if (ret)
+		return ret;
+
+	entries = CALLOC(wim->hdr.image_count, sizeof(entries[0]));
+	if (!entries)
+		return WIMLIB_ERR_NOMEM;
+
+	/* Index only the metadata resources actually in the WIM file; images
+	 * that were added in memory have none yet.  */
+	num_entries = 0;
+	for (int i = 0; i < wim->hdr.image_count; i++)
+		if (image_metadata_in_wim(wim, i))
+			num_entries++;
+
+	entries_size = num_entries * sizeof(entries[0]);
+	out_fd->offset = sizeof(hdr) + entries_size;
+	num_entries = 0;
+	for (int i = 0; i < wim->hdr.image_count; i++) {
+		if (!image_metadata_in_wim(wim, i))
+			continue;
+		ret = write_index_entry(wim->image_metadata[i]->metadata_lte,
+					out_fd, &entries[num_entries++]);
+		if (ret)
+			goto out_free_entries;
+	}
+
+	memcpy(hdr.magic, WIM_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = cpu_to_le32(WIM_INDEX_VERSION);
+	hdr.num_entries = cpu_to_le32(num_entries);
+	memcpy(hdr.guid, wim->hdr.guid, WIM_GUID_LEN);
+	hdr.wim_size = cpu_to_le64(wim_size);
+
+	if (full_pwrite(out_fd, &hdr, sizeof(hdr), 0) ||
+	    full_pwrite(out_fd, entries, entries_size, sizeof(hdr)))
+	{
+		ERROR_WITH_ERRNO("Error writing index file");
+		ret = WIMLIB_ERR_WRITE;
+		goto out_free_entries;
+	}
+	ret = 0;
+out_free_entries:
+	FREE(entries);
+	return ret;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_write_index_file(WIMStruct *wim, int flags)
+{
+	size_t name_len;
+	struct filedes out_fd;
+	int raw_fd;
+	int ret;
+
+	if (flags != 0)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (!wim->filename || !filedes_valid(&wim->in_fd))
+		return WIMLIB_ERR_NO_FILENAME;
+
+	if (!wim_has_metadata(wim))
+		return WIMLIB_ERR_METADATA_NOT_FOUND;
+
+	/* Write the index file to a temporary file, then rename it into place,
+	 * so that other processes never see a partially written index file.
+	 */
+	name_len = tstrlen(wim->filename) + 4;
+	tchar index_name[name_len + 1];
+	tchar tmpfile[name_len + 10];
+
+	get_index_file_name(wim, index_name);
+	tmemcpy(tmpfile, index_name, name_len);
+	randomize_char_array_with_alnum(tmpfile + name_len, 9);
+	tmpfile[name_len + 9] = T('\0');
+
+	raw_fd = topen(tmpfile, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+	if (raw_fd < 0) {
+		ERROR_WITH_ERRNO("Failed to open \"%"TS"\" for writing",
+				 tmpfile);
+		return WIMLIB_ERR_OPEN;
+	}
+	filedes_init(&out_fd, raw_fd);
+
+	ret = write_index_file(wim, &out_fd);
+
+	if (filedes_close(&out_fd) && !ret) {
+		ERROR_WITH_ERRNO("Error closing \"%"TS"\"", tmpfile);
+		ret = WIMLIB_ERR_WRITE;
+	}
+	if (ret)
+		goto out_unlink;
+
+	DEBUG("Renaming `%"TS"' to `%"TS"'", tmpfile, index_name);
+	if (trename(tmpfile, index_name)) {
+		ERROR_WITH_ERRNO("Failed to rename `%"TS"' to `%"TS"'",
+				 tmpfile, index_name);
+		ret = WIMLIB_ERR_RENAME;
+		goto out_unlink;
+	}
+	return 0;
+
+out_unlink:
+	tunlink(tmpfile);
+	return ret;
+}
@@ -30,6 +30,7 @@
 #  include "config.h"
 #endif
 
+#include "wimlib/arena.h"
 #include "wimlib/assert.h"
 #include "wimlib/dentry.h" /* Only for dentry_full_path().  Otherwise the code
 			      in this file doesn't care about file names/paths.
@@ -49,7 +50,7 @@
 struct wim_inode *
 new_inode(void)
 {
-	struct wim_inode *inode = new_timeless_inode();
+	struct wim_inode *inode = new_timeless_inode(NULL);
 	if (inode) {
 		u64 now = get_wim_timestamp();
 		inode->i_creation_time = now;
@@ -59,11 +60,12 @@ new_inode(void)
 	return inode;
 }
 
-/* Allocate a new inode.  Leave the timestamps zeroed out.  */
+/* Allocate a new inode from @arena (which may be NULL).  Leave the timestamps
+ * zeroed out.  */
 struct wim_inode *
-new_timeless_inode(void)
+new_timeless_inode(struct arena *arena)
 {
-	struct wim_inode *inode = CALLOC(1, sizeof(struct wim_inode));
+	struct wim_inode *inode = arena_calloc(arena, sizeof(struct wim_inode));
 	if (inode) {
 		inode->i_security_id = -1;
 		inode->i_nlink = 1;
@@ -117,7 +119,7 @@ free_inode(struct wim_inode *inode)
 	 * behaves the same as list_del(). */
 	if (!hlist_unhashed(&inode->i_hlist))
 		hlist_del(&inode->i_hlist);
-	FREE(inode);
+	arena_free(inode);
 }
 
 /* Return %true iff the alternate data stream entry @entry has the UTF-16LE
@@ -859,7 +861,7 @@ inode_table_get_inode(struct wim_inode_table *table, u64 ino, u64 devno)
 	}
 
 	/* Create a new inode and insert it into the table.  */
-	inode = new_timeless_inode();
+	inode = new_timeless_inode(NULL);
 	if (inode) {
 		inode->i_ino = ino;
 		inode->i_devno = devno;
@@ -146,6 +146,80 @@ reassign_inode_numbers(struct list_head *inode_list)
 		inode->i_ino = cur_ino++;
 }
 
+/*
+ * Begin determining the dentry/inode information of a WIM image incrementally,
+ * for use when the image's dentries are read on demand.  Each dentry must be
+ * passed to inode_fixup_add_dentry() when it is read; then, once every dentry
+ * has been added, inode_fixup_end() produces the final inode list.
+ *
+ * Returns 0 or WIMLIB_ERR_NOMEM.
+ */
+int
+inode_fixup_begin(struct inode_fixup_params **params_ret)
+{
+	struct inode_fixup_params *params;
+	int ret;
+
+	params = MALLOC(sizeof(*params));
+	if (!params)
+		return WIMLIB_ERR_NOMEM;
+
+	/* We use a hash table to map inode numbers to inodes.  */
+	ret = init_inode_table(&params->inode_table, 9001);
+	if (ret) {
+		FREE(params);
+		return ret;
+	}
+
+	params->num_dir_hard_links = 0;
+	params->num_inconsistent_inodes = 0;
+	*params_ret = params;
+	return 0;
+}
+
+/* Add a newly read dentry, which must still have its own inode, to the
+ * incremental inode fixup.  Afterwards, dentry->d_inode may have been changed
+ * to a previously added inode with the same inode number.  */
+void
+inode_fixup_add_dentry(struct wim_dentry *dentry,
+		       struct inode_fixup_params *params)
+{
+	inode_table_insert(dentry, params);
+}
+
+/* Finish an incremental inode fixup, appending the resulting inodes to
+ * @inode_list and freeing @params.  */
+void
+inode_fixup_end(struct inode_fixup_params *params, struct list_head *inode_list)
+{
+	/* Generate the resulting list of inodes, and if needed reassign
+	 * the inode numbers.  */
+	build_inode_list(&params->inode_table, inode_list);
+	destroy_inode_table(&params->inode_table);
+
+	if (unlikely(params->num_inconsistent_inodes))
+		WARNING("Fixed %lu invalid hard links in WIM image",
+			params->num_inconsistent_inodes);
+
+	if (unlikely(params->num_dir_hard_links))
+		WARNING("Ignoring %lu directory hard links",
+			params->num_dir_hard_links);
+
+	if (unlikely(params->num_inconsistent_inodes ||
+		     params->num_dir_hard_links))
+		reassign_inode_numbers(inode_list);
+	FREE(params);
+}
+
+/* Abandon an incremental inode fixup.  The dentry tree containing the added
+ * dentries must already have been freed.  */
+void
+inode_fixup_abort(struct inode_fixup_params *params)
+{
+	destroy_inode_table(&params->inode_table);
+	FREE(params);
+}
+
 /*
  * Given a WIM image's tree of dentries such that each dentry initially
  * has a unique inode associated with it, determine the actual
@@ -173,35 +247,15 @@ reassign_inode_numbers(struct list_head *inode_list)
 int
 dentry_tree_fix_inodes(struct wim_dentry *root, struct list_head *inode_list)
 {
-	struct inode_fixup_params params;
+	struct inode_fixup_params *params;
 	int ret;
 
-	/* We use a hash table to map inode numbers to inodes.  */
-
-	ret = init_inode_table(&params.inode_table, 9001);
+	ret = inode_fixup_begin(&params);
 	if (ret)
 		return ret;
 
-	params.num_dir_hard_links = 0;
-	params.num_inconsistent_inodes = 0;
-
-	for_dentry_in_tree(root, inode_table_insert, &params);
-
-	/* Generate the resulting list of inodes, and if needed reassign
-	 * the inode numbers.  */
-	build_inode_list(&params.inode_table, inode_list);
-	destroy_inode_table(&params.inode_table);
-
-	if (unlikely(params.num_inconsistent_inodes))
-		WARNING("Fixed %lu invalid hard links in WIM image",
-			params.num_inconsistent_inodes);
+	for_dentry_in_tree(root, inode_table_insert, params);
 
-	if (unlikely(params.num_dir_hard_links))
-		WARNING("Ignoring %lu directory hard links",
-			params.num_dir_hard_links);
-
-	if (unlikely(params.num_inconsistent_inodes ||
-		     params.num_dir_hard_links))
-		reassign_inode_numbers(inode_list);
+	inode_fixup_end(params, inode_list);
 	return 0;
 }
@@ -37,9 +37,16 @@
 #include "wimlib/progress.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
+#include "wimlib/util.h"
 #include "wimlib/wim.h"
 #include "wimlib/write.h"
 
+#include <string.h>
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+#  include <pthread.h>
+#endif
+
 /* Size, in bytes, of each SHA1-summed chunk, when wimlib writes integrity
  * information. */
 #define INTEGRITY_CHUNK_SIZE 10485760
@@ -84,6 +91,246 @@ calculate_chunk_sha1(struct filedes *in_fd, size_t this_chunk_size,
 	return 0;
 }
 
+/* Called in order for each chunk covered by an integrity table, once the SHA1
+ * message digest of that chunk is available.  Returns 0 to continue, or a
+ * nonzero value to stop hashing and return that value.  */
+typedef int (*integrity_chunk_done_t)(u32 chunk_idx, size_t this_chunk_size,
+				      void *ctx);
+
+/* Description of a set of integrity chunks to be hashed.  */
+struct integrity_chunks {
+	struct filedes *in_fd;
+
+	/* Number of bytes being checked, starting at WIM_HEADER_DISK_SIZE,
+	 * and the size of each chunk.  */
+	u64 check_bytes;
+	u32 chunk_size;
+	u32 num_chunks;
+
+	/* Chunks before this one already have their message digests in
+	 * @sha1sums and do not need to be hashed.  */
+	u32 first_chunk_to_hash;
+
+	/* Array into which to write the message digests.  */
+	u8 (*sha1sums)[SHA1_HASH_SIZE];
+};
+
+static size_t
+integrity_chunk_size(const struct integrity_chunks *chunks, u32 i)
+{
+	if (i == chunks->num_chunks - 1)
+		return MODULO_NONZERO(chunks->check_bytes, chunks->chunk_size);
+	else
+		return chunks->chunk_size;
+}
+
+static int
+hash_integrity_chunk(const struct integrity_chunks *chunks, u32 i)
+{
+	return calculate_chunk_sha1(chunks->in_fd,
+				    integrity_chunk_size(chunks, i),
+				    WIM_HEADER_DISK_SIZE +
+					(u64)i * chunks->chunk_size,
+				    chunks->sha1sums[i]);
+}
+
+static int
+hash_integrity_chunks_serial(const struct integrity_chunks *chunks,
+			     integrity_chunk_done_t chunk_done, void *ctx)
+{
+	int ret;
+
+	for (u32 i = 0; i < chunks->num_chunks; i++) {
+		if (i >= chunks->first_chunk_to_hash) {
+			ret = hash_integrity_chunk(chunks, i);
+			if (ret)
+				return ret;
+		}
+		ret = (*chunk_done)(i, integrity_chunk_size(chunks, i), ctx);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+/* Shared state for hashing integrity chunks on multiple threads.  Each worker
+ * thread repeatedly claims the next unhashed chunk, reads it with pread(), and
+ * hashes it; so while one thread is waiting for I/O, others can be hashing.
+ * The calling thread consumes the results in order.  */
+struct integrity_hasher {
+	const struct integrity_chunks *chunks;
+
+	pthread_mutex_t lock;
+
+	/* Signaled when a chunk has been hashed, or hashing failed.  */
+	pthread_cond_t chunk_done_cond;
+
+	/* Index of the next chunk to be claimed by a worker thread.  */
+	u32 next_chunk;
+
+	/* chunk_done[i] is set when chunk i has been hashed.  */
+	bool *chunk_done;
+
+	/* Set to stop the worker threads early.  */
+	bool terminating;
+
+	/* First error encountered by a worker thread, or 0.  */
+	int error;
+};
+
+static void *
+integrity_hasher_thread_proc(void *arg)
+{
+	struct integrity_hasher *hasher = arg;
+	u32 i;
+	int ret;
+
+	pthread_mutex_lock(&hasher->lock);
+	while (!hasher->terminating &&
+	       hasher->next_chunk < hasher->chunks->num_chunks)
+	{
+		i = hasher->next_chunk++;
+		pthread_mutex_unlock(&hasher->lock);
+
+		ret = hash_integrity_chunk(hasher->chunks, i);
+
+		pthread_mutex_lock(&hasher->lock);
+		if (ret) {
+			if (!hasher->error)
+				hasher->error = ret;
+			hasher->terminating = true;
+		} else {
+			hasher->chunk_done[i] = true;
+		}
+		pthread_cond_broadcast(&hasher->chunk_done_cond);
+	}
+	pthread_mutex_unlock(&hasher->lock);
+	return NULL;
+}
+
+/* Hash the chunks on @num_threads threads.  If the threads could not be started
+ * at all, *@started_ret is set to %false, in which case the caller should fall
+ * back to hashing serially.  */
+static int
+hash_integrity_chunks_parallel(const struct integrity_chunks *chunks,
+			       unsigned num_threads,
+			       integrity_chunk_done_t chunk_done, void *ctx,
+			       bool *started_ret)
+{
+	struct integrity_hasher hasher;
+	pthread_t *threads;
+	unsigned num_started;
+	int ret;
+
+	memset(&hasher, 0, sizeof(hasher));
+	hasher.chunks = chunks;
+	hasher.next_chunk = chunks->first_chunk_to_hash;
+
+	ret = 0;
+	*started_ret = false;
+	hasher.chunk_done = CALLOC(chunks->num_chunks, sizeof(bool));
+	threads = MALLOC(num_threads * sizeof(threads[0]));
+	if (!hasher.chunk_done || !threads)
+		goto out_free;
+	if (pthread_mutex_init(&hasher.lock, NULL))
+		goto out_free;
+	if (pthread_cond_init(&hasher.chunk_done_cond, NULL))
+		goto out_destroy_lock;
+
+	for (u32 i = 0; i < chunks->first_chunk_to_hash; i++)
+		hasher.chunk_done[i] = true;
+
+	for (num_started = 0; num_started < num_threads; num_started++) {
+		if (pthread_create(&threads[num_started], NULL,
+				   integrity_hasher_thread_proc, &hasher))
+		{
+			WARNING_WITH_ERRNO("Failed to create integrity "
+					   "hashing thread");
+			break;
+		}
+	}
+	if (num_started == 0)
+		goto out_destroy_cond;
+
+	DEBUG("Hashing integrity chunks using %u threads", num_started);
+
+	*started_ret = true;
+	pthread_mutex_lock(&hasher.lock);
+	for (u32 i = 0; i < chunks->num_chunks; i++) {
+		while (!hasher.chunk_done[i] && !hasher.error)
+			pthread_cond_wait(&hasher.chunk_done_cond, &hasher.lock);
+		if (hasher.error) {
+			ret = hasher.error;
+			break;
+		}
+		pthread_mutex_unlock(&hasher.lock);
+		ret = (*chunk_done)(i, integrity_chunk_size(chunks, i), ctx);
+		pthread_mutex_lock(&hasher.lock);
+		if (ret)
+			break;
+	}
+	hasher.terminating = true;
+	pthread_mutex_unlock(&hasher.lock);
+
+	for (unsigned t = 0; t < num_started; t++)
+		pthread_join(threads[t], NULL);
+out_destroy_cond:
+	pthread_cond_destroy(&hasher.chunk_done_cond);
+out_destroy_lock:
+	pthread_mutex_destroy(&hasher.lock);
+out_free:
+	FREE(threads);
+	FREE(hasher.chunk_done);
+	return ret;
+}
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
+
+/*
+ * Compute the SHA1 message digests of integrity chunks, calling @chunk_done for
+ * each chunk in order.
+ *
+ * @num_threads is the number of threads to use for hashing, or 0 to use one
+ * thread per processor.
+ */
+static int
+hash_integrity_chunks(const struct integrity_chunks *chunks,
+		      unsigned num_threads,
+		      integrity_chunk_done_t chunk_done, void *ctx)
+{
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	u32 num_chunks_to_hash;
+	bool started;
+	int ret;
+
+	if (num_threads == 0)
+		num_threads = get_default_num_threads();
+
+#ifdef __WIN32__
+	/* The Windows replacement for pread() temporarily moves the file
+	 * pointer, so concurrent reads from the same descriptor could leave it
+	 * at the wrong position, and the integrity table would then be written
+	 * there.  */
+	num_threads = 1;
+#endif
+
+	num_chunks_to_hash = chunks->num_chunks - chunks->first_chunk_to_hash;
+	if (num_threads > num_chunks_to_hash)
+		num_threads = num_chunks_to_hash;
+
+	if (num_threads > 1) {
+		ret = hash_integrity_chunks_parallel(chunks, num_threads,
+						     chunk_done, ctx, &started);
+		if (started)
+			return ret;
+		WARNING("Couldn't start integrity hashing threads; "
+			"falling back to single-threaded hashing");
+	}
+#endif
+	return hash_integrity_chunks_serial(chunks, chunk_done, ctx);
+}
+
 
 /*
  * read_integrity_table: -  Reads the integrity table from a WIM file.
@@ -149,6 +396,23 @@ invalid:
 	return WIMLIB_ERR_INVALID_INTEGRITY_TABLE;
 }
 
+struct calc_integrity_ctx {
+	union wimlib_progress_info progress;
+	wimlib_progress_func_t progfunc;
+	void *progctx;
+};
+
+static int
+calc_integrity_chunk_done(u32 chunk_idx, size_t this_chunk_size, void *_ctx)
+{
+	struct calc_integrity_ctx *ctx = _ctx;
+
+	ctx->progress.integrity.completed_chunks++;
+	ctx->progress.integrity.completed_bytes += this_chunk_size;
+	return call_progress(ctx->progfunc, WIMLIB_PROGRESS_MSG_CALC_INTEGRITY,
+			     &ctx->progress, ctx->progctx);
+}
+
 /*
  * calculate_integrity_table():
  *
@@ -168,12 +432,16 @@ invalid:
  *
  * @old_check_end:
  *	If @old_table is non-NULL, the byte after the last byte that was checked
- *	in the old table.  Must be less than or equal to new_check_end.
+ *	in the old table.  This may be past @new_check_end if the file has
+ *	shrunk.
  *
  * @integrity_table_ret:
  *	On success, a pointer to the calculated integrity table is written into
  *	this location.
  *
+ * @num_threads:
+ *	Number of threads to use for hashing, or 0 to use one per processor.
+ *
  * Return values:
  *	WIMLIB_ERR_SUCCESS (0)
  *	WIMLIB_ERR_NOMEM
@@ -186,6 +454,7 @@ calculate_integrity_table(struct filedes *in_fd,
 			  const struct integrity_table *old_table,
 			  off_t old_check_end,
 			  struct integrity_table **integrity_table_ret,
+			  unsigned num_threads,
 			  wimlib_progress_func_t progfunc,
 			  void *progctx)
 {
@@ -222,50 +491,58 @@ calculate_integrity_table(struct filedes *in_fd,
 	new_table->size = new_table_size;
 	new_table->chunk_size = chunk_size;
 
-	u64 offset = WIM_HEADER_DISK_SIZE;
-	union wimlib_progress_info progress;
+	struct integrity_chunks chunks = {
+		.in_fd = in_fd,
+		.check_bytes = new_check_bytes,
+		.chunk_size = chunk_size,
+		.num_chunks = new_num_chunks,
+		.first_chunk_to_hash = 0,
+		.sha1sums = new_table->sha1sums,
+	};
+
+	/* The SHA1 message digests of all full chunks from the old integrity
+	 * table, plus the last chunk if it hasn't changed size, can be
+	 * re-used.  */
+	if (old_table) {
+		u32 num_reusable = min(old_num_chunks, new_num_chunks);
+		u32 i;
+		for (i = 0; i < num_reusable; i++) {
+			size_t this_chunk_size = (i == new_num_chunks - 1) ?
+					new_last_chunk_size : chunk_size;
+			if (i == old_num_chunks - 1) {
+				if (this_chunk_size != old_last_chunk_size)
+					break;
+			} else if (this_chunk_size != chunk_size) {
+				break;
+			}
+			copy_hash(new_table->sha1sums[i],
+				  old_table->sha1sums[i]);
+		}
+		chunks.first_chunk_to_hash = i;
+	}
+
+	struct calc_integrity_ctx ctx = {
+		.progfunc = progfunc,
+		.progctx = progctx,
+	};
 
-	progress.integrity.total_bytes      = new_check_bytes;
-	progress.integrity.total_chunks     = new_num_chunks;
-	progress.integrity.completed_chunks = 0;
-	progress.integrity.completed_bytes  = 0;
-	progress.integrity.chunk_size       = chunk_size;
-	progress.integrity.filename         = NULL;
+	ctx.progress.integrity.total_bytes      = new_check_bytes;
+	ctx.progress.integrity.total_chunks     = new_num_chunks;
+	ctx.progress.integrity.completed_chunks = 0;
+	ctx.progress.integrity.completed_bytes  = 0;
+	ctx.progress.integrity.chunk_size       = chunk_size;
+	ctx.progress.integrity.filename         = NULL;
 
 	ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_CALC_INTEGRITY,
-			    &progress, progctx);
+			    &ctx.progress, progctx);
 	if (ret)
 		goto out_free_new_table;
 
-	for (u32 i = 0; i < new_num_chunks; i++) {
-		size_t this_chunk_size;
-		if (i == new_num_chunks - 1)
-			this_chunk_size = new_last_chunk_size;
-		else
-			this_chunk_size = chunk_size;
-		if (old_table &&
-		    ((this_chunk_size == chunk_size && i < old_num_chunks - 1) ||
-		      (i == old_num_chunks - 1 && this_chunk_size == old_last_chunk_size)))
-		{
-			/* Can use SHA1 message digest from old integrity table
-			 * */
-			copy_hash(new_table->sha1sums[i], old_table->sha1sums[i]);
-		} else {
-			/* Calculate the SHA1 message digest of this chunk */
-			ret = calculate_chunk_sha1(in_fd, this_chunk_size,
-						   offset, new_table->sha1sums[i]);
-			if (ret)
-				goto out_free_new_table;
-		}
-		offset += this_chunk_size;
+	ret = hash_integrity_chunks(&chunks, num_threads,
+				    calc_integrity_chunk_done, &ctx);
+	if (ret)
+		goto out_free_new_table;
 
-		progress.integrity.completed_chunks++;
-		progress.integrity.completed_bytes += this_chunk_size;
-		ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_CALC_INTEGRITY,
-				    &progress, progctx);
-		if (ret)
-			goto out_free_new_table;
-	}
 	*integrity_table_ret = new_table;
 	return 0;
 
@@ -304,12 +581,16 @@ out_free_new_table:
  * @old_table
  *	Pointer to the old integrity table read into memory, or NULL if not
  *	specified.
+ *
+ * @num_threads
+ *	Number of threads to use for hashing, or 0 to use one per processor.
  */
 int
 write_integrity_table(WIMStruct *wim,
 		      off_t new_lookup_table_end,
 		      off_t old_lookup_table_end,
-		      struct integrity_table *old_table)
+		      struct integrity_table *old_table,
+		      unsigned num_threads)
 {
 	struct integrity_table *new_table;
 	int ret;
@@ -323,7 +604,8 @@ write_integrity_table(WIMStruct *wim,
 
 	ret = calculate_integrity_table(&wim->out_fd, new_lookup_table_end,
 					old_table, old_lookup_table_end,
-					&new_table, wim->progfunc, wim->progctx);
+					&new_table, num_threads,
+					wim->progfunc, wim->progctx);
 	if (ret)
 		return ret;
 
@@ -347,6 +629,29 @@ write_integrity_table(WIMStruct *wim,
 	return ret;
 }
 
+struct verify_integrity_ctx {
+	const struct integrity_table *table;
+	u8 (*sha1sums)[SHA1_HASH_SIZE];
+	union wimlib_progress_info progress;
+	wimlib_progress_func_t progfunc;
+	void *progctx;
+};
+
+static int
+verify_integrity_chunk_done(u32 chunk_idx, size_t this_chunk_size, void *_ctx)
+{
+	struct verify_integrity_ctx *ctx = _ctx;
+
+	if (!hashes_equal(ctx->sha1sums[chunk_idx],
+			  ctx->table->sha1sums[chunk_idx]))
+		return WIM_INTEGRITY_NOT_OK;
+
+	ctx->progress.integrity.completed_chunks++;
+	ctx->progress.integrity.completed_bytes += this_chunk_size;
+	return call_progress(ctx->progfunc, WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
+			     &ctx->progress, ctx->progctx);
+}
+
 /*
  * verify_integrity():
  *
@@ -362,8 +667,12 @@ write_integrity_table(WIMStruct *wim,
  *	Number of bytes in the WIM that need to be checked (offset of end of the
  *	lookup table minus offset of end of the header).
  *
+ * @num_threads:
+ *	Number of threads to use for hashing, or 0 to use one per processor.
+ *
  * Returns:
- *	> 0 (WIMLIB_ERR_READ, WIMLIB_ERR_UNEXPECTED_END_OF_FILE) on error
+ *	> 0 (WIMLIB_ERR_READ, WIMLIB_ERR_UNEXPECTED_END_OF_FILE,
+ *	     WIMLIB_ERR_NOMEM) on error
  *	0 (WIM_INTEGRITY_OK) if the integrity was checked successfully and there
  *	were no inconsistencies.
  *	-1 (WIM_INTEGRITY_NOT_OK) if the WIM failed the integrity check.
@@ -371,51 +680,45 @@ write_integrity_table(WIMStruct *wim,
 static int
 verify_integrity(struct filedes *in_fd, const tchar *filename,
 		 const struct integrity_table *table,
-		 u64 bytes_to_check,
+		 u64 bytes_to_check, unsigned num_threads,
 		 wimlib_progress_func_t progfunc, void *progctx)
 {
 	int ret;
-	u64 offset = WIM_HEADER_DISK_SIZE;
-	u8 sha1_md[SHA1_HASH_SIZE];
-	union wimlib_progress_info progress;
-
-	progress.integrity.total_bytes      = bytes_to_check;
-	progress.integrity.total_chunks     = table->num_entries;
-	progress.integrity.completed_chunks = 0;
-	progress.integrity.completed_bytes  = 0;
-	progress.integrity.chunk_size       = table->chunk_size;
-	progress.integrity.filename         = filename;
+	struct verify_integrity_ctx ctx = {
+		.table = table,
+		.progfunc = progfunc,
+		.progctx = progctx,
+	};
+
+	ctx.progress.integrity.total_bytes      = bytes_to_check;
+	ctx.progress.integrity.total_chunks     = table->num_entries;
+	ctx.progress.integrity.completed_chunks = 0;
+	ctx.progress.integrity.completed_bytes  = 0;
+	ctx.progress.integrity.chunk_size       = table->chunk_size;
+	ctx.progress.integrity.filename         = filename;
 
 	ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
-			    &progress, progctx);
+			    &ctx.progress, progctx);
 	if (ret)
 		return ret;
 
-	for (u32 i = 0; i < table->num_entries; i++) {
-		size_t this_chunk_size;
-		if (i == table->num_entries - 1)
-			this_chunk_size = MODULO_NONZERO(bytes_to_check,
-							 table->chunk_size);
-		else
-			this_chunk_size = table->chunk_size;
-
-		ret = calculate_chunk_sha1(in_fd, this_chunk_size, offset, sha1_md);
-		if (ret)
-			return ret;
-
-		if (!hashes_equal(sha1_md, table->sha1sums[i]))
-			return WIM_INTEGRITY_NOT_OK;
-
-		offset += this_chunk_size;
-		progress.integrity.completed_chunks++;
-		progress.integrity.completed_bytes += this_chunk_size;
+	ctx.sha1sums = MALLOC(table->num_entries * SHA1_HASH_SIZE);
+	if (!ctx.sha1sums)
+		return WIMLIB_ERR_NOMEM;
 
-		ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
-				    &progress, progctx);
-		if (ret)
-			return ret;
-	}
-	return WIM_INTEGRITY_OK;
+	struct integrity_chunks chunks = {
+		.in_fd = in_fd,
+		.check_bytes = bytes_to_check,
+		.chunk_size = table->chunk_size,
+		.num_chunks = table->num_entries,
+		.first_chunk_to_hash = 0,
+		.sha1sums = ctx.sha1sums,
+	};
+
+	ret = hash_integrity_chunks(&chunks, num_threads,
+				    verify_integrity_chunk_done, &ctx);
+	FREE(ctx.sha1sums);
+	return ret;
 }
 
 
@@ -429,9 +732,12 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
  * @wim:
  *	The WIM, opened for reading.
  *
+ * @num_threads:
+ *	Number of threads to use for hashing, or 0 to use one per processor.
+ *
  * Returns:
  *	> 0 (WIMLIB_ERR_INVALID_INTEGRITY_TABLE, WIMLIB_ERR_READ,
- *	     WIMLIB_ERR_UNEXPECTED_END_OF_FILE) on error
+ *	     WIMLIB_ERR_UNEXPECTED_END_OF_FILE, WIMLIB_ERR_NOMEM) on error
  *	0 (WIM_INTEGRITY_OK) if the integrity was checked successfully and there
  *	were no inconsistencies.
  *	-1 (WIM_INTEGRITY_NOT_OK) if the WIM failed the integrity check.
@@ -439,7 +745,7 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
  *	information.
  */
 int
-check_wim_integrity(WIMStruct *wim)
+check_wim_integrity(WIMStruct *wim, unsigned num_threads)
 {
 	int ret;
 	u64 bytes_to_check;
@@ -465,7 +771,8 @@ check_wim_integrity(WIMStruct *wim)
 	if (ret)
 		return ret;
 	ret = verify_integrity(&wim->in_fd, wim->filename, table,
-			       bytes_to_check, wim->progfunc, wim->progctx);
+			       bytes_to_check, num_threads,
+			       wim->progfunc, wim->progctx);
 	FREE(table);
 	return ret;
 }
@@ -0,0 +1,415 @@
+/*
+ * io_ring.c
+ *
+ * Minimal interface to the Linux io_uring facility, used to batch the system
+ * calls needed to read or write many small files.
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+/*
+ * Reading or writing a small file takes three system calls (open, read or
+ * write, and close), each of which costs far more than copying the data.  With
+ * io_uring, the operations for many files are placed in a shared ring and
+ * submitted with a single system call.
+ *
+ * The kernel interface is used directly, not through liburing, so that no
+ * additional library is needed.  Only the simplest usage pattern is supported:
+ * the caller prepares up to io_ring_depth() operations, then io_ring_run()
+ * submits them and waits for all of them to complete.  If io_uring is not
+ * available (old kernel, disabled by the administrator, or blocked by a seccomp
+ * filter), io_ring_new() returns NULL and the caller uses ordinary system calls
+ * instead.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef ENABLE_IO_URING
+
+#include "wimlib/assert.h"
+#include "wimlib/error.h"
+#include "wimlib/io_ring.h"
+#include "wimlib/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct io_ring {
+	int fd;
+
+	/* Number of entries in the submission queue, which is also the
+	 * maximum number of operations that can be prepared before calling
+	 * io_ring_run().  */
+	unsigned depth;
+
+	/* Number of operations prepared but not yet submitted.  */
+	unsigned num_prepared;
+
+	/* Submission queue, shared with the kernel.  */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	/* Completion queue, shared with the kernel.  */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_map_size;
+};
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		   unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Returns true if the kernel supports all the operations this file uses.  The
+ * operations were added in Linux 5.6, and the probe in 5.6 as well, so a
+ * failed probe means the kernel is too old.  */
+static bool
+io_ring_ops_supported(int fd)
+{
+	static const u8 needed_ops[] = {
+		IORING_OP_OPENAT, IORING_OP_READ,
+		IORING_OP_WRITE, IORING_OP_CLOSE,
+	};
+	const size_t probe_size = sizeof(struct io_uring_probe) +
+				  256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe;
+	bool supported = false;
+
+	probe = CALLOC(1, probe_size);
+	if (!probe)
+		return false;
+	if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+		supported = true;
+		for (size_t i = 0; i < ARRAY_LEN(needed_ops); i++) {
+			if (needed_ops[i] > probe->last_op ||
+			    !(probe->ops[needed_ops[i]].flags &
+			      IO_URING_OP_SUPPORTED))
+				supported = false;
+		}
+	}
+	FREE(probe);
+	return supported;
+}
+
+/* Create an io_uring that allows up to @queue_depth operations to be submitted
+ * at once.  Returns NULL if io_uring is unavailable or out of memory, or if
+ * @queue_depth is less than 2, which is too small for the linked read and close
+ * of even one file.  */
+struct io_ring *
+io_ring_new(unsigned queue_depth)
+{
+	struct io_ring *ring;
+	struct io_uring_params p;
+	u8 *sq_ptr, *cq_ptr;
+
+	if (queue_depth < 2)
+		return NULL;
+	if (queue_depth > IO_RING_MAX_DEPTH)
+		queue_depth = IO_RING_MAX_DEPTH;
+
+	ring = CALLOC(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_io_uring_setup(queue_depth, &p);
+	if (ring->fd < 0) {
+		DEBUG("io_uring_setup() failed: %s", strerror(errno));
+		FREE(ring);
+		return NULL;
+	}
+
+	if (!(p.features & IORING_FEAT_NODROP) ||
+	    !io_ring_ops_supported(ring->fd))
+	{
+		DEBUG("io_uring lacks needed features");
+		goto err;
+	}
+
+	ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_map_size = p.cq_off.cqes +
+			    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_map_size = max(ring->sq_map_size, ring->cq_map_size);
+		ring->cq_map_size = ring->sq_map_size;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED) {
+		ring->sq_map = NULL;
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_size,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED) {
+			ring->cq_map = NULL;
+			goto err;
+		}
+	}
+
+	ring->sqes_map_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_map_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	sq_ptr = ring->sq_map;
+	ring->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+
+	cq_ptr = ring->cq_map;
+	ring->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+	/* The kernel may round the number of entries up to a power of 2, but
+	 * the caller asked for @queue_depth.  */
+	ring->depth = min(queue_depth, p.sq_entries);
+
+	DEBUG("Created io_uring with queue depth %u", ring->depth);
+	return ring;
+
+err:
+	io_ring_free(ring);
+	return NULL;
+}
+
+void
+io_ring_free(struct io_ring *ring)
+{
+	if (!ring)
+		return;
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_map_size);
+	if (ring->cq_map && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	if (ring->sq_map)
+		munmap(ring->sq_map, ring->sq_map_size);
+	close(ring->fd);
+	FREE(ring);
+}
+
+/* Returns the maximum number of operations that may be prepared before each
+ * call to io_ring_run().  */
+unsigned
+io_ring_depth(const struct io_ring *ring)
+{
+	return ring->depth;
+}
+
+static struct io_uring_sqe *
+io_ring_next_sqe(struct io_ring *ring, u8 opcode, int fd, u64 user_data)
+{
+	unsigned tail = *ring->sq_tail + ring->num_prepared;
+	unsigned idx = tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	wimlib_assert(ring->num_prepared < ring->depth);
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	ring->sq_array[idx] = idx;
+	ring->num_prepared++;
+	return sqe;
+}
+
+/* Prepare to open the file at @path, relative to the current directory.  The
+ * result is the new file descriptor.  */
+void
+io_ring_prep_openat(struct io_ring *ring, const char *path, int flags,
+		    u64 user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_ring_next_sqe(ring, IORING_OP_OPENAT, AT_FDCWD, user_data);
+	sqe->addr = (uintptr_t)path;
+	sqe->open_flags = flags;
+}
+
+/* Prepare to read @len bytes at @offset in @fd.  If @link_next is true, the
+ * next operation prepared is only started if this one succeeds; otherwise it
+ * fails with -ECANCELED.  A short read counts as a failure for this purpose.  */
+void
+io_ring_prep_read(struct io_ring *ring, int fd, void *buf, u32 len,
+		  u64 offset, bool link_next, u64 user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_ring_next_sqe(ring, IORING_OP_READ, fd, user_data);
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	if (link_next)
+		sqe->flags |= IOSQE_IO_LINK;
+}
+
+/* Prepare to write @len bytes at @offset in @fd.  */
+void
+io_ring_prep_write(struct io_ring *ring, int fd, const void *buf, u32 len,
+		   u64 offset, u64 user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_ring_next_sqe(ring, IORING_OP_WRITE, fd, user_data);
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+}
+
+/* Prepare to close @fd.  */
+void
+io_ring_prep_close(struct io_ring *ring, int fd, u64 user_data)
+{
+	io_ring_next_sqe(ring, IORING_OP_CLOSE, fd, user_data);
+}
+
+/*
+ * Submit all prepared operations and wait for them to complete, calling
+ * @complete for each one in the order in which they complete.
+ *
+ * @complete is called exactly once for every prepared operation, even if this
+ * function fails, and this function does not return until the kernel has
+ * finished with all of them.  Therefore, once it returns, the caller may close
+ * file descriptors and free buffers regardless of the result.  Operations that
+ * could not be submitted are reported with the result -ECANCELED.
+ *
+ * Returns 0 on success, or WIMLIB_ERR_READ if some operations could not be
+ * submitted.  Failures of individual operations are only reported through
+ * @complete.
+ */
+int
+io_ring_run(struct io_ring *ring, io_ring_completion_t complete, void *ctx)
+{
+	unsigned first = *ring->sq_tail;
+	unsigned num_ops = ring->num_prepared;
+	unsigned remaining = num_ops;
+	int ret = 0;
+
+	if (num_ops == 0)
+		return 0;
+
+	/* Make the prepared entries visible to the kernel.  */
+	__atomic_store_n(ring->sq_tail, first + num_ops, __ATOMIC_RELEASE);
+	ring->num_prepared = 0;
+
+	while (remaining) {
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == tail) {
+			unsigned consumed = __atomic_load_n(ring->sq_head,
+							    __ATOMIC_ACQUIRE)
+					    - first;
+			unsigned to_submit = num_ops - consumed;
+
+			if (ret && to_submit) {
+				/* Take back the entries the kernel has not
+				 * consumed; without SQPOLL it only does so
+				 * within io_uring_enter().  */
+				__atomic_store_n(ring->sq_tail,
+						 first + consumed,
+						 __ATOMIC_RELEASE);
+				for (unsigned i = consumed; i < num_ops; i++) {
+					unsigned idx = (first + i) & ring->sq_mask;
+
+					(*complete)(ring->sqes[idx].user_data,
+						    -ECANCELED, ctx);
+				}
+				num_ops = consumed;
+				remaining -= to_submit;
+				continue;
+			}
+
+			/* Wait for everything that is in flight, so that
+			 * nothing still refers to the caller's buffers or file
+			 * descriptors when this function returns.  */
+			if (sys_io_uring_enter(ring->fd, to_submit,
+					       ret ? remaining : 1,
+					       IORING_ENTER_GETEVENTS) < 0 &&
+			    errno != EINTR && errno != EAGAIN &&
+			    errno != EBUSY && !ret)
+			{
+				ERROR_WITH_ERRNO("io_uring_enter() failed");
+				ret = WIMLIB_ERR_READ;
+			}
+			continue;
+		}
+
+		do {
+			const struct io_uring_cqe *cqe;
+
+			cqe = &ring->cqes[head & ring->cq_mask];
+			(*complete)(cqe->user_data, cqe->res, ctx);
+			head++;
+			remaining--;
+		} while (head != tail);
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return ret;
+}
+
+#endif /* ENABLE_IO_URING */
@@ -40,6 +40,8 @@
 #include "wimlib/util.h"
 #include "wimlib/wim.h"
 
+#include <errno.h>
+
 static int
 init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 		   WIMStruct *wim, int flags)
@@ -77,6 +79,15 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 		wdentry->security_descriptor_size = sd->sizes[inode->i_security_id];
 	}
 	wdentry->reparse_tag = inode->i_reparse_tag;
+
+	/* If the image has only been partly read, the link count of an inode
+	 * with a nonzero hard link group ID only counts the links read so far,
+	 * so read the rest of the image first.  */
+	if (inode->i_ino != 0) {
+		ret = finish_lazy_metadata(wim_get_current_image_metadata(wim));
+		if (ret)
+			return ret;
+	}
 	wdentry->num_links = inode->i_nlink;
 	wdentry->attributes = inode->i_attributes;
 	wdentry->hard_link_group_id = inode->i_ino;
@@ -171,7 +182,10 @@ do_iterate_dir_tree(WIMStruct *wim,
 	{
 		struct wim_dentry *child;
 
-		ret = 0;
+		ret = load_dentry_children(wim, dentry);
+		if (ret)
+			goto out_free_wimlib_dentry;
+
 		for_dentry_child(child, dentry) {
 			ret = do_iterate_dir_tree(wim, child,
 						  flags & ~WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN,
@@ -201,8 +215,13 @@ image_do_iterate_dir_tree(WIMStruct *wim)
 	struct wim_dentry *dentry;
 
 	dentry = get_dentry(wim, ctx->path, WIMLIB_CASE_PLATFORM_DEFAULT);
-	if (dentry == NULL)
+	if (dentry == NULL) {
+		if (errno == ENOMEM)
+			return WIMLIB_ERR_NOMEM;
+		if (errno == EIO)
+			return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
 		return WIMLIB_ERR_PATH_DOES_NOT_EXIST;
+	}
 	return do_iterate_dir_tree(wim, dentry, ctx->flags, ctx->cb, ctx->user_ctx);
 }
 
@@ -230,7 +249,7 @@ wimlib_iterate_dir_tree(WIMStruct *wim, int image, const tchar *_path,
 		.user_ctx = user_ctx,
 	};
 	wim->private = &ctx;
-	ret = for_image(wim, image, image_do_iterate_dir_tree);
+	ret = for_image_lazy(wim, image, image_do_iterate_dir_tree);
 	FREE(path);
 	return ret;
 }
@@ -28,12 +28,15 @@
 #  include "config.h"
 #endif
 
+#include "wimlib/arena.h"
 #include "wimlib/assert.h"
+#include "wimlib/chunk_cache.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/lookup_table.h"
 #include "wimlib/metadata.h"
 #include "wimlib/ntfs_3g.h"
+#include "wimlib/piece_list.h"
 #include "wimlib/resource.h"
 #include "wimlib/util.h"
 #include "wimlib/write.h"
@@ -55,6 +58,10 @@ struct wim_lookup_table {
 	struct hlist_head *array;
 	size_t num_entries;
 	size_t capacity;
+
+	/* Arena from which the entries read from the WIM's lookup table are
+	 * allocated, or NULL.  */
+	struct arena *arena;
 };
 
 struct wim_lookup_table *
@@ -76,6 +83,7 @@ new_lookup_table(size_t capacity)
 	table->num_entries = 0;
 	table->capacity = capacity;
 	table->array = array;
+	table->arena = NULL;
 	return table;
 
 oom:
@@ -97,16 +105,17 @@ free_lookup_table(struct wim_lookup_table *table)
 	if (table) {
 		for_lookup_table_entry(table, do_free_lookup_table_entry, NULL);
 		FREE(table->array);
+		free_arena(table->arena);
 		FREE(table);
 	}
 }
 
-struct wim_lookup_table_entry *
-new_lookup_table_entry(void)
+static struct wim_lookup_table_entry *
+_new_lookup_table_entry(struct arena *arena)
 {
 	struct wim_lookup_table_entry *lte;
 
-	lte = CALLOC(1, sizeof(struct wim_lookup_table_entry));
+	lte = arena_calloc(arena, sizeof(struct wim_lookup_table_entry));
 	if (lte == NULL)
 		return NULL;
 
@@ -118,14 +127,21 @@ new_lookup_table_entry(void)
 	return lte;
 }
 
+struct wim_lookup_table_entry *
+new_lookup_table_entry(void)
+{
+	return _new_lookup_table_entry(NULL);
+}
+
 struct wim_lookup_table_entry *
 clone_lookup_table_entry(const struct wim_lookup_table_entry *old)
 {
 	struct wim_lookup_table_entry *new;
 
-	new = memdup(old, sizeof(struct wim_lookup_table_entry));
+	new = arena_calloc(NULL, sizeof(struct wim_lookup_table_entry));
 	if (new == NULL)
 		return NULL;
+	memcpy(new, old, sizeof(struct wim_lookup_table_entry));
 
 	switch (new->resource_location) {
 	case RESOURCE_IN_WIM:
@@ -151,6 +167,14 @@ clone_lookup_table_entry(const struct wim_lookup_table_entry *old)
 		if (new->attached_buffer == NULL)
 			goto out_free;
 		break;
+	case RESOURCE_IN_PIECES:
+		new->piece_list = clone_piece_list(old->piece_list);
+		if (new->piece_list == NULL)
+			goto out_free;
+		break;
+	case RESOURCE_IN_PARENT_STREAM:
+		new->parent->refcnt++;
+		break;
 #ifdef WITH_NTFS_3G
 	case RESOURCE_IN_NTFS_VOLUME:
 		if (old->ntfs_loc) {
@@ -189,8 +213,12 @@ lte_put_resource(struct wim_lookup_table_entry *lte)
 	switch (lte->resource_location) {
 	case RESOURCE_IN_WIM:
 		list_del(&lte->rspec_node);
-		if (list_empty(&lte->rspec->stream_list))
+		if (list_empty(&lte->rspec->stream_list)) {
+#ifdef WITH_FUSE
+			chunk_cache_drop_rspec(lte->rspec);
+#endif
 			FREE(lte->rspec);
+		}
 		break;
 	case RESOURCE_IN_FILE_ON_DISK:
 #ifdef __WIN32__
@@ -207,6 +235,13 @@ lte_put_resource(struct wim_lookup_table_entry *lte)
 			     (void*)&lte->attached_buffer);
 		FREE(lte->file_on_disk);
 		break;
+	case RESOURCE_IN_PIECES:
+		FREE(lte->piece_list);
+		break;
+	case RESOURCE_IN_PARENT_STREAM:
+		if (--lte->parent->refcnt == 0)
+			free_lookup_table_entry(lte->parent);
+		break;
 #ifdef WITH_NTFS_3G
 	case RESOURCE_IN_NTFS_VOLUME:
 		if (lte->ntfs_loc) {
@@ -226,7 +261,7 @@ free_lookup_table_entry(struct wim_lookup_table_entry *lte)
 {
 	if (lte) {
 		lte_put_resource(lte);
-		FREE(lte);
+		arena_free(lte);
 	}
 }
 
@@ -234,7 +269,9 @@ free_lookup_table_entry(struct wim_lookup_table_entry *lte)
 static bool
 should_retain_lte(const struct wim_lookup_table_entry *lte)
 {
-	return lte->resource_location == RESOURCE_IN_WIM;
+	return lte->resource_location == RESOURCE_IN_WIM ||
+	       (lte->resource_location == RESOURCE_IN_PIECES &&
+		lte->piece_list->wim != NULL);
 }
 
 static void
@@ -261,6 +298,12 @@ lte_decrement_refcnt(struct wim_lookup_table_entry *lte,
 	wimlib_assert(lte->refcnt != 0);
 
 	if (--lte->refcnt == 0) {
+		/* A stream split into pieces holds a reference to each of its
+		 * pieces.  */
+		if (lte->resource_location == RESOURCE_IN_PIECES &&
+		    lte->piece_list->table == table)
+			piece_list_put_pieces(lte->piece_list, table);
+
 		if (lte->unhashed) {
 			list_del(&lte->unhashed_list);
 		#ifdef WITH_FUSE
@@ -456,6 +499,12 @@ cmp_streams_by_sequential_order(const void *p1, const void *p2)
 	case RESOURCE_IN_NTFS_VOLUME:
 		return tstrcmp(lte1->ntfs_loc->path, lte2->ntfs_loc->path);
 #endif
+	case RESOURCE_IN_PARENT_STREAM:
+		/* Keep the pieces of each split stream together and in order.
+		 */
+		if (lte1->parent != lte2->parent)
+			return (lte1->parent < lte2->parent) ? -1 : 1;
+		return cmp_u64(lte1->offset_in_parent, lte2->offset_in_parent);
 	default:
 		/* No additional sorting order defined for this resource
 		 * location (e.g. RESOURCE_IN_ATTACHED_BUFFER); simply compare
@@ -898,6 +947,12 @@ read_wim_lookup_table(WIMStruct *wim)
 	if (!table)
 		goto oom;
 
+	/* The entries are usually all freed together, when the WIMStruct is
+	 * freed, so allocate them from an arena.  */
+	table->arena = new_arena();
+	if (!table->arena)
+		goto oom;
+
 	/* Allocate and initalize stream entries ('struct
 	 * wim_lookup_table_entry's) from the raw lookup table buffer.  Each of
 	 * these entries will point to a 'struct wim_resource_spec' that
@@ -926,7 +981,7 @@ read_wim_lookup_table(WIMStruct *wim)
 			reshdr.flags &= ~WIM_RESHDR_FLAG_PACKED_STREAMS;
 
 		/* Allocate a new 'struct wim_lookup_table_entry'.  */
-		cur_entry = new_lookup_table_entry();
+		cur_entry = _new_lookup_table_entry(table->arena);
 		if (!cur_entry)
 			goto oom;
 
@@ -1085,6 +1140,19 @@ read_wim_lookup_table(WIMStruct *wim)
 				goto free_cur_entry_and_continue;
 			}
 
+			/* If the resource is a piece list rather than the
+			 * stream data, load it.  */
+			if (reshdr.flags & WIM_RESHDR_FLAG_PIECE_LIST) {
+				if (cur_subpacks) {
+					ERROR("Found piece list in packed resource");
+					ret = WIMLIB_ERR_INVALID_LOOKUP_TABLE_ENTRY;
+					goto out;
+				}
+				ret = lte_load_piece_list(cur_entry, wim, table);
+				if (ret)
+					goto out;
+			}
+
 			/* Insert the stream into the in-memory lookup table,
 			 * keyed by its SHA1 message digest.  */
 			lookup_table_insert(table, cur_entry);
@@ -1306,6 +1374,42 @@ new_stream_from_data_buffer(const void *buffer, size_t size,
 	return lte;
 }
 
+/* Move a stream whose SHA1 message digest has just been stored in @lte->hash
+ * from the list of unhashed streams to the stream lookup table.  @back_ptr is
+ * the pointer to the stream, as retrieved before the message digest overwrote
+ * the back pointer.  */
+static void
+finish_hashing_unhashed_stream(struct wim_lookup_table_entry *lte,
+			       struct wim_lookup_table_entry **back_ptr,
+			       struct wim_lookup_table *lookup_table,
+			       struct wim_lookup_table_entry **lte_ret)
+{
+	struct wim_lookup_table_entry *duplicate_lte;
+
+	/* Look for a duplicate stream */
+	duplicate_lte = lookup_stream(lookup_table, lte->hash);
+	list_del(&lte->unhashed_list);
+	if (duplicate_lte) {
+		/* We have a duplicate stream.  Transfer the reference counts
+		 * from this stream to the duplicate and update the reference to
+		 * this stream (in an inode or ads_entry) to point to the
+		 * duplicate.  The caller is responsible for freeing @lte if
+		 * needed.  */
+		wimlib_assert(!(duplicate_lte->unhashed));
+		wimlib_assert(duplicate_lte->size == lte->size);
+		duplicate_lte->refcnt += lte->refcnt;
+		lte->refcnt = 0;
+		*back_ptr = duplicate_lte;
+		lte = duplicate_lte;
+	} else {
+		/* No duplicate stream, so we need to insert this stream into
+		 * the lookup table and treat it as a hashed stream. */
+		lookup_table_insert(lookup_table, lte);
+		lte->unhashed = 0;
+	}
+	*lte_ret = lte;
+}
+
 /* Calculate the SHA1 message digest of a stream and move it from the list of
  * unhashed streams to the stream lookup table, possibly joining it with an
  * existing lookup table entry for an identical stream.
@@ -1325,7 +1429,6 @@ hash_unhashed_stream(struct wim_lookup_table_entry *lte,
 		     struct wim_lookup_table_entry **lte_ret)
 {
 	int ret;
-	struct wim_lookup_table_entry *duplicate_lte;
 	struct wim_lookup_table_entry **back_ptr;
 
 	wimlib_assert(lte->unhashed);
@@ -1339,31 +1442,27 @@ hash_unhashed_stream(struct wim_lookup_table_entry *lte,
 	if (ret)
 		return ret;
 
-	/* Look for a duplicate stream */
-	duplicate_lte = lookup_stream(lookup_table, lte->hash);
-	list_del(&lte->unhashed_list);
-	if (duplicate_lte) {
-		/* We have a duplicate stream.  Transfer the reference counts
-		 * from this stream to the duplicate and update the reference to
-		 * this stream (in an inode or ads_entry) to point to the
-		 * duplicate.  The caller is responsible for freeing @lte if
-		 * needed.  */
-		wimlib_assert(!(duplicate_lte->unhashed));
-		wimlib_assert(duplicate_lte->size == lte->size);
-		duplicate_lte->refcnt += lte->refcnt;
-		lte->refcnt = 0;
-		*back_ptr = duplicate_lte;
-		lte = duplicate_lte;
-	} else {
-		/* No duplicate stream, so we need to insert this stream into
-		 * the lookup table and treat it as a hashed stream. */
-		lookup_table_insert(lookup_table, lte);
-		lte->unhashed = 0;
-	}
-	*lte_ret = lte;
+	finish_hashing_unhashed_stream(lte, back_ptr, lookup_table, lte_ret);
 	return 0;
 }
 
+/* Like hash_unhashed_stream(), but the SHA1 message digest of the stream has
+ * already been calculated as @hash, e.g. by sha1_small_streams().  */
+void
+set_unhashed_stream_hash(struct wim_lookup_table_entry *lte,
+			 const u8 hash[SHA1_HASH_SIZE],
+			 struct wim_lookup_table *lookup_table,
+			 struct wim_lookup_table_entry **lte_ret)
+{
+	struct wim_lookup_table_entry **back_ptr;
+
+	wimlib_assert(lte->unhashed);
+
+	back_ptr = retrieve_lte_pointer(lte);
+	copy_hash(lte->hash, hash);
+	finish_hashing_unhashed_stream(lte, back_ptr, lookup_table, lte_ret);
+}
+
 void
 lte_to_wimlib_resource_entry(const struct wim_lookup_table_entry *lte,
 			     struct wimlib_resource_entry *wentry)
@@ -1383,6 +1482,15 @@ lte_to_wimlib_resource_entry(const struct wim_lookup_table_entry *lte,
 		wentry->raw_resource_offset_in_wim = lte->rspec->offset_in_wim;
 		/*wentry->raw_resource_uncompressed_size = lte->rspec->uncompressed_size;*/
 		wentry->raw_resource_compressed_size = lte->rspec->size_in_wim;
+	} else if (lte->resource_location == RESOURCE_IN_PIECES &&
+		   lte->piece_list->wim != NULL)
+	{
+		/* Report the location of the piece list.  */
+		wentry->part_number = lte->piece_list->wim->hdr.part_number;
+		wentry->compressed_size = lte->piece_list->reshdr.size_in_wim;
+		wentry->offset = lte->piece_list->reshdr.offset_in_wim;
+		wentry->raw_resource_offset_in_wim = wentry->offset;
+		wentry->raw_resource_compressed_size = wentry->compressed_size;
 	}
 	copy_hash(wentry->sha1_hash, lte->hash);
 	wentry->reference_count = lte->refcnt;
@@ -1391,6 +1499,7 @@ lte_to_wimlib_resource_entry(const struct wim_lookup_table_entry *lte,
 	wentry->is_free = (lte->flags & WIM_RESHDR_FLAG_FREE) != 0;
 	wentry->is_spanned = (lte->flags & WIM_RESHDR_FLAG_SPANNED) != 0;
 	wentry->packed = (lte->flags & WIM_RESHDR_FLAG_PACKED_STREAMS) != 0;
+	wentry->is_piece_list = (lte->resource_location == RESOURCE_IN_PIECES);
 }
 
 struct iterate_lte_context {
@@ -351,11 +351,12 @@ static void
 lz_lcpit_load_window(struct lz_mf *_mf, const u8 T[], u32 n)
 {
 	struct lz_lcpit *mf = (struct lz_lcpit *)_mf;
+	const unsigned num_threads = mf->base.params.num_threads;
 	u32 *mem = mf->SA;
 
-	build_SA(&mem[0 * n], T, n, &mem[1 * n]);
-	build_ISA(&mem[2 * n], &mem[0 * n], n);
-	build_LCP(&mem[1 * n], &mem[0 * n], &mem[2 * n], T, n);
+	build_SA(&mem[0 * n], T, n, &mem[1 * n], num_threads);
+	build_ISA(&mem[2 * n], &mem[0 * n], n, num_threads);
+	build_LCP(&mem[1 * n], &mem[0 * n], &mem[2 * n], T, n, num_threads);
 	build_LCPIT(&mem[0 * n], &mem[1 * n], &mem[2 * n],
 		    mf->base.params.nice_match_len, n);
 	mf->SA = &mem[0 * n];
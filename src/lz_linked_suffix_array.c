@@ -423,9 +423,10 @@ static void
 lz_lsa_load_window(struct lz_mf *_mf, const u8 T[], u32 n)
 {
 	struct lz_lsa *mf = (struct lz_lsa *)_mf;
+	const unsigned num_threads = mf->base.params.num_threads;
 	u32 *ISA, *LCP;
 
-	build_SA(mf->SA, T, n, (u32 *)mf->salink);
+	build_SA(mf->SA, T, n, (u32 *)mf->salink, num_threads);
 
 	/* Compute ISA (Inverse Suffix Array) in a preliminary position.
 	 *
@@ -438,11 +439,11 @@ lz_lsa_load_window(struct lz_mf *_mf, const u8 T[], u32 n)
 	 * to save as much memory as possible.  */
 	BUILD_BUG_ON(sizeof(mf->salink[0]) < sizeof(mf->ISA[0]));
 	ISA = (u32 *)mf->salink;
-	build_ISA(ISA, mf->SA, n);
+	build_ISA(ISA, mf->SA, n, num_threads);
 
 	/* Compute LCP (Longest Common Prefix) array.  */
 	LCP = mf->SA + n;
-	build_LCP(LCP, mf->SA, ISA, T, n);
+	build_LCP(LCP, mf->SA, ISA, T, n, num_threads);
 
 	/* Initialize suffix array links.  */
 	init_salink(mf->salink, LCP, mf->SA, T, n,
@@ -454,7 +455,7 @@ lz_lsa_load_window(struct lz_mf *_mf, const u8 T[], u32 n)
 
 	/* Compute ISA (Inverse Suffix Array) in its final position.  */
 	ISA = mf->SA + n;
-	build_ISA(ISA, mf->SA, n);
+	build_ISA(ISA, mf->SA, n, num_threads);
 
 	/* Save new variables and return.  */
 	mf->ISA = ISA;
@@ -38,6 +38,83 @@
 #include "wimlib/lz_suffix_array_utils.h"
 #include "wimlib/util.h"
 
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+#  include <pthread.h>
+#endif
+
+/* The arrays being built, and those they are built from.  */
+struct sa_arrays {
+	u32 *ISA;
+	u32 *LCP;
+	const u32 *SA;
+	const u8 *T;
+	u32 n;
+};
+
+typedef void (*sa_range_func_t)(const struct sa_arrays *, u32 start, u32 end);
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+/* Don't give a thread fewer than this many positions to process.  */
+#define SA_MIN_THREAD_RANGE	(1 << 18)
+
+struct sa_range {
+	sa_range_func_t func;
+	const struct sa_arrays *arrays;
+	u32 start;
+	u32 end;
+	bool started;
+	pthread_t thread;
+};
+
+static void *
+sa_range_thread_proc(void *_range)
+{
+	struct sa_range *range = _range;
+
+	(*range->func)(range->arrays, range->start, range->end);
+	return NULL;
+}
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
+
+/* Call @func on consecutive ranges that together cover [0, @arrays->n), using
+ * up to @num_threads threads including the calling thread.  A range for which a
+ * thread cannot be started is processed on the calling thread.  */
+static void
+run_on_ranges(sa_range_func_t func, const struct sa_arrays *arrays,
+	      unsigned num_threads)
+{
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	struct sa_range *ranges;
+
+	num_threads = min(num_threads, arrays->n / SA_MIN_THREAD_RANGE);
+	if (num_threads > 1 &&
+	    (ranges = MALLOC(num_threads * sizeof(ranges[0]))) != NULL)
+	{
+		for (unsigned i = 0; i < num_threads; i++) {
+			ranges[i].func = func;
+			ranges[i].arrays = arrays;
+			ranges[i].start = (u64)arrays->n * i / num_threads;
+			ranges[i].end = (u64)arrays->n * (i + 1) / num_threads;
+			ranges[i].started = (i != 0 &&
+					     !pthread_create(&ranges[i].thread,
+							     NULL,
+							     sa_range_thread_proc,
+							     &ranges[i]));
+		}
+		for (unsigned i = 0; i < num_threads; i++) {
+			if (ranges[i].started)
+				pthread_join(ranges[i].thread, NULL);
+			else
+				sa_range_thread_proc(&ranges[i]);
+		}
+		FREE(ranges);
+		return;
+	}
+#endif
+	(*func)(arrays, 0, arrays->n);
+}
+
 /* If ENABLE_LZ_DEBUG is defined, verify that the suffix array satisfies its
  * definition.
  *
@@ -98,7 +175,7 @@ verify_SA(const u32 *SA, const u8 *T, u32 n, u32 *tmp)
  *	Issue 2, 2007 Article No. 4.
  */
 void
-build_SA(u32 *SA, const u8 *T, u32 n, u32 *tmp)
+build_SA(u32 *SA, const u8 *T, u32 n, u32 *tmp, unsigned num_threads)
 {
 	BUILD_BUG_ON(BUILD_SA_MIN_TMP_LEN !=
 		     DIVSUFSORT_TMP1_LEN + DIVSUFSORT_TMP2_LEN);
@@ -108,22 +185,40 @@ build_SA(u32 *SA, const u8 *T, u32 n, u32 *tmp)
 	 * divsufsort() has been modified from the original to use the provided
 	 * temporary space instead of allocating its own, since we don't want to
 	 * have to deal with malloc() failures here.  */
-	divsufsort(T, SA, n, tmp, tmp + DIVSUFSORT_TMP1_LEN);
+	divsufsort(T, SA, n, tmp, tmp + DIVSUFSORT_TMP1_LEN, num_threads);
 
 	verify_SA(SA, T, n, tmp);
 }
 
 
+static void
+build_ISA_range(const struct sa_arrays *arrays, u32 start, u32 end)
+{
+	u32 * restrict ISA = arrays->ISA;
+	const u32 * restrict SA = arrays->SA;
+
+	for (u32 r = start; r < end; r++)
+		ISA[SA[r]] = r;
+}
+
 /* Build the inverse suffix array @ISA from the suffix array @SA in linear time.
  *
  * Whereas the suffix array is a mapping from suffix rank to suffix position,
  * the inverse suffix array is a mapping from suffix position to suffix rank.
+ *
+ * Up to @num_threads threads are used, each filling in the positions of the
+ * suffixes in a range of ranks.
  */
 void
-build_ISA(u32 * restrict ISA, const u32 * restrict SA, u32 n)
+build_ISA(u32 *ISA, const u32 *SA, u32 n, unsigned num_threads)
 {
-	for (u32 r = 0; r < n; r++)
-		ISA[SA[r]] = r;
+	const struct sa_arrays arrays = {
+		.ISA = ISA,
+		.SA = SA,
+		.n = n,
+	};
+
+	run_on_ranges(build_ISA_range, &arrays, num_threads);
 }
 
 /* If ENABLE_LZ_DEBUG is defined, verify that the LCP (Longest Common Prefix)
@@ -168,14 +263,18 @@ verify_LCP(const u32 *LCP, const u32 *SA, const u8 *T, u32 n)
  *	Suffix Arrays and Its Applications.  CPM '01 Proceedings of the 12th
  *	Annual Symposium on Combinatorial Pattern Matching pp. 181-192.
  */
-void
-build_LCP(u32 * restrict LCP, const u32 * restrict SA,
-	  const u32 * restrict ISA, const u8 * restrict T, u32 n)
+static void
+build_LCP_range(const struct sa_arrays *arrays, u32 start, u32 end)
 {
+	u32 * restrict LCP = arrays->LCP;
+	const u32 * restrict SA = arrays->SA;
+	const u32 * restrict ISA = arrays->ISA;
+	const u8 * restrict T = arrays->T;
+	const u32 n = arrays->n;
 	u32 h, i, r, j, lim;
 
 	h = 0;
-	for (i = 0; i < n; i++) {
+	for (i = start; i < end; i++) {
 		r = ISA[i];
 		if (r > 0) {
 			j = SA[r - 1];
@@ -188,6 +287,24 @@ build_LCP(u32 * restrict LCP, const u32 * restrict SA,
 				h--;
 		}
 	}
+}
+
+/* Build the LCP array as described above, using up to @num_threads threads.
+ * Each thread handles the suffixes starting in a range of positions, starting
+ * over from a common prefix length of 0 at the beginning of its range.  */
+void
+build_LCP(u32 *LCP, const u32 *SA, const u32 *ISA, const u8 *T, u32 n,
+	  unsigned num_threads)
+{
+	const struct sa_arrays arrays = {
+		.ISA = (u32 *)ISA,
+		.LCP = LCP,
+		.SA = SA,
+		.T = T,
+		.n = n,
+	};
+
+	run_on_ranges(build_LCP_range, &arrays, num_threads);
 
 	verify_LCP(LCP, SA, T, n);
 }
@@ -176,25 +176,27 @@ lzms_maybe_do_x86_translation(u8 data[restrict], s32 i, s32 num_op_bytes,
 			      s32 last_target_usages[restrict],
 			      s32 max_trans_offset, bool undo)
 {
+	le32 *p32 = (le32*)&data[i + num_op_bytes];
+	u32 n = le32_to_cpu(*p32);
 	u16 pos;
 
+	/* Take the target from the untranslated operand in @n; re-reading it
+	 * from @data as a le16 after storing it as a le32 would violate strict
+	 * aliasing.  */
 	if (undo) {
 		if (i - *closest_target_usage_p <= max_trans_offset) {
 			LZMS_DEBUG("Undid x86 translation at position %d "
 				   "(opcode 0x%02x)", i, data[i]);
-			le32 *p32 = (le32*)&data[i + num_op_bytes];
-			u32 n = le32_to_cpu(*p32);
-			*p32 = cpu_to_le32(n - i);
+			n -= i;
+			*p32 = cpu_to_le32(n);
 		}
-		pos = i + le16_to_cpu(*(const le16*)&data[i + num_op_bytes]);
+		pos = i + (u16)n;
 	} else {
-		pos = i + le16_to_cpu(*(const le16*)&data[i + num_op_bytes]);
+		pos = i + (u16)n;
 
 		if (i - *closest_target_usage_p <= max_trans_offset) {
 			LZMS_DEBUG("Did x86 translation at position %d "
 				   "(opcode 0x%02x)", i, data[i]);
-			le32 *p32 = (le32*)&data[i + num_op_bytes];
-			u32 n = le32_to_cpu(*p32);
 			*p32 = cpu_to_le32(n + i);
 		}
 	}
@@ -42,8 +42,10 @@
 #include "wimlib/error.h"
 #include "wimlib/lz_mf.h"
 #include "wimlib/lzms.h"
+#include "wimlib/spsc_queue.h"
 #include "wimlib/util.h"
 
+#include <errno.h>
 #include <string.h>
 #include <limits.h>
 #include <pthread.h>
@@ -163,6 +165,32 @@ struct lzms_compressor_params {
 	u32 optim_array_length;
 };
 
+/* Minimum number of entries in each batch of matches.  */
+#define LZMS_MATCH_BATCH_LEN		16384
+
+/* Number of batches of matches a match-finding thread can fill ahead of the
+ * parser.  */
+#define LZMS_NUM_MATCH_BATCHES		4
+
+/* Windows smaller than this are never searched for matches on a separate
+ * thread; the thread would not save enough time to be worth starting.  */
+#define LZMS_MT_MIN_WINDOW_SIZE		(1 << 20)
+
+/*
+ * A batch of matches found ahead of the parser.
+ *
+ * For each position searched, there is a header entry whose @len is the number
+ * of matches found at that position and whose @offset is the number of
+ * positions following it that were skipped without searching, followed by the
+ * matches themselves.
+ */
+struct lzms_match_batch {
+	/* Number of entries of @matches filled in.  */
+	u32 len;
+
+	struct lz_match matches[];
+};
+
 /* State of the LZMS compressor.  */
 struct lzms_compressor {
 	/* Pointer to a buffer holding the preprocessed data to compress.  */
@@ -177,8 +205,36 @@ struct lzms_compressor {
 	/* Lempel-Ziv match-finder.  */
 	struct lz_mf *mf;
 
-	/* Temporary space to store found matches.  */
-	struct lz_match *matches;
+	/* Batches of matches found ahead of the parser, and the number of
+	 * entries each can hold.  Only the first is allocated unless matches
+	 * are found on a separate thread.  */
+	struct lzms_match_batch *match_batches[LZMS_NUM_MATCH_BATCHES];
+	u32 match_batch_len;
+
+	/* The batch the parser is taking matches from, the index of its next
+	 * entry, and the number of positions the parser must pass before it
+	 * reaches the position of that entry.  */
+	struct lzms_match_batch *cur_batch;
+	u32 cur_batch_idx;
+	u32 num_skipped_positions;
+
+	/* Position in the window at which the parser next looks for matches.
+	 * This is ahead of @cur_window_pos while the parser is looking for the
+	 * best sequence of items to encode.  */
+	u32 search_pos;
+
+	/* Maximum number of threads to use to compress each block.  */
+	unsigned num_threads;
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	/* Set while matches are being found on @mf_thread, which passes batches
+	 * of matches to the parser through @filled_batches and gets them back
+	 * through @empty_batches.  */
+	bool mf_in_thread;
+	pthread_t mf_thread;
+	struct spsc_queue filled_batches;
+	struct spsc_queue empty_batches;
+#endif
 
 	/* Match-chooser data.  */
 	struct lzms_mc_pos_data *optimum;
@@ -749,17 +805,130 @@ lzms_get_length_cost(const struct lzms_huffman_encoder *enc, u32 length)
 	return cost;
 }
 
+/*
+ * Search for matches at the next positions of the window, filling @batch until
+ * it is full or the end of the window is reached.
+ *
+ * The parser takes the matches from the batches in order, so that they can be
+ * found on another thread while the parser works on earlier positions.  That
+ * thread cannot know which positions the parser will skip, so this skips
+ * positions by the same rule on its own: the positions covered by a match of
+ * at least nice_match_length bytes are not searched.  This is the main case in
+ * which the parser skips positions, and it is applied whether or not a
+ * separate thread is used, so the compressed data does not depend on the
+ * number of threads.
+ */
+static void
+lzms_find_matches(struct lzms_compressor *ctx, struct lzms_match_batch *batch)
+{
+	struct lz_mf *mf = ctx->mf;
+	u32 len = 0;
+
+	while (lz_mf_get_bytes_remaining(mf) != 0 &&
+	       ctx->match_batch_len - len > ctx->params.max_search_depth)
+	{
+		struct lz_match *hdr = &batch->matches[len];
+		u32 num_matches;
+		u32 num_skipped = 0;
+
+		num_matches = lz_mf_get_matches(mf, hdr + 1);
+		if (num_matches &&
+		    hdr[num_matches].len >= ctx->params.nice_match_length)
+		{
+			num_skipped = hdr[num_matches].len - 1;
+			lz_mf_skip_positions(mf, num_skipped);
+		}
+		hdr->len = num_matches;
+		hdr->offset = num_skipped;
+		len += 1 + num_matches;
+	}
+	batch->len = len;
+}
+
+/* Move the parser on to the next batch of matches, which is either received
+ * from the match-finding thread or found now.  */
+static void
+lzms_next_match_batch(struct lzms_compressor *ctx)
+{
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx->mf_in_thread) {
+		if (ctx->cur_batch)
+			spsc_queue_put(&ctx->empty_batches, ctx->cur_batch);
+		ctx->cur_batch = spsc_queue_get(&ctx->filled_batches, NULL);
+		ctx->cur_batch_idx = 0;
+		return;
+	}
+#endif
+	ctx->cur_batch = ctx->match_batches[0];
+	lzms_find_matches(ctx, ctx->cur_batch);
+	ctx->cur_batch_idx = 0;
+}
+
+/* Take the header entry of the next searched position from the batches of
+ * matches.  */
+static struct lz_match *
+lzms_next_match_entry(struct lzms_compressor *ctx)
+{
+	struct lz_match *hdr;
+
+	if (!ctx->cur_batch || ctx->cur_batch_idx == ctx->cur_batch->len)
+		lzms_next_match_batch(ctx);
+
+	hdr = &ctx->cur_batch->matches[ctx->cur_batch_idx];
+	ctx->cur_batch_idx += 1 + hdr->len;
+	ctx->num_skipped_positions = hdr->offset;
+	return hdr;
+}
+
 static u32
 lzms_get_matches(struct lzms_compressor *ctx, struct lz_match **matches_ret)
 {
-	*matches_ret = ctx->matches;
-	return lz_mf_get_matches(ctx->mf, ctx->matches);
+	struct lz_match *hdr;
+
+	ctx->search_pos++;
+
+	if (ctx->num_skipped_positions != 0) {
+		ctx->num_skipped_positions--;
+		*matches_ret = NULL;
+		return 0;
+	}
+
+	hdr = lzms_next_match_entry(ctx);
+	*matches_ret = hdr + 1;
+	return hdr->len;
 }
 
 static void
 lzms_skip_bytes(struct lzms_compressor *ctx, u32 n)
 {
-	lz_mf_skip_positions(ctx->mf, n);
+	ctx->search_pos += n;
+
+	for (;;) {
+		u32 k = min(n, ctx->num_skipped_positions);
+
+		ctx->num_skipped_positions -= k;
+		n -= k;
+		if (n == 0)
+			break;
+		lzms_next_match_entry(ctx);
+		n--;
+	}
+}
+
+/* Returns the number of bytes remaining in the window from the position at
+ * which the parser next looks for matches.  */
+static inline u32
+lzms_get_bytes_remaining(const struct lzms_compressor *ctx)
+{
+	return ctx->window_size - ctx->search_pos;
+}
+
+/* Returns a pointer to the window at the position at which the parser next
+ * looks for matches.  */
+static inline const u8 *
+lzms_get_window_ptr(const struct lzms_compressor *ctx)
+{
+	return &ctx->window[ctx->search_pos];
 }
 
 static u32
@@ -900,11 +1069,11 @@ lzms_get_near_optimal_item(struct lzms_compressor *ctx)
 	ctx->optimum_end_idx = 0;
 
 	longest_rep_len = ctx->params.min_match_length - 1;
-	if (lz_mf_get_position(ctx->mf) >= LZMS_MAX_INIT_RECENT_OFFSET) {
-		u32 limit = lz_mf_get_bytes_remaining(ctx->mf);
+	if (ctx->search_pos >= LZMS_MAX_INIT_RECENT_OFFSET) {
+		u32 limit = lzms_get_bytes_remaining(ctx);
 		for (int i = 0; i < LZMS_NUM_RECENT_OFFSETS; i++) {
 			u32 offset = ctx->lru.lz.recent_offsets[i];
-			const u8 *strptr = lz_mf_get_window_ptr(ctx->mf);
+			const u8 *strptr = lzms_get_window_ptr(ctx);
 			const u8 *matchptr = strptr - offset;
 			u32 len = 0;
 			while (len < limit && strptr[len] == matchptr[len])
@@ -946,7 +1115,7 @@ lzms_get_near_optimal_item(struct lzms_compressor *ctx)
 	ctx->optimum[1].state = initial_state;
 	ctx->optimum[1].cost = lzms_get_literal_cost(ctx,
 						     &ctx->optimum[1].state,
-						     *(lz_mf_get_window_ptr(ctx->mf) - 1));
+						     *(lzms_get_window_ptr(ctx) - 1));
 	ctx->optimum[1].prev.link = 0;
 
 	for (u32 i = 0, len = 2; i < num_matches; i++) {
@@ -1003,11 +1172,11 @@ lzms_get_near_optimal_item(struct lzms_compressor *ctx)
 			return lzms_match_chooser_reverse_list(ctx, cur_pos);
 
 		longest_rep_len = ctx->params.min_match_length - 1;
-		if (lz_mf_get_position(ctx->mf) >= LZMS_MAX_INIT_RECENT_OFFSET) {
-			u32 limit = lz_mf_get_bytes_remaining(ctx->mf);
+		if (ctx->search_pos >= LZMS_MAX_INIT_RECENT_OFFSET) {
+			u32 limit = lzms_get_bytes_remaining(ctx);
 			for (int i = 0; i < LZMS_NUM_RECENT_OFFSETS; i++) {
 				u32 offset = ctx->optimum[cur_pos].state.lru.recent_offsets[i];
-				const u8 *strptr = lz_mf_get_window_ptr(ctx->mf);
+				const u8 *strptr = lzms_get_window_ptr(ctx);
 				const u8 *matchptr = strptr - offset;
 				u32 len = 0;
 				while (len < limit && strptr[len] == matchptr[len])
@@ -1058,7 +1227,7 @@ lzms_get_near_optimal_item(struct lzms_compressor *ctx)
 		cost = ctx->optimum[cur_pos].cost +
 			lzms_get_literal_cost(ctx,
 					      &state,
-					      *(lz_mf_get_window_ptr(ctx->mf) - 1));
+					      *(lzms_get_window_ptr(ctx) - 1));
 		if (cost < ctx->optimum[cur_pos + 1].cost) {
 			ctx->optimum[cur_pos + 1].state = state;
 			ctx->optimum[cur_pos + 1].cost = cost;
@@ -1115,6 +1284,84 @@ lzms_get_near_optimal_item(struct lzms_compressor *ctx)
 	}
 }
 
+static struct lzms_match_batch *
+lzms_alloc_match_batch(const struct lzms_compressor *ctx)
+{
+	return MALLOC(sizeof(struct lzms_match_batch) +
+		      ctx->match_batch_len * sizeof(struct lz_match));
+}
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+static void *
+lzms_mf_thread_proc(void *_ctx)
+{
+	struct lzms_compressor *ctx = _ctx;
+	unsigned num_unused_batches = LZMS_NUM_MATCH_BATCHES;
+
+	lz_mf_load_window(ctx->mf, ctx->window, ctx->window_size);
+
+	while (lz_mf_get_bytes_remaining(ctx->mf) != 0) {
+		struct lzms_match_batch *batch;
+
+		if (num_unused_batches != 0)
+			batch = ctx->match_batches[--num_unused_batches];
+		else
+			batch = spsc_queue_get(&ctx->empty_batches, NULL);
+		lzms_find_matches(ctx, batch);
+		spsc_queue_put(&ctx->filled_batches, batch);
+	}
+	return NULL;
+}
+
+/* Start a thread to load the window into the match-finder and find the matches
+ * ahead of the parser.  If this fails, the matches are found on the calling
+ * thread as usual.  */
+static void
+lzms_start_mf_thread(struct lzms_compressor *ctx)
+{
+	int ret;
+
+	for (unsigned i = 1; i < LZMS_NUM_MATCH_BATCHES; i++) {
+		if (!ctx->match_batches[i]) {
+			ctx->match_batches[i] = lzms_alloc_match_batch(ctx);
+			if (!ctx->match_batches[i])
+				return;
+		}
+	}
+
+	if (spsc_queue_init(&ctx->filled_batches, LZMS_NUM_MATCH_BATCHES))
+		return;
+	if (spsc_queue_init(&ctx->empty_batches, LZMS_NUM_MATCH_BATCHES))
+		goto err_destroy_filled_batches;
+
+	ret = pthread_create(&ctx->mf_thread, NULL, lzms_mf_thread_proc, ctx);
+	if (ret) {
+		errno = ret;
+		WARNING_WITH_ERRNO("Failed to create match-finding thread");
+		goto err_destroy_empty_batches;
+	}
+	ctx->mf_in_thread = true;
+	return;
+
+err_destroy_empty_batches:
+	spsc_queue_destroy(&ctx->empty_batches);
+err_destroy_filled_batches:
+	spsc_queue_destroy(&ctx->filled_batches);
+}
+
+/* Wait for the match-finding thread to exit.  It does so as soon as it has
+ * searched the whole window, which the parser must have taken all the matches
+ * from.  */
+static void
+lzms_stop_mf_thread(struct lzms_compressor *ctx)
+{
+	pthread_join(ctx->mf_thread, NULL);
+	spsc_queue_destroy(&ctx->empty_batches);
+	spsc_queue_destroy(&ctx->filled_batches);
+	ctx->mf_in_thread = false;
+}
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
+
 /*
  * The main loop for the LZMS compressor.
  *
@@ -1134,8 +1381,20 @@ lzms_encode(struct lzms_compressor *ctx)
 {
 	struct lz_match item;
 
-	/* Load window into the match-finder.  */
-	lz_mf_load_window(ctx->mf, ctx->window, ctx->window_size);
+	/* Reset the batches of matches.  */
+	ctx->cur_batch = NULL;
+	ctx->cur_batch_idx = 0;
+	ctx->num_skipped_positions = 0;
+	ctx->search_pos = 0;
+
+	/* Load window into the match-finder, unless that is left to a
+	 * match-finding thread.  */
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx->num_threads > 1 && ctx->window_size >= LZMS_MT_MIN_WINDOW_SIZE)
+		lzms_start_mf_thread(ctx);
+	if (!ctx->mf_in_thread)
+#endif
+		lz_mf_load_window(ctx->mf, ctx->window, ctx->window_size);
 
 	/* Reset the match-chooser.  */
 	ctx->optimum_cur_idx = 0;
@@ -1148,6 +1407,11 @@ lzms_encode(struct lzms_compressor *ctx)
 		else
 			lzms_encode_lz_match(ctx, item.len, item.offset);
 	}
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx->mf_in_thread)
+		lzms_stop_mf_thread(ctx);
+#endif
 }
 
 static void
@@ -1327,6 +1591,16 @@ lzms_build_mf_params(const struct lzms_compressor_params *lzms_params,
 	mf_params->nice_match_len = lzms_params->nice_match_length;
 }
 
+/* Returns the number of entries to allocate in each batch of matches.  A batch
+ * must be able to hold the header entry and the matches of at least one
+ * position.  */
+static u32
+lzms_get_match_batch_len(const struct lzms_compressor_params *lzms_params)
+{
+	return max(LZMS_MATCH_BATCH_LEN,
+		   2 * (lzms_params->max_search_depth + 1));
+}
+
 static void
 lzms_free_compressor(void *_ctx);
 
@@ -1342,7 +1616,8 @@ lzms_get_needed_memory(size_t max_block_size, unsigned int compression_level)
 	size += sizeof(struct lzms_compressor);
 	size += max_block_size;
 	size += lz_mf_get_needed_memory(LZ_MF_DEFAULT, max_block_size);
-	size += params.max_search_depth * sizeof(struct lz_match);
+	size += sizeof(struct lzms_match_batch) +
+		lzms_get_match_batch_len(&params) * sizeof(struct lz_match);
 	size += (params.optim_array_length + params.nice_match_length) *
 		sizeof(struct lzms_mc_pos_data);
 
@@ -1380,10 +1655,13 @@ lzms_create_compressor(size_t max_block_size, unsigned int compression_level,
 	if (!ctx->mf)
 		goto oom;
 
-	ctx->matches = MALLOC(params.max_search_depth * sizeof(struct lz_match));
-	if (!ctx->matches)
+	ctx->match_batch_len = lzms_get_match_batch_len(&params);
+	ctx->match_batches[0] = lzms_alloc_match_batch(ctx);
+	if (!ctx->match_batches[0])
 		goto oom;
 
+	ctx->num_threads = 1;
+
 	ctx->optimum = MALLOC((params.optim_array_length +
 			       params.nice_match_length) *
 				sizeof(struct lzms_mc_pos_data));
@@ -1462,15 +1740,29 @@ lzms_free_compressor(void *_ctx)
 	if (ctx) {
 		FREE(ctx->window);
 		lz_mf_free(ctx->mf);
-		FREE(ctx->matches);
+		for (unsigned i = 0; i < LZMS_NUM_MATCH_BATCHES; i++)
+			FREE(ctx->match_batches[i]);
 		FREE(ctx->optimum);
 		FREE(ctx);
 	}
 }
 
+static void
+lzms_set_num_threads(void *_ctx, unsigned num_threads)
+{
+	struct lzms_compressor *ctx = _ctx;
+
+	ctx->num_threads = num_threads;
+
+	/* While the window is being loaded into the match-finder, the parser
+	 * waits for matches, so the match-finder can use all the threads.  */
+	lz_mf_set_num_threads(ctx->mf, num_threads);
+}
+
 const struct compressor_ops lzms_compressor_ops = {
 	.get_needed_memory  = lzms_get_needed_memory,
 	.create_compressor  = lzms_create_compressor,
+	.set_num_threads    = lzms_set_num_threads,
 	.compress	    = lzms_compress,
 	.free_compressor    = lzms_free_compressor,
 };
@@ -0,0 +1,108 @@
+/*
+ * message_queue.c
+ *
+ * Simple blocking queue for passing work between threads.  This is used by
+ * the parallel chunk decompressor.
+ */
+
+/*
+ * Copyright (C) 2013, 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+#include "wimlib/error.h"
+#include "wimlib/message_queue.h"
+
+int
+message_queue_init(struct message_queue *q)
+{
+	if (pthread_mutex_init(&q->lock, NULL)) {
+		ERROR_WITH_ERRNO("Failed to initialize mutex");
+		goto err;
+	}
+	if (pthread_cond_init(&q->msg_avail_cond, NULL)) {
+		ERROR_WITH_ERRNO("Failed to initialize condition variable");
+		goto err_destroy_lock;
+	}
+	if (pthread_cond_init(&q->space_avail_cond, NULL)) {
+		ERROR_WITH_ERRNO("Failed to initialize condition variable");
+		goto err_destroy_msg_avail_cond;
+	}
+	INIT_LIST_HEAD(&q->list);
+	return 0;
+
+err_destroy_msg_avail_cond:
+	pthread_cond_destroy(&q->msg_avail_cond);
+err_destroy_lock:
+	pthread_mutex_destroy(&q->lock);
+err:
+	return WIMLIB_ERR_NOMEM;
+}
+
+void
+message_queue_destroy(struct message_queue *q)
+{
+	if (q->list.next != NULL) {
+		pthread_mutex_destroy(&q->lock);
+		pthread_cond_destroy(&q->msg_avail_cond);
+		pthread_cond_destroy(&q->space_avail_cond);
+	}
+}
+
+void
+message_queue_put(struct message_queue *q, struct list_head *msg)
+{
+	pthread_mutex_lock(&q->lock);
+	list_add_tail(msg, &q->list);
+	pthread_cond_signal(&q->msg_avail_cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Wait for a message to become available, then remove it from the queue and
+ * return it.  Returns NULL if the queue is being terminated.  */
+struct list_head *
+message_queue_get(struct message_queue *q)
+{
+	struct list_head *msg;
+
+	pthread_mutex_lock(&q->lock);
+	while (list_empty(&q->list) && !q->terminating)
+		pthread_cond_wait(&q->msg_avail_cond, &q->lock);
+	if (!q->terminating) {
+		msg = q->list.next;
+		list_del(msg);
+	} else
+		msg = NULL;
+	pthread_mutex_unlock(&q->lock);
+	return msg;
+}
+
+void
+message_queue_terminate(struct message_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->terminating = true;
+	pthread_cond_broadcast(&q->msg_avail_cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
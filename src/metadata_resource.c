@@ -24,66 +24,46 @@
 #  include "config.h"
 #endif
 
+#include "wimlib/arena.h"
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
+#include "wimlib/index_file.h"
+#include "wimlib/inode.h"
 #include "wimlib/lookup_table.h"
 #include "wimlib/metadata.h"
 #include "wimlib/resource.h"
 #include "wimlib/security.h"
 #include "wimlib/write.h"
 
+/* State kept for an image whose dentry tree is being read on demand.  */
+struct wim_lazy_metadata {
+
+	/* The uncompressed metadata resource, and the buffer to free when done
+	 * with it (NULL if it is in the WIM's index file)  */
+	const void *buf;
+	size_t buf_len;
+	void *alloc_buf;
+
+	/* Inode fixup for the dentries read so far  */
+	struct inode_fixup_params *fixup;
+};
+
 /*
- * Reads and parses a metadata resource for an image in the WIM file.
- *
- * @wim:
- *	Pointer to the WIMStruct for the WIM file.
- *
- * @imd:
- *	Pointer to the image metadata structure for the image whose metadata
- *	resource we are reading.  Its `metadata_lte' member specifies the lookup
- *	table entry for the metadata resource.  The rest of the image metadata
- *	entry will be filled in by this function.
- *
- * Return values:
- *	WIMLIB_ERR_SUCCESS (0)
- *	WIMLIB_ERR_INVALID_METADATA_RESOURCE
- *	WIMLIB_ERR_NOMEM
- *	WIMLIB_ERR_READ
- *	WIMLIB_ERR_UNEXPECTED_END_OF_FILE
- *	WIMLIB_ERR_DECOMPRESSION
+ * Parse the uncompressed metadata resource @buf of @len bytes into the image
+ * metadata @imd.  @alloc_buf is the buffer to free when done with @buf, or NULL
+ * if @buf must not be freed; it is freed even on failure.  See
+ * read_metadata_resource() for @lazy.
  */
-int
-read_metadata_resource(WIMStruct *wim, struct wim_image_metadata *imd)
+static int
+parse_metadata_resource(const void *buf, size_t len, void *alloc_buf,
+			bool lazy, struct wim_image_metadata *imd)
 {
-	const struct wim_lookup_table_entry *metadata_lte;
-	void *buf;
 	int ret;
 	struct wim_security_data *sd;
+	struct arena *arena;
 	struct wim_dentry *root;
 	struct wim_inode *inode;
 
-	metadata_lte = imd->metadata_lte;
-
-	DEBUG("Reading metadata resource (size=%"PRIu64").", metadata_lte->size);
-
-	/* Read the metadata resource into memory.  (It may be compressed.)  */
-	ret = read_full_stream_into_alloc_buf(metadata_lte, &buf);
-	if (ret)
-		return ret;
-
-	/* Checksum the metadata resource.  */
-	if (!metadata_lte->dont_check_metadata_hash) {
-		u8 hash[SHA1_HASH_SIZE];
-
-		sha1_buffer(buf, metadata_lte->size, hash);
-		if (!hashes_equal(metadata_lte->hash, hash)) {
-			ERROR("Metadata resource is corrupted "
-			      "(invalid SHA-1 message digest)!");
-			ret = WIMLIB_ERR_INVALID_METADATA_RESOURCE;
-			goto out_free_buf;
-		}
-	}
-
 	/* Parse the metadata resource.
 	 *
 	 * Notes: The metadata resource consists of the security data, followed
@@ -94,17 +74,56 @@ read_metadata_resource(WIMStruct *wim, struct wim_image_metadata *imd)
 	 * by a directory entry of length '0', really of length 8, because
 	 * that's how long the 'length' field is.  */
 
-	ret = read_wim_security_data(buf, metadata_lte->size, &sd);
+	ret = read_wim_security_data(buf, len, &sd);
 	if (ret)
 		goto out_free_buf;
 
-	ret = read_dentry_tree(buf, metadata_lte->size, sd->total_length, &root);
-	if (ret)
+	/* Allocate the dentries and inodes from an arena owned by the image,
+	 * since they are usually all freed together.  */
+	arena = new_arena();
+	if (!arena) {
+		ret = WIMLIB_ERR_NOMEM;
 		goto out_free_security_data;
+	}
+
+	ret = read_dentry_tree(buf, len, sd->total_length, lazy, arena, &root);
+	if (ret)
+		goto out_free_arena;
+
+	if (lazy && root && root->children_not_loaded) {
+		struct wim_lazy_metadata *state;
+
+		/* Keep the buffer so that the rest of the dentry tree can be
+		 * read from it later.  */
+		state = MALLOC(sizeof(*state));
+		if (!state) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out_free_dentry_tree;
+		}
+		ret = inode_fixup_begin(&state->fixup);
+		if (ret) {
+			FREE(state);
+			goto out_free_dentry_tree;
+		}
+		state->buf = buf;
+		state->buf_len = len;
+		state->alloc_buf = alloc_buf;
+
+		check_inode(root->d_inode, sd);
+		inode_fixup_add_dentry(root, state->fixup);
+
+		imd->lazy = state;
+		imd->arena = arena;
+		imd->root_dentry = root;
+		imd->security_data = sd;
+		INIT_LIST_HEAD(&imd->unhashed_streams);
+		DEBUG("Reading the rest of the metadata resource on demand.");
+		return 0;
+	}
 
 	/* We have everything we need from the buffer now.  */
-	FREE(buf);
-	buf = NULL;
+	FREE(alloc_buf);
+	alloc_buf = NULL;
 
 	/* Calculate and validate inodes.  */
 
@@ -116,6 +135,7 @@ read_metadata_resource(WIMStruct *wim, struct wim_image_metadata *imd)
 		check_inode(inode, sd);
 
 	/* Success; fill in the image_metadata structure.  */
+	imd->arena = arena;
 	imd->root_dentry = root;
 	imd->security_data = sd;
 	INIT_LIST_HEAD(&imd->unhashed_streams);
@@ -124,13 +144,175 @@ read_metadata_resource(WIMStruct *wim, struct wim_image_metadata *imd)
 
 out_free_dentry_tree:
 	free_dentry_tree(root, NULL);
+out_free_arena:
+	free_arena(arena);
 out_free_security_data:
 	free_wim_security_data(sd);
 out_free_buf:
-	FREE(buf);
+	FREE(alloc_buf);
+	return ret;
+}
+
+/*
+ * Reads and parses a metadata resource for an image in the WIM file.
+ *
+ * @wim:
+ *	Pointer to the WIMStruct for the WIM file.
+ *
+ * @imd:
+ *	Pointer to the image metadata structure for the image whose metadata
+ *	resource we are reading.  Its `metadata_lte' member specifies the lookup
+ *	table entry for the metadata resource.  The rest of the image metadata
+ *	entry will be filled in by this function.
+ *
+ * @lazy:
+ *	If true, only read the root directory.  The uncompressed metadata
+ *	resource is kept in memory, and the children of each directory are read
+ *	from it when load_dentry_children() is first called on the directory.
+ *	Until finish_lazy_metadata() is called, the image's inode list is empty
+ *	and its inodes' link counts only count the dentries read so far.
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS (0)
+ *	WIMLIB_ERR_INVALID_METADATA_RESOURCE
+ *	WIMLIB_ERR_NOMEM
+ *	WIMLIB_ERR_READ
+ *	WIMLIB_ERR_UNEXPECTED_END_OF_FILE
+ *	WIMLIB_ERR_DECOMPRESSION
+ */
+int
+read_metadata_resource(WIMStruct *wim, struct wim_image_metadata *imd,
+		       bool lazy)
+{
+	const struct wim_lookup_table_entry *metadata_lte;
+	const void *buf;
+	void *alloc_buf = NULL;
+	int ret;
+
+	metadata_lte = imd->metadata_lte;
+
+	DEBUG("Reading metadata resource (size=%"PRIu64").", metadata_lte->size);
+
+	/* If the WIM has an index file containing the uncompressed metadata
+	 * resource, with the correct checksum, use it directly.  Otherwise,
+	 * read the metadata resource into memory (it may be compressed) and
+	 * checksum it.  */
+	buf = wim_index_file_get_metadata(wim, metadata_lte);
+	if (!buf) {
+		ret = read_full_stream_into_alloc_buf(metadata_lte, &alloc_buf);
+		if (ret)
+			return ret;
+
+		if (!metadata_lte->dont_check_metadata_hash) {
+			u8 hash[SHA1_HASH_SIZE];
+
+			sha1_buffer(alloc_buf, metadata_lte->size, hash);
+			if (!hashes_equal(metadata_lte->hash, hash)) {
+				ERROR("Metadata resource is corrupted "
+				      "(invalid SHA-1 message digest)!");
+				ret = WIMLIB_ERR_INVALID_METADATA_RESOURCE;
+				goto out_free_buf;
+			}
+		}
+		buf = alloc_buf;
+	}
+
+	return parse_metadata_resource(buf, metadata_lte->size, alloc_buf,
+				       lazy, imd);
+
+out_free_buf:
+	FREE(alloc_buf);
+	return ret;
+}
+
+/* Read the children of the directory @dir, which is marked with
+ * 'children_not_loaded', in the lazily loaded image @imd.  Usually called
+ * through load_dentry_children().  */
+int
+do_load_dentry_children(struct wim_image_metadata *imd, struct wim_dentry *dir)
+{
+	struct wim_lazy_metadata *state = imd->lazy;
+	struct wim_dentry *child;
+	int ret;
+
+	wimlib_assert(state != NULL);
+
+	ret = read_dentry_children(state->buf, state->buf_len, dir,
+				   imd->arena);
+
+	/* Even on failure, any children that were read have been linked into
+	 * the tree and must be accounted for.  */
+	for_dentry_child(child, dir) {
+		check_inode(child->d_inode, imd->security_data);
+		inode_fixup_add_dentry(child, state->fixup);
+	}
 	return ret;
 }
 
+static int
+load_dentry_children_cb(struct wim_dentry *dentry, void *_imd)
+{
+	struct wim_image_metadata *imd = _imd;
+
+	if (!dentry->children_not_loaded)
+		return 0;
+	return do_load_dentry_children(imd, dentry);
+}
+
+/* Make sure the full subtree rooted at @dentry, which must be in the image of
+ * @wim currently selected with select_wim_image_lazy(), has been read from the
+ * metadata resource.  */
+int
+load_dentry_subtree(WIMStruct *wim, struct wim_dentry *dentry)
+{
+	struct wim_image_metadata *imd = wim_get_current_image_metadata(wim);
+
+	if (!imd->lazy)
+		return 0;
+	return for_dentry_in_tree(dentry, load_dentry_children_cb, imd);
+}
+
+/* Read the rest of the dentry tree of the lazily loaded image @imd, then build
+ * its inode list and release the metadata resource buffer.  Afterwards, the
+ * image is indistinguishable from one read with read_metadata_resource() with
+ * @lazy == false.  */
+int
+finish_lazy_metadata(struct wim_image_metadata *imd)
+{
+	struct wim_lazy_metadata *state = imd->lazy;
+	int ret;
+
+	if (!state)
+		return 0;
+
+	ret = for_dentry_in_tree(imd->root_dentry, load_dentry_children_cb, imd);
+	if (ret)
+		return ret;
+
+	inode_fixup_end(state->fixup, &imd->inode_list);
+	FREE(state->alloc_buf);
+	FREE(state);
+	imd->lazy = NULL;
+	DEBUG("Done parsing metadata resource.");
+	return 0;
+}
+
+/* Free the state of the lazily loaded image @imd, if any.  Its dentry tree must
+ * have already been freed.  */
+void
+free_lazy_metadata(struct wim_image_metadata *imd)
+{
+	struct wim_lazy_metadata *state = imd->lazy;
+
+	if (!state)
+		return;
+
+	inode_fixup_abort(state->fixup);
+	FREE(state->alloc_buf);
+	FREE(state);
+	imd->lazy = NULL;
+}
+
 static void
 recalculate_security_data_length(struct wim_security_data *sd)
 {
@@ -245,3 +427,25 @@ write_metadata_resource(WIMStruct *wim, int image, int write_resource_flags)
 	FREE(buf);
 	return ret;
 }
+
+/*
+ * Copy the dentry tree and security data of the image @image of @wim into the
+ * image metadata @imd, which must not have any yet.  The copy shares nothing
+ * with the original.  As in an image read from a WIM file, the inodes of the
+ * copy refer to their streams by SHA-1 message digest, so the streams of the
+ * original image must have been checksummed.  The caller is responsible for the
+ * reference counts of the streams.
+ */
+int
+clone_image_metadata(WIMStruct *wim, int image, struct wim_image_metadata *imd)
+{
+	u8 *buf;
+	size_t len;
+	int ret;
+
+	ret = prepare_metadata_resource(wim, image, &buf, &len);
+	if (ret)
+		return ret;
+
+	return parse_metadata_resource(buf, len, buf, false, imd);
+}
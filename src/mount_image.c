@@ -39,6 +39,7 @@
 #  error "FUSE mount not supported on Windows!  Please configure --without-fuse"
 #endif
 
+#include "wimlib/chunk_cache.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/metadata.h"
@@ -47,6 +48,7 @@
 #include "wimlib/reparse.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/unix_data.h"
+#include "wimlib/util.h"
 #include "wimlib/write.h"
 #include "wimlib/xml.h"
 
@@ -125,6 +127,11 @@ struct wimfs_fd {
 	 * even if the indices of the inode's alternate data streams are changed
 	 * by a deletion.  */
 	u32 f_stream_id;
+
+	/* Offset just past the end of the last read from this file descriptor.
+	 * A read starting here is considered sequential and triggers
+	 * readahead.  */
+	u64 f_next_read_offset;
 };
 
 #define WIMFS_FD(fi) ((struct wimfs_fd *)(uintptr_t)((fi)->fh))
@@ -166,6 +173,10 @@ struct wimfs_context {
 	/* Parameters for unmounting the image (can be set via extended
 	 * attribute "wimfs.unmount_info").  */
 	struct wimfs_unmount_info unmount_info;
+
+	/* Cache of decompressed chunks of compressed resources in the WIM, or
+	 * NULL if caching is disabled.  */
+	struct chunk_cache *chunk_cache;
 };
 
 #define WIMFS_CTX(fuse_ctx) ((struct wimfs_context*)(fuse_ctx)->private_data)
@@ -287,6 +298,7 @@ alloc_wimfs_fd(struct wim_inode *inode,
 	filedes_invalidate(&fd->f_staging_fd);
 	fd->f_idx       = i;
 	fd->f_stream_id = stream_id;
+	fd->f_next_read_offset = 0;
 	*fd_ret         = fd;
 	inode->i_fds[i] = fd;
 	inode->i_num_opened_fds++;
@@ -1182,10 +1194,14 @@ unmount_wimfs(void)
 		close_all_fds(wimfs_ctx);
 	}
 
-	if (unmount_flags & WIMLIB_UNMOUNT_FLAG_COMMIT)
+	if (unmount_flags & WIMLIB_UNMOUNT_FLAG_COMMIT) {
+		/* Stop the readahead threads before the WIM is modified.  */
+		free_chunk_cache(wimfs_ctx->chunk_cache);
+		wimfs_ctx->chunk_cache = NULL;
 		ret = commit_image(wimfs_ctx, unmount_flags, mq);
-	else
+	} else {
 		ret = 0;
+	}
 out:
 	/* Leave the image mounted if commit failed, unless this is a
 	 * forced unmount.  The user can retry without commit if they
@@ -1339,6 +1355,30 @@ wimfs_getxattr(const char *path, const char *name, char *value,
 			return copy_xattr(value, size,
 					  &ctx->mount_flags, sizeof(int));
 		}
+		if (!strcmp(name, "cache_stats")) {
+			struct chunk_cache_stats stats;
+			char buf[256];
+			int len;
+
+			if (!ctx->chunk_cache)
+				return -ENOATTR;
+			chunk_cache_get_stats(ctx->chunk_cache, &stats);
+			len = sprintf(buf,
+				      "hits=%"PRIu64"\n"
+				      "misses=%"PRIu64"\n"
+				      "evictions=%"PRIu64"\n"
+				      "readahead_chunks=%"PRIu64"\n"
+				      "readahead_waits=%"PRIu64"\n"
+				      "chunks=%"PRIu64"\n"
+				      "size=%"PRIu64"\n"
+				      "max_size=%"PRIu64"\n",
+				      stats.hits, stats.misses, stats.evictions,
+				      stats.readahead_chunks,
+				      stats.readahead_waits,
+				      stats.num_chunks, stats.cur_size,
+				      stats.max_size);
+			return copy_xattr(value, size, buf, len);
+		}
 		if (!strcmp(name, "unmount")) {
 			if (!may_unmount_wimfs())
 				return -EPERM;
@@ -1389,6 +1429,26 @@ wimfs_getxattr(const char *path, const char *name, char *value,
 	return lte->size;
 }
 
+static void *
+wimfs_init(struct fuse_conn_info *conn)
+{
+	struct wimfs_context *ctx = wimfs_get_context();
+
+	/* Threads must be created here rather than in wimlib_mount_image(),
+	 * since fuse_main() forks to daemonize the process after the mount
+	 * succeeds, and threads are not inherited across fork().  The number
+	 * of decompression threads set for the WIM is used as the number of
+	 * threads that decompress chunks ahead of sequential readers.  */
+	if (ctx->chunk_cache) {
+		unsigned num_threads = ctx->wim->num_decompression_threads;
+
+		if (num_threads == 0)
+			num_threads = get_default_num_threads();
+		chunk_cache_start_readahead(ctx->chunk_cache, num_threads);
+	}
+	return ctx;
+}
+
 static int
 wimfs_link(const char *existing_path, const char *new_path)
 {
@@ -1641,6 +1701,7 @@ wimfs_read(const char *path, char *buf, size_t size,
 {
 	struct wimfs_fd *fd = WIMFS_FD(fi);
 	const struct wim_lookup_table_entry *lte;
+	struct wimfs_context *ctx;
 	ssize_t ret;
 
 	lte = fd->f_lte;
@@ -1658,7 +1719,12 @@ wimfs_read(const char *path, char *buf, size_t size,
 
 	switch (lte->resource_location) {
 	case RESOURCE_IN_WIM:
-		if (read_partial_wim_stream_into_buf(lte, size, offset, buf))
+		ctx = wimfs_get_context();
+		if (offset == fd->f_next_read_offset)
+			chunk_cache_readahead(ctx->chunk_cache, lte, offset + size);
+		fd->f_next_read_offset = offset + size;
+		if (read_partial_wim_stream_cached(ctx->chunk_cache,
+						   lte, size, offset, buf))
 			ret = -errno;
 		else
 			ret = size;
@@ -1672,6 +1738,12 @@ wimfs_read(const char *path, char *buf, size_t size,
 		memcpy(buf, lte->attached_buffer + offset, size);
 		ret = size;
 		break;
+	case RESOURCE_IN_PIECES:
+		if (read_partial_stream_into_buf(lte, size, offset, buf))
+			ret = -errno;
+		else
+			ret = size;
+		break;
 	default:
 		ret = -EINVAL;
 		break;
@@ -2018,6 +2090,7 @@ static struct fuse_operations wimfs_operations = {
 	.ftruncate   = wimfs_ftruncate,
 	.getattr     = wimfs_getattr,
 	.getxattr    = wimfs_getxattr,
+	.init        = wimfs_init,
 	.link        = wimfs_link,
 	.listxattr   = wimfs_listxattr,
 	.mkdir       = wimfs_mkdir,
@@ -2120,11 +2193,20 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	ctx.mount_flags = mount_flags;
 	if (mount_flags & WIMLIB_MOUNT_FLAG_STREAM_INTERFACE_WINDOWS)
 		ctx.default_lookup_flags = LOOKUP_FLAG_ADS_OK;
+
+	/* Set up the cache of decompressed chunks, if enabled.  The readahead
+	 * threads are started later, by wimfs_init().  */
+	if (wim->mount_cache_size) {
+		ret = new_chunk_cache(wim->mount_cache_size, &ctx.chunk_cache);
+		if (ret)
+			goto out_unlock;
+	}
+
 	/* For read-write mount, create the staging directory.  */
 	if (mount_flags & WIMLIB_MOUNT_FLAG_READWRITE) {
 		ret = make_staging_dir(&ctx, staging_dir);
 		if (ret)
-			goto out_unlock;
+			goto out_free_chunk_cache;
 	}
 	ctx.owner_uid = getuid();
 	ctx.owner_gid = getgid();
@@ -2259,6 +2341,8 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	release_extra_refcnts(&ctx);
 	if (mount_flags & WIMLIB_MOUNT_FLAG_READWRITE)
 		delete_staging_dir(&ctx);
+out_free_chunk_cache:
+	free_chunk_cache(ctx.chunk_cache);
 out_unlock:
 	unlock_wim_for_append(wim);
 	return ret;
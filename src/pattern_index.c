@@ -0,0 +1,466 @@
+/*
+ * pattern_index.c
+ *
+ * An index of wildcard path patterns, as found in the [ExclusionList] and
+ * [ExclusionException] sections of a capture configuration file, that finds all
+ * the patterns matching a path without trying each pattern in turn.
+ *
+ * Each pattern is tagged with flags, and pattern_index_match() returns the
+ * bitwise OR of the flags of all patterns that match the path, with the same
+ * meaning of "match" as match_path() with @prefix_ok set.  There are two kinds
+ * of patterns:
+ *
+ * - Patterns that begin with a path separator must match the path, or one of
+ *   its ancestor directories, one path component at a time.  They are stored
+ *   in a trie of path components.  Components without wildcard characters are
+ *   kept in a sorted array at each node and found by binary search, so only
+ *   the components containing wildcards must be tried one by one.
+ *
+ * - Other patterns only match the file name.  Literal names are kept in a
+ *   sorted array, and patterns of the form "*SUFFIX" without other wildcards
+ *   (such as "*.mp3") in sorted arrays grouped by suffix length, so that each
+ *   group is searched with one binary search.  Only the remaining patterns are
+ *   tried one by one.
+ *
+ * The index does not copy the patterns; they must be kept until the index is
+ * freed.
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/error.h"
+#include "wimlib/paths.h"
+#include "wimlib/pattern_index.h"
+#include "wimlib/util.h"
+#include "wimlib/wildcard.h"
+
+#include <ctype.h>
+#include <string.h>
+
+struct pattern_node;
+
+/* A pattern, or a component of a pattern, as a string that is not
+ * null-terminated.  */
+struct pattern_entry {
+	const tchar *str;
+	size_t nchars;
+
+	/* Flags of the patterns that end with this entry.  */
+	u32 flags;
+
+	/* In the component trie, the node reached by this component.  */
+	struct pattern_node *node;
+};
+
+/* A list of pattern entries.  */
+struct pattern_list {
+	struct pattern_entry *entries;
+	size_t num_entries;
+	size_t num_alloc_entries;
+};
+
+/* A node of the trie of path components.  */
+struct pattern_node {
+	/* Components without wildcards, sorted with compare_names().  */
+	struct pattern_list literals;
+
+	/* Components with wildcards.  */
+	struct pattern_list globs;
+};
+
+/* Patterns "*SUFFIX" with suffixes of the same length.  */
+struct suffix_group {
+	size_t suffix_nchars;
+	struct pattern_list suffixes;
+};
+
+struct pattern_index {
+	bool ignore_case;
+
+	/* Root of the trie for patterns that begin with a path separator.  */
+	struct pattern_node root;
+
+	/* Patterns that match the file name only.  */
+	struct pattern_list literal_names;
+	struct suffix_group *suffix_groups;
+	size_t num_suffix_groups;
+	struct pattern_list glob_names;
+};
+
+/* Create a new, empty pattern index.  @ignore_case specifies whether the
+ * patterns match case insensitively.  */
+struct pattern_index *
+new_pattern_index(bool ignore_case)
+{
+	struct pattern_index *index;
+
+	index = CALLOC(1, sizeof(struct pattern_index));
+	if (index)
+		index->ignore_case = ignore_case;
+	return index;
+}
+
+static void
+destroy_pattern_node(struct pattern_node *node);
+
+static void
+destroy_pattern_list(struct pattern_list *list)
+{
+	for (size_t i = 0; i < list->num_entries; i++) {
+		if (list->entries[i].node) {
+			destroy_pattern_node(list->entries[i].node);
+			FREE(list->entries[i].node);
+		}
+	}
+	FREE(list->entries);
+}
+
+static void
+destroy_pattern_node(struct pattern_node *node)
+{
+	destroy_pattern_list(&node->literals);
+	destroy_pattern_list(&node->globs);
+}
+
+void
+free_pattern_index(struct pattern_index *index)
+{
+	if (!index)
+		return;
+	destroy_pattern_node(&index->root);
+	destroy_pattern_list(&index->literal_names);
+	for (size_t i = 0; i < index->num_suffix_groups; i++)
+		destroy_pattern_list(&index->suffix_groups[i].suffixes);
+	FREE(index->suffix_groups);
+	destroy_pattern_list(&index->glob_names);
+	FREE(index);
+}
+
+static bool
+has_wildcards(const tchar *str, size_t nchars)
+{
+	for (size_t i = 0; i < nchars; i++)
+		if (str[i] == T('*') || str[i] == T('?'))
+			return true;
+	return false;
+}
+
+/* Compare two names in the same way match_wildcard() compares characters.  */
+static int
+compare_names(const tchar *s1, size_t n1, const tchar *s2, size_t n2,
+	      bool ignore_case)
+{
+	size_t n = min(n1, n2);
+
+	for (size_t i = 0; i < n; i++) {
+		tchar c1 = s1[i];
+		tchar c2 = s2[i];
+
+		if (ignore_case) {
+			c1 = totlower(c1);
+			c2 = totlower(c2);
+		}
+		if (c1 != c2)
+			return (c1 < c2) ? -1 : 1;
+	}
+	return (n1 < n2) ? -1 : (n1 > n2) ? 1 : 0;
+}
+
+/* Binary search for a name in a sorted list.  Returns the index of the entry
+ * found, or the bitwise NOT of the position at which it would be inserted.  */
+static ssize_t
+search_sorted_list(const struct pattern_list *list,
+		   const tchar *str, size_t nchars, bool ignore_case)
+{
+	size_t lo = 0;
+	size_t hi = list->num_entries;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct pattern_entry *e = &list->entries[mid];
+		int res = compare_names(str, nchars, e->str, e->nchars,
+					ignore_case);
+		if (res == 0)
+			return mid;
+		if (res < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return ~(ssize_t)lo;
+}
+
+static struct pattern_entry *
+insert_entry(struct pattern_list *list, size_t pos,
+	     const tchar *str, size_t nchars)
+{
+	struct pattern_entry *e;
+
+	if (list->num_entries == list->num_alloc_entries) {
+		size_t new_num_alloc = max(list->num_alloc_entries * 2, 4);
+		struct pattern_entry *new_entries;
+
+		new_entries = REALLOC(list->entries,
+				      new_num_alloc * sizeof(list->entries[0]));
+		if (!new_entries)
+			return NULL;
+		list->entries = new_entries;
+		list->num_alloc_entries = new_num_alloc;
+	}
+	e = &list->entries[pos];
+	memmove(e + 1, e, (list->num_entries - pos) * sizeof(*e));
+	list->num_entries++;
+	e->str = str;
+	e->nchars = nchars;
+	e->flags = 0;
+	e->node = NULL;
+	return e;
+}
+
+/* Find or add the entry for @str in @list.  If @sorted, @list is kept sorted
+ * with compare_names(); otherwise entries are compared exactly and new ones are
+ * appended.  */
+static struct pattern_entry *
+get_entry(struct pattern_list *list, const tchar *str, size_t nchars,
+	  bool sorted, bool ignore_case)
+{
+	if (sorted) {
+		ssize_t i = search_sorted_list(list, str, nchars, ignore_case);
+
+		if (i >= 0)
+			return &list->entries[i];
+		return insert_entry(list, ~i, str, nchars);
+	}
+
+	for (size_t i = 0; i < list->num_entries; i++) {
+		struct pattern_entry *e = &list->entries[i];
+
+		if (e->nchars == nchars && !tmemcmp(e->str, str, nchars))
+			return e;
+	}
+	return insert_entry(list, list->num_entries, str, nchars);
+}
+
+/* Add a pattern that begins with a path separator to the component trie.  */
+static int
+add_path_pattern(struct pattern_index *index, const tchar *pat, u32 flags)
+{
+	struct pattern_node *node = &index->root;
+	struct pattern_entry *e;
+
+	do {
+		const tchar *comp = pat + 1;
+		const tchar *comp_end = comp;
+		bool glob;
+
+		while (*comp_end != T('\0') &&
+		       *comp_end != OS_PREFERRED_PATH_SEPARATOR)
+			comp_end++;
+
+		glob = has_wildcards(comp, comp_end - comp);
+		e = get_entry(glob ? &node->globs : &node->literals,
+			      comp, comp_end - comp, !glob, index->ignore_case);
+		if (!e)
+			return WIMLIB_ERR_NOMEM;
+
+		pat = comp_end;
+		if (*pat == T('\0'))
+			break;
+
+		if (!e->node) {
+			e->node = CALLOC(1, sizeof(struct pattern_node));
+			if (!e->node)
+				return WIMLIB_ERR_NOMEM;
+		}
+		node = e->node;
+	} while (1);
+
+	e->flags |= flags;
+	return 0;
+}
+
+/* Add a pattern that matches the file name only.  */
+static int
+add_name_pattern(struct pattern_index *index, const tchar *pat, u32 flags)
+{
+	size_t nchars = tstrlen(pat);
+	struct pattern_entry *e;
+
+	if (!has_wildcards(pat, nchars)) {
+		e = get_entry(&index->literal_names, pat, nchars, true,
+			      index->ignore_case);
+	} else if (pat[0] == T('*') && !has_wildcards(pat + 1, nchars - 1)) {
+		struct suffix_group *group = NULL;
+
+		for (size_t i = 0; i < index->num_suffix_groups; i++) {
+			if (index->suffix_groups[i].suffix_nchars == nchars - 1) {
+				group = &index->suffix_groups[i];
+				break;
+			}
+		}
+		if (!group) {
+			struct suffix_group *groups;
+
+			groups = REALLOC(index->suffix_groups,
+					 (index->num_suffix_groups + 1) *
+						sizeof(groups[0]));
+			if (!groups)
+				return WIMLIB_ERR_NOMEM;
+			index->suffix_groups = groups;
+			group = &groups[index->num_suffix_groups++];
+			memset(group, 0, sizeof(*group));
+			group->suffix_nchars = nchars - 1;
+		}
+		e = get_entry(&group->suffixes, pat + 1, nchars - 1, true,
+			      index->ignore_case);
+	} else {
+		e = get_entry(&index->glob_names, pat, nchars, false,
+			      index->ignore_case);
+	}
+	if (!e)
+		return WIMLIB_ERR_NOMEM;
+	e->flags |= flags;
+	return 0;
+}
+
+/*
+ * Add the wildcard pattern @pat, tagged with @flags, to the index.  The pattern
+ * must be in the form produced by mangle_pat(), and it must be kept until the
+ * index is freed.
+ *
+ * Returns 0 or WIMLIB_ERR_NOMEM.
+ */
+int
+pattern_index_add(struct pattern_index *index, const tchar *pat, u32 flags)
+{
+	if (pat[0] == OS_PREFERRED_PATH_SEPARATOR)
+		return add_path_pattern(index, pat, flags);
+	else
+		return add_name_pattern(index, pat, flags);
+}
+
+static u32
+match_path_components(const struct pattern_index *index,
+		      const struct pattern_node *node,
+		      const tchar *path, const tchar *path_end);
+
+/* The path component ending at @comp_end matched the entry @e.  A pattern that
+ * ends with @e matches the path, or an ancestor of it; longer patterns must
+ * match the rest of the path.  */
+static u32
+matched_component(const struct pattern_index *index,
+		  const struct pattern_entry *e,
+		  const tchar *comp_end, const tchar *path_end)
+{
+	u32 flags = e->flags;
+
+	if (e->node && comp_end != path_end)
+		flags |= match_path_components(index, e->node,
+					       comp_end, path_end);
+	return flags;
+}
+
+/* Match the path components starting at the path separator @path against the
+ * children of @node.  */
+static u32
+match_path_components(const struct pattern_index *index,
+		      const struct pattern_node *node,
+		      const tchar *path, const tchar *path_end)
+{
+	const tchar *comp = path + 1;
+	const tchar *comp_end = comp;
+	size_t comp_nchars;
+	ssize_t i;
+	u32 flags = 0;
+
+	while (comp_end != path_end && *comp_end != OS_PREFERRED_PATH_SEPARATOR)
+		comp_end++;
+	comp_nchars = comp_end - comp;
+
+	i = search_sorted_list(&node->literals, comp, comp_nchars,
+			       index->ignore_case);
+	if (i >= 0)
+		flags |= matched_component(index, &node->literals.entries[i],
+					   comp_end, path_end);
+
+	for (size_t j = 0; j < node->globs.num_entries; j++) {
+		const struct pattern_entry *e = &node->globs.entries[j];
+
+		if (match_wildcard(comp, comp_nchars, e->str, e->nchars,
+				   index->ignore_case))
+			flags |= matched_component(index, e, comp_end, path_end);
+	}
+	return flags;
+}
+
+static u32
+match_name(const struct pattern_index *index,
+	   const tchar *name, size_t name_nchars)
+{
+	u32 flags = 0;
+	ssize_t i;
+
+	i = search_sorted_list(&index->literal_names, name, name_nchars,
+			       index->ignore_case);
+	if (i >= 0)
+		flags |= index->literal_names.entries[i].flags;
+
+	for (size_t j = 0; j < index->num_suffix_groups; j++) {
+		const struct suffix_group *group = &index->suffix_groups[j];
+
+		if (group->suffix_nchars > name_nchars)
+			continue;
+		i = search_sorted_list(&group->suffixes,
+				       &name[name_nchars - group->suffix_nchars],
+				       group->suffix_nchars,
+				       index->ignore_case);
+		if (i >= 0)
+			flags |= group->suffixes.entries[i].flags;
+	}
+
+	for (size_t j = 0; j < index->glob_names.num_entries; j++) {
+		const struct pattern_entry *e = &index->glob_names.entries[j];
+
+		if (match_wildcard(name, name_nchars, e->str, e->nchars,
+				   index->ignore_case))
+			flags |= e->flags;
+	}
+	return flags;
+}
+
+/*
+ * Return the bitwise OR of the flags of all patterns in @index that match
+ * @path.  @path must be in the form required by match_path(), with
+ * OS_PREFERRED_PATH_SEPARATOR as the path separator.  A pattern matches if
+ * match_path() with @prefix_ok set would return %true for it.
+ */
+u32
+pattern_index_match(const struct pattern_index *index,
+		    const tchar *path, size_t path_nchars)
+{
+	const tchar *name = path_basename_with_len(path, path_nchars);
+
+	return match_name(index, name, &path[path_nchars] - name) |
+	       match_path_components(index, &index->root,
+				     path, &path[path_nchars]);
+}
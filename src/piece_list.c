@@ -0,0 +1,393 @@
+/*
+ * piece_list.c
+ *
+ * Content-defined splitting of large streams into pieces.
+ *
+ * When a large file is modified in place, or when two large files mostly
+ * differ by inserted or deleted data, single-instance storage of whole streams
+ * cannot share anything between the versions.  To handle this case, a large
+ * stream may instead be stored as a "piece list": a short resource, flagged
+ * with WIM_RESHDR_FLAG_PIECE_LIST in the lookup table, that gives the SHA1
+ * message digests of the pieces whose concatenation is the stream's data.  The
+ * lookup table entry of the stream itself still carries the SHA1 message digest
+ * of the full stream, so dentries refer to the stream as usual.
+ *
+ * Each piece is an ordinary stream in the lookup table.  Pieces are therefore
+ * single-instanced just like other streams: against each other, against
+ * whole small files, and across images.  The reference count of a piece
+ * includes one reference for each occurrence of the piece in the piece list of
+ * each stream that is referenced.
+ *
+ * The piece boundaries are chosen with a rolling "gear" hash over the data, so
+ * that an insertion or deletion only changes the pieces near it; the pieces
+ * after it are found again at their new offsets.  The boundary condition is
+ * harder to satisfy before the average piece size and easier after it, which
+ * keeps piece sizes closer to the average (the "normalized chunking" of
+ * FastCDC).
+ *
+ * The on-disk format of a piece list is:
+ *
+ *	le32 magic (PIECE_LIST_MAGIC)
+ *	le32 number of pieces
+ *	le64 uncompressed size of the stream
+ *	u8 [number of pieces][20] SHA1 message digests of the pieces
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/assert.h"
+#include "wimlib/endianness.h"
+#include "wimlib/error.h"
+#include "wimlib/lookup_table.h"
+#include "wimlib/piece_list.h"
+#include "wimlib/resource.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+
+#include <string.h>
+
+#define PIECE_LIST_MAGIC	0x4c435057	/* "WPCL" */
+
+struct piece_list_header_disk {
+	le32 magic;
+	le32 num_pieces;
+	le64 stream_size;
+} _packed_attribute;
+
+/* Masks for the boundary condition.  The gear hash of a position depends on the
+ * 64 bytes ending at that position, with the oldest byte only affecting the
+ * highest bit, so the masks select high bits.  PIECE_MASK_SMALL, used before
+ * the average piece size is reached, has two more bits than log2 of the average
+ * piece size; PIECE_MASK_LARGE, used after, has two fewer.  */
+#define PIECE_MASK_SMALL	(~(u64)0 << (64 - 18))
+#define PIECE_MASK_LARGE	(~(u64)0 << (64 - 14))
+
+/* The boundary condition is not tested until this many bytes into a piece, and
+ * since the hash only depends on the last 64 bytes, the bytes before that do
+ * not need to be hashed at all.  */
+#define PIECE_SKIP_SIZE		(PIECE_MIN_SIZE - 64)
+
+static u64 gear_table[256];
+
+/* Fill in the table of random values for the gear hash.  The values must never
+ * change, since they determine where streams are split and therefore whether
+ * pieces of streams written at different times are shared.  */
+static void
+init_gear_table(void)
+{
+	u64 x = 0x57494d4c49422031ULL;
+
+	if (gear_table[ARRAY_LEN(gear_table) - 1] != 0)
+		return;
+
+	for (size_t i = 0; i < ARRAY_LEN(gear_table); i++) {
+		/* splitmix64  */
+		u64 z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear_table[i] = z ^ (z >> 31);
+	}
+}
+
+struct piece_list *
+new_piece_list(u32 num_pieces)
+{
+	struct piece_list *pl;
+
+	pl = MALLOC(sizeof(struct piece_list) +
+		    (size_t)num_pieces * SHA1_HASH_SIZE);
+	if (pl == NULL)
+		return NULL;
+	pl->table = NULL;
+	pl->wim = NULL;
+	pl->num_pieces = num_pieces;
+	return pl;
+}
+
+struct piece_list *
+clone_piece_list(const struct piece_list *pl)
+{
+	return memdup(pl, sizeof(struct piece_list) +
+			  (size_t)pl->num_pieces * SHA1_HASH_SIZE);
+}
+
+/* Return the on-disk representation of the piece list @pl of a stream of size
+ * @stream_size, in a newly allocated buffer whose size is returned in
+ * @size_ret.  */
+void *
+serialize_piece_list(const struct piece_list *pl, u64 stream_size,
+		     size_t *size_ret)
+{
+	struct piece_list_header_disk *hdr;
+	size_t size;
+
+	size = sizeof(*hdr) + (size_t)pl->num_pieces * SHA1_HASH_SIZE;
+	hdr = MALLOC(size);
+	if (hdr == NULL)
+		return NULL;
+	hdr->magic = cpu_to_le32(PIECE_LIST_MAGIC);
+	hdr->num_pieces = cpu_to_le32(pl->num_pieces);
+	hdr->stream_size = cpu_to_le64(stream_size);
+	memcpy(hdr + 1, pl->hashes, (size_t)pl->num_pieces * SHA1_HASH_SIZE);
+	*size_ret = size;
+	return hdr;
+}
+
+/*
+ * Read the piece list of @lte, a stream entry just read from the lookup table
+ * of @wim with WIM_RESHDR_FLAG_PIECE_LIST set, and change the stream's location
+ * from the resource containing the piece list to RESOURCE_IN_PIECES, with the
+ * pieces to be looked up in @table.
+ */
+int
+lte_load_piece_list(struct wim_lookup_table_entry *lte, WIMStruct *wim,
+		    struct wim_lookup_table *table)
+{
+	const struct piece_list_header_disk *hdr;
+	struct piece_list *pl;
+	struct wim_reshdr reshdr;
+	void *buf;
+	u32 num_pieces;
+	int ret;
+
+	wimlib_assert(lte->resource_location == RESOURCE_IN_WIM);
+
+	if ((lte->flags & (WIM_RESHDR_FLAG_PACKED_STREAMS |
+			   WIM_RESHDR_FLAG_METADATA)) ||
+	    lte->size < sizeof(*hdr) || wim_is_pipable(wim))
+		goto invalid;
+
+	ret = read_full_stream_into_alloc_buf(lte, &buf);
+	if (ret)
+		return ret;
+
+	hdr = buf;
+	num_pieces = le32_to_cpu(hdr->num_pieces);
+	if (le32_to_cpu(hdr->magic) != PIECE_LIST_MAGIC ||
+	    lte->size != sizeof(*hdr) + (u64)num_pieces * SHA1_HASH_SIZE)
+	{
+		FREE(buf);
+		goto invalid;
+	}
+
+	pl = new_piece_list(num_pieces);
+	if (pl == NULL) {
+		FREE(buf);
+		return WIMLIB_ERR_NOMEM;
+	}
+	memcpy(pl->hashes, hdr + 1, (size_t)num_pieces * SHA1_HASH_SIZE);
+	pl->table = table;
+	pl->wim = wim;
+	wim_res_spec_to_hdr(lte->rspec, &reshdr);
+	reshdr.flags = lte->flags;
+	copy_reshdr(&pl->reshdr, &reshdr);
+
+	lte_put_resource(lte);
+	lte->resource_location = RESOURCE_IN_PIECES;
+	lte->piece_list = pl;
+	lte->size = le64_to_cpu(hdr->stream_size);
+	lte->flags = 0;
+	FREE(buf);
+	return 0;
+
+invalid:
+	ERROR("Invalid piece list in lookup table entry");
+	return WIMLIB_ERR_INVALID_LOOKUP_TABLE_ENTRY;
+}
+
+/* Drop the references that the piece list @pl holds to its pieces in @table.
+ */
+void
+piece_list_put_pieces(const struct piece_list *pl,
+		      struct wim_lookup_table *table)
+{
+	struct wim_lookup_table_entry *piece;
+
+	for (u32 i = 0; i < pl->num_pieces; i++) {
+		piece = lookup_stream(table, pl->hashes[i]);
+		if (piece && piece->refcnt &&
+		    piece->resource_location != RESOURCE_IN_PIECES)
+			lte_decrement_refcnt(piece, table);
+	}
+}
+
+/* Count the references that the piece list @pl holds to its pieces in @table
+ * in the pieces' @real_refcnt.  */
+void
+piece_list_tally_refcnts(const struct piece_list *pl,
+			 const struct wim_lookup_table *table)
+{
+	struct wim_lookup_table_entry *piece;
+
+	for (u32 i = 0; i < pl->num_pieces; i++) {
+		piece = lookup_stream(table, pl->hashes[i]);
+		if (piece)
+			piece->real_refcnt++;
+	}
+}
+
+struct splitter_ctx {
+	SHA_CTX stream_sha_ctx;
+	SHA_CTX piece_sha_ctx;
+	u64 hash;
+	u64 piece_size;
+	u64 offset;
+	struct piece_list *pl;
+	u64 *offsets;
+	u32 alloc_pieces;
+};
+
+/* Finish the current piece, which ends at the current offset.  */
+static int
+splitter_end_piece(struct splitter_ctx *ctx)
+{
+	struct piece_list *pl = ctx->pl;
+
+	if (pl->num_pieces == ctx->alloc_pieces) {
+		u32 new_alloc = ctx->alloc_pieces * 2;
+		u64 *new_offsets;
+
+		pl = REALLOC(pl, sizeof(struct piece_list) +
+				 (size_t)new_alloc * SHA1_HASH_SIZE);
+		if (pl == NULL)
+			return WIMLIB_ERR_NOMEM;
+		ctx->pl = pl;
+		new_offsets = REALLOC(ctx->offsets,
+				      ((size_t)new_alloc + 1) * sizeof(u64));
+		if (new_offsets == NULL)
+			return WIMLIB_ERR_NOMEM;
+		ctx->offsets = new_offsets;
+		ctx->alloc_pieces = new_alloc;
+	}
+
+	sha1_final(pl->hashes[pl->num_pieces], &ctx->piece_sha_ctx);
+	ctx->offsets[pl->num_pieces++] = ctx->offset - ctx->piece_size;
+	sha1_init(&ctx->piece_sha_ctx);
+	ctx->piece_size = 0;
+	ctx->hash = 0;
+	return 0;
+}
+
+static int
+splitter_cb(const void *chunk, size_t size, void *_ctx)
+{
+	struct splitter_ctx *ctx = _ctx;
+	const u8 *p = chunk;
+	const u8 * const end = p + size;
+	const u8 *piece_start = p;
+	u64 hash = ctx->hash;
+	int ret;
+
+	sha1_update(&ctx->stream_sha_ctx, chunk, size);
+
+	while (p != end) {
+		if (ctx->piece_size < PIECE_SKIP_SIZE) {
+			size_t n = min((size_t)(end - p),
+				       (size_t)(PIECE_SKIP_SIZE - ctx->piece_size));
+			p += n;
+			ctx->offset += n;
+			ctx->piece_size += n;
+			continue;
+		}
+
+		hash = (hash << 1) + gear_table[*p++];
+		ctx->offset++;
+		ctx->piece_size++;
+
+		if (ctx->piece_size < PIECE_MIN_SIZE)
+			continue;
+		if (ctx->piece_size < PIECE_AVG_SIZE) {
+			if (hash & PIECE_MASK_SMALL)
+				continue;
+		} else if (ctx->piece_size < PIECE_MAX_SIZE) {
+			if (hash & PIECE_MASK_LARGE)
+				continue;
+		}
+
+		sha1_update(&ctx->piece_sha_ctx, piece_start, p - piece_start);
+		piece_start = p;
+		ret = splitter_end_piece(ctx);
+		if (ret)
+			return ret;
+		hash = 0;
+	}
+	sha1_update(&ctx->piece_sha_ctx, piece_start, p - piece_start);
+	ctx->hash = hash;
+	return 0;
+}
+
+/*
+ * Read the data of the stream @lte and split it into pieces at content-defined
+ * boundaries.
+ *
+ * On success, returns 0, the SHA1 message digest of the full stream in
+ * @stream_hash, a new piece list (with no table or WIM set) in @pl_ret, and in
+ * @offsets_ret an array of (number of pieces + 1) offsets giving the start of
+ * each piece in the stream, followed by the size of the stream.  Both must be
+ * freed with FREE().
+ */
+int
+split_stream_into_pieces(const struct wim_lookup_table_entry *lte,
+			 u8 stream_hash[SHA1_HASH_SIZE],
+			 struct piece_list **pl_ret, u64 **offsets_ret)
+{
+	struct splitter_ctx ctx;
+	int ret;
+
+	init_gear_table();
+
+	ctx.alloc_pieces = lte->size / PIECE_AVG_SIZE + 16;
+	ctx.pl = new_piece_list(ctx.alloc_pieces);
+	ctx.offsets = MALLOC(((size_t)ctx.alloc_pieces + 1) * sizeof(u64));
+	if (ctx.pl == NULL || ctx.offsets == NULL) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out_free;
+	}
+	ctx.pl->num_pieces = 0;
+	ctx.hash = 0;
+	ctx.piece_size = 0;
+	ctx.offset = 0;
+	sha1_init(&ctx.stream_sha_ctx);
+	sha1_init(&ctx.piece_sha_ctx);
+
+	ret = read_stream_range(lte, 0, lte->size, splitter_cb, &ctx);
+	if (ret)
+		goto out_free;
+
+	if (ctx.piece_size != 0) {
+		ret = splitter_end_piece(&ctx);
+		if (ret)
+			goto out_free;
+	}
+	ctx.offsets[ctx.pl->num_pieces] = ctx.offset;
+	sha1_final(stream_hash, &ctx.stream_sha_ctx);
+
+	*pl_ret = ctx.pl;
+	*offsets_ret = ctx.offsets;
+	return 0;
+
+out_free:
+	FREE(ctx.pl);
+	FREE(ctx.offsets);
+	return ret;
+}
@@ -0,0 +1,372 @@
+/*
+ * read_thread.c
+ *
+ * Read and checksum a list of streams on a separate thread, while the calling
+ * thread processes the data.
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+/*
+ * read_stream_list_in_thread() runs read_stream_list() on a reader thread, with
+ * callbacks that pass everything back to the calling thread through a queue of
+ * messages.  The calling thread then calls the real callbacks, in the same
+ * order and with the same data as read_stream_list() would have, so that the
+ * callbacks never run on another thread and need no locking.  Meanwhile the
+ * reader thread goes on reading, and computing the SHA1 message digest of, the
+ * next data.
+ *
+ * The data is copied into a fixed number of buffers, which the calling thread
+ * hands back once it has consumed them; the reader thread waits for a buffer
+ * when all are in use.
+ *
+ * The begin_stream callback may remove the stream from the list, or decide that
+ * the stream is not to be read at all, so the reader thread waits for it to
+ * return before going on.  All data sent before it has been consumed by then,
+ * so begin_stream callbacks may freely inspect and modify the list.  The other
+ * callbacks do not make the reader thread wait.  An error returned by any
+ * callback is passed on to the reader thread, which stops reading at the next
+ * opportunity.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+#include "wimlib/assert.h"
+#include "wimlib/error.h"
+#include "wimlib/read_thread.h"
+#include "wimlib/spsc_queue.h"
+#include "wimlib/util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+enum read_thread_msg_type {
+	READ_THREAD_MSG_BEGIN_STREAM,
+	READ_THREAD_MSG_DATA,
+	READ_THREAD_MSG_END_STREAM,
+	READ_THREAD_MSG_DONE,
+};
+
+struct read_thread_msg {
+	enum read_thread_msg_type type;
+
+	/* For BEGIN_STREAM and END_STREAM: the stream.  */
+	struct wim_lookup_table_entry *lte;
+
+	/* For BEGIN_STREAM: the return value of the begin_stream callback.
+	 * For END_STREAM: the status of reading the stream.  For DONE: the
+	 * return value of read_stream_list().  */
+	int status;
+
+	/* For DATA: the data, and the number of bytes of it filled in.  */
+	u8 *data;
+	size_t size;
+};
+
+struct read_thread {
+	/* Arguments for read_stream_list().  */
+	struct list_head *stream_list;
+	size_t list_head_offset;
+	int flags;
+	struct io_ring *ring;
+
+	pthread_t thread;
+
+	/* Messages from the reader thread to the calling thread.  */
+	struct spsc_queue msgs;
+
+	/* DATA messages handed back to the reader thread.  */
+	struct spsc_queue free_data_msgs;
+
+	/* BEGIN_STREAM messages handed back with the callback's status.  */
+	struct spsc_queue begin_replies;
+
+	struct read_thread_msg data_msgs[READ_THREAD_NUM_BUFS];
+	u8 *bufs;
+
+	/* Only one of each of these is ever outstanding, since the reader
+	 * thread waits for each BEGIN_STREAM message to be replied to and the
+	 * calling thread handles messages in order.  */
+	struct read_thread_msg begin_msg;
+	struct read_thread_msg end_msg;
+	struct read_thread_msg done_msg;
+
+	/* Used only by the reader thread: the DATA message being filled, or
+	 * NULL, and the number of DATA messages never used yet.  */
+	struct read_thread_msg *cur_data_msg;
+	unsigned num_unused_data_msgs;
+
+	/* The first error returned by a callback on the calling thread, or 0.
+	 * Read by the reader thread to stop early.  */
+	int status;
+};
+
+static inline int
+callback_status(const struct read_thread *rt)
+{
+	return __atomic_load_n(&rt->status, __ATOMIC_RELAXED);
+}
+
+static void
+send_cur_data_msg(struct read_thread *rt)
+{
+	if (rt->cur_data_msg) {
+		spsc_queue_put(&rt->msgs, rt->cur_data_msg);
+		rt->cur_data_msg = NULL;
+	}
+}
+
+static int
+reader_begin_stream(struct wim_lookup_table_entry *lte, void *_rt)
+{
+	struct read_thread *rt = _rt;
+	int status;
+
+	status = callback_status(rt);
+	if (status)
+		return status;
+
+	rt->begin_msg.lte = lte;
+	spsc_queue_put(&rt->msgs, &rt->begin_msg);
+	spsc_queue_get(&rt->begin_replies, NULL);
+	return rt->begin_msg.status;
+}
+
+static int
+reader_consume_chunk(const void *chunk, size_t size, void *_rt)
+{
+	struct read_thread *rt = _rt;
+	const u8 *p = chunk;
+	int status;
+
+	status = callback_status(rt);
+	if (status)
+		return status;
+
+	while (size != 0) {
+		struct read_thread_msg *msg = rt->cur_data_msg;
+		size_t n;
+
+		if (!msg) {
+			if (rt->num_unused_data_msgs != 0)
+				msg = &rt->data_msgs[--rt->num_unused_data_msgs];
+			else
+				msg = spsc_queue_get(&rt->free_data_msgs, NULL);
+			msg->size = 0;
+			rt->cur_data_msg = msg;
+		}
+
+		n = min(size, READ_THREAD_BUF_SIZE - msg->size);
+		memcpy(&msg->data[msg->size], p, n);
+		msg->size += n;
+		p += n;
+		size -= n;
+
+		if (msg->size == READ_THREAD_BUF_SIZE)
+			send_cur_data_msg(rt);
+	}
+	return 0;
+}
+
+static int
+reader_end_stream(struct wim_lookup_table_entry *lte, int status, void *_rt)
+{
+	struct read_thread *rt = _rt;
+
+	send_cur_data_msg(rt);
+	rt->end_msg.lte = lte;
+	rt->end_msg.status = status;
+	spsc_queue_put(&rt->msgs, &rt->end_msg);
+
+	/* An error from the end_stream callback itself is noticed when the next
+	 * stream is begun.  */
+	return status;
+}
+
+static void *
+reader_thread_proc(void *_rt)
+{
+	struct read_thread *rt = _rt;
+	const struct read_stream_list_callbacks cbs = {
+		.begin_stream		= reader_begin_stream,
+		.begin_stream_ctx	= rt,
+		.consume_chunk		= reader_consume_chunk,
+		.consume_chunk_ctx	= rt,
+		.end_stream		= reader_end_stream,
+		.end_stream_ctx		= rt,
+	};
+
+	rt->done_msg.status = read_stream_list(rt->stream_list,
+					       rt->list_head_offset,
+					       &cbs, rt->flags, rt->ring);
+	spsc_queue_put(&rt->msgs, &rt->done_msg);
+	return NULL;
+}
+
+static void
+set_callback_status(struct read_thread *rt, int status)
+{
+	__atomic_store_n(&rt->status, status, __ATOMIC_RELAXED);
+}
+
+/* Call the callbacks for the messages from the reader thread until it is done.
+ * Returns the first error from a callback or from read_stream_list().  */
+static int
+handle_msgs(struct read_thread *rt, const struct read_stream_list_callbacks *cbs)
+{
+	int status = 0;
+	int ret;
+
+	for (;;) {
+		struct read_thread_msg *msg = spsc_queue_get(&rt->msgs, NULL);
+
+		switch (msg->type) {
+		case READ_THREAD_MSG_BEGIN_STREAM:
+			if (status)
+				msg->status = status;
+			else
+				msg->status = (*cbs->begin_stream)(msg->lte,
+								   cbs->begin_stream_ctx);
+			spsc_queue_put(&rt->begin_replies, msg);
+			break;
+		case READ_THREAD_MSG_DATA:
+			if (!status) {
+				status = (*cbs->consume_chunk)(msg->data,
+							       msg->size,
+							       cbs->consume_chunk_ctx);
+				set_callback_status(rt, status);
+			}
+			spsc_queue_put(&rt->free_data_msgs, msg);
+			break;
+		case READ_THREAD_MSG_END_STREAM:
+			ret = (*cbs->end_stream)(msg->lte,
+						 msg->status ? msg->status : status,
+						 cbs->end_stream_ctx);
+			if (ret && !status) {
+				status = ret;
+				set_callback_status(rt, status);
+			}
+			break;
+		case READ_THREAD_MSG_DONE:
+			return status ? status : msg->status;
+		}
+	}
+}
+
+static void
+free_read_thread(struct read_thread *rt)
+{
+	spsc_queue_destroy(&rt->begin_replies);
+	spsc_queue_destroy(&rt->free_data_msgs);
+	spsc_queue_destroy(&rt->msgs);
+	FREE(rt->bufs);
+	FREE(rt);
+}
+
+static struct read_thread *
+new_read_thread(void)
+{
+	struct read_thread *rt;
+
+	rt = CALLOC(1, sizeof(*rt));
+	if (!rt)
+		return NULL;
+
+	rt->bufs = MALLOC(READ_THREAD_MAX_MEMORY);
+	if (!rt->bufs)
+		goto err;
+	for (unsigned i = 0; i < READ_THREAD_NUM_BUFS; i++) {
+		rt->data_msgs[i].type = READ_THREAD_MSG_DATA;
+		rt->data_msgs[i].data = &rt->bufs[i * READ_THREAD_BUF_SIZE];
+	}
+	rt->num_unused_data_msgs = READ_THREAD_NUM_BUFS;
+	rt->begin_msg.type = READ_THREAD_MSG_BEGIN_STREAM;
+	rt->end_msg.type = READ_THREAD_MSG_END_STREAM;
+	rt->done_msg.type = READ_THREAD_MSG_DONE;
+
+	if (spsc_queue_init(&rt->msgs, READ_THREAD_NUM_BUFS + 3) ||
+	    spsc_queue_init(&rt->free_data_msgs, READ_THREAD_NUM_BUFS) ||
+	    spsc_queue_init(&rt->begin_replies, 1))
+		goto err;
+	return rt;
+
+err:
+	free_read_thread(rt);
+	return NULL;
+}
+
+/*
+ * Like read_stream_list(), but the streams are read, and their SHA1 message
+ * digests computed or verified, by a separate thread.  The callbacks are still
+ * all called on the calling thread, in the same order.  All three callbacks
+ * must be provided.
+ *
+ * The consume_chunk and end_stream callbacks run while the reader thread goes
+ * on reading the stream list, so they must not modify the list, or any stream
+ * other than the one given, except as permitted by read_stream_list().  The
+ * begin_stream callback runs while the reader thread waits.
+ *
+ * If the reader thread cannot be started, the streams are read by the calling
+ * thread instead.
+ */
+int
+read_stream_list_in_thread(struct list_head *stream_list,
+			   size_t list_head_offset,
+			   const struct read_stream_list_callbacks *cbs,
+			   int flags,
+			   struct io_ring *ring)
+{
+	struct read_thread *rt;
+	int ret;
+
+	wimlib_assert(cbs->begin_stream && cbs->consume_chunk && cbs->end_stream);
+
+	rt = new_read_thread();
+	if (!rt)
+		goto read_directly;
+
+	rt->stream_list = stream_list;
+	rt->list_head_offset = list_head_offset;
+	rt->flags = flags;
+	rt->ring = ring;
+
+	ret = pthread_create(&rt->thread, NULL, reader_thread_proc, rt);
+	if (ret) {
+		errno = ret;
+		WARNING_WITH_ERRNO("Failed to create reader thread");
+		free_read_thread(rt);
+		goto read_directly;
+	}
+
+	ret = handle_msgs(rt, cbs);
+
+	pthread_join(rt->thread, NULL);
+	free_read_thread(rt);
+	return ret;
+
+read_directly:
+	return read_stream_list(stream_list, list_head_offset, cbs, flags, ring);
+}
+
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
@@ -31,6 +31,7 @@
 #include "wimlib/error.h"
 #include "wimlib/glob.h"
 #include "wimlib/lookup_table.h"
+#include "wimlib/piece_list.h"
 #include "wimlib/wim.h"
 
 #define WIMLIB_REF_MASK_PUBLIC (WIMLIB_REF_FLAG_GLOB_ENABLE | \
@@ -43,6 +44,16 @@ struct lookup_tables {
 	struct wim_lookup_table *dest_table;
 };
 
+/* The pieces of a stream split into pieces are referenced along with it, so
+ * look them up in the lookup table the stream is being moved to.  */
+static void
+lte_set_piece_table(struct wim_lookup_table_entry *lte,
+		    struct wim_lookup_table *table)
+{
+	if (lte->resource_location == RESOURCE_IN_PIECES)
+		lte->piece_list->table = table;
+}
+
 static int
 lte_gift(struct wim_lookup_table_entry *lte, void *_tables)
 {
@@ -54,6 +65,7 @@ lte_gift(struct wim_lookup_table_entry *lte, void *_tables)
 	if (lookup_stream(dest_table, lte->hash)) {
 		free_lookup_table_entry(lte);
 	} else {
+		lte_set_piece_table(lte, dest_table);
 		lte->out_refcnt = 1;
 		lookup_table_insert(dest_table, lte);
 	}
@@ -71,6 +83,7 @@ lte_clone_if_new(struct wim_lookup_table_entry *lte, void *_lookup_table)
 	lte = clone_lookup_table_entry(lte);
 	if (lte == NULL)
 		return WIMLIB_ERR_NOMEM;
+	lte_set_piece_table(lte, lookup_table);
 	lte->out_refcnt = 1;
 	lookup_table_insert(lookup_table, lte);
 	return 0;
@@ -183,8 +196,12 @@ reference_resource_paths(WIMStruct *wim,
 	if (ret)
 		goto out_free_resource_wims;
 
-	for (i = 0; i < num_resource_wimfiles; i++)
+	for (i = 0; i < num_resource_wimfiles; i++) {
+		resource_wims[i]->num_decompression_threads =
+			wim->num_decompression_threads;
+		resource_wims[i]->max_memory = wim->max_memory;
 		list_add_tail(&resource_wims[i]->subwim_node, &wim->subwims);
+	}
 
 	ret = 0;
 	goto out_free_array;
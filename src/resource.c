@@ -27,10 +27,13 @@
 #endif
 
 #include "wimlib/assert.h"
+#include "wimlib/chunk_decompressor.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
+#include "wimlib/io_ring.h"
 #include "wimlib/lookup_table.h"
+#include "wimlib/piece_list.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
 #include "wimlib/wim.h"
@@ -96,6 +99,137 @@ struct data_range {
 	u64 size;
 };
 
+/* Position in a list of data ranges whose data is being fed to a callback.  */
+struct data_range_cursor {
+	const struct data_range *cur_range;
+	const struct data_range *end_range;
+	u64 cur_range_pos;
+	u64 cur_range_end;
+};
+
+/* Minimum number of chunks a read must span before it is worth handing the
+ * chunks off to a parallel chunk decompressor.  */
+#define PARALLEL_DECOMPRESSION_MIN_CHUNKS 4
+
+/* Feed the data in an uncompressed chunk that falls within the requested
+ * ranges to the callback function, advancing @cursor.  The chunk must contain
+ * at least the byte at @cursor->cur_range_pos.  */
+static int
+feed_chunk_to_ranges(const u8 *ubuf, u64 chunk_start_offset,
+		     u64 chunk_end_offset, struct data_range_cursor *cursor,
+		     consume_data_callback_t cb, void *cb_ctx)
+{
+	int ret;
+
+	wimlib_assert(cursor->cur_range_pos >= chunk_start_offset);
+	wimlib_assert(cursor->cur_range_pos < chunk_end_offset);
+
+	do {
+		size_t start, end, size;
+
+		/* Calculate how many bytes of data should be sent to the
+		 * callback function, taking into account that data sent to the
+		 * callback function must not overlap range boundaries.  */
+		start = cursor->cur_range_pos - chunk_start_offset;
+		end = min(cursor->cur_range_end, chunk_end_offset) - chunk_start_offset;
+		size = end - start;
+
+		ret = (*cb)(&ubuf[start], size, cb_ctx);
+		if (ret)
+			return ret;
+
+		cursor->cur_range_pos += size;
+		if (cursor->cur_range_pos == cursor->cur_range_end) {
+			/* Advance to next range.  */
+			if (++cursor->cur_range == cursor->end_range) {
+				cursor->cur_range_pos = ~0ULL;
+			} else {
+				cursor->cur_range_pos = cursor->cur_range->offset;
+				cursor->cur_range_end = cursor->cur_range->offset +
+							cursor->cur_range->size;
+			}
+		}
+	} while (cursor->cur_range_pos < chunk_end_offset);
+
+	return 0;
+}
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+/* Get a parallel chunk decompressor for the specified compression type and
+ * chunk size, re-using the one cached in the WIMStruct if possible.  Returns
+ * NULL if a parallel chunk decompressor is not available, in which case the
+ * caller should decompress the chunks itself.  */
+static struct chunk_decompressor *
+get_chunk_decompressor(WIMStruct *wim, int ctype, u32 chunk_size)
+{
+	struct chunk_decompressor *chunk_decompressor;
+	int ret;
+
+	chunk_decompressor = wim->chunk_decompressor;
+	if (chunk_decompressor &&
+	    chunk_decompressor->in_ctype == ctype &&
+	    chunk_decompressor->in_chunk_size == chunk_size)
+	{
+		wim->chunk_decompressor = NULL;
+		return chunk_decompressor;
+	}
+
+	ret = new_parallel_chunk_decompressor(ctype, chunk_size,
+					      wim->num_decompression_threads,
+					      wim->max_memory,
+					      &chunk_decompressor);
+	if (ret) {
+		DEBUG("Couldn't create parallel chunk decompressor "
+		      "(status %d)", ret);
+		return NULL;
+	}
+	return chunk_decompressor;
+}
+
+/* Return a parallel chunk decompressor to the WIMStruct's cache, first
+ * discarding any chunks that are still in flight due to an early return.  */
+static void
+put_chunk_decompressor(WIMStruct *wim,
+		       struct chunk_decompressor *chunk_decompressor)
+{
+	const void *udata;
+	u32 usize;
+
+	while (chunk_decompressor->get_chunk(chunk_decompressor,
+					     &udata, &usize))
+		;
+
+	if (wim->chunk_decompressor)
+		wim->chunk_decompressor->destroy(wim->chunk_decompressor);
+	wim->chunk_decompressor = chunk_decompressor;
+}
+
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
+
+/* Feed a chunk retrieved from a parallel chunk decompressor to the callback
+ * function.  Chunks are retrieved in order and only chunks containing
+ * requested data are submitted, so the chunk is always the one containing the
+ * next byte the cursor is waiting for.  */
+static int
+feed_decompressed_chunk(const void *udata, u32 usize, u32 chunk_order,
+			struct data_range_cursor *cursor,
+			consume_data_callback_t cb, void *cb_ctx)
+{
+	u64 chunk_start_offset;
+
+	if (udata == NULL) {
+		ERROR("Failed to decompress data!");
+		errno = EINVAL;
+		return WIMLIB_ERR_DECOMPRESSION;
+	}
+
+	chunk_start_offset = (cursor->cur_range_pos >> chunk_order) << chunk_order;
+	return feed_chunk_to_ranges(udata, chunk_start_offset,
+				    chunk_start_offset + usize,
+				    cursor, cb, cb_ctx);
+}
+
 /*
  * read_compressed_wim_resource() -
  *
@@ -115,6 +249,10 @@ struct data_range {
  *	of unspecified size.
  * @cb_ctx
  *	Parameter to pass to @cb_ctx.
+ * @pd
+ *	If not NULL, use and cache the decompressor in this structure rather
+ *	than the one cached in the WIMStruct, and never decompress in parallel.
+ *	This allows reading from the WIM on more than one thread at a time.
  *
  * Possible return values:
  *
@@ -131,7 +269,8 @@ read_compressed_wim_resource(const struct wim_resource_spec * const rspec,
 			     const struct data_range * const ranges,
 			     const size_t num_ranges,
 			     const consume_data_callback_t cb,
-			     void * const cb_ctx)
+			     void * const cb_ctx,
+			     struct private_decompressor * const pd)
 {
 	int ret;
 	int errno_save;
@@ -144,6 +283,7 @@ read_compressed_wim_resource(const struct wim_resource_spec * const rspec,
 	bool ubuf_malloced = false;
 	bool cbuf_malloced = false;
 	struct wimlib_decompressor *decompressor = NULL;
+	struct chunk_decompressor *chunk_decompressor = NULL;
 
 	/* Sanity checks  */
 	wimlib_assert(rspec != NULL);
@@ -197,24 +337,6 @@ read_compressed_wim_resource(const struct wim_resource_spec * const rspec,
 		goto out_free_memory;
 	}
 
-	/* Get valid decompressor.  */
-	if (ctype == rspec->wim->decompressor_ctype &&
-	    chunk_size == rspec->wim->decompressor_max_block_size)
-	{
-		/* Cached decompressor.  */
-		decompressor = rspec->wim->decompressor;
-		rspec->wim->decompressor_ctype = WIMLIB_COMPRESSION_TYPE_NONE;
-		rspec->wim->decompressor = NULL;
-	} else {
-		ret = wimlib_create_decompressor(ctype, chunk_size,
-						 &decompressor);
-		if (ret) {
-			if (ret != WIMLIB_ERR_NOMEM)
-				errno = EINVAL;
-			goto out_free_memory;
-		}
-	}
-
 	const u32 chunk_order = bsr32(chunk_size);
 
 	/* Calculate the total number of chunks the resource is divided into.  */
@@ -225,6 +347,55 @@ read_compressed_wim_resource(const struct wim_resource_spec * const rspec,
 	const u64 first_needed_chunk = first_offset >> chunk_order;
 	const u64 last_needed_chunk = last_offset >> chunk_order;
 
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	/* If enabled, use a parallel chunk decompressor for large reads.  */
+	if (pd == NULL &&
+	    rspec->wim->num_decompression_threads != 1 &&
+	    last_needed_chunk - first_needed_chunk + 1 >=
+			PARALLEL_DECOMPRESSION_MIN_CHUNKS)
+	{
+		chunk_decompressor = get_chunk_decompressor(rspec->wim,
+							    ctype, chunk_size);
+	}
+#endif
+
+	/* Otherwise, get valid decompressor.  */
+	if (pd != NULL) {
+		if (pd->decompressor == NULL ||
+		    ctype != pd->ctype ||
+		    chunk_size != pd->max_block_size)
+		{
+			free_private_decompressor(pd);
+			ret = wimlib_create_decompressor(ctype, chunk_size,
+							 &pd->decompressor);
+			if (ret) {
+				if (ret != WIMLIB_ERR_NOMEM)
+					errno = EINVAL;
+				goto out_free_memory;
+			}
+			pd->ctype = ctype;
+			pd->max_block_size = chunk_size;
+		}
+		decompressor = pd->decompressor;
+	} else if (chunk_decompressor == NULL) {
+		if (ctype == rspec->wim->decompressor_ctype &&
+		    chunk_size == rspec->wim->decompressor_max_block_size)
+		{
+			/* Cached decompressor.  */
+			decompressor = rspec->wim->decompressor;
+			rspec->wim->decompressor_ctype = WIMLIB_COMPRESSION_TYPE_NONE;
+			rspec->wim->decompressor = NULL;
+		} else {
+			ret = wimlib_create_decompressor(ctype, chunk_size,
+							 &decompressor);
+			if (ret) {
+				if (ret != WIMLIB_ERR_NOMEM)
+					errno = EINVAL;
+				goto out_free_memory;
+			}
+		}
+	}
+
 	/* Calculate the 0-based index of the first chunk that actually needs to
 	 * be read.  This is normally first_needed_chunk, but for pipe reads we
 	 * must always start from the 0th chunk.  */
@@ -390,11 +561,18 @@ read_compressed_wim_resource(const struct wim_resource_spec * const rspec,
 		cbuf_malloced = true;
 	}
 
-	/* Set current data range.  */
-	const struct data_range *cur_range = ranges;
+	/* Set current data range.  The cursor tracks the data being fed to the
+	 * callback function, whereas @next_read_range tracks the data being
+	 * read.  These only differ when a parallel chunk decompressor is in
+	 * use, in which case reading runs ahead of decompression.  */
 	const struct data_range * const end_range = &ranges[num_ranges];
-	u64 cur_range_pos = cur_range->offset;
-	u64 cur_range_end = cur_range->offset + cur_range->size;
+	const struct data_range *next_read_range = ranges;
+	struct data_range_cursor cursor = {
+		.cur_range = ranges,
+		.end_range = end_range,
+		.cur_range_pos = ranges[0].offset,
+		.cur_range_end = ranges[0].offset + ranges[0].size,
+	};
 
 	/* Read and process each needed chunk.  */
 	for (u64 i = read_start_chunk; i <= last_needed_chunk; i++) {
@@ -442,7 +620,13 @@ read_compressed_wim_resource(const struct wim_resource_spec * const rspec,
 		const u64 chunk_start_offset = i << chunk_order;
 		const u64 chunk_end_offset = chunk_start_offset + chunk_usize;
 
-		if (chunk_end_offset <= cur_range_pos) {
+		while (next_read_range != end_range &&
+		       next_read_range->offset + next_read_range->size <= chunk_start_offset)
+			next_read_range++;
+
+		if (next_read_range == end_range ||
+		    next_read_range->offset >= chunk_end_offset)
+		{
 
 			/* The next range does not require data in this chunk,
 			 * so skip it.  */
@@ -471,6 +655,32 @@ read_compressed_wim_resource(const struct wim_resource_spec * const rspec,
 					 cur_read_offset);
 			if (ret)
 				goto read_error;
+			cur_read_offset += chunk_csize;
+
+			if (chunk_decompressor) {
+				/* Hand the chunk off to the parallel chunk
+				 * decompressor, feeding already-decompressed
+				 * chunks to the callback function while it has
+				 * no space.  */
+				while (!chunk_decompressor->submit_chunk(chunk_decompressor,
+									 read_buf,
+									 chunk_csize,
+									 chunk_usize))
+				{
+					const void *udata;
+					u32 usize;
+
+					chunk_decompressor->get_chunk(chunk_decompressor,
+								      &udata, &usize);
+					ret = feed_decompressed_chunk(udata, usize,
+								      chunk_order,
+								      &cursor,
+								      cb, cb_ctx);
+					if (ret)
+						goto out_free_memory;
+				}
+				continue;
+			}
 
 			if (read_buf == cbuf) {
 				DEBUG("Decompressing chunk %"PRIu64" "
@@ -488,37 +698,28 @@ read_compressed_wim_resource(const struct wim_resource_spec * const rspec,
 					goto out_free_memory;
 				}
 			}
-			cur_read_offset += chunk_csize;
 
 			/* At least one range requires data in this chunk.  */
-			do {
-				size_t start, end, size;
-
-				/* Calculate how many bytes of data should be
-				 * sent to the callback function, taking into
-				 * account that data sent to the callback
-				 * function must not overlap range boundaries.
-				 */
-				start = cur_range_pos - chunk_start_offset;
-				end = min(cur_range_end, chunk_end_offset) - chunk_start_offset;
-				size = end - start;
-
-				ret = (*cb)(&ubuf[start], size, cb_ctx);
+			ret = feed_chunk_to_ranges(ubuf, chunk_start_offset,
+						   chunk_end_offset, &cursor,
+						   cb, cb_ctx);
+			if (ret)
+				goto out_free_memory;
+		}
+	}
 
-				if (ret)
-					goto out_free_memory;
+	if (chunk_decompressor) {
+		/* Feed the remaining chunks to the callback function.  */
+		const void *udata;
+		u32 usize;
 
-				cur_range_pos += size;
-				if (cur_range_pos == cur_range_end) {
-					/* Advance to next range.  */
-					if (++cur_range == end_range) {
-						cur_range_pos = ~0ULL;
-					} else {
-						cur_range_pos = cur_range->offset;
-						cur_range_end = cur_range->offset + cur_range->size;
-					}
-				}
-			} while (cur_range_pos < chunk_end_offset);
+		while (chunk_decompressor->get_chunk(chunk_decompressor,
+						     &udata, &usize))
+		{
+			ret = feed_decompressed_chunk(udata, usize, chunk_order,
+						      &cursor, cb, cb_ctx);
+			if (ret)
+				goto out_free_memory;
 		}
 	}
 
@@ -540,7 +741,11 @@ read_compressed_wim_resource(const struct wim_resource_spec * const rspec,
 
 out_free_memory:
 	errno_save = errno;
-	if (decompressor) {
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (chunk_decompressor)
+		put_chunk_decompressor(rspec->wim, chunk_decompressor);
+#endif
+	if (decompressor && pd == NULL) {
 		wimlib_free_decompressor(rspec->wim->decompressor);
 		rspec->wim->decompressor = decompressor;
 		rspec->wim->decompressor_ctype = ctype;
@@ -645,6 +850,9 @@ bufferer_cb(const void *chunk, size_t size, void *_ctx)
  *	of unspecified size.
  * @cb_ctx
  *	Parameter to pass to @cb_ctx.
+ * @pd
+ *	Private decompressor to use, or NULL; see
+ *	read_compressed_wim_resource().
  *
  * Return values:
  *	WIMLIB_ERR_SUCCESS (0)
@@ -658,7 +866,8 @@ bufferer_cb(const void *chunk, size_t size, void *_ctx)
 static int
 read_partial_wim_resource(const struct wim_resource_spec *rspec,
 			  u64 offset, u64 size,
-			  consume_data_callback_t cb, void *cb_ctx)
+			  consume_data_callback_t cb, void *cb_ctx,
+			  struct private_decompressor *pd)
 {
 	/* Sanity checks.  */
 	wimlib_assert(offset + size >= offset);
@@ -679,7 +888,7 @@ read_partial_wim_resource(const struct wim_resource_spec *rspec,
 			.size = size,
 		};
 		return read_compressed_wim_resource(rspec, &range, 1,
-						    cb, cb_ctx);
+						    cb, cb_ctx, pd);
 	} else {
 		/* Reading uncompressed resource.  For completeness, handle the
 		 * weird case where size_in_wim < uncompressed_size.  */
@@ -715,21 +924,41 @@ read_partial_wim_resource(const struct wim_resource_spec *rspec,
 	}
 }
 
+/* Read the specified range of uncompressed data from the specified WIM
+ * resource into the specified buffer.  If @pd is not NULL, it is used as the
+ * decompressor, which makes it safe to call this function on multiple threads
+ * at once provided that each uses a different @pd.  */
+int
+read_partial_wim_resource_into_buf(const struct wim_resource_spec *rspec,
+				   size_t size, u64 offset, void *_buf,
+				   struct private_decompressor *pd)
+{
+	u8 *buf = _buf;
+
+	return read_partial_wim_resource(rspec, offset, size,
+					 bufferer_cb, &buf, pd);
+}
+
+void
+free_private_decompressor(struct private_decompressor *pd)
+{
+	wimlib_free_decompressor(pd->decompressor);
+	pd->decompressor = NULL;
+}
+
 /* Read the specified range of uncompressed data from the specified stream,
  * which must be located into a WIM file, into the specified buffer.  */
 int
 read_partial_wim_stream_into_buf(const struct wim_lookup_table_entry *lte,
-				 size_t size, u64 offset, void *_buf)
+				 size_t size, u64 offset, void *buf)
 {
-	u8 *buf = _buf;
-
 	wimlib_assert(lte->resource_location == RESOURCE_IN_WIM);
 
-	return read_partial_wim_resource(lte->rspec,
-					 lte->offset_in_res + offset,
-					 size,
-					 bufferer_cb,
-					 &buf);
+	return read_partial_wim_resource_into_buf(lte->rspec,
+						  size,
+						  lte->offset_in_res + offset,
+						  buf,
+						  NULL);
 }
 
 /* A consume_data_callback_t implementation that simply ignores the data
@@ -752,6 +981,7 @@ skip_wim_stream(struct wim_lookup_table_entry *lte)
 					 0,
 					 lte->rspec->uncompressed_size,
 					 skip_chunk_cb,
+					 NULL,
 					 NULL);
 }
 
@@ -760,7 +990,7 @@ read_wim_stream_prefix(const struct wim_lookup_table_entry *lte, u64 size,
 		       consume_data_callback_t cb, void *cb_ctx)
 {
 	return read_partial_wim_resource(lte->rspec, lte->offset_in_res, size,
-					 cb, cb_ctx);
+					 cb, cb_ctx, NULL);
 }
 
 /* This function handles reading stream data that is located in an external
@@ -772,16 +1002,18 @@ read_wim_stream_prefix(const struct wim_lookup_table_entry *lte, u64 size,
  * the file may need FILE_FLAG_BACKUP_SEMANTICS to be opened, or the file may be
  * encrypted), so Windows uses its own code for its equivalent case.  */
 static int
-read_file_on_disk_prefix(const struct wim_lookup_table_entry *lte, u64 size,
-			 consume_data_callback_t cb, void *cb_ctx)
+read_file_on_disk_range(const struct wim_lookup_table_entry *lte,
+			u64 offset, u64 size,
+			consume_data_callback_t cb, void *cb_ctx)
 {
 	int ret;
 	int raw_fd;
 	struct filedes fd;
 
-	wimlib_assert(size <= lte->size);
+	wimlib_assert(offset + size <= lte->size);
 
-	DEBUG("Reading %"PRIu64" bytes from \"%"TS"\"", size, lte->file_on_disk);
+	DEBUG("Reading %"PRIu64" bytes @ %"PRIu64" from \"%"TS"\"",
+	      size, offset, lte->file_on_disk);
 
 	raw_fd = topen(lte->file_on_disk, O_BINARY | O_RDONLY);
 	if (raw_fd < 0) {
@@ -789,11 +1021,18 @@ read_file_on_disk_prefix(const struct wim_lookup_table_entry *lte, u64 size,
 		return WIMLIB_ERR_OPEN;
 	}
 	filedes_init(&fd, raw_fd);
-	ret = read_raw_file_data(&fd, 0, size, cb, cb_ctx);
+	ret = read_raw_file_data(&fd, offset, size, cb, cb_ctx);
 	filedes_close(&fd);
 	return ret;
 }
 
+static int
+read_file_on_disk_prefix(const struct wim_lookup_table_entry *lte, u64 size,
+			 consume_data_callback_t cb, void *cb_ctx)
+{
+	return read_file_on_disk_range(lte, 0, size, cb, cb_ctx);
+}
+
 #ifdef WITH_FUSE
 static int
 read_staging_file_prefix(const struct wim_lookup_table_entry *lte, u64 size,
@@ -832,6 +1071,105 @@ read_buffer_prefix(const struct wim_lookup_table_entry *lte,
 	return (*cb)(lte->attached_buffer, size, cb_ctx);
 }
 
+/* Return the piece at index @i of the piece list @pl, or NULL (with an error
+ * message) if it is not available.  */
+static const struct wim_lookup_table_entry *
+lookup_piece(const struct piece_list *pl, u32 i)
+{
+	const struct wim_lookup_table_entry *piece;
+
+	piece = lookup_stream(pl->table, pl->hashes[i]);
+	if (unlikely(piece == NULL ||
+		     piece->resource_location == RESOURCE_IN_PIECES))
+	{
+		ERROR("Piece %"PRIu32" of a stream split into %"PRIu32" pieces "
+		      "is missing", i + 1, pl->num_pieces);
+		return NULL;
+	}
+	return piece;
+}
+
+/* Read a range of the data of a stream that has been split into pieces.  */
+static int
+read_pieces_range(const struct wim_lookup_table_entry *lte,
+		  u64 offset, u64 size,
+		  consume_data_callback_t cb, void *cb_ctx)
+{
+	const struct piece_list *pl = lte->piece_list;
+	const struct wim_lookup_table_entry *piece, *next;
+	u64 piece_offset = 0;
+	u64 run_size;
+	u64 n;
+	u32 i = 0;
+	int ret;
+
+	while (size) {
+		if (i == pl->num_pieces) {
+			ERROR("The pieces of a %"PRIu64"-byte stream are too "
+			      "short", lte->size);
+			return WIMLIB_ERR_INVALID_LOOKUP_TABLE_ENTRY;
+		}
+		piece = lookup_piece(pl, i++);
+		if (piece == NULL)
+			return WIMLIB_ERR_RESOURCE_NOT_FOUND;
+
+		if (offset >= piece_offset + piece->size) {
+			piece_offset += piece->size;
+			continue;
+		}
+
+		/* Extend the read over the following pieces if they are stored
+		 * right after this one in the same WIM resource.  This way, a
+		 * run of pieces packed into one resource is decompressed in a
+		 * single pass rather than once per piece.  */
+		run_size = piece->size;
+		if (piece->resource_location == RESOURCE_IN_WIM) {
+			while (piece_offset + run_size < offset + size &&
+			       i < pl->num_pieces &&
+			       (next = lookup_stream(pl->table, pl->hashes[i])) &&
+			       next->resource_location == RESOURCE_IN_WIM &&
+			       next->rspec == piece->rspec &&
+			       next->offset_in_res == piece->offset_in_res + run_size)
+			{
+				run_size += next->size;
+				i++;
+			}
+		}
+
+		n = min(piece_offset + run_size - offset, size);
+		if (piece->resource_location == RESOURCE_IN_WIM) {
+			ret = read_partial_wim_resource(piece->rspec,
+							piece->offset_in_res +
+								(offset - piece_offset),
+							n, cb, cb_ctx, NULL);
+		} else {
+			ret = read_stream_range(piece, offset - piece_offset,
+						n, cb, cb_ctx);
+		}
+		if (ret)
+			return ret;
+		piece_offset += run_size;
+		offset += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int
+read_pieces_prefix(const struct wim_lookup_table_entry *lte, u64 size,
+		   consume_data_callback_t cb, void *cb_ctx)
+{
+	return read_pieces_range(lte, 0, size, cb, cb_ctx);
+}
+
+static int
+read_parent_stream_prefix(const struct wim_lookup_table_entry *lte, u64 size,
+			  consume_data_callback_t cb, void *cb_ctx)
+{
+	return read_stream_range(lte->parent, lte->offset_in_parent, size,
+				 cb, cb_ctx);
+}
+
 typedef int (*read_stream_prefix_handler_t)(const struct wim_lookup_table_entry *lte,
 					    u64 size,
 					    consume_data_callback_t cb,
@@ -860,6 +1198,8 @@ read_stream_prefix(const struct wim_lookup_table_entry *lte, u64 size,
 		[RESOURCE_IN_WIM]             = read_wim_stream_prefix,
 		[RESOURCE_IN_FILE_ON_DISK]    = read_file_on_disk_prefix,
 		[RESOURCE_IN_ATTACHED_BUFFER] = read_buffer_prefix,
+		[RESOURCE_IN_PIECES]          = read_pieces_prefix,
+		[RESOURCE_IN_PARENT_STREAM]   = read_parent_stream_prefix,
 	#ifdef WITH_FUSE
 		[RESOURCE_IN_STAGING_FILE]    = read_staging_file_prefix,
 	#endif
@@ -876,6 +1216,86 @@ read_stream_prefix(const struct wim_lookup_table_entry *lte, u64 size,
 	return handlers[lte->resource_location](lte, size, cb, cb_ctx);
 }
 
+struct skip_prefix_ctx {
+	u64 skip;
+	consume_data_callback_t cb;
+	void *cb_ctx;
+};
+
+/* A consume_data_callback_t implementation that discards a number of bytes
+ * before passing the rest of the data on to another callback.  */
+static int
+skip_prefix_cb(const void *chunk, size_t size, void *_ctx)
+{
+	struct skip_prefix_ctx *ctx = _ctx;
+
+	if (ctx->skip >= size) {
+		ctx->skip -= size;
+		return 0;
+	}
+	chunk = (const u8 *)chunk + ctx->skip;
+	size -= ctx->skip;
+	ctx->skip = 0;
+	return (*ctx->cb)(chunk, size, ctx->cb_ctx);
+}
+
+/*
+ * read_stream_range()-
+ *
+ * Like read_stream_prefix(), but reads the @size bytes at offset @offset in the
+ * stream.  Locations that do not support reading from an offset are read from
+ * the beginning, with the data before @offset discarded.
+ */
+int
+read_stream_range(const struct wim_lookup_table_entry *lte,
+		  u64 offset, u64 size,
+		  consume_data_callback_t cb, void *cb_ctx)
+{
+	struct skip_prefix_ctx skip_ctx;
+
+	wimlib_assert(offset + size >= offset && offset + size <= lte->size);
+
+	if (size == 0)
+		return 0;
+
+	switch (lte->resource_location) {
+	case RESOURCE_IN_WIM:
+		return read_partial_wim_resource(lte->rspec,
+						 lte->offset_in_res + offset,
+						 size, cb, cb_ctx, NULL);
+	case RESOURCE_IN_FILE_ON_DISK:
+		return read_file_on_disk_range(lte, offset, size, cb, cb_ctx);
+	case RESOURCE_IN_ATTACHED_BUFFER:
+		return (*cb)((const u8 *)lte->attached_buffer + offset, size,
+			     cb_ctx);
+	case RESOURCE_IN_PIECES:
+		return read_pieces_range(lte, offset, size, cb, cb_ctx);
+	case RESOURCE_IN_PARENT_STREAM:
+		return read_stream_range(lte->parent,
+					 lte->offset_in_parent + offset,
+					 size, cb, cb_ctx);
+	default:
+		if (offset == 0)
+			return read_stream_prefix(lte, size, cb, cb_ctx);
+		skip_ctx.skip = offset;
+		skip_ctx.cb = cb;
+		skip_ctx.cb_ctx = cb_ctx;
+		return read_stream_prefix(lte, offset + size,
+					  skip_prefix_cb, &skip_ctx);
+	}
+}
+
+/* Read the specified range of uncompressed data from the specified stream,
+ * which may be in any location, into the specified buffer.  */
+int
+read_partial_stream_into_buf(const struct wim_lookup_table_entry *lte,
+			     size_t size, u64 offset, void *_buf)
+{
+	u8 *buf = _buf;
+
+	return read_stream_range(lte, offset, size, bufferer_cb, &buf);
+}
+
 /* Read the full uncompressed data of the specified stream into the specified
  * buffer, which must have space for at least lte->size bytes.  */
 int
@@ -1250,7 +1670,8 @@ read_packed_streams(struct wim_lookup_table_entry *first_stream,
 					   ranges,
 					   stream_count,
 					   streamifier_cb,
-					   &streamifier_ctx);
+					   &streamifier_ctx,
+					   NULL);
 
 	if (ranges_malloced)
 		FREE(ranges);
@@ -1266,6 +1687,202 @@ read_packed_streams(struct wim_lookup_table_entry *first_stream,
 	return ret;
 }
 
+#ifdef ENABLE_IO_URING
+
+/* A small file being read with an io_ring.  */
+struct ring_read {
+	struct wim_lookup_table_entry *lte;
+
+	/* Buffer of lte->size bytes to receive the data.  */
+	u8 *buf;
+
+	/* File descriptor, or a negated errno value if the file could not be
+	 * opened.  */
+	int fd;
+
+	/* Result of the read: the number of bytes read, or a negated errno
+	 * value.  */
+	s32 res;
+};
+
+static bool
+can_read_with_ring(const struct wim_lookup_table_entry *lte)
+{
+	return lte->resource_location == RESOURCE_IN_FILE_ON_DISK &&
+	       lte->size <= RING_READ_MAX_FILE_SIZE;
+}
+
+/* Returns true if the full data of the file was read into @r->buf.  */
+static inline bool
+ring_read_succeeded(const struct ring_read *r)
+{
+	return r->fd >= 0 && r->res == r->lte->size;
+}
+
+static void
+ring_open_done(u64 user_data, s32 res, void *_reads)
+{
+	struct ring_read *reads = _reads;
+
+	reads[user_data].fd = res;
+}
+
+/* The read and the close of each file are submitted as a linked pair, so that
+ * the close only runs if the full data was read.  The user_data of the read is
+ * (index << 1) and the user_data of the close is (index << 1) | 1.  */
+static void
+ring_read_done(u64 user_data, s32 res, void *_reads)
+{
+	struct ring_read *reads = _reads;
+	struct ring_read *r = &reads[user_data >> 1];
+
+	if (!(user_data & 1))
+		r->res = res;
+	else if (res == -ECANCELED)
+		close(r->fd);
+}
+
+/*
+ * Read the full data of the files in @reads into their buffers, opening,
+ * reading, and closing up to RING_READ_MAX_OPEN_FILES files with one system
+ * call each.  Every stream must satisfy can_read_with_ring().
+ *
+ * Failures to open or read individual files are not reported here; the caller
+ * checks ring_read_succeeded() and reads any failed files again with the
+ * ordinary code, which reports the error with the usual message.  Only a
+ * failure of io_uring itself is returned.
+ */
+static int
+read_files_with_ring(struct ring_read reads[], size_t num_reads,
+		     struct io_ring *ring)
+{
+	size_t batch_size = min(io_ring_depth(ring) / 2,
+				RING_READ_MAX_OPEN_FILES);
+	int ret;
+
+	for (size_t start = 0; start < num_reads; start += batch_size) {
+		size_t end = min(num_reads, start + batch_size);
+
+		for (size_t i = start; i < end; i++) {
+			reads[i].fd = -1;
+			reads[i].res = -1;
+			io_ring_prep_openat(ring, reads[i].lte->file_on_disk,
+					    O_RDONLY, i);
+		}
+		ret = io_ring_run(ring, ring_open_done, reads);
+		if (ret) {
+			for (size_t i = start; i < end; i++)
+				if (reads[i].fd >= 0)
+					close(reads[i].fd);
+			return ret;
+		}
+
+		for (size_t i = start; i < end; i++) {
+			if (reads[i].fd < 0)
+				continue;
+			io_ring_prep_read(ring, reads[i].fd, reads[i].buf,
+					  reads[i].lte->size, 0, true, i << 1);
+			io_ring_prep_close(ring, reads[i].fd, (i << 1) | 1);
+		}
+		ret = io_ring_run(ring, ring_read_done, reads);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Pass the data of a stream that has already been read into memory to the
+ * callbacks, in the same way read_full_stream_with_cbs() would.  */
+static int
+read_buffered_stream_with_cbs(struct wim_lookup_table_entry *lte,
+			      const u8 *buf,
+			      const struct read_stream_list_callbacks *cbs)
+{
+	u64 size = lte->size;
+	int ret;
+
+	ret = (*cbs->begin_stream)(lte, cbs->begin_stream_ctx);
+	if (ret)
+		return ret;
+
+	for (u64 offset = 0; offset < size && !ret; offset += BUFFER_SIZE) {
+		ret = (*cbs->consume_chunk)(&buf[offset],
+					    min(BUFFER_SIZE, size - offset),
+					    cbs->consume_chunk_ctx);
+	}
+
+	return (*cbs->end_stream)(lte, ret, cbs->end_stream_ctx);
+}
+
+/*
+ * Read a batch of small streams in files on disk with @ring, starting at the
+ * list node *@cur_p and ending at the first stream that cannot be read with
+ * the ring or when the batch is full.  The streams are passed to the callbacks
+ * in list order, as if each had been read with read_full_stream_with_cbs().
+ * On return, *@cur_p is set to the list node following the batch.
+ *
+ * The callbacks may only delete the stream they are currently given from the
+ * list, so it is safe to look ahead at the other streams of the batch.
+ */
+static int
+read_stream_batch_with_ring(struct list_head *stream_list,
+			    size_t list_head_offset,
+			    struct list_head **cur_p,
+			    const struct read_stream_list_callbacks *cbs,
+			    struct io_ring *ring)
+{
+	struct ring_read reads[RING_READ_MAX_BATCH_STREAMS];
+	size_t num_reads = 0;
+	size_t total_size = 0;
+	struct list_head *cur;
+	u8 *buf, *p;
+	int ret;
+
+	for (cur = *cur_p;
+	     cur != stream_list && num_reads < ARRAY_LEN(reads);
+	     cur = cur->next)
+	{
+		struct wim_lookup_table_entry *lte;
+
+		lte = (struct wim_lookup_table_entry*)((u8*)cur - list_head_offset);
+		if (!can_read_with_ring(lte))
+			break;
+		reads[num_reads++].lte = lte;
+		total_size += lte->size;
+	}
+	*cur_p = cur;
+
+	buf = MALLOC(max(total_size, 1));
+	if (!buf)
+		return WIMLIB_ERR_NOMEM;
+
+	p = buf;
+	for (size_t i = 0; i < num_reads; i++) {
+		reads[i].buf = p;
+		p += reads[i].lte->size;
+	}
+
+	ret = read_files_with_ring(reads, num_reads, ring);
+	if (ret)
+		goto out_free_buf;
+
+	for (size_t i = 0; i < num_reads; i++) {
+		if (ring_read_succeeded(&reads[i]))
+			ret = read_buffered_stream_with_cbs(reads[i].lte,
+							    reads[i].buf, cbs);
+		else
+			ret = read_full_stream_with_cbs(reads[i].lte, cbs);
+		if (ret && ret != BEGIN_STREAM_STATUS_SKIP_STREAM)
+			goto out_free_buf;
+	}
+	ret = 0;
+out_free_buf:
+	FREE(buf);
+	return ret;
+}
+
+#endif /* ENABLE_IO_URING */
+
 /*
  * Read a list of streams, each of which may be in any supported location (e.g.
  * in a WIM or in an external file).  Unlike read_stream_prefix() or the
@@ -1298,6 +1915,10 @@ read_packed_streams(struct wim_lookup_table_entry *first_stream,
  *	STREAM_LIST_ALREADY_SORTED
  *		@stream_list is already sorted in sequential order for reading.
  *
+ * @ring
+ *	If not NULL, an io_ring used to read small streams located in files on
+ *	disk in batches, with far fewer system calls.
+ *
  * The callback functions are allowed to delete the current stream from the list
  * if necessary.
  *
@@ -1309,7 +1930,8 @@ int
 read_stream_list(struct list_head *stream_list,
 		 size_t list_head_offset,
 		 const struct read_stream_list_callbacks *cbs,
-		 int flags)
+		 int flags,
+		 struct io_ring *ring)
 {
 	int ret;
 	struct list_head *cur, *next;
@@ -1348,6 +1970,18 @@ read_stream_list(struct list_head *stream_list,
 	{
 		lte = (struct wim_lookup_table_entry*)((u8*)cur - list_head_offset);
 
+	#ifdef ENABLE_IO_URING
+		if (ring && can_read_with_ring(lte)) {
+			next = cur;
+			ret = read_stream_batch_with_ring(stream_list,
+							  list_head_offset,
+							  &next, sink_cbs, ring);
+			if (ret)
+				return ret;
+			continue;
+		}
+	#endif
+
 		if (lte->flags & WIM_RESHDR_FLAG_PACKED_STREAMS &&
 		    lte->size != lte->rspec->uncompressed_size)
 		{
@@ -1470,6 +2104,91 @@ sha1_stream(struct wim_lookup_table_entry *lte)
 	return read_full_stream_with_sha1(lte, &cbs);
 }
 
+/*
+ * Calculate the SHA1 message digests of a batch of small streams.
+ *
+ * Each stream must be no larger than SHA1_BATCH_MAX_STREAM_SIZE bytes, and at
+ * most SHA1_BATCH_MAX_STREAMS may be given.  The streams are read fully into
+ * memory, then checksummed together with sha1_multi_buffer(), which for small
+ * streams is much faster than calling sha1_stream() on each one.
+ *
+ * The message digests are returned in @hashes rather than stored in the stream
+ * entries, since the hash of an unhashed stream is in union with the back
+ * pointer that the caller must retrieve first.
+ *
+ * If @ring is not NULL, streams in files on disk are read with it.
+ */
+int
+sha1_small_streams(struct wim_lookup_table_entry * const ltes[],
+		   size_t num_streams, u8 hashes[][SHA1_HASH_SIZE],
+		   struct io_ring *ring)
+{
+	const void *bufs[SHA1_BATCH_MAX_STREAMS];
+	size_t lens[SHA1_BATCH_MAX_STREAMS];
+	size_t total_size = 0;
+	u8 *buf, *p;
+	int ret;
+
+	wimlib_assert(num_streams <= SHA1_BATCH_MAX_STREAMS);
+
+	for (size_t i = 0; i < num_streams; i++) {
+		wimlib_assert(ltes[i]->size <= SHA1_BATCH_MAX_STREAM_SIZE);
+		total_size += ltes[i]->size;
+	}
+
+	buf = MALLOC(max(total_size, 1));
+	if (!buf)
+		return WIMLIB_ERR_NOMEM;
+
+	p = buf;
+	for (size_t i = 0; i < num_streams; i++) {
+		bufs[i] = p;
+		lens[i] = ltes[i]->size;
+		p += ltes[i]->size;
+	}
+
+#ifdef ENABLE_IO_URING
+	if (ring) {
+		struct ring_read reads[SHA1_BATCH_MAX_STREAMS];
+		size_t num_reads = 0;
+
+		for (size_t i = 0; i < num_streams; i++) {
+			if (can_read_with_ring(ltes[i])) {
+				reads[num_reads].lte = ltes[i];
+				reads[num_reads].buf = (u8 *)bufs[i];
+				num_reads++;
+			}
+		}
+		ret = read_files_with_ring(reads, num_reads, ring);
+		if (ret)
+			goto out_free_buf;
+
+		/* Read anything that could not be read with the ring.  */
+		for (size_t i = 0, j = 0; i < num_streams; i++) {
+			if (j < num_reads && reads[j].lte == ltes[i] &&
+			    ring_read_succeeded(&reads[j++]))
+				continue;
+			ret = read_full_stream_into_buf(ltes[i], (u8 *)bufs[i]);
+			if (ret)
+				goto out_free_buf;
+		}
+	} else
+#endif
+	{
+		for (size_t i = 0; i < num_streams; i++) {
+			ret = read_full_stream_into_buf(ltes[i], (u8 *)bufs[i]);
+			if (ret)
+				goto out_free_buf;
+		}
+	}
+
+	sha1_multi_buffer(bufs, lens, hashes, num_streams);
+	ret = 0;
+out_free_buf:
+	FREE(buf);
+	return ret;
+}
+
 /* Convert a short WIM resource header to a stand-alone WIM resource
  * specification.
  *
@@ -16,6 +16,7 @@
 #  include "config.h"
 #endif
 
+#include "wimlib/cpu_features.h"
 #include "wimlib/endianness.h"
 #include "wimlib/sha1.h"
 
@@ -123,12 +124,10 @@ sha1_transform_default(u32 state[5], const u8 block[64])
 
 #ifdef ENABLE_SSSE3_SHA1
 extern void
-sha1_transform_blocks_ssse3(u32 state[5], const void *data, size_t num_blocks);
+sha1_transform_blocks_ssse3_asm(u32 state[5], const void *data,
+				size_t num_blocks);
 extern void
 sha1_transform_blocks_default(u32 state[5], const void *data, size_t num_blocks);
-#  define sha1_transform_blocks sha1_transform_blocks_ssse3
-#else
-#  define sha1_transform_blocks sha1_transform_blocks_default
 #endif
 
 #ifndef ENABLE_SSSE3_SHA1
@@ -143,6 +142,605 @@ sha1_transform_blocks_default(u32 state[5], const void *data, size_t num_blocks)
 	} while (--num_blocks);
 }
 
+#if X86_CPU_FEATURES_ENABLED
+
+#include <immintrin.h>
+
+/* Round constants, one per group of 20 rounds.  */
+static const u32 sha1_K[4] = {
+	0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6,
+};
+
+/* Do 4 rounds with the SHA extensions, using the message words msg0 and the
+ * rounds function 'func'.  e0 is derived from the previous value of abcd and
+ * used as the e input for these rounds; e1 saves the current value of abcd for
+ * the next 4 rounds.  */
+#define SHANI_4ROUNDS(e0, e1, msg0, func)				\
+	e0 = _mm_sha1nexte_epu32(e0, msg0);				\
+	e1 = abcd;							\
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, func);
+
+/* Steps of the message schedule.  With the four message registers used in
+ * rotation, msg0 holds the message words for the current 4 rounds, and msg1,
+ * msg2, and msg3 hold partially computed message words for the next 4, 8, and
+ * 12 rounds respectively.  */
+#define SHANI_MSG2(msg0, msg1)	msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+#define SHANI_XOR(msg0, msg2)	msg2 = _mm_xor_si128(msg2, msg0);
+#define SHANI_MSG1(msg0, msg3)	msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+
+#define SHANI_4ROUNDS_FULL(e0, e1, m0, m1, m2, m3, func)		\
+	SHANI_MSG2(m0, m1)						\
+	SHANI_4ROUNDS(e0, e1, m0, func)					\
+	SHANI_MSG1(m0, m3)						\
+	SHANI_XOR(m0, m2)
+
+static __attribute__((target("sha,sse4.1"))) void
+sha1_transform_blocks_shani(u32 state[5], const void *data, size_t num_blocks)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i abcd, abcd_save, e0, e0_save, e1;
+	__m128i m0, m1, m2, m3;
+
+	/* The SHA extensions expect a in the highest lane of abcd, and e in the
+	 * highest lane of its own register.  */
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	do {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + 0), bswap);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + 1), bswap);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + 2), bswap);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + 3), bswap);
+
+		/* Rounds 0-15 use the message words as-is.  The first group's e
+		 * input is the previous e; sha1nexte is only needed from then on
+		 * to rotate a into e.  */
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		SHANI_4ROUNDS(e1, e0, m1, 0)
+		SHANI_MSG1(m1, m0)
+
+		SHANI_4ROUNDS(e0, e1, m2, 0)
+		SHANI_MSG1(m2, m1)
+		SHANI_XOR(m2, m0)
+
+		SHANI_MSG2(m3, m0)
+		SHANI_4ROUNDS(e1, e0, m3, 0)
+		SHANI_MSG1(m3, m2)
+		SHANI_XOR(m3, m1)
+
+		/* Rounds 16-67 */
+		SHANI_4ROUNDS_FULL(e0, e1, m0, m1, m2, m3, 0)
+		SHANI_4ROUNDS_FULL(e1, e0, m1, m2, m3, m0, 1)
+		SHANI_4ROUNDS_FULL(e0, e1, m2, m3, m0, m1, 1)
+		SHANI_4ROUNDS_FULL(e1, e0, m3, m0, m1, m2, 1)
+		SHANI_4ROUNDS_FULL(e0, e1, m0, m1, m2, m3, 1)
+		SHANI_4ROUNDS_FULL(e1, e0, m1, m2, m3, m0, 1)
+		SHANI_4ROUNDS_FULL(e0, e1, m2, m3, m0, m1, 2)
+		SHANI_4ROUNDS_FULL(e1, e0, m3, m0, m1, m2, 2)
+		SHANI_4ROUNDS_FULL(e0, e1, m0, m1, m2, m3, 2)
+		SHANI_4ROUNDS_FULL(e1, e0, m1, m2, m3, m0, 2)
+		SHANI_4ROUNDS_FULL(e0, e1, m2, m3, m0, m1, 2)
+		SHANI_4ROUNDS_FULL(e1, e0, m3, m0, m1, m2, 3)
+		SHANI_4ROUNDS_FULL(e0, e1, m0, m1, m2, m3, 3)
+
+		/* Rounds 68-79: no more message words need to be started.  */
+		SHANI_MSG2(m1, m2)
+		SHANI_4ROUNDS(e1, e0, m1, 3)
+		SHANI_XOR(m1, m3)
+
+		SHANI_MSG2(m2, m3)
+		SHANI_4ROUNDS(e0, e1, m2, 3)
+
+		SHANI_4ROUNDS(e1, e0, m3, 3)
+
+		/* Add this block's result to the state.  */
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+
+		data += 64;
+	} while (--num_blocks);
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+/*
+ * SHA-1 with SSSE3: the rounds are done with scalar instructions as usual, but
+ * the message schedule is computed 4 words at a time in SSE registers, in the
+ * way of Intel's "Improving the Performance of the Secure Hash Algorithm (SHA-1)"
+ * paper.  The scheduling instructions are interleaved with the rounds, and the
+ * next block is loaded during the last 16 rounds.  The rounds add W[i] + K in
+ * first and rol(a, 5) last, which keeps the additions off the critical path.
+ */
+
+#define SSSE3_R1(v, w, x, y, z, i)					\
+	z += wk[i]; z += (w & (x ^ y)) ^ y; z += rol(v, 5);		\
+	w = rol(w, 30);
+
+#define SSSE3_R2(v, w, x, y, z, i)					\
+	z += wk[i]; z += w ^ x ^ y; z += rol(v, 5);			\
+	w = rol(w, 30);
+
+#define SSSE3_R3(v, w, x, y, z, i)					\
+	z += wk[i] + (x & y); z += w & (x ^ y); z += rol(v, 5);	\
+	w = rol(w, 30);
+
+#define SSSE3_ROL(x, n)							\
+	_mm_or_si128(_mm_slli_epi32((x), (n)), _mm_srli_epi32((x), 32 - (n)))
+
+/* Store W[4*i..4*i+3] + K in wk[] for the rounds they are used in.  The next
+ * block's first 16 words go into w[0..3] and wk[0..15], which the current
+ * block no longer needs by then.  */
+#define SSSE3_STORE_WK(i)						\
+	_mm_store_si128((__m128i *)&wk[4 * ((i) % 20)],			\
+			_mm_add_epi32(w[i], _mm_set1_epi32(sha1_K[((i) % 20) / 5])))
+
+/* Load message words 4*j..4*j+3 of the block at @next.  */
+#define SSSE3_LOAD(j)							\
+	w[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)next + (j)), \
+				bswap);					\
+	SSSE3_STORE_WK(j);
+
+/* W[16..31]: the last of the 4 words depends on the first, so it is fixed up
+ * with an extra rotate by 2 of the first word's input.  */
+#define SSSE3_SCHED16(i) {						\
+	__m128i t = _mm_xor_si128(					\
+		_mm_xor_si128(w[(i) - 4],				\
+			      _mm_alignr_epi8(w[(i) - 3], w[(i) - 4], 8)), \
+		_mm_xor_si128(w[(i) - 2], _mm_srli_si128(w[(i) - 1], 4))); \
+	w[i] = _mm_xor_si128(SSSE3_ROL(t, 1),				\
+			     SSSE3_ROL(_mm_slli_si128(t, 12), 2));	\
+	SSSE3_STORE_WK(i);						\
+}
+
+/* W[32..79]: use the equivalent recurrence
+ * W[t] = rol(W[t-6] ^ W[t-16] ^ W[t-28] ^ W[t-32], 2), which has no
+ * dependencies within a group of 4 words.  */
+#define SSSE3_SCHED32(i) {						\
+	w[i] = SSSE3_ROL(_mm_xor_si128(					\
+		_mm_xor_si128(_mm_alignr_epi8(w[(i) - 1], w[(i) - 2], 8), \
+			      w[(i) - 4]),				\
+		_mm_xor_si128(w[(i) - 7], w[(i) - 8])), 2);		\
+	SSSE3_STORE_WK(i);						\
+}
+
+static __attribute__((target("ssse3"))) void
+sha1_transform_blocks_ssse3(u32 state[5], const void *data, size_t num_blocks)
+{
+	const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+					   4, 5, 6, 7, 0, 1, 2, 3);
+	u32 wk[80] __attribute__((aligned(16)));
+	__m128i w[20];
+	const u8 *next = data;
+	u32 a, b, c, d, e;
+
+	SSSE3_LOAD(0) SSSE3_LOAD(1) SSSE3_LOAD(2) SSSE3_LOAD(3)
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+
+	do {
+		/* Don't read past the end of the data when loading the
+		 * "next" block during the last block.  Reloading the current
+		 * block instead is harmless.  */
+		if (num_blocks > 1)
+			next += 64;
+
+		SSSE3_SCHED16(4);
+		SSSE3_R1(a,b,c,d,e, 0); SSSE3_R1(e,a,b,c,d, 1); SSSE3_R1(d,e,a,b,c, 2); SSSE3_R1(c,d,e,a,b, 3);
+		SSSE3_SCHED16(5);
+		SSSE3_R1(b,c,d,e,a, 4); SSSE3_R1(a,b,c,d,e, 5); SSSE3_R1(e,a,b,c,d, 6); SSSE3_R1(d,e,a,b,c, 7);
+		SSSE3_SCHED16(6);
+		SSSE3_R1(c,d,e,a,b, 8); SSSE3_R1(b,c,d,e,a, 9); SSSE3_R1(a,b,c,d,e,10); SSSE3_R1(e,a,b,c,d,11);
+		SSSE3_SCHED16(7);
+		SSSE3_R1(d,e,a,b,c,12); SSSE3_R1(c,d,e,a,b,13); SSSE3_R1(b,c,d,e,a,14); SSSE3_R1(a,b,c,d,e,15);
+		SSSE3_SCHED32(8);
+		SSSE3_R1(e,a,b,c,d,16); SSSE3_R1(d,e,a,b,c,17); SSSE3_R1(c,d,e,a,b,18); SSSE3_R1(b,c,d,e,a,19);
+		SSSE3_SCHED32(9);
+		SSSE3_R2(a,b,c,d,e,20); SSSE3_R2(e,a,b,c,d,21); SSSE3_R2(d,e,a,b,c,22); SSSE3_R2(c,d,e,a,b,23);
+		SSSE3_SCHED32(10);
+		SSSE3_R2(b,c,d,e,a,24); SSSE3_R2(a,b,c,d,e,25); SSSE3_R2(e,a,b,c,d,26); SSSE3_R2(d,e,a,b,c,27);
+		SSSE3_SCHED32(11);
+		SSSE3_R2(c,d,e,a,b,28); SSSE3_R2(b,c,d,e,a,29); SSSE3_R2(a,b,c,d,e,30); SSSE3_R2(e,a,b,c,d,31);
+		SSSE3_SCHED32(12);
+		SSSE3_R2(d,e,a,b,c,32); SSSE3_R2(c,d,e,a,b,33); SSSE3_R2(b,c,d,e,a,34); SSSE3_R2(a,b,c,d,e,35);
+		SSSE3_SCHED32(13);
+		SSSE3_R2(e,a,b,c,d,36); SSSE3_R2(d,e,a,b,c,37); SSSE3_R2(c,d,e,a,b,38); SSSE3_R2(b,c,d,e,a,39);
+		SSSE3_SCHED32(14);
+		SSSE3_R3(a,b,c,d,e,40); SSSE3_R3(e,a,b,c,d,41); SSSE3_R3(d,e,a,b,c,42); SSSE3_R3(c,d,e,a,b,43);
+		SSSE3_SCHED32(15);
+		SSSE3_R3(b,c,d,e,a,44); SSSE3_R3(a,b,c,d,e,45); SSSE3_R3(e,a,b,c,d,46); SSSE3_R3(d,e,a,b,c,47);
+		SSSE3_SCHED32(16);
+		SSSE3_R3(c,d,e,a,b,48); SSSE3_R3(b,c,d,e,a,49); SSSE3_R3(a,b,c,d,e,50); SSSE3_R3(e,a,b,c,d,51);
+		SSSE3_SCHED32(17);
+		SSSE3_R3(d,e,a,b,c,52); SSSE3_R3(c,d,e,a,b,53); SSSE3_R3(b,c,d,e,a,54); SSSE3_R3(a,b,c,d,e,55);
+		SSSE3_SCHED32(18);
+		SSSE3_R3(e,a,b,c,d,56); SSSE3_R3(d,e,a,b,c,57); SSSE3_R3(c,d,e,a,b,58); SSSE3_R3(b,c,d,e,a,59);
+		SSSE3_SCHED32(19);
+		SSSE3_R2(a,b,c,d,e,60); SSSE3_R2(e,a,b,c,d,61); SSSE3_R2(d,e,a,b,c,62); SSSE3_R2(c,d,e,a,b,63);
+		SSSE3_LOAD(0);
+		SSSE3_R2(b,c,d,e,a,64); SSSE3_R2(a,b,c,d,e,65); SSSE3_R2(e,a,b,c,d,66); SSSE3_R2(d,e,a,b,c,67);
+		SSSE3_LOAD(1);
+		SSSE3_R2(c,d,e,a,b,68); SSSE3_R2(b,c,d,e,a,69); SSSE3_R2(a,b,c,d,e,70); SSSE3_R2(e,a,b,c,d,71);
+		SSSE3_LOAD(2);
+		SSSE3_R2(d,e,a,b,c,72); SSSE3_R2(c,d,e,a,b,73); SSSE3_R2(b,c,d,e,a,74); SSSE3_R2(a,b,c,d,e,75);
+		SSSE3_LOAD(3);
+		SSSE3_R2(e,a,b,c,d,76); SSSE3_R2(d,e,a,b,c,77); SSSE3_R2(c,d,e,a,b,78); SSSE3_R2(b,c,d,e,a,79);
+
+		a = (state[0] += a);
+		b = (state[1] += b);
+		c = (state[2] += c);
+		d = (state[3] += d);
+		e = (state[4] += e);
+	} while (--num_blocks);
+}
+
+#undef SSSE3_SCHED32
+#undef SSSE3_SCHED16
+#undef SSSE3_LOAD
+#undef SSSE3_STORE_WK
+#undef SSSE3_ROL
+#undef SSSE3_R3
+#undef SSSE3_R2
+#undef SSSE3_R1
+
+
+/*
+ * Multi-buffer SHA-1 with AVX2: each 32-bit lane of the 256-bit vectors holds
+ * the state of a different message, so 8 independent messages are hashed at
+ * once.  This is much faster than hashing small messages one by one, since the
+ * serial dependency chain of the SHA-1 rounds is no longer the bottleneck.
+ */
+
+#define SHA1_MB_LANES 8
+
+#define ROL8(x, n) \
+	_mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+#define MB_ROUND(f, k, wt)						\
+{									\
+	__m256i tmp = _mm256_add_epi32(_mm256_add_epi32(ROL8(a, 5), (f)), \
+				       _mm256_add_epi32(e, _mm256_add_epi32(k, wt))); \
+	e = d;								\
+	d = c;								\
+	c = ROL8(b, 30);						\
+	b = a;								\
+	a = tmp;							\
+}
+
+#define MB_F1 _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#define MB_F2 _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define MB_F3 _mm256_or_si256(_mm256_and_si256(b, c), \
+			      _mm256_and_si256(d, _mm256_or_si256(b, c)))
+
+#define MB_SCHEDULE(t)							\
+	(w[(t) & 15] = ROL8(_mm256_xor_si256(				\
+		_mm256_xor_si256(w[((t) - 3) & 15], w[((t) - 8) & 15]), \
+		_mm256_xor_si256(w[((t) - 14) & 15], w[(t) & 15])), 1))
+
+/* Load word i...i+7 of the current block of each lane, transposed so that
+ * w[i + j] holds word i + j of all lanes.  */
+static inline __attribute__((target("avx2"))) void
+sha1_mb_load_words(__m256i w[8], const u8 * const ptrs[SHA1_MB_LANES],
+		   size_t offset)
+{
+	const __m256i bswap32 = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+						4, 5, 6, 7, 0, 1, 2, 3,
+						12, 13, 14, 15, 8, 9, 10, 11,
+						4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i r[8], t[8], u[8];
+
+	for (int i = 0; i < 8; i++)
+		r[i] = _mm256_loadu_si256((const __m256i *)(ptrs[i] + offset));
+
+	for (int i = 0; i < 8; i += 2) {
+		t[i + 0] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (int i = 0; i < 8; i += 4) {
+		u[i + 0] = _mm256_unpacklo_epi64(t[i + 0], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i + 0], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; i++) {
+		w[i + 0] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		w[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+	for (int i = 0; i < 8; i++)
+		w[i] = _mm256_shuffle_epi8(w[i], bswap32);
+}
+
+/* Process @num_blocks consecutive blocks starting at ptrs[lane] for each of the
+ * 8 lanes.  state[i][lane] is word i of the state of each lane.  */
+static __attribute__((target("avx2"))) void
+sha1_transform_blocks_8way_avx2(u32 state[5][SHA1_MB_LANES],
+				const u8 * const ptrs[SHA1_MB_LANES],
+				size_t num_blocks)
+{
+	__m256i a = _mm256_loadu_si256((const __m256i *)state[0]);
+	__m256i b = _mm256_loadu_si256((const __m256i *)state[1]);
+	__m256i c = _mm256_loadu_si256((const __m256i *)state[2]);
+	__m256i d = _mm256_loadu_si256((const __m256i *)state[3]);
+	__m256i e = _mm256_loadu_si256((const __m256i *)state[4]);
+	const __m256i k1 = _mm256_set1_epi32(sha1_K[0]);
+	const __m256i k2 = _mm256_set1_epi32(sha1_K[1]);
+	const __m256i k3 = _mm256_set1_epi32(sha1_K[2]);
+	const __m256i k4 = _mm256_set1_epi32(sha1_K[3]);
+	__m256i w[16];
+	int t;
+
+	for (size_t offset = 0; offset < num_blocks * 64; offset += 64) {
+		__m256i a0 = a, b0 = b, c0 = c, d0 = d, e0 = e;
+
+		sha1_mb_load_words(&w[0], ptrs, offset);
+		sha1_mb_load_words(&w[8], ptrs, offset + 32);
+
+		for (t = 0; t < 16; t++)
+			MB_ROUND(MB_F1, k1, w[t]);
+		for (; t < 20; t++)
+			MB_ROUND(MB_F1, k1, MB_SCHEDULE(t));
+		for (; t < 40; t++)
+			MB_ROUND(MB_F2, k2, MB_SCHEDULE(t));
+		for (; t < 60; t++)
+			MB_ROUND(MB_F3, k3, MB_SCHEDULE(t));
+		for (; t < 80; t++)
+			MB_ROUND(MB_F2, k4, MB_SCHEDULE(t));
+
+		a = _mm256_add_epi32(a, a0);
+		b = _mm256_add_epi32(b, b0);
+		c = _mm256_add_epi32(c, c0);
+		d = _mm256_add_epi32(d, d0);
+		e = _mm256_add_epi32(e, e0);
+	}
+
+	_mm256_storeu_si256((__m256i *)state[0], a);
+	_mm256_storeu_si256((__m256i *)state[1], b);
+	_mm256_storeu_si256((__m256i *)state[2], c);
+	_mm256_storeu_si256((__m256i *)state[3], d);
+	_mm256_storeu_si256((__m256i *)state[4], e);
+}
+
+#undef MB_SCHEDULE
+#undef MB_F3
+#undef MB_F2
+#undef MB_F1
+#undef MB_ROUND
+#undef ROL8
+
+/* A lane of the multi-buffer SHA-1 computation.  Each message is processed as
+ * its full blocks, taken directly from the message, followed by the 1 or 2
+ * padded blocks at the end, which are built in @tail.  */
+struct sha1_mb_lane {
+	size_t msg_idx;
+	const u8 *next_block;
+	size_t blocks_left;
+	bool in_tail;
+	u8 tail[128];
+};
+
+static void
+sha1_mb_start_tail(struct sha1_mb_lane *lane, const u8 *msg, size_t len)
+{
+	size_t rem = len & 63;
+	size_t tail_len = (rem + 9 <= 64) ? 64 : 128;
+	be64 bitcount = cpu_to_be64((u64)len << 3);
+
+	memcpy(lane->tail, msg + (len - rem), rem);
+	lane->tail[rem] = 0x80;
+	memset(&lane->tail[rem + 1], 0, tail_len - 8 - (rem + 1));
+	memcpy(&lane->tail[tail_len - 8], &bitcount, 8);
+
+	lane->next_block = lane->tail;
+	lane->blocks_left = tail_len / 64;
+	lane->in_tail = true;
+}
+
+static void
+sha1_multi_buffer_avx2(const void * const bufs[], const size_t lens[],
+		       u8 hashes[][SHA1_HASH_SIZE], size_t num_bufs)
+{
+	struct sha1_mb_lane lanes[SHA1_MB_LANES];
+	u32 state[5][SHA1_MB_LANES] _aligned_attribute(32);
+	const u8 *ptrs[SHA1_MB_LANES];
+	size_t next_msg = 0;
+	unsigned num_active = 0;
+
+	/* All lanes start out idle.  Whenever a lane is idle, it is assigned
+	 * the next message, if any remain.  */
+	for (unsigned i = 0; i < SHA1_MB_LANES; i++)
+		lanes[i].msg_idx = SIZE_MAX;
+
+	for (;;) {
+		size_t min_blocks = SIZE_MAX;
+		const u8 *any_ptr = NULL;
+
+		for (unsigned i = 0; i < SHA1_MB_LANES; i++) {
+			struct sha1_mb_lane *lane = &lanes[i];
+
+			if (lane->msg_idx == SIZE_MAX && next_msg < num_bufs) {
+				lane->msg_idx = next_msg++;
+				state[0][i] = 0x67452301;
+				state[1][i] = 0xEFCDAB89;
+				state[2][i] = 0x98BADCFE;
+				state[3][i] = 0x10325476;
+				state[4][i] = 0xC3D2E1F0;
+				if (lens[lane->msg_idx] >= 64) {
+					lane->next_block = bufs[lane->msg_idx];
+					lane->blocks_left = lens[lane->msg_idx] / 64;
+					lane->in_tail = false;
+				} else {
+					sha1_mb_start_tail(lane,
+							   bufs[lane->msg_idx],
+							   lens[lane->msg_idx]);
+				}
+				num_active++;
+			}
+			if (lane->msg_idx != SIZE_MAX) {
+				min_blocks = min(min_blocks, lane->blocks_left);
+				any_ptr = lane->next_block;
+			}
+		}
+
+		if (num_active == 0)
+			break;
+
+		/* Hash in parallel until some lane finishes its current run of
+		 * blocks.  Idle lanes just duplicate the work of an active
+		 * lane; their results are ignored.  */
+		for (unsigned i = 0; i < SHA1_MB_LANES; i++) {
+			if (lanes[i].msg_idx != SIZE_MAX)
+				ptrs[i] = lanes[i].next_block;
+			else
+				ptrs[i] = any_ptr;
+		}
+		sha1_transform_blocks_8way_avx2(state, ptrs, min_blocks);
+
+		for (unsigned i = 0; i < SHA1_MB_LANES; i++) {
+			struct sha1_mb_lane *lane = &lanes[i];
+			size_t idx = lane->msg_idx;
+
+			if (idx == SIZE_MAX)
+				continue;
+			lane->next_block += min_blocks * 64;
+			lane->blocks_left -= min_blocks;
+			if (lane->blocks_left)
+				continue;
+			if (!lane->in_tail) {
+				sha1_mb_start_tail(lane, bufs[idx], lens[idx]);
+				continue;
+			}
+			for (int j = 0; j < 5; j++)
+				((be32 *)hashes[idx])[j] = cpu_to_be32(state[j][i]);
+			lane->msg_idx = SIZE_MAX;
+			num_active--;
+		}
+	}
+}
+
+#endif /* X86_CPU_FEATURES_ENABLED */
+
+typedef void (*sha1_transform_blocks_func_t)(u32 state[5], const void *data,
+					     size_t num_blocks);
+
+struct sha1_impl {
+	const char *name;
+	u32 required_x86_features;
+	sha1_transform_blocks_func_t transform_blocks;
+};
+
+/* The SHA-1 implementations compiled in, fastest first.  */
+static const struct sha1_impl sha1_impls[] = {
+#if X86_CPU_FEATURES_ENABLED
+	{
+		.name = "shani",
+		.required_x86_features = X86_CPU_FEATURE_SHA |
+					 X86_CPU_FEATURE_SSE4_1,
+		.transform_blocks = sha1_transform_blocks_shani,
+	},
+#endif
+#ifdef ENABLE_SSSE3_SHA1
+	/* The assembly code does its own check for SSSE3 support.  */
+	{
+		.name = "ssse3-asm",
+		.transform_blocks = sha1_transform_blocks_ssse3_asm,
+	},
+#endif
+#if X86_CPU_FEATURES_ENABLED
+	{
+		.name = "ssse3",
+		.required_x86_features = X86_CPU_FEATURE_SSSE3,
+		.transform_blocks = sha1_transform_blocks_ssse3,
+	},
+#endif
+	{
+		.name = "generic",
+		.transform_blocks = sha1_transform_blocks_default,
+	},
+};
+
+static bool
+sha1_impl_supported(const struct sha1_impl *impl)
+{
+#if X86_CPU_FEATURES_ENABLED
+	if (impl->required_x86_features &&
+	    !x86_have_cpu_features(impl->required_x86_features))
+		return false;
+#endif
+	return true;
+}
+
+static void
+sha1_transform_blocks_dispatch(u32 state[5], const void *data,
+			       size_t num_blocks);
+
+/* The SHA-1 implementation in use.  This starts out pointing to a function that
+ * selects the fastest implementation the CPU supports the first time SHA-1 is
+ * used.  Multiple threads racing to do this is harmless, since they will all
+ * select the same implementation.  */
+static const struct sha1_impl *sha1_cur_impl;
+static sha1_transform_blocks_func_t sha1_transform_blocks =
+	sha1_transform_blocks_dispatch;
+
+/* Return the name of the @idx'th SHA-1 implementation which is both compiled in
+ * and supported by the CPU, fastest first, or NULL if @idx is out of range.
+ * For benchmarking.  */
+const char *
+sha1_supported_impl_name(size_t idx)
+{
+	for (size_t i = 0; i < ARRAY_LEN(sha1_impls); i++)
+		if (sha1_impl_supported(&sha1_impls[i]) && idx-- == 0)
+			return sha1_impls[i].name;
+	return NULL;
+}
+
+/* Use the SHA-1 implementation named @name, or the fastest supported one if
+ * @name is NULL.  Returns false if there is no supported implementation with
+ * the name.  This is not thread safe, and is meant for benchmarking.  */
+bool
+sha1_select_impl(const char *name)
+{
+	for (size_t i = 0; i < ARRAY_LEN(sha1_impls); i++) {
+		const struct sha1_impl *impl = &sha1_impls[i];
+
+		if (!sha1_impl_supported(impl))
+			continue;
+		if (name && strcmp(name, impl->name))
+			continue;
+		sha1_cur_impl = impl;
+		sha1_transform_blocks = impl->transform_blocks;
+		return true;
+	}
+	return false;
+}
+
+/* Return the name of the SHA-1 implementation in use.  */
+const char *
+sha1_selected_impl_name(void)
+{
+	if (!sha1_cur_impl)
+		sha1_select_impl(NULL);
+	return sha1_cur_impl->name;
+}
+
+static void
+sha1_transform_blocks_dispatch(u32 state[5], const void *data,
+			       size_t num_blocks)
+{
+	sha1_select_impl(NULL);
+	sha1_transform_blocks(state, data, num_blocks);
+}
+
 /* Initializes the specified SHA-1 context.
  *
  * After sha1_init(), call sha1_update() zero or more times to provide the data
@@ -224,4 +822,34 @@ sha1_buffer(const void *buffer, size_t len, u8 md[20])
 	sha1_final(md, &ctx);
 }
 
+/*
+ * Calculate the SHA-1 message digests of @num_bufs independent buffers.
+ * @bufs[i] and @lens[i] give the data and length of the i'th buffer, and its
+ * message digest is written to @hashes[i].
+ *
+ * When the processor supports it, multiple buffers are hashed at the same time
+ * in the lanes of vector registers.  This is faster than sha1_buffer() on each
+ * buffer, especially for small buffers, so callers should try to pass many
+ * buffers at once.  On processors with the SHA extensions, this is only the
+ * case when there are enough buffers to fill all the lanes; smaller batches are
+ * hashed one buffer at a time.
+ */
+void
+sha1_multi_buffer(const void * const bufs[], const size_t lens[],
+		  u8 hashes[][SHA1_HASH_SIZE], size_t num_bufs)
+{
+#if X86_CPU_FEATURES_ENABLED
+	if (num_bufs > 1 && x86_have_cpu_features(X86_CPU_FEATURE_AVX2) &&
+	    (num_bufs >= SHA1_MB_LANES ||
+	     !x86_have_cpu_features(X86_CPU_FEATURE_SHA |
+				    X86_CPU_FEATURE_SSE4_1)))
+	{
+		sha1_multi_buffer_avx2(bufs, lens, hashes, num_bufs);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < num_bufs; i++)
+		sha1_buffer(bufs[i], lens[i], hashes[i]);
+}
+
 #endif /* !WITH_LIBCRYPTO */
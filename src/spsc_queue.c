@@ -0,0 +1,180 @@
+/*
+ * spsc_queue.c
+ *
+ * Lock-free single-producer, single-consumer queue for passing work between
+ * two threads.  The parallel chunk compressor gives each compressor thread one
+ * of these for chunks to compress and one for compressed chunks, so that the
+ * threads do not all contend for the lock of a shared queue.
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+#include "wimlib/assert.h"
+#include "wimlib/error.h"
+#include "wimlib/spsc_queue.h"
+#include "wimlib/timestamp.h"
+#include "wimlib/util.h"
+
+/* Number of times a consumer that finds the queue empty checks it again before
+ * going to sleep.  Work usually arrives within a few microseconds when the
+ * queue is busy, and sleeping and waking up cost far more than that.  */
+#define SPSC_QUEUE_MAX_SPINS	4000
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/* Initialize a queue that can hold up to @capacity items at once.  */
+int
+spsc_queue_init(struct spsc_queue *q, size_t capacity)
+{
+	size_t num_slots = 1;
+
+	while (num_slots < capacity)
+		num_slots <<= 1;
+
+	q->slots = MALLOC(num_slots * sizeof(q->slots[0]));
+	if (!q->slots)
+		goto err;
+	q->mask = num_slots - 1;
+	q->head = 0;
+	q->tail = 0;
+	q->consumer_sleeping = 0;
+	q->terminating = false;
+
+	/* Spinning only helps if the producer can run at the same time.  */
+	q->max_spins = (get_default_num_threads() > 1) ? SPSC_QUEUE_MAX_SPINS : 0;
+
+	if (pthread_mutex_init(&q->lock, NULL)) {
+		ERROR_WITH_ERRNO("Failed to initialize mutex");
+		goto err_free_slots;
+	}
+	if (pthread_cond_init(&q->item_avail_cond, NULL)) {
+		ERROR_WITH_ERRNO("Failed to initialize condition variable");
+		goto err_destroy_lock;
+	}
+	return 0;
+
+err_destroy_lock:
+	pthread_mutex_destroy(&q->lock);
+err_free_slots:
+	FREE(q->slots);
+err:
+	q->slots = NULL;
+	return WIMLIB_ERR_NOMEM;
+}
+
+void
+spsc_queue_destroy(struct spsc_queue *q)
+{
+	if (q->slots != NULL) {
+		pthread_mutex_destroy(&q->lock);
+		pthread_cond_destroy(&q->item_avail_cond);
+		FREE(q->slots);
+		q->slots = NULL;
+	}
+}
+
+/* Add an item to the queue.  Must only be called by the producer thread.  */
+void
+spsc_queue_put(struct spsc_queue *q, void *item)
+{
+	u32 head = q->head;
+
+	wimlib_assert(head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) <= q->mask);
+
+	q->slots[head & q->mask] = item;
+
+	/* Publishing the item and checking whether the consumer is asleep must
+	 * not be reordered, or the consumer could go to sleep right after
+	 * finding the queue empty and never be woken up.  The consumer does
+	 * the same in the opposite order.  */
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->consumer_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_signal(&q->item_avail_cond);
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+/* Remove the oldest item from the queue and return it, waiting for one to
+ * arrive if the queue is empty.  Returns NULL if the queue is being terminated.
+ * Must only be called by the consumer thread.
+ *
+ * If @wait_nsec_ret is not NULL, the number of nanoseconds spent waiting for
+ * the item, or 0 if it was already available, is stored in it.  */
+void *
+spsc_queue_get(struct spsc_queue *q, u64 *wait_nsec_ret)
+{
+	u32 tail = q->tail;
+	u64 start_time = 0;
+	unsigned spins = 0;
+	void *item;
+
+	while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail) {
+		if (__atomic_load_n(&q->terminating, __ATOMIC_ACQUIRE)) {
+			item = NULL;
+			goto out;
+		}
+		if (start_time == 0)
+			start_time = get_monotonic_time_nsec();
+		if (spins < q->max_spins) {
+			spins++;
+			cpu_relax();
+			continue;
+		}
+		pthread_mutex_lock(&q->lock);
+		__atomic_store_n(&q->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == tail &&
+		       !q->terminating)
+			pthread_cond_wait(&q->item_avail_cond, &q->lock);
+		__atomic_store_n(&q->consumer_sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	item = q->slots[tail & q->mask];
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+out:
+	if (wait_nsec_ret)
+		*wait_nsec_ret = start_time ? get_monotonic_time_nsec() - start_time : 0;
+	return item;
+}
+
+/* Make the consumer return NULL from spsc_queue_get() from now on.  May be
+ * called by any thread.  */
+void
+spsc_queue_terminate(struct spsc_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	__atomic_store_n(&q->terminating, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&q->item_avail_cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
@@ -28,6 +28,7 @@
 #endif
 
 #include "wimlib.h"
+#include "wimlib/capture.h"
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
 #include "wimlib/lookup_table.h"
@@ -203,13 +204,42 @@ dentry_reference_template(struct wim_dentry *dentry, void *_args)
 	return ret;
 }
 
+/*
+ * Like wimlib_reference_template_image(), but only for the files in the
+ * @num_branches directory trees rooted at @branches, which must be in a
+ * modified image of @wim.
+ */
+int
+reference_template_branches(WIMStruct *wim, struct wim_dentry **branches,
+			    size_t num_branches, WIMStruct *template_wim,
+			    int template_image)
+{
+	int ret;
+	struct reference_template_args args = {
+		.wim = wim,
+		.template_wim = template_wim,
+	};
+
+	ret = select_wim_image(template_wim, template_image);
+	if (ret)
+		return ret;
+
+	for (size_t i = 0; i < num_branches; i++) {
+		ret = for_dentry_in_tree(branches[i],
+					 dentry_reference_template, &args);
+		dentry_tree_clear_inode_visited(branches[i]);
+		if (ret)
+			break;
+	}
+	return ret;
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI int
 wimlib_reference_template_image(WIMStruct *wim, int new_image,
 				WIMStruct *template_wim, int template_image,
 				int flags)
 {
-	int ret;
 	struct wim_image_metadata *new_imd;
 
 	if (flags != 0)
@@ -231,17 +261,6 @@ wimlib_reference_template_image(WIMStruct *wim, int new_image,
 	if (!new_imd->modified)
 		return WIMLIB_ERR_INVALID_PARAM;
 
-	ret = select_wim_image(template_wim, template_image);
-	if (ret)
-		return ret;
-
-	struct reference_template_args args = {
-		.wim = wim,
-		.template_wim = template_wim,
-	};
-
-	ret = for_dentry_in_tree(new_imd->root_dentry,
-				 dentry_reference_template, &args);
-	dentry_tree_clear_inode_visited(new_imd->root_dentry);
-	return ret;
+	return reference_template_branches(wim, &new_imd->root_dentry, 1,
+					   template_wim, template_image);
 }
@@ -39,6 +39,18 @@ get_wim_timestamp(void)
 	return timeval_to_wim_timestamp(tv);
 }
 
+/* Return the time in nanoseconds since an unspecified starting point, from a
+ * clock that is not affected by changes to the system time.  This is only
+ * useful for measuring elapsed time.  */
+u64
+get_monotonic_time_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 void
 wim_timestamp_to_str(u64 timestamp, tchar *buf, size_t len)
 {
@@ -30,13 +30,18 @@
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
+#include "wimlib/io_ring.h"
 #include "wimlib/reparse.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/unix_data.h"
+#include "wimlib/wim.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+#  include <pthread.h>
+#endif
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -66,6 +71,33 @@ unix_get_supported_features(const char *target,
 
 #define NUM_PATHBUFS 2  /* We need 2 when creating hard links  */
 
+#ifdef ENABLE_IO_URING
+
+/* With an io_ring, the data of streams no larger than this is copied into a
+ * buffer and written later, in a batch with the data of other small files.  */
+#define DEFERRED_WRITE_MAX_STREAM_SIZE	65536
+
+/* Size of the buffer for the data of deferred files.  */
+#define DEFERRED_WRITE_BUFFER_SIZE	(4 << 20)
+
+/* Maximum number of files that can be deferred at once.  Each one stays open
+ * until the batch is written.  */
+#define MAX_DEFERRED_FILES		256
+
+/* A regular file that has been created, but whose data has not been written
+ * yet.  */
+struct deferred_file {
+	struct filedes fd;
+	const struct wim_inode *inode;
+	const u8 *data;
+	u32 size;
+
+	/* Result of the write, then of the close  */
+	s32 res;
+};
+
+#endif /* ENABLE_IO_URING */
+
 struct unix_apply_ctx {
 	/* Extract flags, the pointer to the WIMStruct, etc.  */
 	struct apply_ctx common;
@@ -98,6 +130,43 @@ struct unix_apply_ctx {
 
 	/* Number of special files we couldn't create due to EPERM  */
 	unsigned long num_special_files_ignored;
+
+#ifdef ENABLE_IO_URING
+	/* io_ring used to write and close small files in batches, or NULL  */
+	struct io_ring *ring;
+
+	/* Buffer for the data of the deferred files (allocated)  */
+	u8 *deferred_buf;
+
+	/* Number of bytes in @deferred_buf in use  */
+	size_t deferred_buf_used;
+
+	/* If the stream currently being extracted is being written to deferred
+	 * files, the start of its data in @deferred_buf and the next byte to
+	 * fill; otherwise NULL.  */
+	u8 *deferred_data;
+	u8 *deferred_ptr;
+
+	/* Regular files whose data still needs to be written, after which their
+	 * metadata is set and they are closed (allocated)  */
+	struct deferred_file *deferred_files;
+
+	/* Number of files in @deferred_files, and the maximum allowed  */
+	unsigned num_deferred_files;
+	unsigned max_deferred_files;
+#endif
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	/* Pool of threads that create files and set metadata, or NULL if
+	 * everything is done on the calling thread  */
+	struct unix_apply_pool *pool;
+
+	/* If the stream currently being extracted is being copied into a job
+	 * for the pool, the job and the next byte of its data to fill;
+	 * otherwise NULL.  */
+	struct unix_apply_job *cur_job;
+	u8 *cur_job_ptr;
+#endif
 };
 
 /* Returns the number of characters needed to represent the path to the
@@ -352,17 +421,14 @@ unix_create_hardlinks(const struct wim_inode *inode,
 	return 0;
 }
 
-/* If @dentry represents a directory, create it.  */
+/* Create the directory @dentry.  */
 static int
-unix_create_if_directory(const struct wim_dentry *dentry,
-			 struct unix_apply_ctx *ctx)
+unix_create_directory(const struct wim_dentry *dentry,
+		      struct unix_apply_ctx *ctx)
 {
 	const char *path;
 	struct stat stbuf;
 
-	if (!dentry_is_directory(dentry))
-		return 0;
-
 	path = unix_build_extraction_path(dentry, ctx);
 	if (mkdir(path, 0755) &&
 	    /* It's okay if the path already exists, as long as it's a
@@ -372,32 +438,55 @@ unix_create_if_directory(const struct wim_dentry *dentry,
 		ERROR_WITH_ERRNO("Can't create directory \"%s\"", path);
 		return WIMLIB_ERR_MKDIR;
 	}
-
-	return report_file_created(&ctx->common);
+	return 0;
 }
 
-/* If @dentry represents an empty regular file or a special file, create it, set
- * its metadata, and create any needed hard links.  */
+/* If @dentry represents a directory, create it.  */
 static int
-unix_extract_if_empty_file(const struct wim_dentry *dentry,
-			   struct unix_apply_ctx *ctx)
+unix_create_if_directory(const struct wim_dentry *dentry,
+			 struct unix_apply_ctx *ctx)
 {
-	const struct wim_inode *inode;
-	struct wimlib_unix_data unix_data;
-	const char *path;
 	int ret;
 
-	inode = dentry->d_inode;
+	if (!dentry_is_directory(dentry))
+		return 0;
+
+	ret = unix_create_directory(dentry, ctx);
+	if (ret)
+		return ret;
+
+	return report_file_created(&ctx->common);
+}
+
+/* Returns true if @dentry is the first alias of an empty regular file or a
+ * special file, which have no representatives in the stream list.  */
+static bool
+unix_is_empty_file(const struct wim_dentry *dentry)
+{
+	const struct wim_inode *inode = dentry->d_inode;
 
 	/* Extract all aliases only when the "first" comes up.  */
 	if (dentry != inode_first_extraction_dentry(inode))
-		return 0;
+		return false;
 
 	/* Is this a directory, a symbolic link, or any type of nonempty file?
 	 */
-	if (inode_is_directory(inode) || inode_is_symlink(inode) ||
-	    inode_unnamed_lte_resolved(inode))
-		return 0;
+	return !(inode_is_directory(inode) || inode_is_symlink(inode) ||
+		 inode_unnamed_lte_resolved(inode));
+}
+
+/* Create the empty regular file or special file @dentry, set its metadata, and
+ * create any needed hard links.  */
+static int
+unix_extract_empty_file(const struct wim_dentry *dentry,
+			struct unix_apply_ctx *ctx)
+{
+	const struct wim_inode *inode;
+	struct wimlib_unix_data unix_data;
+	const char *path;
+	int ret;
+
+	inode = dentry->d_inode;
 
 	/* Recognize special files in UNIX_DATA mode  */
 	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) &&
@@ -445,8 +534,24 @@ unix_extract_if_empty_file(const struct wim_dentry *dentry,
 	if (ret)
 		return ret;
 
-	ret = unix_create_hardlinks(inode, dentry, path, ctx);
-	if (ret)
+	return unix_create_hardlinks(inode, dentry, path, ctx);
+}
+
+/* If @dentry represents an empty regular file or a special file, create it, set
+ * its metadata, and create any needed hard links.  */
+static int
+unix_extract_if_empty_file(const struct wim_dentry *dentry,
+			   struct unix_apply_ctx *ctx)
+{
+	unsigned long num_special_files_ignored;
+	int ret;
+
+	if (!unix_is_empty_file(dentry))
+		return 0;
+
+	num_special_files_ignored = ctx->num_special_files_ignored;
+	ret = unix_extract_empty_file(dentry, ctx);
+	if (ret || ctx->num_special_files_ignored != num_special_files_ignored)
 		return ret;
 
 	return report_file_created(&ctx->common);
@@ -564,6 +669,128 @@ retry_create:
 	return unix_create_hardlinks(inode, first_dentry, first_path, ctx);
 }
 
+#ifdef ENABLE_IO_URING
+
+static void
+unix_deferred_file_done(u64 user_data, s32 res, void *_ctx)
+{
+	struct unix_apply_ctx *ctx = _ctx;
+
+	ctx->deferred_files[user_data].res = res;
+}
+
+/* Finish extracting a deferred file after its write has completed: complete
+ * a short write, if necessary, then set the file's metadata.  */
+static int
+unix_finish_deferred_file(struct deferred_file *f, struct unix_apply_ctx *ctx)
+{
+	int ret;
+
+	if (f->res < 0) {
+		errno = -f->res;
+		ERROR_WITH_ERRNO("Error writing data to filesystem");
+		return WIMLIB_ERR_WRITE;
+	}
+	if (f->res < f->size) {
+		ret = full_pwrite(&f->fd, &f->data[f->res], f->size - f->res,
+				  f->res);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing data to filesystem");
+			return ret;
+		}
+	}
+	return unix_set_metadata(f->fd.fd, f->inode, NULL, ctx);
+}
+
+/* Write the data of all deferred files, set their metadata, and close them.
+ * The writes, and then the closes, of all the files are each submitted with a
+ * single system call.  */
+static int
+unix_write_deferred_files(struct unix_apply_ctx *ctx)
+{
+	unsigned num_files = ctx->num_deferred_files;
+	int ret;
+
+	ctx->num_deferred_files = 0;
+	ctx->deferred_buf_used = 0;
+
+	if (num_files == 0)
+		return 0;
+
+	for (unsigned i = 0; i < num_files; i++) {
+		struct deferred_file *f = &ctx->deferred_files[i];
+
+		io_ring_prep_write(ctx->ring, f->fd.fd, f->data, f->size, 0, i);
+	}
+	ret = io_ring_run(ctx->ring, unix_deferred_file_done, ctx);
+	if (ret) {
+		for (unsigned i = 0; i < num_files; i++)
+			filedes_close(&ctx->deferred_files[i].fd);
+		return ret;
+	}
+
+	for (unsigned i = 0; i < num_files; i++) {
+		struct deferred_file *f = &ctx->deferred_files[i];
+
+		if (!ret)
+			ret = unix_finish_deferred_file(f, ctx);
+		io_ring_prep_close(ctx->ring, f->fd.fd, i);
+	}
+	if (io_ring_run(ctx->ring, unix_deferred_file_done, ctx)) {
+		/* Close the files whose close could not be submitted.  */
+		for (unsigned i = 0; i < num_files; i++) {
+			struct deferred_file *f = &ctx->deferred_files[i];
+
+			if (f->res == -ECANCELED)
+				filedes_close(&f->fd);
+		}
+		return ret ? ret : WIMLIB_ERR_WRITE;
+	}
+
+	for (unsigned i = 0; i < num_files && !ret; i++) {
+		struct deferred_file *f = &ctx->deferred_files[i];
+
+		if (f->res < 0) {
+			errno = -f->res;
+			ERROR_WITH_ERRNO("Error closing \"%s\"",
+					 unix_build_inode_extraction_path(f->inode,
+									  ctx));
+			ret = WIMLIB_ERR_WRITE;
+		}
+	}
+	return ret;
+}
+
+/* If @stream is small enough, arrange for its data to be copied into the
+ * deferred write buffer rather than written to the files directly, writing the
+ * pending deferred files first if there is no room.  */
+static int
+unix_maybe_defer_stream(const struct wim_lookup_table_entry *stream,
+			struct unix_apply_ctx *ctx)
+{
+	int ret;
+
+	if (!ctx->ring ||
+	    stream->size > DEFERRED_WRITE_MAX_STREAM_SIZE ||
+	    stream->out_refcnt > ctx->max_deferred_files)
+		return 0;
+
+	if (ctx->deferred_buf_used + stream->size > DEFERRED_WRITE_BUFFER_SIZE ||
+	    ctx->num_deferred_files + stream->out_refcnt > ctx->max_deferred_files)
+	{
+		ret = unix_write_deferred_files(ctx);
+		if (ret)
+			return ret;
+	}
+
+	ctx->deferred_data = &ctx->deferred_buf[ctx->deferred_buf_used];
+	ctx->deferred_ptr = ctx->deferred_data;
+	ctx->deferred_buf_used += stream->size;
+	return 0;
+}
+
+#endif /* ENABLE_IO_URING */
+
 /* Called when starting to read a single-instance stream for extraction  */
 static int
 unix_begin_extract_stream(struct wim_lookup_table_entry *stream, void *_ctx)
@@ -572,6 +799,12 @@ unix_begin_extract_stream(struct wim_lookup_table_entry *stream, void *_ctx)
 	const struct stream_owner *owners = stream_owners(stream);
 	int ret;
 
+#ifdef ENABLE_IO_URING
+	ret = unix_maybe_defer_stream(stream, ctx);
+	if (ret)
+		return ret;
+#endif
+
 	for (u32 i = 0; i < stream->out_refcnt; i++) {
 		const struct wim_inode *inode = owners[i].inode;
 
@@ -579,6 +812,12 @@ unix_begin_extract_stream(struct wim_lookup_table_entry *stream, void *_ctx)
 		if (ret) {
 			ctx->reparse_ptr = NULL;
 			unix_cleanup_open_fds(ctx, 0);
+		#ifdef ENABLE_IO_URING
+			if (ctx->deferred_data) {
+				ctx->deferred_buf_used -= stream->size;
+				ctx->deferred_data = NULL;
+			}
+		#endif
 			return ret;
 		}
 	}
@@ -591,9 +830,18 @@ static int
 unix_extract_chunk(const void *chunk, size_t size, void *_ctx)
 {
 	struct unix_apply_ctx *ctx = _ctx;
+	unsigned num_fds = ctx->num_open_fds;
 	int ret;
 
-	for (unsigned i = 0; i < ctx->num_open_fds; i++) {
+#ifdef ENABLE_IO_URING
+	if (ctx->deferred_data) {
+		/* The data will be written to the files later.  */
+		ctx->deferred_ptr = mempcpy(ctx->deferred_ptr, chunk, size);
+		num_fds = 0;
+	}
+#endif
+
+	for (unsigned i = 0; i < num_fds; i++) {
 		ret = full_write(&ctx->open_fds[i], chunk, size);
 		if (ret) {
 			ERROR_WITH_ERRNO("Error writing data to filesystem");
@@ -614,6 +862,11 @@ unix_end_extract_stream(struct wim_lookup_table_entry *stream, int status,
 	int ret;
 	unsigned j;
 	const struct stream_owner *owners = stream_owners(stream);
+#ifdef ENABLE_IO_URING
+	const u8 *deferred_data = ctx->deferred_data;
+
+	ctx->deferred_data = NULL;
+#endif
 
 	ctx->reparse_ptr = NULL;
 
@@ -657,6 +910,21 @@ unix_end_extract_stream(struct wim_lookup_table_entry *stream, int status,
 			 */
 			struct filedes *fd = &ctx->open_fds[j];
 
+		#ifdef ENABLE_IO_URING
+			if (deferred_data) {
+				/* Do that once the data has been written.  */
+				ctx->deferred_files[ctx->num_deferred_files++] =
+					(struct deferred_file) {
+						.fd = *fd,
+						.inode = inode,
+						.data = deferred_data,
+						.size = stream->size,
+					};
+				j++;
+				continue;
+			}
+		#endif
+
 			ret = unix_set_metadata(fd->fd, inode, NULL, ctx);
 			if (ret)
 				break;
@@ -693,6 +961,629 @@ unix_set_dir_metadata(struct list_head *dentry_list, struct unix_apply_ctx *ctx)
 	return 0;
 }
 
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+/*
+ * Parallel extraction
+ *
+ * When many small files are extracted, especially to SSDs and network
+ * filesystems, most of the time goes to the system calls that create each file
+ * and set its metadata rather than to reading data from the WIM.  When more
+ * than one thread is requested, those calls are made by a pool of worker
+ * threads, while the calling thread still reads the streams from the WIM in
+ * the usual sequential order.
+ *
+ * Extraction proceeds in the same phases as on one thread, waiting for all jobs
+ * to finish between phases:
+ *
+ * - Directories are created one level of the tree at a time, so that the parent
+ *   of each directory exists by the time it is created.
+ * - Empty regular files and special files are created.
+ * - The data of each small stream is copied into a job, and a worker creates
+ *   the files (and hard links and symbolic links) that use it, writes the
+ *   data, and sets their metadata.  Larger streams are extracted by the
+ *   calling thread as usual.
+ * - Metadata is set on directories, deepest level first, so that a directory
+ *   is never made inaccessible before its subdirectories are done.
+ *
+ * Each worker has a private copy of the extraction context, with its own path
+ * buffers and file descriptor table, so the same helper functions are used as
+ * on one thread.  Progress is reported, and the first error returned, on the
+ * calling thread.
+ */
+
+/* Streams no larger than this are copied into jobs for the worker threads.  */
+#define PARALLEL_MAX_STREAM_SIZE	(1 << 20)
+
+/* Streams with more extraction targets than this are extracted by the calling
+ * thread, which limits the number of file descriptors each worker may have
+ * open.  */
+#define PARALLEL_MAX_STREAM_REFCNT	16
+
+/* Maximum memory for jobs waiting to be done or in progress.  The calling
+ * thread waits when this would be exceeded.  */
+#define PARALLEL_MAX_QUEUED_BYTES	(64 << 20)
+
+enum unix_apply_job_type {
+	UNIX_APPLY_JOB_CREATE_DIRECTORY,
+	UNIX_APPLY_JOB_EXTRACT_EMPTY_FILE,
+	UNIX_APPLY_JOB_EXTRACT_STREAM,
+	UNIX_APPLY_JOB_SET_DIR_METADATA,
+};
+
+struct unix_apply_job {
+	struct list_head list;
+	enum unix_apply_job_type type;
+
+	/* Memory used by the job, counted in the pool's queued_bytes  */
+	size_t mem;
+
+	/* For all but UNIX_APPLY_JOB_EXTRACT_STREAM: the file  */
+	const struct wim_dentry *dentry;
+
+	/* For UNIX_APPLY_JOB_EXTRACT_STREAM: a private copy of the stream's
+	 * entry, which may be reused by the calling thread meanwhile; a copy
+	 * of its owners if they are not inline (allocated); and its data.  */
+	struct wim_lookup_table_entry *stream;
+	struct stream_owner *owners;
+	u8 *data;
+};
+
+struct unix_apply_worker {
+	struct unix_apply_pool *pool;
+	pthread_t thread;
+
+	/* Private copy of the extraction context (allocated)  */
+	struct unix_apply_ctx *ctx;
+};
+
+/* A directory to extract and its depth below the extraction root  */
+struct unix_apply_dir {
+	const struct wim_dentry *dentry;
+	unsigned depth;
+};
+
+struct unix_apply_pool {
+	struct unix_apply_worker *workers;
+	unsigned num_workers;
+
+	/* The directories to extract, sorted by depth (allocated)  */
+	struct unix_apply_dir *dirs;
+	size_t num_dirs;
+
+	/* Function to call on the calling thread for each finished job that
+	 * counts towards file progress, or NULL  */
+	int (*report)(struct apply_ctx *ctx);
+
+	/* Protects the fields below  */
+	pthread_mutex_t lock;
+
+	/* Signaled when jobs are queued or the pool is terminating  */
+	pthread_cond_t job_cond;
+
+	/* Signaled when a job has finished  */
+	pthread_cond_t done_cond;
+
+	/* Jobs waiting for a worker  */
+	struct list_head jobs;
+
+	/* Memory used by the jobs that are queued or in progress  */
+	size_t queued_bytes;
+
+	/* Number of finished jobs not yet passed to @report  */
+	size_t num_reports;
+
+	/* First error from a job, or 0.  Once set, remaining jobs are skipped.
+	 */
+	int error;
+
+	bool terminating;
+};
+
+static void
+unix_free_job(struct unix_apply_job *job)
+{
+	FREE(job->owners);
+	FREE(job);
+}
+
+static int
+unix_run_job(struct unix_apply_job *job, struct unix_apply_ctx *ctx)
+{
+	int ret;
+
+	switch (job->type) {
+	case UNIX_APPLY_JOB_CREATE_DIRECTORY:
+		return unix_create_directory(job->dentry, ctx);
+	case UNIX_APPLY_JOB_EXTRACT_EMPTY_FILE:
+		return unix_extract_empty_file(job->dentry, ctx);
+	case UNIX_APPLY_JOB_EXTRACT_STREAM:
+		ret = unix_begin_extract_stream(job->stream, ctx);
+		if (ret)
+			return ret;
+		ret = unix_extract_chunk(job->data, job->stream->size, ctx);
+		return unix_end_extract_stream(job->stream, ret, ctx);
+	case UNIX_APPLY_JOB_SET_DIR_METADATA:
+		return unix_set_metadata(-1, job->dentry->d_inode, NULL, ctx);
+	}
+	return 0;
+}
+
+static void *
+unix_apply_thread_proc(void *arg)
+{
+	struct unix_apply_worker *worker = arg;
+	struct unix_apply_pool *pool = worker->pool;
+	struct unix_apply_ctx *ctx = worker->ctx;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		struct unix_apply_job *job;
+		unsigned long num_special_files_ignored;
+		size_t mem;
+		bool report = false;
+		int ret = 0;
+
+		while (list_empty(&pool->jobs) && !pool->terminating)
+			pthread_cond_wait(&pool->job_cond, &pool->lock);
+		if (list_empty(&pool->jobs))
+			break;
+		job = list_first_entry(&pool->jobs, struct unix_apply_job, list);
+		list_del(&job->list);
+
+		if (!pool->error) {
+			pthread_mutex_unlock(&pool->lock);
+
+			num_special_files_ignored = ctx->num_special_files_ignored;
+			ret = unix_run_job(job, ctx);
+			report = (job->type != UNIX_APPLY_JOB_EXTRACT_STREAM &&
+				  !ret && ctx->num_special_files_ignored ==
+					num_special_files_ignored);
+
+			pthread_mutex_lock(&pool->lock);
+		}
+		mem = job->mem;
+		unix_free_job(job);
+
+		if (ret && !pool->error)
+			pool->error = ret;
+		if (report)
+			pool->num_reports++;
+		pool->queued_bytes -= mem;
+		pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Wait until the jobs that are queued or in progress use no more than
+ * @max_bytes of memory, reporting file progress for the jobs that finish in the
+ * meantime.  With @max_bytes == 0, this waits for all jobs to finish.  Returns
+ * the first error from any job, or from the progress function.  */
+static int
+unix_wait_for_jobs(struct unix_apply_ctx *ctx, size_t max_bytes)
+{
+	struct unix_apply_pool *pool = ctx->pool;
+	size_t num_reports;
+	bool done;
+	int ret;
+
+	do {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->error && !pool->num_reports &&
+		       pool->queued_bytes > max_bytes)
+			pthread_cond_wait(&pool->done_cond, &pool->lock);
+		ret = pool->error;
+		num_reports = pool->num_reports;
+		pool->num_reports = 0;
+		done = (pool->queued_bytes <= max_bytes);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (ret)
+			return ret;
+
+		while (num_reports--) {
+			ret = (*pool->report)(&ctx->common);
+			if (ret) {
+				/* Skip the remaining jobs.  */
+				pthread_mutex_lock(&pool->lock);
+				pool->error = ret;
+				pthread_mutex_unlock(&pool->lock);
+				return ret;
+			}
+		}
+	} while (!done);
+
+	return 0;
+}
+
+/* Queue @job for the worker threads, first waiting for memory to be available
+ * if needed.  The job is freed on failure.  */
+static int
+unix_queue_job(struct unix_apply_job *job, struct unix_apply_ctx *ctx)
+{
+	struct unix_apply_pool *pool = ctx->pool;
+	int ret;
+
+	ret = unix_wait_for_jobs(ctx, PARALLEL_MAX_QUEUED_BYTES - job->mem);
+	if (ret) {
+		unix_free_job(job);
+		return ret;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	list_add_tail(&job->list, &pool->jobs);
+	pool->queued_bytes += job->mem;
+	pthread_cond_signal(&pool->job_cond);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+static int
+unix_queue_dentry_job(enum unix_apply_job_type type,
+		      const struct wim_dentry *dentry,
+		      struct unix_apply_ctx *ctx)
+{
+	struct unix_apply_job *job;
+
+	job = CALLOC(1, sizeof(*job));
+	if (!job)
+		return WIMLIB_ERR_NOMEM;
+	job->type = type;
+	job->mem = sizeof(*job);
+	job->dentry = dentry;
+	return unix_queue_job(job, ctx);
+}
+
+/* Queue a job of type @type for each directory at each depth in turn, waiting
+ * for the jobs at one depth to finish before starting the next.  The depths
+ * are visited in increasing order, or in decreasing order if @reverse.  */
+static int
+unix_queue_dir_jobs_by_depth(enum unix_apply_job_type type, bool reverse,
+			     struct unix_apply_ctx *ctx)
+{
+	const struct unix_apply_pool *pool = ctx->pool;
+	size_t i = 0;
+	int ret;
+
+	while (i < pool->num_dirs) {
+		const struct unix_apply_dir *dir;
+		unsigned depth;
+
+		dir = &pool->dirs[reverse ? pool->num_dirs - 1 - i : i];
+		depth = dir->depth;
+		do {
+			ret = unix_queue_dentry_job(type, dir->dentry, ctx);
+			if (ret)
+				return ret;
+			if (++i == pool->num_dirs)
+				break;
+			dir = &pool->dirs[reverse ? pool->num_dirs - 1 - i : i];
+		} while (dir->depth == depth);
+
+		ret = unix_wait_for_jobs(ctx, 0);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int
+unix_create_dirs_and_empty_files_parallel(const struct list_head *dentry_list,
+					  struct unix_apply_ctx *ctx)
+{
+	const struct wim_dentry *dentry;
+	int ret;
+
+	ctx->pool->report = report_file_created;
+
+	ret = unix_queue_dir_jobs_by_depth(UNIX_APPLY_JOB_CREATE_DIRECTORY,
+					   false, ctx);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		if (unix_is_empty_file(dentry)) {
+			ret = unix_queue_dentry_job(UNIX_APPLY_JOB_EXTRACT_EMPTY_FILE,
+						    dentry, ctx);
+			if (ret)
+				return ret;
+		}
+	}
+	return unix_wait_for_jobs(ctx, 0);
+}
+
+static int
+unix_set_dir_metadata_parallel(struct unix_apply_ctx *ctx)
+{
+	ctx->pool->report = report_file_metadata_applied;
+
+	return unix_queue_dir_jobs_by_depth(UNIX_APPLY_JOB_SET_DIR_METADATA,
+					    true, ctx);
+}
+
+/* Called when starting to read a single-instance stream for extraction, when
+ * extracting with a pool of worker threads.  If the stream is small, its data
+ * will be copied into a job; otherwise it is extracted as usual.  */
+static int
+unix_begin_extract_stream_parallel(struct wim_lookup_table_entry *stream,
+				   void *_ctx)
+{
+	struct unix_apply_ctx *ctx = _ctx;
+	struct unix_apply_job *job;
+	size_t owners_size;
+
+	if (stream->size > PARALLEL_MAX_STREAM_SIZE ||
+	    stream->out_refcnt > PARALLEL_MAX_STREAM_REFCNT)
+		return unix_begin_extract_stream(stream, ctx);
+
+	job = CALLOC(1, sizeof(*job) + sizeof(*stream) + stream->size);
+	if (!job)
+		return WIMLIB_ERR_NOMEM;
+	job->type = UNIX_APPLY_JOB_EXTRACT_STREAM;
+	job->mem = sizeof(*job) + sizeof(*stream) + stream->size;
+	job->stream = (struct wim_lookup_table_entry *)(job + 1);
+	job->data = (u8 *)(job->stream + 1);
+	memcpy(job->stream, stream, sizeof(*stream));
+
+	if (stream->out_refcnt > ARRAY_LEN(stream->inline_stream_owners)) {
+		owners_size = stream->out_refcnt * sizeof(job->owners[0]);
+		job->owners = memdup(stream->stream_owners, owners_size);
+		if (!job->owners) {
+			FREE(job);
+			return WIMLIB_ERR_NOMEM;
+		}
+		job->stream->stream_owners = job->owners;
+	}
+
+	ctx->cur_job = job;
+	ctx->cur_job_ptr = job->data;
+	return 0;
+}
+
+static int
+unix_extract_chunk_parallel(const void *chunk, size_t size, void *_ctx)
+{
+	struct unix_apply_ctx *ctx = _ctx;
+
+	if (!ctx->cur_job)
+		return unix_extract_chunk(chunk, size, ctx);
+
+	ctx->cur_job_ptr = mempcpy(ctx->cur_job_ptr, chunk, size);
+	return 0;
+}
+
+static int
+unix_end_extract_stream_parallel(struct wim_lookup_table_entry *stream,
+				 int status, void *_ctx)
+{
+	struct unix_apply_ctx *ctx = _ctx;
+	struct unix_apply_job *job = ctx->cur_job;
+
+	if (!job)
+		return unix_end_extract_stream(stream, status, ctx);
+
+	ctx->cur_job = NULL;
+	if (status) {
+		unix_free_job(job);
+		return status;
+	}
+	return unix_queue_job(job, ctx);
+}
+
+static unsigned
+unix_dentry_depth(const struct wim_dentry *dentry)
+{
+	unsigned depth = 0;
+
+	while (!dentry_is_root(dentry) && will_extract_dentry(dentry->d_parent)) {
+		depth++;
+		dentry = dentry->d_parent;
+	}
+	return depth;
+}
+
+static int
+cmp_dirs_by_depth(const void *p1, const void *p2)
+{
+	const struct unix_apply_dir *dir1 = p1;
+	const struct unix_apply_dir *dir2 = p2;
+
+	if (dir1->depth < dir2->depth)
+		return -1;
+	if (dir1->depth > dir2->depth)
+		return 1;
+	return 0;
+}
+
+static int
+unix_collect_dirs(const struct list_head *dentry_list,
+		  struct unix_apply_pool *pool)
+{
+	const struct wim_dentry *dentry;
+	size_t num_dirs = 0;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
+		if (dentry_is_directory(dentry))
+			num_dirs++;
+
+	if (num_dirs == 0)
+		return 0;
+
+	pool->dirs = MALLOC(num_dirs * sizeof(pool->dirs[0]));
+	if (!pool->dirs)
+		return WIMLIB_ERR_NOMEM;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		if (dentry_is_directory(dentry)) {
+			pool->dirs[pool->num_dirs].dentry = dentry;
+			pool->dirs[pool->num_dirs].depth = unix_dentry_depth(dentry);
+			pool->num_dirs++;
+		}
+	}
+	qsort(pool->dirs, pool->num_dirs, sizeof(pool->dirs[0]),
+	      cmp_dirs_by_depth);
+	return 0;
+}
+
+/* Make a private copy of @ctx for a worker thread.  */
+static struct unix_apply_ctx *
+unix_clone_ctx(const struct unix_apply_ctx *ctx, size_t path_max)
+{
+	struct unix_apply_ctx *clone;
+
+	clone = MALLOC(sizeof(*clone));
+	if (!clone)
+		return NULL;
+	memcpy(clone, ctx, sizeof(*clone));
+	clone->which_pathbuf = 0;
+	clone->num_open_fds = 0;
+	clone->reparse_ptr = NULL;
+	clone->num_special_files_ignored = 0;
+#ifdef ENABLE_IO_URING
+	clone->ring = NULL;
+	clone->deferred_data = NULL;
+#endif
+	clone->pool = NULL;
+	clone->cur_job = NULL;
+
+	for (unsigned i = 0; i < NUM_PATHBUFS; i++) {
+		clone->pathbufs[i] = MALLOC(path_max);
+		if (!clone->pathbufs[i]) {
+			while (i--)
+				FREE(clone->pathbufs[i]);
+			FREE(clone);
+			return NULL;
+		}
+		memcpy(clone->pathbufs[i],
+		       ctx->common.target, ctx->common.target_nchars);
+	}
+	return clone;
+}
+
+static void
+unix_free_clone_ctx(struct unix_apply_ctx *clone)
+{
+	if (clone) {
+		for (unsigned i = 0; i < NUM_PATHBUFS; i++)
+			FREE(clone->pathbufs[i]);
+		FREE(clone);
+	}
+}
+
+/* Stop the worker threads, if any, and free the pool.  */
+static void
+unix_stop_workers(struct unix_apply_ctx *ctx)
+{
+	struct unix_apply_pool *pool = ctx->pool;
+	struct unix_apply_job *job, *tmp;
+
+	if (!pool)
+		return;
+
+	if (ctx->cur_job) {
+		unix_free_job(ctx->cur_job);
+		ctx->cur_job = NULL;
+	}
+
+	/* Discard any jobs that haven't been started, which can only remain
+	 * after an error.  */
+	pthread_mutex_lock(&pool->lock);
+	list_for_each_entry_safe(job, tmp, &pool->jobs, list)
+		unix_free_job(job);
+	INIT_LIST_HEAD(&pool->jobs);
+	pool->terminating = true;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned i = 0; i < pool->num_workers; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+		ctx->num_special_files_ignored +=
+			pool->workers[i].ctx->num_special_files_ignored;
+		unix_free_clone_ctx(pool->workers[i].ctx);
+	}
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->job_cond);
+	pthread_mutex_destroy(&pool->lock);
+	FREE(pool->dirs);
+	FREE(pool->workers);
+	FREE(pool);
+	ctx->pool = NULL;
+}
+
+/* If more than one thread was requested, start a pool of worker threads for
+ * the extraction.  Failure to start threads is not an error; the extraction is
+ * then done on fewer threads, or on the calling thread only.  */
+static int
+unix_start_workers(const struct list_head *dentry_list, size_t path_max,
+		   struct unix_apply_ctx *ctx)
+{
+	struct unix_apply_pool *pool;
+	unsigned num_threads;
+	int ret;
+
+	num_threads = ctx->common.wim->num_extraction_threads;
+	if (num_threads == 0)
+		num_threads = get_default_num_threads();
+	if (num_threads <= 1)
+		return 0;
+
+#ifdef ENABLE_IO_URING
+	/* Batching with io_uring was requested instead.  */
+	if (ctx->common.wim->io_queue_depth > 1)
+		return 0;
+#endif
+
+	pool = CALLOC(1, sizeof(*pool));
+	if (!pool)
+		return WIMLIB_ERR_NOMEM;
+	pool->workers = CALLOC(num_threads, sizeof(pool->workers[0]));
+	if (!pool->workers) {
+		FREE(pool);
+		return WIMLIB_ERR_NOMEM;
+	}
+	INIT_LIST_HEAD(&pool->jobs);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	ctx->pool = pool;
+
+	ret = unix_collect_dirs(dentry_list, pool);
+	if (ret)
+		goto err;
+
+	while (pool->num_workers < num_threads) {
+		struct unix_apply_worker *worker =
+			&pool->workers[pool->num_workers];
+
+		worker->pool = pool;
+		worker->ctx = unix_clone_ctx(ctx, path_max);
+		if (!worker->ctx) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto err;
+		}
+		if (pthread_create(&worker->thread, NULL,
+				   unix_apply_thread_proc, worker))
+		{
+			WARNING_WITH_ERRNO("Failed to create extraction thread");
+			unix_free_clone_ctx(worker->ctx);
+			break;
+		}
+		pool->num_workers++;
+	}
+
+	if (pool->num_workers == 0)
+		unix_stop_workers(ctx);
+	return 0;
+
+err:
+	unix_stop_workers(ctx);
+	return ret;
+}
+
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
+
 static int
 unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 {
@@ -716,12 +1607,25 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 		       ctx->common.target, ctx->common.target_nchars);
 	}
 
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	/* If requested, start threads to create files and set metadata in
+	 * parallel.  */
+	ret = unix_start_workers(dentry_list, path_max, ctx);
+	if (ret)
+		goto out;
+#endif
+
 	/* Extract directories and empty regular files.  Directories are needed
 	 * because we can't extract any other files until their directories
 	 * exist.  Empty files are needed because they don't have
 	 * representatives in the stream list.  */
 	reset_file_progress(&ctx->common);
-	ret = unix_create_dirs_and_empty_files(dentry_list, ctx);
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx->pool)
+		ret = unix_create_dirs_and_empty_files_parallel(dentry_list, ctx);
+	else
+#endif
+		ret = unix_create_dirs_and_empty_files(dentry_list, ctx);
 	if (ret)
 		goto out;
 
@@ -747,25 +1651,86 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 		.end_stream        = unix_end_extract_stream,
 		.end_stream_ctx    = ctx,
 	};
-	ret = extract_stream_list(&ctx->common, &cbs);
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx->pool) {
+		/* The workers are idle, so they can be given the target path
+		 * without locking.  */
+		for (unsigned i = 0; i < ctx->pool->num_workers; i++) {
+			struct unix_apply_ctx *wctx = ctx->pool->workers[i].ctx;
+
+			wctx->target_abspath = ctx->target_abspath;
+			wctx->target_abspath_nchars = ctx->target_abspath_nchars;
+		}
+		cbs.begin_stream  = unix_begin_extract_stream_parallel;
+		cbs.consume_chunk = unix_extract_chunk_parallel;
+		cbs.end_stream    = unix_end_extract_stream_parallel;
+		ctx->pool->report = NULL;
+		ret = extract_stream_list(&ctx->common, &cbs);
+		if (!ret)
+			ret = unix_wait_for_jobs(ctx, 0);
+	} else
+#endif
+	{
+#ifdef ENABLE_IO_URING
+		/* If requested and available, write and close small files in
+		 * batches.  */
+		ctx->ring = io_ring_new(ctx->common.wim->io_queue_depth);
+		if (ctx->ring) {
+			ctx->max_deferred_files = min(io_ring_depth(ctx->ring),
+						      MAX_DEFERRED_FILES);
+			ctx->deferred_buf = MALLOC(DEFERRED_WRITE_BUFFER_SIZE);
+			ctx->deferred_files = MALLOC(ctx->max_deferred_files *
+						     sizeof(ctx->deferred_files[0]));
+			if (!ctx->deferred_buf || !ctx->deferred_files) {
+				ret = WIMLIB_ERR_NOMEM;
+				goto out;
+			}
+		}
+#endif
+		ret = extract_stream_list(&ctx->common, &cbs);
+#ifdef ENABLE_IO_URING
+		if (ctx->ring) {
+			int ret2 = unix_write_deferred_files(ctx);
+			if (!ret)
+				ret = ret2;
+		}
+#endif
+	}
 	if (ret)
 		goto out;
 
-
 	/* Set directory metadata.  We do this last so that we get the right
 	 * directory timestamps.  */
 	reset_file_progress(&ctx->common);
-	ret = unix_set_dir_metadata(dentry_list, ctx);
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx->pool)
+		ret = unix_set_dir_metadata_parallel(ctx);
+	else
+#endif
+		ret = unix_set_dir_metadata(dentry_list, ctx);
 	if (ret)
 		goto out;
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	/* Collect the workers' counts of special files ignored.  */
+	unix_stop_workers(ctx);
+#endif
 	if (ctx->num_special_files_ignored) {
 		WARNING("%lu special files were not extracted due to EPERM!",
 			ctx->num_special_files_ignored);
 	}
 out:
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	unix_stop_workers(ctx);
+#endif
 	for (unsigned i = 0; i < NUM_PATHBUFS; i++)
 		FREE(ctx->pathbufs[i]);
 	FREE(ctx->target_abspath);
+#ifdef ENABLE_IO_URING
+	FREE(ctx->deferred_buf);
+	FREE(ctx->deferred_files);
+	io_ring_free(ctx->ring);
+#endif
 	return ret;
 }
 
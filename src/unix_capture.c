@@ -31,6 +31,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h> /* for PATH_MAX */
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+#  include <pthread.h>
+#endif
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -250,33 +253,17 @@ unix_fixup_abslink(char *dest, u64 ino, u64 dev)
 	return NULL;
 }
 
+/* Turn @inode into a symbolic link to @dest, which is the UNIX target of the
+ * symbolic link @full_path.  @dest may be modified in place.  */
 static int
-unix_scan_symlink(const char *full_path, int dirfd, const char *relpath,
-		  struct wim_inode *inode, struct add_image_params *params)
+unix_set_symlink_target(const char *full_path, char *dest,
+			struct wim_inode *inode, struct add_image_params *params)
 {
-	char deref_name_buf[4096];
-	ssize_t deref_name_len;
-	char *dest;
 	int ret;
 
 	inode->i_attributes = FILE_ATTRIBUTE_REPARSE_POINT;
 	inode->i_reparse_tag = WIM_IO_REPARSE_TAG_SYMLINK;
 
-	/* The idea here is to call readlink() to get the UNIX target of the
-	 * symbolic link, then turn the target into a reparse point data buffer
-	 * that contains a relative or absolute symbolic link. */
-	deref_name_len = my_readlinkat(full_path, dirfd, relpath,
-				       deref_name_buf, sizeof(deref_name_buf) - 1);
-	if (deref_name_len < 0) {
-		ERROR_WITH_ERRNO("\"%s\": Can't read target of symbolic link",
-				 full_path);
-		return WIMLIB_ERR_READLINK;
-	}
-
-	dest = deref_name_buf;
-
-	dest[deref_name_len] = '\0';
-
 	if ((params->add_flags & WIMLIB_ADD_FLAG_RPFIX) &&
 	     dest[0] == '/')
 	{
@@ -289,7 +276,7 @@ unix_scan_symlink(const char *full_path, int dirfd, const char *relpath,
 						params->capture_root_ino,
 						params->capture_root_dev);
 		params->progress.scan.cur_path = full_path;
-		params->progress.scan.symlink_target = deref_name_buf;
+		params->progress.scan.symlink_target = dest;
 		if (fixed_dest) {
 			/* Link points inside the tree being captured, so it was
 			 * fixed.  */
@@ -308,7 +295,30 @@ unix_scan_symlink(const char *full_path, int dirfd, const char *relpath,
 		if (ret)
 			return ret;
 	}
-	ret = wim_inode_set_symlink(inode, dest, params->lookup_table);
+	return wim_inode_set_symlink(inode, dest, params->lookup_table);
+}
+
+static int
+unix_scan_symlink(const char *full_path, int dirfd, const char *relpath,
+		  struct wim_inode *inode, struct add_image_params *params)
+{
+	char deref_name_buf[4096];
+	ssize_t deref_name_len;
+	int ret;
+
+	/* The idea here is to call readlink() to get the UNIX target of the
+	 * symbolic link, then turn the target into a reparse point data buffer
+	 * that contains a relative or absolute symbolic link. */
+	deref_name_len = my_readlinkat(full_path, dirfd, relpath,
+				       deref_name_buf, sizeof(deref_name_buf) - 1);
+	if (deref_name_len < 0) {
+		ERROR_WITH_ERRNO("\"%s\": Can't read target of symbolic link",
+				 full_path);
+		return WIMLIB_ERR_READLINK;
+	}
+	deref_name_buf[deref_name_len] = '\0';
+
+	ret = unix_set_symlink_target(full_path, deref_name_buf, inode, params);
 	if (ret)
 		return ret;
 
@@ -323,6 +333,86 @@ unix_scan_symlink(const char *full_path, int dirfd, const char *relpath,
 	return 0;
 }
 
+/*
+ * Create the dentry for the file @full_path, named @name, from its metadata
+ * @stbuf.  On success, *tree_ret is set to the new dentry, or to NULL if the
+ * file was skipped because its type is unsupported.  If the file is a hard
+ * link to an inode that has already been captured, the inode's i_nlink will be
+ * greater than 1 and there is nothing more to do for it.  Otherwise, the caller
+ * must still capture the file's data.
+ */
+static int
+unix_new_dentry(struct wim_dentry **tree_ret, const char *full_path,
+		const char *name, const struct stat *stbuf,
+		struct add_image_params *params)
+{
+	struct wim_dentry *tree;
+	struct wim_inode *inode;
+	int ret;
+
+	*tree_ret = NULL;
+
+	if (!(params->add_flags & WIMLIB_ADD_FLAG_UNIX_DATA)) {
+		if (unlikely(!S_ISREG(stbuf->st_mode) &&
+			     !S_ISDIR(stbuf->st_mode) &&
+			     !S_ISLNK(stbuf->st_mode)))
+		{
+			if (params->add_flags &
+			    WIMLIB_ADD_FLAG_NO_UNSUPPORTED_EXCLUDE)
+			{
+				ERROR("\"%s\": File type is unsupported",
+				      full_path);
+				return WIMLIB_ERR_UNSUPPORTED_FILE;
+			}
+			params->progress.scan.cur_path = full_path;
+			return do_capture_progress(params,
+						   WIMLIB_SCAN_DENTRY_UNSUPPORTED,
+						   NULL);
+		}
+	}
+
+	ret = inode_table_new_dentry(params->inode_table, name,
+				     stbuf->st_ino, stbuf->st_dev,
+				     S_ISDIR(stbuf->st_mode), &tree);
+	if (ret)
+		return ret;
+
+	*tree_ret = tree;
+	inode = tree->d_inode;
+
+	/* Already seen this inode?  */
+	if (inode->i_nlink > 1)
+		return 0;
+
+#ifdef HAVE_STAT_NANOSECOND_PRECISION
+	inode->i_creation_time = timespec_to_wim_timestamp(stbuf->st_mtim);
+	inode->i_last_write_time = timespec_to_wim_timestamp(stbuf->st_mtim);
+	inode->i_last_access_time = timespec_to_wim_timestamp(stbuf->st_atim);
+#else
+	inode->i_creation_time = unix_timestamp_to_wim(stbuf->st_mtime);
+	inode->i_last_write_time = unix_timestamp_to_wim(stbuf->st_mtime);
+	inode->i_last_access_time = unix_timestamp_to_wim(stbuf->st_atime);
+#endif
+	inode->i_resolved = 1;
+	if (params->add_flags & WIMLIB_ADD_FLAG_UNIX_DATA) {
+		struct wimlib_unix_data unix_data;
+
+		unix_data.uid = stbuf->st_uid;
+		unix_data.gid = stbuf->st_gid;
+		unix_data.mode = stbuf->st_mode;
+		unix_data.rdev = stbuf->st_rdev;
+		if (!inode_set_unix_data(inode, &unix_data, UNIX_DATA_ALL))
+			return WIMLIB_ERR_NOMEM;
+	}
+
+	if (params->add_flags & WIMLIB_ADD_FLAG_ROOT) {
+		params->capture_root_ino = stbuf->st_ino;
+		params->capture_root_dev = stbuf->st_dev;
+		params->add_flags &= ~WIMLIB_ADD_FLAG_ROOT;
+	}
+	return 0;
+}
+
 static int
 unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 				 char *full_path, size_t full_path_len,
@@ -354,31 +444,8 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 		goto out;
 	}
 
-	if (!(params->add_flags & WIMLIB_ADD_FLAG_UNIX_DATA)) {
-		if (unlikely(!S_ISREG(stbuf.st_mode) &&
-			     !S_ISDIR(stbuf.st_mode) &&
-			     !S_ISLNK(stbuf.st_mode)))
-		{
-			if (params->add_flags &
-			    WIMLIB_ADD_FLAG_NO_UNSUPPORTED_EXCLUDE)
-			{
-				ERROR("\"%s\": File type is unsupported",
-				      full_path);
-				ret = WIMLIB_ERR_UNSUPPORTED_FILE;
-				goto out;
-			}
-			params->progress.scan.cur_path = full_path;
-			ret = do_capture_progress(params,
-						  WIMLIB_SCAN_DENTRY_UNSUPPORTED,
-						  NULL);
-			goto out;
-		}
-	}
-
-	ret = inode_table_new_dentry(params->inode_table, relpath,
-				     stbuf.st_ino, stbuf.st_dev,
-				     S_ISDIR(stbuf.st_mode), &tree);
-	if (ret)
+	ret = unix_new_dentry(&tree, full_path, relpath, &stbuf, params);
+	if (ret || !tree)
 		goto out;
 
 	inode = tree->d_inode;
@@ -387,35 +454,6 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 	if (inode->i_nlink > 1)
 		goto out_progress;
 
-#ifdef HAVE_STAT_NANOSECOND_PRECISION
-	inode->i_creation_time = timespec_to_wim_timestamp(stbuf.st_mtim);
-	inode->i_last_write_time = timespec_to_wim_timestamp(stbuf.st_mtim);
-	inode->i_last_access_time = timespec_to_wim_timestamp(stbuf.st_atim);
-#else
-	inode->i_creation_time = unix_timestamp_to_wim(stbuf.st_mtime);
-	inode->i_last_write_time = unix_timestamp_to_wim(stbuf.st_mtime);
-	inode->i_last_access_time = unix_timestamp_to_wim(stbuf.st_atime);
-#endif
-	inode->i_resolved = 1;
-	if (params->add_flags & WIMLIB_ADD_FLAG_UNIX_DATA) {
-		struct wimlib_unix_data unix_data;
-
-		unix_data.uid = stbuf.st_uid;
-		unix_data.gid = stbuf.st_gid;
-		unix_data.mode = stbuf.st_mode;
-		unix_data.rdev = stbuf.st_rdev;
-		if (!inode_set_unix_data(inode, &unix_data, UNIX_DATA_ALL)) {
-			ret = WIMLIB_ERR_NOMEM;
-			goto out;
-		}
-	}
-
-	if (params->add_flags & WIMLIB_ADD_FLAG_ROOT) {
-		params->capture_root_ino = stbuf.st_ino;
-		params->capture_root_dev = stbuf.st_dev;
-		params->add_flags &= ~WIMLIB_ADD_FLAG_ROOT;
-	}
-
 	if (S_ISREG(stbuf.st_mode)) {
 		ret = unix_scan_regular_file(full_path, stbuf.st_size,
 					     inode, params->unhashed_streams);
@@ -444,6 +482,664 @@ out:
 	return ret;
 }
 
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+/*
+ * Parallel scanning
+ *
+ * On large directory trees, and especially on network filesystems, most of the
+ * time spent scanning goes to the system calls that read directories and get
+ * the metadata of each file.  When more than one thread is requested, those
+ * calls are made by a pool of worker threads, and the calling thread builds
+ * the dentry tree from their results.
+ *
+ * Each worker has a double-ended queue of directories waiting to be read.  A
+ * worker takes directories from the tail of its own queue, so it keeps going
+ * depth-first into the directories it just read.  When its own queue is empty,
+ * it steals from the head of another worker's queue, which holds directories
+ * found earlier and nearer the root.
+ *
+ * The calling thread visits the results in the same order as the serial scan,
+ * waiting for each directory to be read if it hasn't been yet.  Everything that
+ * touches shared state is done on the calling thread: creating dentries and
+ * inodes, detecting hard links, adding streams to the unhashed list, and
+ * reporting progress and errors.  The resulting tree is therefore the same
+ * regardless of the number of threads and of how the work was divided.
+ */
+
+/* Information about a file, gathered by a worker thread.  */
+struct unix_scan_node {
+	/* Next file in the same directory, in readdir() order.  */
+	struct unix_scan_node *next;
+
+	/* For directories: the files in the directory, in readdir() order.
+	 * Only valid once @scanned has been set.  */
+	struct unix_scan_node *children;
+
+	/* For directories waiting to be read: the full path of the directory,
+	 * and the link in a worker's queue.  */
+	char *dir_path;
+	size_t dir_path_len;
+	struct list_head queue_list;
+
+	/* For symbolic links: the target of the link.  */
+	char *symlink_target;
+
+	/* WIMLIB_ERR_* code for a failure while scanning this file, or 0.  For
+	 * directories, this may be set even though some of the children were
+	 * read.  */
+	int error;
+
+	/* errno value for @error.  */
+	int errnum;
+
+	/* For directories: true if the directory was queued to be read, and
+	 * true once it has been read.  @scanned is protected by the scanner's
+	 * lock.  */
+	bool queued;
+	bool scanned;
+
+	/* True if the file is excluded by the capture configuration.  */
+	bool excluded;
+
+	/* For symbolic links: true if the target is a directory.  */
+	bool symlink_to_dir;
+
+	struct stat stbuf;
+
+	char name[];
+};
+
+struct unix_scan_worker {
+	struct unix_scanner *scanner;
+	pthread_t thread;
+
+	/* Directories waiting to be read, protected by @lock.  */
+	pthread_mutex_t lock;
+	struct list_head queue;
+
+	/* Buffer for building the paths of files in a directory.  */
+	char *path_buf;
+
+	/* Exclusion checks done by this worker, added to the capture
+	 * configuration's once the scan is done.  */
+	struct exclusion_stats exclusion_stats;
+};
+
+struct unix_scanner {
+	struct unix_scan_worker *workers;
+
+	/* Number of workers whose threads have been started.  Workers read it
+	 * atomically, since it is still increasing when the first ones start.  */
+	unsigned num_workers;
+
+	/* Protects the fields below and the 'scanned' flag of each node.  To
+	 * queue directories, this lock is taken before the worker's lock.  */
+	pthread_mutex_t lock;
+
+	/* Signaled when directories are queued or the scan is terminating.  */
+	pthread_cond_t work_cond;
+
+	/* Signaled when a directory has been read.  */
+	pthread_cond_t scanned_cond;
+
+	/* Number of directories in all the workers' queues.  */
+	size_t num_queued;
+
+	bool terminating;
+
+	struct capture_config *config;
+	size_t capture_root_nchars;
+	size_t path_bufsz;
+
+	/* Flags for my_fstatat() on files other than the root.  */
+	int stat_flags;
+};
+
+static struct unix_scan_node *
+unix_scan_new_node(const char *name, size_t name_len)
+{
+	struct unix_scan_node *node;
+
+	node = CALLOC(1, sizeof(*node) + name_len + 1);
+	if (node)
+		memcpy(node->name, name, name_len + 1);
+	return node;
+}
+
+static void
+unix_scan_set_error(struct unix_scan_node *node, int error)
+{
+	node->error = error;
+	node->errnum = errno;
+}
+
+/* Gather into @node the information needed to capture the file @full_path,
+ * which is @relpath relative to the directory @dirfd.  A directory is only
+ * prepared to be queued here; it is read later by unix_scan_read_dir().
+ * The exclusion check is counted in @stats, which belongs to the calling
+ * thread.  */
+static void
+unix_scan_file(struct unix_scanner *scanner, struct unix_scan_node *node,
+	       const char *full_path, size_t full_path_len,
+	       int dirfd, const char *relpath, int stat_flags,
+	       struct exclusion_stats *stats)
+{
+	if (should_exclude_path_stats(full_path + scanner->capture_root_nchars,
+				      full_path_len - scanner->capture_root_nchars,
+				      scanner->config, stats))
+	{
+		node->excluded = true;
+		return;
+	}
+
+	if (my_fstatat(full_path, dirfd, relpath, &node->stbuf, stat_flags)) {
+		unix_scan_set_error(node, WIMLIB_ERR_STAT);
+		return;
+	}
+
+	if (S_ISDIR(node->stbuf.st_mode)) {
+		node->dir_path = MALLOC(full_path_len + 1);
+		if (!node->dir_path) {
+			node->error = WIMLIB_ERR_NOMEM;
+			return;
+		}
+		memcpy(node->dir_path, full_path, full_path_len + 1);
+		node->dir_path_len = full_path_len;
+	} else if (S_ISLNK(node->stbuf.st_mode)) {
+		char buf[4096];
+		ssize_t len;
+		struct stat stbuf;
+
+		len = my_readlinkat(full_path, dirfd, relpath,
+				    buf, sizeof(buf) - 1);
+		if (len < 0) {
+			unix_scan_set_error(node, WIMLIB_ERR_READLINK);
+			return;
+		}
+		node->symlink_target = MALLOC(len + 1);
+		if (!node->symlink_target) {
+			node->error = WIMLIB_ERR_NOMEM;
+			return;
+		}
+		memcpy(node->symlink_target, buf, len);
+		node->symlink_target[len] = '\0';
+
+		if (my_fstatat(full_path, dirfd, relpath, &stbuf, 0) == 0 &&
+		    S_ISDIR(stbuf.st_mode))
+			node->symlink_to_dir = true;
+	}
+}
+
+/* Append the @num_dirs directories in @dirs to the queue of @worker.  The
+ * caller must hold the scanner's lock.  */
+static void
+unix_scan_queue_dirs(struct unix_scanner *scanner,
+		     struct unix_scan_worker *worker,
+		     struct list_head *dirs, size_t num_dirs)
+{
+	pthread_mutex_lock(&worker->lock);
+	list_splice_tail(dirs, &worker->queue);
+	pthread_mutex_unlock(&worker->lock);
+	scanner->num_queued += num_dirs;
+	pthread_cond_broadcast(&scanner->work_cond);
+}
+
+static struct unix_scan_node *
+unix_scan_dequeue_dir(struct unix_scan_worker *worker, bool from_tail)
+{
+	struct unix_scan_node *dir = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	if (!list_empty(&worker->queue)) {
+		if (from_tail)
+			dir = list_last_entry(&worker->queue,
+					      struct unix_scan_node, queue_list);
+		else
+			dir = list_first_entry(&worker->queue,
+					       struct unix_scan_node, queue_list);
+		list_del(&dir->queue_list);
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return dir;
+}
+
+/* Return the next directory that @worker should read, or NULL if the scan is
+ * terminating.  */
+static struct unix_scan_node *
+unix_scan_next_dir(struct unix_scan_worker *worker)
+{
+	struct unix_scanner *scanner = worker->scanner;
+	unsigned idx = worker - scanner->workers;
+	struct unix_scan_node *dir;
+
+	for (;;) {
+		/* More workers may still be being started.  */
+		unsigned num_workers = __atomic_load_n(&scanner->num_workers,
+						       __ATOMIC_RELAXED);
+
+		dir = unix_scan_dequeue_dir(worker, true);
+		for (unsigned i = 1; !dir && i < num_workers; i++) {
+			dir = unix_scan_dequeue_dir(
+				&scanner->workers[(idx + i) % num_workers],
+				false);
+		}
+
+		pthread_mutex_lock(&scanner->lock);
+		if (scanner->terminating) {
+			dir = NULL;
+			break;
+		}
+		if (dir) {
+			scanner->num_queued--;
+			break;
+		}
+		while (!scanner->num_queued && !scanner->terminating)
+			pthread_cond_wait(&scanner->work_cond, &scanner->lock);
+		pthread_mutex_unlock(&scanner->lock);
+	}
+	pthread_mutex_unlock(&scanner->lock);
+	return dir;
+}
+
+/* Read the directory @dir, gather information about each file in it, and queue
+ * its subdirectories.  */
+static void
+unix_scan_read_dir(struct unix_scan_worker *worker, struct unix_scan_node *dir)
+{
+	struct unix_scanner *scanner = worker->scanner;
+	char *path = worker->path_buf;
+	size_t path_len = dir->dir_path_len;
+	struct unix_scan_node **tail = &dir->children;
+	LIST_HEAD(subdirs);
+	size_t num_subdirs = 0;
+	DIR *d;
+
+	memcpy(path, dir->dir_path, path_len + 1);
+	FREE(dir->dir_path);
+	dir->dir_path = NULL;
+
+	d = opendir(path);
+	if (!d) {
+		unix_scan_set_error(dir, WIMLIB_ERR_OPENDIR);
+		goto out;
+	}
+
+	for (;;) {
+		struct dirent *entry;
+		struct unix_scan_node *child;
+		size_t name_len;
+
+		errno = 0;
+		entry = readdir(d);
+		if (!entry) {
+			if (errno)
+				unix_scan_set_error(dir, WIMLIB_ERR_READ);
+			break;
+		}
+
+		if (entry->d_name[0] == '.' &&
+		    (entry->d_name[1] == '\0' ||
+		     (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+			continue;
+
+		name_len = strlen(entry->d_name);
+		child = unix_scan_new_node(entry->d_name, name_len);
+		if (!child) {
+			dir->error = WIMLIB_ERR_NOMEM;
+			break;
+		}
+		*tail = child;
+		tail = &child->next;
+
+		if (path_len + 1 + name_len >= scanner->path_bufsz) {
+			child->error = WIMLIB_ERR_STAT;
+			child->errnum = ENAMETOOLONG;
+			continue;
+		}
+		path[path_len] = '/';
+		memcpy(&path[path_len + 1], entry->d_name, name_len + 1);
+		unix_scan_file(scanner, child, path, path_len + 1 + name_len,
+			       dirfd(d), child->name, scanner->stat_flags,
+			       &worker->exclusion_stats);
+		path[path_len] = '\0';
+
+		/* Queue the subdirectories in reverse order, so that this
+		 * worker reads the first one next, which is also the first
+		 * one the calling thread will need.  */
+		if (child->dir_path) {
+			child->queued = true;
+			list_add(&child->queue_list, &subdirs);
+			num_subdirs++;
+		}
+	}
+	closedir(d);
+out:
+	pthread_mutex_lock(&scanner->lock);
+	if (num_subdirs)
+		unix_scan_queue_dirs(scanner, worker, &subdirs, num_subdirs);
+	dir->scanned = true;
+	pthread_cond_broadcast(&scanner->scanned_cond);
+	pthread_mutex_unlock(&scanner->lock);
+}
+
+static void *
+unix_scan_thread_proc(void *arg)
+{
+	struct unix_scan_worker *worker = arg;
+	struct unix_scan_node *dir;
+
+	while ((dir = unix_scan_next_dir(worker)))
+		unix_scan_read_dir(worker, dir);
+	return NULL;
+}
+
+/* Wait until @dir has been read, if it was queued to be.  */
+static void
+unix_scan_wait_for_dir(struct unix_scanner *scanner, struct unix_scan_node *dir)
+{
+	if (!dir->queued)
+		return;
+	pthread_mutex_lock(&scanner->lock);
+	while (!dir->scanned)
+		pthread_cond_wait(&scanner->scanned_cond, &scanner->lock);
+	pthread_mutex_unlock(&scanner->lock);
+}
+
+/* Free @node and everything below it.  If @scanner is not NULL, the worker
+ * threads may still be running, so wait for any directories in the subtree
+ * to be read first.  */
+static void
+unix_scan_free_tree(struct unix_scanner *scanner, struct unix_scan_node *node)
+{
+	struct unix_scan_node *child, *next;
+
+	if (scanner)
+		unix_scan_wait_for_dir(scanner, node);
+	for (child = node->children; child; child = next) {
+		next = child->next;
+		unix_scan_free_tree(scanner, child);
+	}
+	FREE(node->dir_path);
+	FREE(node->symlink_target);
+	FREE(node);
+}
+
+static int
+unix_scan_report_error(const struct unix_scan_node *node, const char *full_path)
+{
+	errno = node->errnum;
+	switch (node->error) {
+	case WIMLIB_ERR_STAT:
+		ERROR_WITH_ERRNO("\"%s\": Can't read metadata", full_path);
+		break;
+	case WIMLIB_ERR_OPENDIR:
+		ERROR_WITH_ERRNO("\"%s\": Can't open directory", full_path);
+		break;
+	case WIMLIB_ERR_READ:
+		ERROR_WITH_ERRNO("\"%s\": Error reading directory", full_path);
+		break;
+	case WIMLIB_ERR_READLINK:
+		ERROR_WITH_ERRNO("\"%s\": Can't read target of symbolic link",
+				 full_path);
+		break;
+	}
+	return node->error;
+}
+
+static int
+unix_build_tree_from_scan(struct wim_dentry **tree_ret,
+			  struct unix_scanner *scanner,
+			  struct unix_scan_node *node,
+			  char *full_path, size_t full_path_len,
+			  struct add_image_params *params);
+
+static int
+unix_build_dir_from_scan(struct wim_dentry *dir_dentry,
+			 struct unix_scanner *scanner,
+			 struct unix_scan_node *dir,
+			 char *full_path, size_t full_path_len,
+			 struct add_image_params *params)
+{
+	struct unix_scan_node *child;
+	int ret;
+
+	unix_scan_wait_for_dir(scanner, dir);
+
+	if (dir->error != WIMLIB_ERR_OPENDIR)
+		dir_dentry->d_inode->i_attributes = FILE_ATTRIBUTE_DIRECTORY;
+
+	/* Free each child once it has been captured.  On failure, the rest of
+	 * the scan tree is left in place to be freed by the caller.  */
+	while ((child = dir->children)) {
+		struct wim_dentry *child_dentry;
+		size_t name_len = strlen(child->name);
+
+		full_path[full_path_len] = '/';
+		memcpy(&full_path[full_path_len + 1], child->name, name_len + 1);
+		ret = unix_build_tree_from_scan(&child_dentry, scanner, child,
+						full_path,
+						full_path_len + 1 + name_len,
+						params);
+		full_path[full_path_len] = '\0';
+		if (ret)
+			return ret;
+		if (child_dentry)
+			dentry_add_child(dir_dentry, child_dentry);
+		dir->children = child->next;
+		unix_scan_free_tree(scanner, child);
+	}
+
+	if (dir->error)
+		return unix_scan_report_error(dir, full_path);
+	return 0;
+}
+
+/* Counterpart of unix_build_dentry_tree_recursive() that uses the information
+ * gathered by the worker threads.  */
+static int
+unix_build_tree_from_scan(struct wim_dentry **tree_ret,
+			  struct unix_scanner *scanner,
+			  struct unix_scan_node *node,
+			  char *full_path, size_t full_path_len,
+			  struct add_image_params *params)
+{
+	struct wim_dentry *tree = NULL;
+	struct wim_inode *inode = NULL;
+	int ret;
+
+	if (node->excluded)
+		goto out_progress;
+
+	if (node->error == WIMLIB_ERR_STAT) {
+		ret = unix_scan_report_error(node, full_path);
+		goto out;
+	}
+
+	ret = unix_new_dentry(&tree, full_path, node->name, &node->stbuf,
+			      params);
+	if (ret || !tree)
+		goto out;
+
+	inode = tree->d_inode;
+
+	/* Already seen this inode?  */
+	if (inode->i_nlink > 1)
+		goto out_progress;
+
+	if (S_ISREG(node->stbuf.st_mode)) {
+		ret = unix_scan_regular_file(full_path, node->stbuf.st_size,
+					     inode, params->unhashed_streams);
+	} else if (S_ISDIR(node->stbuf.st_mode)) {
+		ret = unix_build_dir_from_scan(tree, scanner, node, full_path,
+					       full_path_len, params);
+	} else if (S_ISLNK(node->stbuf.st_mode)) {
+		if (node->error) {
+			ret = unix_scan_report_error(node, full_path);
+		} else {
+			ret = unix_set_symlink_target(full_path,
+						      node->symlink_target,
+						      inode, params);
+			if (!ret && node->symlink_to_dir)
+				inode->i_attributes |= FILE_ATTRIBUTE_DIRECTORY;
+		}
+	}
+
+	if (ret)
+		goto out;
+
+out_progress:
+	params->progress.scan.cur_path = full_path;
+	if (likely(tree))
+		ret = do_capture_progress(params, WIMLIB_SCAN_DENTRY_OK, inode);
+	else
+		ret = do_capture_progress(params, WIMLIB_SCAN_DENTRY_EXCLUDED, NULL);
+out:
+	if (likely(ret == 0))
+		*tree_ret = tree;
+	else
+		free_dentry_tree(tree, params->lookup_table);
+	return ret;
+}
+
+/* Build the dentry tree rooted at @path_buf with the help of @num_threads
+ * worker threads.  If no threads can be created, fall back to scanning on the
+ * calling thread.  */
+static int
+unix_build_dentry_tree_parallel(struct wim_dentry **root_ret,
+				char *path_buf, size_t path_len,
+				size_t path_bufsz, unsigned num_threads,
+				struct add_image_params *params)
+{
+	struct unix_scanner *scanner;
+	struct unix_scan_node *root;
+	unsigned num_workers_inited;
+	int root_stat_flags;
+	int ret;
+
+	ret = WIMLIB_ERR_NOMEM;
+	scanner = CALLOC(1, sizeof(*scanner));
+	if (!scanner)
+		goto out;
+	scanner->workers = CALLOC(num_threads, sizeof(scanner->workers[0]));
+	if (!scanner->workers)
+		goto out_free_scanner;
+	root = unix_scan_new_node(path_buf, path_len);
+	if (!root)
+		goto out_free_workers;
+
+	if (pthread_mutex_init(&scanner->lock, NULL))
+		goto out_free_root;
+	if (pthread_cond_init(&scanner->work_cond, NULL))
+		goto out_destroy_lock;
+	if (pthread_cond_init(&scanner->scanned_cond, NULL))
+		goto out_destroy_work_cond;
+
+	for (num_workers_inited = 0;
+	     num_workers_inited < num_threads;
+	     num_workers_inited++)
+	{
+		struct unix_scan_worker *worker =
+			&scanner->workers[num_workers_inited];
+
+		worker->scanner = scanner;
+		INIT_LIST_HEAD(&worker->queue);
+		worker->path_buf = MALLOC(path_bufsz);
+		if (!worker->path_buf)
+			goto out_destroy_workers;
+		if (pthread_mutex_init(&worker->lock, NULL)) {
+			FREE(worker->path_buf);
+			goto out_destroy_workers;
+		}
+	}
+
+	scanner->config = params->config;
+	scanner->capture_root_nchars = params->capture_root_nchars;
+	scanner->path_bufsz = path_bufsz;
+	if (params->add_flags & WIMLIB_ADD_FLAG_DEREFERENCE)
+		scanner->stat_flags = 0;
+	else
+		scanner->stat_flags = AT_SYMLINK_NOFOLLOW;
+	if (params->add_flags & WIMLIB_ADD_FLAG_ROOT)
+		root_stat_flags = 0;
+	else
+		root_stat_flags = scanner->stat_flags;
+
+	while (scanner->num_workers < num_threads) {
+		struct unix_scan_worker *worker =
+			&scanner->workers[scanner->num_workers];
+
+		if (pthread_create(&worker->thread, NULL,
+				   unix_scan_thread_proc, worker))
+		{
+			WARNING_WITH_ERRNO("Failed to create scanning thread");
+			break;
+		}
+		__atomic_store_n(&scanner->num_workers,
+				 scanner->num_workers + 1, __ATOMIC_RELAXED);
+	}
+
+	if (scanner->num_workers == 0) {
+		ret = unix_build_dentry_tree_recursive(root_ret, path_buf,
+						       path_len, AT_FDCWD,
+						       path_buf, params);
+		goto out_destroy_workers;
+	}
+
+	unix_scan_file(scanner, root, path_buf, path_len,
+		       AT_FDCWD, path_buf, root_stat_flags,
+		       params->config ? &params->config->exclusion_stats : NULL);
+	if (root->dir_path) {
+		LIST_HEAD(dirs);
+
+		root->queued = true;
+		list_add(&root->queue_list, &dirs);
+		pthread_mutex_lock(&scanner->lock);
+		unix_scan_queue_dirs(scanner, &scanner->workers[0], &dirs, 1);
+		pthread_mutex_unlock(&scanner->lock);
+	}
+
+	ret = unix_build_tree_from_scan(root_ret, scanner, root,
+					path_buf, path_len, params);
+
+	pthread_mutex_lock(&scanner->lock);
+	scanner->terminating = true;
+	pthread_cond_broadcast(&scanner->work_cond);
+	pthread_mutex_unlock(&scanner->lock);
+	for (unsigned i = 0; i < scanner->num_workers; i++) {
+		const struct exclusion_stats *stats =
+			&scanner->workers[i].exclusion_stats;
+
+		pthread_join(scanner->workers[i].thread, NULL);
+		if (params->config) {
+			params->config->exclusion_stats.num_checks +=
+				stats->num_checks;
+			params->config->exclusion_stats.nsec += stats->nsec;
+		}
+	}
+
+out_destroy_workers:
+	while (num_workers_inited--) {
+		pthread_mutex_destroy(&scanner->workers[num_workers_inited].lock);
+		FREE(scanner->workers[num_workers_inited].path_buf);
+	}
+	pthread_cond_destroy(&scanner->scanned_cond);
+out_destroy_work_cond:
+	pthread_cond_destroy(&scanner->work_cond);
+out_destroy_lock:
+	pthread_mutex_destroy(&scanner->lock);
+out_free_root:
+	unix_scan_free_tree(NULL, root);
+out_free_workers:
+	FREE(scanner->workers);
+out_free_scanner:
+	FREE(scanner);
+out:
+	return ret;
+}
+
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
+
 /*
  * unix_build_dentry_tree():
  *	Builds a tree of WIM dentries from an on-disk directory tree (UNIX
@@ -455,7 +1151,9 @@ out:
  *
  * @root_disk_path:  The path to the root of the directory tree on disk.
  *
- * @params:     See doc for `struct add_image_params'.
+ * @params:     See doc for `struct add_image_params'.  If params->num_threads
+ *		is not 1, the files are scanned on multiple threads; see
+ *		"Parallel scanning" above.
  *
  * @return:	0 on success, nonzero on failure.  It is a failure if any of
  *		the files cannot be `stat'ed, or if any of the needed
@@ -473,6 +1171,9 @@ unix_build_dentry_tree(struct wim_dentry **root_ret,
 	size_t path_bufsz;
 	char *path_buf;
 	int ret;
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	unsigned num_threads;
+#endif
 
 	path_len = strlen(root_disk_path);
 	path_bufsz = min(32790, PATH_MAX + 1);
@@ -485,8 +1186,21 @@ unix_build_dentry_tree(struct wim_dentry **root_ret,
 		return WIMLIB_ERR_NOMEM;
 	memcpy(path_buf, root_disk_path, path_len + 1);
 
-	params->capture_root_nchars = path_len;
+	params->capture_root_nchars = path_len -
+				      params->capture_root_suffix_nchars;
 
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	num_threads = params->num_threads;
+	if (num_threads == 0)
+		num_threads = get_default_num_threads();
+	if (num_threads > 1) {
+		ret = unix_build_dentry_tree_parallel(root_ret, path_buf,
+						      path_len, path_bufsz,
+						      num_threads, params);
+		FREE(path_buf);
+		return ret;
+	}
+#endif
 	ret = unix_build_dentry_tree_recursive(root_ret, path_buf, path_len,
 					       AT_FDCWD, path_buf, params);
 	FREE(path_buf);
@@ -809,7 +809,11 @@ execute_add_command(struct update_command_journal *j,
 	params.sd_set = sd_set;
 	params.config = &config;
 	params.add_flags = add_flags;
+	params.num_threads = wim->num_capture_threads;
 	params.extra_arg = extra_arg;
+	if ((add_flags & WIMLIB_ADD_FLAG_CONFIG_FROM_TARGET) &&
+	    !WIMLIB_IS_WIM_ROOT_PATH(wim_target_path))
+		params.capture_root_suffix_nchars = tstrlen(wim_target_path);
 
 	params.progfunc = wim->progfunc;
 	params.progctx = wim->progctx;
@@ -822,10 +826,25 @@ execute_add_command(struct update_command_journal *j,
 
 	if (WIMLIB_IS_WIM_ROOT_PATH(wim_target_path))
 		params.add_flags |= WIMLIB_ADD_FLAG_ROOT;
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (add_flags & WIMLIB_ADD_FLAG_PIPELINE) {
+		ret = start_capture_pipeline(&params);
+		if (ret)
+			goto out_destroy_config;
+	}
+#endif
 	ret = (*capture_tree)(&branch, fs_source_path, &params);
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (params.pipeline)
+		end_capture_pipeline(&params, ret == 0);
+#endif
 	if (ret)
 		goto out_destroy_config;
 
+	params.progress.scan.num_exclusion_checks =
+		config.exclusion_stats.num_checks;
+	params.progress.scan.exclusion_check_nsec =
+		config.exclusion_stats.nsec;
 	ret = call_progress(params.progfunc, WIMLIB_PROGRESS_MSG_SCAN_END,
 			    &params.progress, params.progctx);
 	if (ret) {
@@ -1224,7 +1243,8 @@ check_add_command(struct wimlib_update_command *cmd,
 			  WIMLIB_ADD_FLAG_NO_UNSUPPORTED_EXCLUDE |
 			  WIMLIB_ADD_FLAG_WINCONFIG |
 			  WIMLIB_ADD_FLAG_WIMBOOT |
-			  WIMLIB_ADD_FLAG_NO_REPLACE))
+			  WIMLIB_ADD_FLAG_NO_REPLACE |
+			  WIMLIB_ADD_FLAG_PIPELINE))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	bool is_entire_image = WIMLIB_IS_WIM_ROOT_PATH(cmd->add.wim_target_path);
@@ -1420,13 +1440,15 @@ err:
 	goto out;
 }
 
-/* API function documented in wimlib.h  */
-WIMLIBAPI int
-wimlib_update_image(WIMStruct *wim,
-		    int image,
-		    const struct wimlib_update_command *cmds,
-		    size_t num_cmds,
-		    int update_flags)
+/*
+ * Like wimlib_update_image(), but also set the internal add flags
+ * @internal_add_flags, which cannot be passed through the public API, on each
+ * add command.
+ */
+int
+update_image(WIMStruct *wim, int image,
+	     const struct wimlib_update_command *cmds, size_t num_cmds,
+	     int update_flags, int internal_add_flags)
 {
 	int ret;
 	struct wimlib_update_command *cmds_copy;
@@ -1465,6 +1487,10 @@ wimlib_update_image(WIMStruct *wim,
 	if (ret)
 		goto out_free_cmds_copy;
 
+	for (size_t i = 0; i < num_cmds; i++)
+		if (cmds_copy[i].op == WIMLIB_UPDATE_OP_ADD)
+			cmds_copy[i].add.add_flags |= internal_add_flags;
+
 	/* Actually execute the update commands. */
 	DEBUG("Executing %zu update commands", num_cmds);
 	ret = execute_update_commands(wim, cmds_copy, num_cmds, update_flags);
@@ -1483,6 +1509,17 @@ out:
 	return ret;
 }
 
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_update_image(WIMStruct *wim,
+		    int image,
+		    const struct wimlib_update_command *cmds,
+		    size_t num_cmds,
+		    int update_flags)
+{
+	return update_image(wim, image, cmds, num_cmds, update_flags, 0);
+}
+
 static int
 update1(WIMStruct *wim, int image, const struct wimlib_update_command *cmd)
 {
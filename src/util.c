@@ -46,14 +46,21 @@
 #include "wimlib/xml.h"
 
 #ifdef __WIN32__
-#  include "wimlib/win32.h" /* win32_strerror_r_replacement */
+#  include "wimlib/win32.h" /* win32_strerror_r_replacement,
+				    win32_get_number_of_processors() */
 #endif
 
 #include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_SYSCTL_H
+#  include <sys/sysctl.h>
+#endif
 
 size_t
 utf16le_strlen(const utf16lechar *s)
@@ -574,3 +581,208 @@ void *mempcpy(void *dst, const void *src, size_t n)
 	return memcpy(dst, src, n) + n;
 }
 #endif
+
+/* Return the number of processors available to this process, which is used as
+ * the default number of threads for parallel compression and decompression. */
+unsigned
+get_default_num_threads(void)
+{
+	long n;
+#ifdef __WIN32__
+	n = win32_get_number_of_processors();
+#else
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n < 1 || n >= UINT_MAX) {
+		WARNING("Failed to determine number of processors; assuming 1.");
+		return 1;
+	}
+	return n;
+}
+
+#ifdef __linux__
+
+/* Read the value of the key @key, or the whole file if @key is NULL, from the
+ * cgroup control file @name in the directory @dir.  Returns UINT64_MAX if the
+ * file or key does not exist or the value is not a number (such as "max",
+ * which cgroup v2 uses to mean no limit).  */
+static u64
+read_cgroup_value(const char *dir, const char *name, const char *key)
+{
+	char path[4096];
+	char line[256];
+	size_t key_len = key ? strlen(key) : 0;
+	u64 value = UINT64_MAX;
+	FILE *fp;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path))
+		return UINT64_MAX;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return UINT64_MAX;
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *p = line;
+		char *tmp;
+		unsigned long long n;
+
+		if (key) {
+			if (strncmp(line, key, key_len) || line[key_len] != ' ')
+				continue;
+			p += key_len + 1;
+		}
+		n = strtoull(p, &tmp, 10);
+		if (tmp != p && (*tmp == '\n' || *tmp == '\0'))
+			value = n;
+		break;
+	}
+	fclose(fp);
+	return value;
+}
+
+/* Return the amount of memory, in bytes, that the memory cgroup(s) this process
+ * belongs to still allow it to use, or UINT64_MAX if there is no limit.  This
+ * is the limit minus the current usage, minimized over the cgroup and all its
+ * ancestors, since a limit set on any of them applies.  Inactive file pages are
+ * not counted as used, since the kernel reclaims them before it resorts to
+ * killing processes.
+ *
+ * Both the unified (v2) hierarchy and the "memory" controller of the v1
+ * hierarchy are supported.  When this process is in a container, its cgroup
+ * path in /proc/self/cgroup may be relative to a hierarchy root that is not
+ * visible in the container's /sys/fs/cgroup; walking up to the mount point
+ * handles this case too.  */
+static u64
+get_cgroup_avail_memory(void)
+{
+	FILE *fp;
+	char line[4096];
+	u64 avail = UINT64_MAX;
+
+	fp = fopen("/proc/self/cgroup", "r");
+	if (!fp)
+		return UINT64_MAX;
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *controllers, *cgpath, *p;
+		const char *root, *limit_name, *usage_name, *inactive_key;
+		char dir[4096];
+		size_t root_len, len;
+		bool v2;
+
+		/* Each line is "hierarchy-ID:controller-list:cgroup-path".  */
+		controllers = strchr(line, ':');
+		if (!controllers)
+			continue;
+		*controllers++ = '\0';
+		cgpath = strchr(controllers, ':');
+		if (!cgpath)
+			continue;
+		*cgpath++ = '\0';
+		p = strchr(cgpath, '\n');
+		if (p)
+			*p = '\0';
+
+		v2 = (!strcmp(line, "0") && *controllers == '\0');
+		if (v2) {
+			root = "/sys/fs/cgroup";
+			limit_name = "memory.max";
+			usage_name = "memory.current";
+			inactive_key = "inactive_file";
+		} else {
+			bool has_memory = false;
+
+			for (p = controllers; p; p = strchr(p, ',')) {
+				if (*p == ',')
+					p++;
+				if (!strncmp(p, "memory", 6) &&
+				    (p[6] == ',' || p[6] == '\0'))
+					has_memory = true;
+			}
+			if (!has_memory)
+				continue;
+			root = "/sys/fs/cgroup/memory";
+			limit_name = "memory.limit_in_bytes";
+			usage_name = "memory.usage_in_bytes";
+			inactive_key = "total_inactive_file";
+		}
+
+		root_len = strlen(root);
+		if (root_len + strlen(cgpath) >= sizeof(dir))
+			continue;
+		memcpy(dir, root, root_len);
+		strcpy(&dir[root_len], cgpath);
+
+		for (;;) {
+			u64 limit, usage, inactive;
+
+			/* Strip trailing slashes.  */
+			len = strlen(dir);
+			while (len > root_len && dir[len - 1] == '/')
+				dir[--len] = '\0';
+
+			limit = read_cgroup_value(dir, limit_name, NULL);
+			if (limit != UINT64_MAX) {
+				usage = read_cgroup_value(dir, usage_name, NULL);
+				if (usage == UINT64_MAX)
+					usage = 0;
+				inactive = read_cgroup_value(dir, "memory.stat",
+							     inactive_key);
+				if (inactive != UINT64_MAX && inactive <= usage)
+					usage -= inactive;
+				avail = min(avail, (limit > usage) ? limit - usage : 0);
+			}
+
+			if (len <= root_len)
+				break;
+			p = strrchr(&dir[root_len], '/');
+			if (!p)
+				break;
+			*p = '\0';
+		}
+	}
+	fclose(fp);
+
+	if (avail != UINT64_MAX)
+		DEBUG("cgroup memory available: %"PRIu64" bytes", avail);
+	return avail;
+}
+#endif /* __linux__ */
+
+/* Return the amount of memory, in bytes, that multithreaded code may consider
+ * using for buffers.  This is the amount of physical memory, reduced on Linux
+ * to what the process's memory cgroup(s) still allow it to use.  */
+u64
+get_avail_memory(void)
+{
+	u64 avail;
+#ifdef __WIN32__
+	u64 phys_bytes = win32_get_avail_memory();
+	if (phys_bytes == 0)
+		goto default_size;
+	avail = phys_bytes;
+#elif defined(_SC_PAGESIZE) && defined(_SC_PHYS_PAGES)
+	long page_size = sysconf(_SC_PAGESIZE);
+	long num_pages = sysconf(_SC_PHYS_PAGES);
+	if (page_size <= 0 || num_pages <= 0)
+		goto default_size;
+	avail = (u64)page_size * (u64)num_pages;
+#else
+	int mib[2] = {CTL_HW, HW_MEMSIZE};
+	u64 memsize;
+	size_t len = sizeof(memsize);
+	if (sysctl(mib, ARRAY_LEN(mib), &memsize, &len, NULL, 0) < 0 || len != 8)
+		goto default_size;
+	avail = memsize;
+#endif
+
+#ifdef __linux__
+	avail = min(avail, get_cgroup_avail_memory());
+#endif
+	return avail;
+
+default_size:
+	WARNING("Failed to determine available memory; assuming 1 GiB");
+	return 1ULL << 30;
+}
@@ -31,6 +31,7 @@
 #include "wimlib/error.h"
 #include "wimlib/lookup_table.h"
 #include "wimlib/metadata.h"
+#include "wimlib/piece_list.h"
 #include "wimlib/progress.h"
 #include "wimlib/security.h"
 
@@ -57,6 +58,17 @@ tally_inode_refcnts(const struct wim_inode *inode,
 }
 
 
+static int
+tally_piece_refcnts(struct wim_lookup_table_entry *lte, void *_table)
+{
+	const struct wim_lookup_table *table = _table;
+
+	if (lte->resource_location == RESOURCE_IN_PIECES &&
+	    lte->piece_list->table == table && lte->real_refcnt != 0)
+		piece_list_tally_refcnts(lte->piece_list, table);
+	return 0;
+}
+
 static int
 tally_image_refcnts(WIMStruct *wim)
 {
@@ -88,6 +100,8 @@ wim_recalculate_refcnts(WIMStruct *wim)
 	ret = for_image(wim, WIMLIB_ALL_IMAGES, tally_image_refcnts);
 	if (ret)
 		return ret;
+	for_lookup_table_entry(wim->lookup_table, tally_piece_refcnts,
+			       wim->lookup_table);
 	num_ltes_with_bogus_refcnt = 0;
 	for_lookup_table_entry(wim->lookup_table, lte_fix_refcnt,
 			       &num_ltes_with_bogus_refcnt);
@@ -224,5 +238,5 @@ wimlib_verify_wim(WIMStruct *wim, int verify_flags)
 	return read_stream_list(&stream_list,
 				offsetof(struct wim_lookup_table_entry,
 					 extraction_list),
-				&cbs, VERIFY_STREAM_HASHES);
+				&cbs, VERIFY_STREAM_HASHES, NULL);
 }
@@ -36,6 +36,7 @@
 #include "wimlib/wildcard.h"
 
 struct match_dentry_ctx {
+	WIMStruct *wim;
 	int (*consume_dentry)(struct wim_dentry *, void *);
 	void *consume_dentry_ctx;
 	size_t consume_dentry_count;
@@ -45,10 +46,15 @@ struct match_dentry_ctx {
 	bool case_insensitive;
 };
 
-static bool
-do_match_wildcard(const tchar *string, size_t string_len,
-		  const tchar *wildcard, size_t wildcard_len,
-		  bool ignore_case)
+/*
+ * Determines whether a string matches a wildcard pattern, in which '*' matches
+ * zero or more characters and '?' matches any one character.  Neither string
+ * need be null-terminated.
+ */
+bool
+match_wildcard(const tchar *string, size_t string_len,
+	       const tchar *wildcard, size_t wildcard_len,
+	       bool ignore_case)
 {
 	for (;;) {
 		if (string_len == 0) {
@@ -68,26 +74,18 @@ do_match_wildcard(const tchar *string, size_t string_len,
 			wildcard++;
 			continue;
 		} else if (*wildcard == T('*')) {
-			return do_match_wildcard(string, string_len,
-						 wildcard + 1, wildcard_len - 1,
-						 ignore_case) ||
-			       do_match_wildcard(string + 1, string_len - 1,
-						 wildcard, wildcard_len,
-						 ignore_case);
+			return match_wildcard(string, string_len,
+					      wildcard + 1, wildcard_len - 1,
+					      ignore_case) ||
+			       match_wildcard(string + 1, string_len - 1,
+					      wildcard, wildcard_len,
+					      ignore_case);
 		} else {
 			return false;
 		}
 	}
 }
 
-static bool
-match_wildcard(const tchar *string, const tchar *wildcard,
-	       size_t wildcard_len, bool ignore_case)
-{
-	return do_match_wildcard(string, tstrlen(string),
-				 wildcard, wildcard_len, ignore_case);
-}
-
 /*
  * Determines whether a path matches a wildcard pattern.
  *
@@ -127,7 +125,9 @@ match_path(const tchar *path, size_t path_nchars,
 	if (*wildcard != path_sep) {
 		/* Pattern doesn't begin with path separator.  Try to match the
 		 * file name only.  */
-		return match_wildcard(path_basename_with_len(path, path_nchars),
+		const tchar *name = path_basename_with_len(path, path_nchars);
+
+		return match_wildcard(name, tstrlen(name),
 				      wildcard, tstrlen(wildcard),
 				      default_ignore_case);
 	} else {
@@ -150,9 +150,9 @@ match_path(const tchar *path, size_t path_nchars,
 				wildcard_component_len++;
 			} while (wildcard[wildcard_component_len] != path_sep &&
 				 wildcard[wildcard_component_len] != T('\0'));
-			if (!do_match_wildcard(path, path_component_len,
-					       wildcard, wildcard_component_len,
-					       default_ignore_case))
+			if (!match_wildcard(path, path_component_len,
+					    wildcard, wildcard_component_len,
+					    default_ignore_case))
 				return false;
 			path += path_component_len;
 			wildcard += wildcard_component_len;
@@ -202,11 +202,11 @@ match_dentry(struct wim_dentry *cur_dentry, struct match_dentry_ctx *ctx)
 		return ret;
 	name_nchars /= sizeof(tchar);
 
-	if (do_match_wildcard(name,
-			      name_nchars,
-			      &ctx->wildcard_path[ctx->cur_component_offset],
-			      ctx->cur_component_len,
-			      ctx->case_insensitive))
+	if (match_wildcard(name,
+			   name_nchars,
+			   &ctx->wildcard_path[ctx->cur_component_offset],
+			   ctx->cur_component_len,
+			   ctx->case_insensitive))
 	{
 		switch (wildcard_status(&ctx->wildcard_path[
 				ctx->cur_component_offset +
@@ -265,6 +265,10 @@ expand_wildcard_recursive(struct wim_dentry *cur_dentry,
 	if (len == 0)
 		return 0;
 
+	ret = load_dentry_children(ctx->wim, cur_dentry);
+	if (ret)
+		return ret;
+
 	offset_save = ctx->cur_component_offset;
 	len_save = ctx->cur_component_len;
 
@@ -332,6 +336,7 @@ expand_wildcard(WIMStruct *wim,
 		goto no_match;
 
 	struct match_dentry_ctx ctx = {
+		.wim = wim,
 		.consume_dentry = consume_dentry,
 		.consume_dentry_ctx = consume_dentry_ctx,
 		.consume_dentry_count = 0,
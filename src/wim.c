@@ -26,9 +26,13 @@
 #endif
 
 #include "wimlib.h"
+#include "wimlib/arena.h"
+#include "wimlib/chunk_cache.h"
+#include "wimlib/chunk_decompressor.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/file_io.h"
+#include "wimlib/index_file.h"
 #include "wimlib/integrity.h"
 #include "wimlib/lookup_table.h"
 #include "wimlib/metadata.h"
@@ -80,6 +84,10 @@ new_wim_struct(void)
 	wim->out_pack_compression_type = wim_default_pack_compression_type();
 	wim->out_pack_chunk_size = wim_default_pack_chunk_size(
 					wim->out_pack_compression_type);
+	wim->num_decompression_threads = 1;
+	wim->num_capture_threads = 1;
+	wim->num_extraction_threads = 1;
+	wim->mount_cache_size = DEFAULT_MOUNT_CACHE_SIZE;
 	INIT_LIST_HEAD(&wim->subwims);
 	return wim;
 }
@@ -151,8 +159,9 @@ wim_default_chunk_size(int ctype)
  * as the current image in turn.  If @image is a certain image, @visitor is
  * called on the WIM only once, with that image selected.
  */
-int
-for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
+static int
+do_for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *),
+	     int (*select)(WIMStruct *, int))
 {
 	int ret;
 	int start;
@@ -169,7 +178,7 @@ for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
 		return WIMLIB_ERR_INVALID_IMAGE;
 	}
 	for (i = start; i <= end; i++) {
-		ret = select_wim_image(wim, i);
+		ret = (*select)(wim, i);
 		if (ret != 0)
 			return ret;
 		ret = visitor(wim);
@@ -179,6 +188,19 @@ for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
 	return 0;
 }
 
+int
+for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
+{
+	return do_for_image(wim, image, visitor, select_wim_image);
+}
+
+/* Like for_image(), but select the images with select_wim_image_lazy().  */
+int
+for_image_lazy(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
+{
+	return do_for_image(wim, image, visitor, select_wim_image_lazy);
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI int
 wimlib_create_new_wim(int ctype, WIMStruct **wim_ret)
@@ -225,6 +247,9 @@ destroy_image_metadata(struct wim_image_metadata *imd,
 {
 	free_dentry_tree(imd->root_dentry, table);
 	imd->root_dentry = NULL;
+	free_lazy_metadata(imd);
+	free_arena(imd->arena);
+	imd->arena = NULL;
 	free_wim_security_data(imd->security_data);
 	imd->security_data = NULL;
 
@@ -326,8 +351,8 @@ new_image_metadata_array(unsigned num_images)
  * On failure, WIMLIB_ERR_INVALID_IMAGE, WIMLIB_ERR_METADATA_NOT_FOUND,
  * or another error code will be returned.
  */
-int
-select_wim_image(WIMStruct *wim, int image)
+static int
+do_select_wim_image(WIMStruct *wim, int image, bool lazy)
 {
 	struct wim_image_metadata *imd;
 	int ret;
@@ -335,8 +360,11 @@ select_wim_image(WIMStruct *wim, int image)
 	if (image == WIMLIB_NO_IMAGE)
 		return WIMLIB_ERR_INVALID_IMAGE;
 
-	if (image == wim->current_image)
-		return 0;
+	if (image == wim->current_image) {
+		if (lazy)
+			return 0;
+		return finish_lazy_metadata(wim_get_current_image_metadata(wim));
+	}
 
 	if (image < 1 || image > wim->hdr.image_count)
 		return WIMLIB_ERR_INVALID_IMAGE;
@@ -357,14 +385,35 @@ select_wim_image(WIMStruct *wim, int image)
 	imd = wim_get_current_image_metadata(wim);
 	if (imd->root_dentry || imd->modified) {
 		ret = 0;
+		if (!lazy)
+			ret = finish_lazy_metadata(imd);
 	} else {
-		ret = read_metadata_resource(wim, imd);
+		ret = read_metadata_resource(wim, imd,
+					     lazy && wim->lazy_metadata);
 		if (ret)
 			wim->current_image = WIMLIB_NO_IMAGE;
 	}
 	return ret;
 }
 
+int
+select_wim_image(WIMStruct *wim, int image)
+{
+	return do_select_wim_image(wim, image, false);
+}
+
+/*
+ * Like select_wim_image(), but if the WIM was opened with
+ * WIMLIB_OPEN_FLAG_LAZY_METADATA, the image's dentry tree may only be partially
+ * loaded.  The caller must then use load_dentry_children() before accessing the
+ * children of any directory, or load_dentry_subtree() before walking a subtree.
+ */
+int
+select_wim_image_lazy(WIMStruct *wim, int image)
+{
+	return do_select_wim_image(wim, image, true);
+}
+
 
 /* API function documented in wimlib.h  */
 WIMLIBAPI const tchar *
@@ -596,6 +645,81 @@ wimlib_set_output_pack_chunk_size(WIMStruct *wim, uint32_t chunk_size)
 				  &wim->out_pack_chunk_size);
 }
 
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_set_capture_threads(WIMStruct *wim, unsigned num_threads)
+{
+	wim->num_capture_threads = num_threads;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_set_decompression_threads(WIMStruct *wim, unsigned num_threads)
+{
+	WIMStruct *subwim;
+
+	if (num_threads != wim->num_decompression_threads &&
+	    wim->chunk_decompressor != NULL)
+	{
+		wim->chunk_decompressor->destroy(wim->chunk_decompressor);
+		wim->chunk_decompressor = NULL;
+	}
+	wim->num_decompression_threads = num_threads;
+
+	/* Streams may also be read from WIMs referenced with
+	 * wimlib_reference_resource_files().  */
+	list_for_each_entry(subwim, &wim->subwims, subwim_node)
+		wimlib_set_decompression_threads(subwim, num_threads);
+}
+
+/* Number of threads for checking the integrity of WIMs being opened; set by
+ * wimlib_set_integrity_check_threads().  */
+static unsigned integrity_check_threads;
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_set_integrity_check_threads(unsigned num_threads)
+{
+	integrity_check_threads = num_threads;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_set_extraction_threads(WIMStruct *wim, unsigned num_threads)
+{
+	wim->num_extraction_threads = num_threads;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_set_io_queue_depth(WIMStruct *wim, unsigned queue_depth)
+{
+	wim->io_queue_depth = queue_depth;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_set_mount_cache_size(WIMStruct *wim, uint64_t max_bytes)
+{
+	wim->mount_cache_size = max_bytes;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_set_memory_limit(WIMStruct *wim, uint64_t max_bytes)
+{
+	WIMStruct *subwim;
+
+	if (max_bytes != wim->max_memory && wim->chunk_decompressor != NULL) {
+		wim->chunk_decompressor->destroy(wim->chunk_decompressor);
+		wim->chunk_decompressor = NULL;
+	}
+	wim->max_memory = max_bytes;
+
+	list_for_each_entry(subwim, &wim->subwims, subwim_node)
+		wimlib_set_memory_limit(subwim, max_bytes);
+}
+
 WIMLIBAPI void
 wimlib_register_progress_function(WIMStruct *wim,
 				  wimlib_progress_func_t progfunc,
@@ -684,6 +808,17 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 	    (wim->hdr.total_parts != 1))
 		return WIMLIB_ERR_IS_SPLIT_WIM;
 
+	if (open_flags & WIMLIB_OPEN_FLAG_LAZY_METADATA)
+		wim->lazy_metadata = 1;
+
+	if ((open_flags & WIMLIB_OPEN_FLAG_USE_INDEX_FILE) && wimfile &&
+	    wim->hdr.part_number == 1)
+	{
+		ret = open_wim_index_file(wim);
+		if (ret)
+			return ret;
+	}
+
 	/* If the boot index is invalid, print a warning and set it to 0 */
 	if (wim->hdr.boot_idx > wim->hdr.image_count) {
 		WARNING("Ignoring invalid boot index.");
@@ -718,7 +853,7 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 	}
 
 	if (open_flags & WIMLIB_OPEN_FLAG_CHECK_INTEGRITY) {
-		ret = check_wim_integrity(wim);
+		ret = check_wim_integrity(wim, integrity_check_threads);
 		if (ret == WIM_INTEGRITY_NONEXISTENT) {
 			WARNING("\"%"TS"\" does not contain integrity "
 				"information.  Skipping integrity check.",
@@ -798,7 +933,9 @@ wimlib_open_wim_with_progress(const tchar *wimfile, int open_flags,
 {
 	if (open_flags & ~(WIMLIB_OPEN_FLAG_CHECK_INTEGRITY |
 			   WIMLIB_OPEN_FLAG_ERROR_IF_SPLIT |
-			   WIMLIB_OPEN_FLAG_WRITE_ACCESS))
+			   WIMLIB_OPEN_FLAG_WRITE_ACCESS |
+			   WIMLIB_OPEN_FLAG_LAZY_METADATA |
+			   WIMLIB_OPEN_FLAG_USE_INDEX_FILE))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	if (!wimfile || !*wimfile || !wim_ret)
@@ -816,14 +953,41 @@ wimlib_open_wim(const tchar *wimfile, int open_flags, WIMStruct **wim_ret)
 					     NULL, NULL);
 }
 
+/* Checksum a batch of small unhashed streams at once and merge them into the
+ * lookup table.  */
+static int
+checksum_small_unhashed_streams(WIMStruct *wim,
+				struct wim_lookup_table_entry *ltes[],
+				size_t num_streams)
+{
+	u8 hashes[SHA1_BATCH_MAX_STREAMS][SHA1_HASH_SIZE];
+	int ret;
+
+	ret = sha1_small_streams(ltes, num_streams, hashes, NULL);
+	if (ret)
+		return ret;
+
+	for (size_t i = 0; i < num_streams; i++) {
+		struct wim_lookup_table_entry *new_lte;
+
+		set_unhashed_stream_hash(ltes[i], hashes[i], wim->lookup_table,
+					 &new_lte);
+		if (new_lte != ltes[i])
+			free_lookup_table_entry(ltes[i]);
+	}
+	return 0;
+}
+
 /* Checksum all streams that are unhashed (other than the metadata streams),
  * merging them into the lookup table as needed.  This is a no-op unless the
  * library has previously used to add or mount an image using the same
- * WIMStruct. */
+ * WIMStruct.  Small streams are checksummed in batches, which is faster.  */
 int
 wim_checksum_unhashed_streams(WIMStruct *wim)
 {
 	int ret;
+	struct wim_lookup_table_entry *batch[SHA1_BATCH_MAX_STREAMS];
+	size_t batch_len = 0;
 
 	if (!wim_has_metadata(wim))
 		return 0;
@@ -832,6 +996,18 @@ wim_checksum_unhashed_streams(WIMStruct *wim)
 		struct wim_image_metadata *imd = wim->image_metadata[i];
 		image_for_each_unhashed_stream_safe(lte, tmp, imd) {
 			struct wim_lookup_table_entry *new_lte;
+
+			if (lte->size <= SHA1_BATCH_MAX_STREAM_SIZE) {
+				batch[batch_len++] = lte;
+				if (batch_len == SHA1_BATCH_MAX_STREAMS) {
+					ret = checksum_small_unhashed_streams(
+							wim, batch, batch_len);
+					if (ret)
+						return ret;
+					batch_len = 0;
+				}
+				continue;
+			}
 			ret = hash_unhashed_stream(lte, wim->lookup_table, &new_lte);
 			if (ret)
 				return ret;
@@ -839,6 +1015,8 @@ wim_checksum_unhashed_streams(WIMStruct *wim)
 				free_lookup_table_entry(lte);
 		}
 	}
+	if (batch_len != 0)
+		return checksum_small_unhashed_streams(wim, batch, batch_len);
 	return 0;
 }
 
@@ -924,6 +1102,8 @@ wimlib_free(WIMStruct *wim)
 	free_lookup_table(wim->lookup_table);
 
 	wimlib_free_decompressor(wim->decompressor);
+	if (wim->chunk_decompressor)
+		wim->chunk_decompressor->destroy(wim->chunk_decompressor);
 
 	FREE(wim->filename);
 	free_wim_info(wim->wim_info);
@@ -932,6 +1112,7 @@ wimlib_free(WIMStruct *wim)
 			put_image_metadata(wim->image_metadata[i], NULL);
 		FREE(wim->image_metadata);
 	}
+	close_wim_index_file(wim);
 	FREE(wim);
 }
 
@@ -1426,6 +1426,8 @@ win32_build_dentry_tree(struct wim_dentry **root_ret,
 		params->capture_root_nchars = ntpath_nchars;
 		if (path[ntpath_nchars - 1] == L'\\')
 			params->capture_root_nchars--;
+		params->capture_root_nchars -=
+				params->capture_root_suffix_nchars;
 		ret = 0;
 	}
 	HeapFree(GetProcessHeap(), 0, ntpath.Buffer);
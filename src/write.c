@@ -41,15 +41,19 @@
 #include "wimlib/header.h"
 #include "wimlib/inode.h"
 #include "wimlib/integrity.h"
+#include "wimlib/io_ring.h"
 #include "wimlib/lookup_table.h"
 #include "wimlib/metadata.h"
 #include "wimlib/paths.h"
+#include "wimlib/piece_list.h"
 #include "wimlib/progress.h"
+#include "wimlib/read_thread.h"
 #include "wimlib/resource.h"
 #ifdef __WIN32__
 #  include "wimlib/win32.h" /* win32_rename_replacement() */
 #endif
 #include "wimlib/write.h"
+#include "wimlib/write_behind.h"
 #include "wimlib/xml.h"
 
 #include <errno.h>
@@ -88,6 +92,19 @@ struct filter_context {
 	WIMStruct *wim;
 };
 
+/* Return the WIM file in which the specified stream is stored (for a stream
+ * split into pieces, the WIM file containing its piece list), or NULL if the
+ * stream is not stored in a WIM file.  */
+static WIMStruct *
+stream_containing_wim(const struct wim_lookup_table_entry *lte)
+{
+	if (lte->resource_location == RESOURCE_IN_WIM)
+		return lte->rspec->wim;
+	if (lte->resource_location == RESOURCE_IN_PIECES)
+		return lte->piece_list->wim;
+	return NULL;
+}
+
 /* Determine specified stream should be filtered out from the write.
  *
  * Return values:
@@ -109,13 +126,12 @@ stream_filtered(const struct wim_lookup_table_entry *lte,
 		return 0;
 
 	if (write_flags & WIMLIB_WRITE_FLAG_OVERWRITE &&
-	    lte->resource_location == RESOURCE_IN_WIM &&
-	    lte->rspec->wim == wim)
+	    stream_containing_wim(lte) == wim)
 		return 1;
 
 	if (write_flags & WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS &&
-	    lte->resource_location == RESOURCE_IN_WIM &&
-	    lte->rspec->wim != wim)
+	    stream_containing_wim(lte) != NULL &&
+	    stream_containing_wim(lte) != wim)
 		return -1;
 
 	return 0;
@@ -213,7 +229,8 @@ filter_resource_flags(u8 flags)
 	return (flags & ~(WIM_RESHDR_FLAG_PACKED_STREAMS |
 			  WIM_RESHDR_FLAG_COMPRESSED |
 			  WIM_RESHDR_FLAG_SPANNED |
-			  WIM_RESHDR_FLAG_FREE));
+			  WIM_RESHDR_FLAG_FREE |
+			  WIM_RESHDR_FLAG_PIECE_LIST));
 }
 
 static void
@@ -246,34 +263,6 @@ stream_set_out_reshdr_for_reuse(struct wim_lookup_table_entry *lte)
 }
 
 
-/* Write the header for a stream in a pipable WIM.  */
-static int
-write_pwm_stream_header(const struct wim_lookup_table_entry *lte,
-			struct filedes *out_fd,
-			int additional_reshdr_flags)
-{
-	struct pwm_stream_hdr stream_hdr;
-	u32 reshdr_flags;
-	int ret;
-
-	stream_hdr.magic = cpu_to_le64(PWM_STREAM_MAGIC);
-	stream_hdr.uncompressed_size = cpu_to_le64(lte->size);
-	if (additional_reshdr_flags & PWM_RESHDR_FLAG_UNHASHED) {
-		zero_out_hash(stream_hdr.hash);
-	} else {
-		wimlib_assert(!lte->unhashed);
-		copy_hash(stream_hdr.hash, lte->hash);
-	}
-
-	reshdr_flags = filter_resource_flags(lte->flags);
-	reshdr_flags |= additional_reshdr_flags;
-	stream_hdr.flags = cpu_to_le32(reshdr_flags);
-	ret = full_write(out_fd, &stream_hdr, sizeof(stream_hdr));
-	if (ret)
-		ERROR_WITH_ERRNO("Write error");
-	return ret;
-}
-
 struct write_streams_progress_data {
 	wimlib_progress_func_t progfunc;
 	void *progctx;
@@ -396,6 +385,17 @@ struct write_streams_ctx {
 
 	struct wim_inode *stream_inode;
 
+	/* io_ring used to read small files from disk in batches, or NULL.  */
+	struct io_ring *ring;
+
+	/* Set if the streams are being read by a separate thread, with
+	 * read_stream_list_in_thread().  */
+	bool reading_in_thread;
+
+	/* Thread writing the output data, or NULL if it is written directly.
+	 * */
+	struct write_behind *writer;
+
 	/* Current uncompressed offset in the stream being read.  */
 	u64 cur_read_stream_offset;
 
@@ -421,8 +421,91 @@ struct write_streams_ctx {
 	/* Offset in the output file of the start of the chunks of the resource
 	 * currently being written.  */
 	u64 chunks_start_offset;
+
+	/* The list of streams being written, linked by @write_streams_list.  */
+	struct list_head *stream_list;
+
+	/* Small unhashed streams, in the order they will be read, whose SHA1
+	 * message digests have been calculated ahead of time as a batch, and
+	 * the corresponding message digests.  */
+	struct wim_lookup_table_entry *prehashed_streams[SHA1_BATCH_MAX_STREAMS];
+	u8 prehashed_hashes[SHA1_BATCH_MAX_STREAMS][SHA1_HASH_SIZE];
+
+	/* Number of entries in @prehashed_streams, and index of the next one
+	 * that will be read.  */
+	size_t num_prehashed_streams;
+	size_t next_prehashed_stream;
 };
 
+/* Maximum number of streams to look ahead in the stream list for small unhashed
+ * streams to checksum in the same batch.  */
+#define PREHASH_LOOKAHEAD	1024
+
+/* Write data at the current offset of the output file, handing it to the
+ * writer thread if there is one.  */
+static int
+write_output(struct write_streams_ctx *ctx, const void *buf, size_t count)
+{
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx->writer)
+		return write_behind_write(ctx->writer, buf, count);
+#endif
+	return full_write(ctx->out_fd, buf, count);
+}
+
+/* Write data at the specified offset of the output file, handing it to the
+ * writer thread if there is one.  */
+static int
+pwrite_output(struct write_streams_ctx *ctx, const void *buf, size_t count,
+	      off_t offset)
+{
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx->writer)
+		return write_behind_pwrite(ctx->writer, buf, count, offset);
+#endif
+	return full_pwrite(ctx->out_fd, buf, count, offset);
+}
+
+/* Wait for the writer thread, if any, to write all data handed to it, so that
+ * the output file descriptor can be used directly.  */
+static int
+flush_output(struct write_streams_ctx *ctx)
+{
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx->writer)
+		return write_behind_flush(ctx->writer);
+#endif
+	return 0;
+}
+
+/* Write the header for a stream in a pipable WIM.  */
+static int
+write_pwm_stream_header(const struct wim_lookup_table_entry *lte,
+			struct write_streams_ctx *ctx,
+			int additional_reshdr_flags)
+{
+	struct pwm_stream_hdr stream_hdr;
+	u32 reshdr_flags;
+	int ret;
+
+	stream_hdr.magic = cpu_to_le64(PWM_STREAM_MAGIC);
+	stream_hdr.uncompressed_size = cpu_to_le64(lte->size);
+	if (additional_reshdr_flags & PWM_RESHDR_FLAG_UNHASHED) {
+		zero_out_hash(stream_hdr.hash);
+	} else {
+		wimlib_assert(!lte->unhashed);
+		copy_hash(stream_hdr.hash, lte->hash);
+	}
+
+	reshdr_flags = filter_resource_flags(lte->flags);
+	reshdr_flags |= additional_reshdr_flags;
+	stream_hdr.flags = cpu_to_le32(reshdr_flags);
+	ret = write_output(ctx, &stream_hdr, sizeof(stream_hdr));
+	if (ret)
+		ERROR_WITH_ERRNO("Write error");
+	return ret;
+}
+
 /* Reserve space for the chunk table and prepare to accumulate the chunk table
  * in memory.  */
 static int
@@ -479,7 +562,7 @@ begin_chunk_table(struct write_streams_ctx *ctx, u64 res_expected_size)
 		if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_PACK_STREAMS)
 			reserve_size += sizeof(struct alt_chunk_table_header_disk);
 		memset(ctx->chunk_csizes, 0, reserve_size);
-		ret = full_write(ctx->out_fd, ctx->chunk_csizes, reserve_size);
+		ret = write_output(ctx, ctx->chunk_csizes, reserve_size);
 		if (ret)
 			return ret;
 	}
@@ -563,7 +646,7 @@ end_chunk_table(struct write_streams_ctx *ctx, u64 res_actual_size,
 	u64 res_end_offset;
 
 	if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE) {
-		ret = full_write(ctx->out_fd, ctx->chunk_csizes, chunk_table_size);
+		ret = write_output(ctx, ctx->chunk_csizes, chunk_table_size);
 		if (ret)
 			goto error;
 		res_end_offset = ctx->out_fd->offset;
@@ -586,8 +669,8 @@ end_chunk_table(struct write_streams_ctx *ctx, u64 res_actual_size,
 			BUILD_BUG_ON(WIMLIB_COMPRESSION_TYPE_LZX != 2);
 			BUILD_BUG_ON(WIMLIB_COMPRESSION_TYPE_LZMS != 3);
 
-			ret = full_pwrite(ctx->out_fd, &hdr, sizeof(hdr),
-					  chunk_table_offset - sizeof(hdr));
+			ret = pwrite_output(ctx, &hdr, sizeof(hdr),
+					    chunk_table_offset - sizeof(hdr));
 			if (ret)
 				goto error;
 			res_start_offset = chunk_table_offset - sizeof(hdr);
@@ -595,8 +678,8 @@ end_chunk_table(struct write_streams_ctx *ctx, u64 res_actual_size,
 			res_start_offset = chunk_table_offset;
 		}
 
-		ret = full_pwrite(ctx->out_fd, ctx->chunk_csizes,
-				  chunk_table_size, chunk_table_offset);
+		ret = pwrite_output(ctx, ctx->chunk_csizes,
+				    chunk_table_size, chunk_table_offset);
 		if (ret)
 			goto error;
 	}
@@ -710,6 +793,72 @@ done_with_stream(struct wim_lookup_table_entry *stream,
 	return 0;
 }
 
+/* Calculate the SHA1 message digests of @lte, which is about to be read, and of
+ * the next small unhashed streams in the stream list, in a batch.  */
+static int
+prehash_small_streams(struct write_streams_ctx *ctx,
+		      struct wim_lookup_table_entry *lte)
+{
+	struct list_head *cur;
+	size_t num_streams = 0;
+	unsigned num_scanned = 0;
+	int ret;
+
+	ctx->prehashed_streams[num_streams++] = lte;
+
+	for (cur = lte->write_streams_list.next;
+	     cur != ctx->stream_list &&
+	     num_streams < SHA1_BATCH_MAX_STREAMS &&
+	     num_scanned < PREHASH_LOOKAHEAD;
+	     cur = cur->next, num_scanned++)
+	{
+		struct wim_lookup_table_entry *next_lte;
+
+		next_lte = list_entry(cur, struct wim_lookup_table_entry,
+				      write_streams_list);
+		if (next_lte->unhashed && !next_lte->unique_size &&
+		    next_lte->size <= SHA1_BATCH_MAX_STREAM_SIZE)
+			ctx->prehashed_streams[num_streams++] = next_lte;
+	}
+
+	ctx->num_prehashed_streams = 0;
+	ctx->next_prehashed_stream = 0;
+
+	ret = sha1_small_streams(ctx->prehashed_streams, num_streams,
+				 ctx->prehashed_hashes, ctx->ring);
+	if (ret)
+		return ret;
+
+	ctx->num_prehashed_streams = num_streams;
+	return 0;
+}
+
+/* Like hash_unhashed_stream(), but small streams are checksummed in batches
+ * ahead of when they are read for writing.  */
+static int
+write_stream_hash_unhashed(struct write_streams_ctx *ctx,
+			   struct wim_lookup_table_entry *lte,
+			   struct wim_lookup_table_entry **lte_ret)
+{
+	int ret;
+
+	if (lte->size > SHA1_BATCH_MAX_STREAM_SIZE)
+		return hash_unhashed_stream(lte, ctx->lookup_table, lte_ret);
+
+	if (ctx->next_prehashed_stream == ctx->num_prehashed_streams ||
+	    ctx->prehashed_streams[ctx->next_prehashed_stream] != lte)
+	{
+		ret = prehash_small_streams(ctx, lte);
+		if (ret)
+			return ret;
+	}
+
+	set_unhashed_stream_hash(lte,
+				 ctx->prehashed_hashes[ctx->next_prehashed_stream++],
+				 ctx->lookup_table, lte_ret);
+	return 0;
+}
+
 /* Begin processing a stream for writing.  */
 static int
 write_stream_begin_read(struct wim_lookup_table_entry *lte, void *_ctx)
@@ -737,13 +886,14 @@ write_stream_begin_read(struct wim_lookup_table_entry *lte, void *_ctx)
 	 * function, thereby advancing ahead of read_stream_list(), which will
 	 * still provide the data again to write_stream_process_chunk().  This
 	 * is okay because an unhashed stream cannot be in a WIM resource, which
-	 * might be costly to decompress.  */
+	 * might be costly to decompress.  Small streams are checksummed in
+	 * batches, further ahead of read_stream_list().  */
 	ctx->stream_was_duplicate = false;
 	if (ctx->lookup_table != NULL && lte->unhashed && !lte->unique_size) {
 
 		struct wim_lookup_table_entry *lte_new;
 
-		ret = hash_unhashed_stream(lte, ctx->lookup_table, &lte_new);
+		ret = write_stream_hash_unhashed(ctx, lte, &lte_new);
 		if (ret)
 			return ret;
 		if (lte_new != lte) {
@@ -853,6 +1003,20 @@ write_stream_uncompressed(struct wim_lookup_table_entry *lte,
 	return 0;
 }
 
+/* Returns true if the data of @lte can be read again by write_stream_uncompressed()
+ * while the stream list is being written.  While a separate thread is reading
+ * the stream list, this is only done for streams in files on disk or in memory,
+ * since reading a stream from a WIM, for example, uses state shared with the
+ * reader thread.  */
+static bool
+can_reread_stream(const struct write_streams_ctx *ctx,
+		  const struct wim_lookup_table_entry *lte)
+{
+	return !ctx->reading_in_thread ||
+		lte->resource_location == RESOURCE_IN_FILE_ON_DISK ||
+		lte->resource_location == RESOURCE_IN_ATTACHED_BUFFER;
+}
+
 /* Write the next chunk of (typically compressed) data to the output WIM,
  * handling the writing of the chunk table.  */
 static int
@@ -881,7 +1045,7 @@ write_chunk(struct write_streams_ctx *ctx, const void *cchunk,
 			DEBUG("Writing pipable WIM stream header "
 			      "(offset=%"PRIu64")", ctx->out_fd->offset);
 
-			ret = write_pwm_stream_header(lte, ctx->out_fd,
+			ret = write_pwm_stream_header(lte, ctx,
 						      additional_reshdr_flags);
 			if (ret)
 				return ret;
@@ -903,15 +1067,15 @@ write_chunk(struct write_streams_ctx *ctx, const void *cchunk,
 			struct pwm_chunk_hdr chunk_hdr = {
 				.compressed_size = cpu_to_le32(csize),
 			};
-			ret = full_write(ctx->out_fd, &chunk_hdr,
-					 sizeof(chunk_hdr));
+			ret = write_output(ctx, &chunk_hdr,
+					   sizeof(chunk_hdr));
 			if (ret)
 				goto error;
 		}
 	}
 
 	/* Write the chunk data.  */
-	ret = full_write(ctx->out_fd, cchunk, csize);
+	ret = write_output(ctx, cchunk, csize);
 	if (ret)
 		goto error;
 
@@ -967,7 +1131,8 @@ write_chunk(struct write_streams_ctx *ctx, const void *cchunk,
 			    lte->out_reshdr.size_in_wim >= lte->out_reshdr.uncompressed_size &&
 			    !(ctx->write_resource_flags & (WRITE_RESOURCE_FLAG_PIPABLE |
 							   WRITE_RESOURCE_FLAG_SEND_DONE_WITH_FILE)) &&
-			    !(lte->flags & WIM_RESHDR_FLAG_PACKED_STREAMS))
+			    !(lte->flags & WIM_RESHDR_FLAG_PACKED_STREAMS) &&
+			    can_reread_stream(ctx, lte))
 			{
 				/* Stream did not compress to less than its original
 				 * size.  If we're not writing a pipable WIM (which
@@ -979,6 +1144,9 @@ write_chunk(struct write_streams_ctx *ctx, const void *cchunk,
 				DEBUG("Stream of size %"PRIu64" did not compress to "
 				      "less than original size; writing uncompressed.",
 				      lte->size);
+				ret = flush_output(ctx);
+				if (ret)
+					goto error;
 				ret = write_stream_uncompressed(lte, ctx->out_fd);
 				if (ret)
 					return ret;
@@ -989,6 +1157,16 @@ write_chunk(struct write_streams_ctx *ctx, const void *cchunk,
 		}
 	}
 
+	if (ctx->compressor != NULL) {
+		union wimlib_progress_info *progress = &ctx->progress_data.progress;
+
+		progress->write_streams.compress_wait_nsec =
+			ctx->compressor->wait_nsec;
+		progress->write_streams.compress_idle_nsec =
+			__atomic_load_n(&ctx->compressor->idle_nsec,
+					__ATOMIC_RELAXED);
+	}
+
 	return do_write_streams_progress(&ctx->progress_data, lte,
 					 completed_size, completed_stream_count,
 					 false);
@@ -1168,6 +1346,8 @@ compute_stream_list_stats(struct list_head *stream_list,
 	ctx->progress_data.progress.write_streams.compression_type  = ctx->out_ctype;
 	ctx->progress_data.progress.write_streams.total_parts       = total_parts;
 	ctx->progress_data.progress.write_streams.completed_parts   = 0;
+	ctx->progress_data.progress.write_streams.compress_wait_nsec = 0;
+	ctx->progress_data.progress.write_streams.compress_idle_nsec = 0;
 	ctx->progress_data.next_progress = 0;
 }
 
@@ -1391,7 +1571,20 @@ remove_zero_length_streams(struct list_head *stream_list)
  * @num_threads
  *	Number of threads to use to compress data.  If 0, a default number of
  *	threads will be chosen.  The number of threads still may be decreased
- *	from the specified value if insufficient memory is detected.
+ *	from the specified value if insufficient memory is detected.  If more
+ *	than one thread is used, the streams are also read and checksummed on
+ *	a separate thread, and the output is written on another.
+ *
+ * @io_queue_depth
+ *	If greater than 1, small streams in files on disk are opened and read
+ *	in batches of up to this many operations with io_uring, if available.
+ *
+ * @max_memory
+ *	Maximum number of bytes of memory to use for the compressors, including
+ *	their match-finders, and for the buffers holding data read from the
+ *	streams and waiting to be compressed.  If 0, the amount of memory
+ *	available to the process is used.  The number of threads is reduced as
+ *	needed to stay within this budget.
  *
  * @lookup_table
  *	If on-the-fly deduplication of unhashed streams is desired, this
@@ -1461,6 +1654,8 @@ write_stream_list(struct list_head *stream_list,
 		  int out_ctype,
 		  u32 out_chunk_size,
 		  unsigned num_threads,
+		  unsigned io_queue_depth,
+		  u64 max_memory,
 		  struct wim_lookup_table *lookup_table,
 		  struct filter_context *filter_ctx,
 		  wimlib_progress_func_t progfunc,
@@ -1469,6 +1664,7 @@ write_stream_list(struct list_head *stream_list,
 	int ret;
 	struct write_streams_ctx ctx;
 	struct list_head raw_copy_streams;
+	int read_flags;
 
 	wimlib_assert((write_resource_flags &
 		       (WRITE_RESOURCE_FLAG_PACK_STREAMS |
@@ -1494,6 +1690,7 @@ write_stream_list(struct list_head *stream_list,
 		return ret;
 
 	ctx.out_fd = out_fd;
+	ctx.stream_list = stream_list;
 	ctx.lookup_table = lookup_table;
 	ctx.out_ctype = out_ctype;
 	ctx.out_chunk_size = out_chunk_size;
@@ -1545,28 +1742,82 @@ write_stream_list(struct list_head *stream_list,
 	 * specified number of threads, unless the upper bound on the number
 	 * bytes needing to be compressed is less than a heuristic value.  */
 	if (out_ctype != WIMLIB_COMPRESSION_TYPE_NONE) {
+		unsigned serial_num_threads = num_threads;
 
 	#ifdef ENABLE_MULTITHREADED_COMPRESSION
 		if (ctx.num_bytes_to_compress > max(2000000, out_chunk_size)) {
+			u64 max_num_chunks = 0;
+
+			if (max_memory == 0)
+				max_memory = get_avail_memory();
+		#ifdef ENABLE_IO_URING
+			/* The buffers for batches of small files read with
+			 * io_uring come out of the same budget.  */
+			if (io_queue_depth > 1)
+				max_memory -= min(max_memory,
+						  RING_READ_MAX_BATCH_SIZE);
+		#endif
+			/* So do the buffers of the reader and writer threads.
+			 * */
+			max_memory -= min(max_memory,
+					  READ_THREAD_MAX_MEMORY +
+						WRITE_BEHIND_MAX_MEMORY);
+			/* The streams of a solid resource are compressed
+			 * together, so it has at most this many chunks.  */
+			if (write_resource_flags &
+			    WRITE_RESOURCE_FLAG_PACK_STREAMS)
+				max_num_chunks = DIV_ROUND_UP(ctx.num_bytes_to_compress,
+							      out_chunk_size);
 			ret = new_parallel_chunk_compressor(out_ctype,
 							    out_chunk_size,
-							    num_threads, 0,
+							    num_threads,
+							    max(max_memory, 1),
+							    max_num_chunks,
 							    &ctx.compressor);
 			if (ret) {
 				DEBUG("Couldn't create parallel chunk compressor "
 				      "(status %d)", ret);
+				/* -2 means the memory limit only leaves room
+				 * for one thread.  Don't let the serial
+				 * compressor use more threads for each chunk
+				 * instead.  */
+				if (ret == -2)
+					serial_num_threads = 1;
 			}
 		}
 	#endif
 
 		if (ctx.compressor == NULL) {
 			ret = new_serial_chunk_compressor(out_ctype, out_chunk_size,
+							  serial_num_threads,
 							  &ctx.compressor);
 			if (ret)
 				goto out_destroy_context;
 		}
 	}
 
+#ifdef ENABLE_IO_URING
+	/* Files to be read from disk can be opened and read in batches.  */
+	if (io_queue_depth > 1)
+		ctx.ring = io_ring_new(io_queue_depth);
+#endif
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	/* If the data is being compressed by multiple threads, don't leave
+	 * reading and checksumming the data and writing the compressed data
+	 * all to this thread, which would then hold back the compressor
+	 * threads.  Instead, a reader thread reads and checksums the data while
+	 * this thread hands it to the compressor, and a writer thread writes
+	 * the compressed chunks.  */
+	if (ctx.compressor && ctx.compressor->num_threads > 1) {
+		ctx.reading_in_thread = true;
+		ret = write_behind_start(out_fd, &ctx.writer);
+		if (ret) {
+			DEBUG("Couldn't start writer thread (status %d)", ret);
+		}
+	}
+#endif
+
 	if (ctx.compressor)
 		ctx.progress_data.progress.write_streams.num_threads = ctx.compressor->num_threads;
 	else
@@ -1603,12 +1854,22 @@ write_stream_list(struct list_head *stream_list,
 		.end_stream_ctx		= &ctx,
 	};
 
-	ret = read_stream_list(stream_list,
-			       offsetof(struct wim_lookup_table_entry, write_streams_list),
-			       &cbs,
-			       STREAM_LIST_ALREADY_SORTED |
-					VERIFY_STREAM_HASHES |
-					COMPUTE_MISSING_STREAM_HASHES);
+	read_flags = STREAM_LIST_ALREADY_SORTED |
+		     VERIFY_STREAM_HASHES |
+		     COMPUTE_MISSING_STREAM_HASHES;
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx.reading_in_thread)
+		ret = read_stream_list_in_thread(stream_list,
+						 offsetof(struct wim_lookup_table_entry,
+							  write_streams_list),
+						 &cbs, read_flags, ctx.ring);
+	else
+#endif
+		ret = read_stream_list(stream_list,
+				       offsetof(struct wim_lookup_table_entry,
+						write_streams_list),
+				       &cbs, read_flags, ctx.ring);
 
 	if (ret)
 		goto out_destroy_context;
@@ -1646,6 +1907,14 @@ write_stream_list(struct list_head *stream_list,
 		wimlib_assert(offset_in_res == reshdr.uncompressed_size);
 	}
 
+	/* Wait for the writer thread to catch up before the output file
+	 * descriptor is used directly.  */
+	ret = flush_output(&ctx);
+	if (ret) {
+		ERROR_WITH_ERRNO("Write error");
+		goto out_destroy_context;
+	}
+
 out_write_raw_copy_resources:
 	/* Copy any compressed resources for which the raw data can be reused
 	 * without decompression.  */
@@ -1658,6 +1927,13 @@ out_destroy_context:
 	FREE(ctx.chunk_csizes);
 	if (ctx.compressor)
 		ctx.compressor->destroy(ctx.compressor);
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+	if (ctx.writer)
+		write_behind_finish(ctx.writer);
+#endif
+#ifdef ENABLE_IO_URING
+	io_ring_free(ctx.ring);
+#endif
 	DEBUG("Done (ret=%d)", ret);
 	return ret;
 }
@@ -1711,6 +1987,8 @@ wim_write_stream_list(WIMStruct *wim,
 				 out_ctype,
 				 out_chunk_size,
 				 num_threads,
+				 wim->io_queue_depth,
+				 wim->max_memory,
 				 wim->lookup_table,
 				 filter_ctx,
 				 wim->progfunc,
@@ -1733,6 +2011,8 @@ write_wim_resource(struct wim_lookup_table_entry *lte,
 				 out_ctype,
 				 out_chunk_size,
 				 1,
+				 0,
+				 0,
 				 NULL,
 				 NULL,
 				 NULL,
@@ -1914,18 +2194,48 @@ image_find_streams_to_reference(WIMStruct *wim)
 	return 0;
 }
 
+/* Will the specified stream, if it has been split into pieces, be written as a
+ * piece list (rather than as its full data) when writing @wim with the
+ * specified write flags?  */
+static bool
+stream_kept_as_piece_list(const struct wim_lookup_table_entry *lte,
+			  const WIMStruct *wim, int write_flags)
+{
+	return lte->resource_location == RESOURCE_IN_PIECES &&
+	       lte->piece_list->table == wim->lookup_table &&
+	       !(write_flags & WIMLIB_WRITE_FLAG_PIPABLE);
+}
+
+static int
+reference_pieces_for_write(const struct piece_list *pl,
+			   struct list_head *stream_list)
+{
+	struct wim_lookup_table_entry *piece;
+
+	for (u32 i = 0; i < pl->num_pieces; i++) {
+		piece = lookup_stream(pl->table, pl->hashes[i]);
+		if (!piece || piece->resource_location == RESOURCE_IN_PIECES) {
+			ERROR("A piece of a stream split into pieces is missing");
+			return WIMLIB_ERR_RESOURCE_NOT_FOUND;
+		}
+		reference_stream_for_write(piece, stream_list, 1);
+	}
+	return 0;
+}
+
 static int
 prepare_unfiltered_list_of_streams_in_output_wim(WIMStruct *wim,
 						 int image,
-						 int streams_ok,
+						 int write_flags,
 						 struct list_head *stream_list_ret)
 {
 	int ret;
 
 	INIT_LIST_HEAD(stream_list_ret);
 
-	if (streams_ok && (image == WIMLIB_ALL_IMAGES ||
-			   (image == 1 && wim->hdr.image_count == 1)))
+	if ((write_flags & WIMLIB_WRITE_FLAG_STREAMS_OK) &&
+	    (image == WIMLIB_ALL_IMAGES ||
+	     (image == 1 && wim->hdr.image_count == 1)))
 	{
 		/* Fast case:  Assume that all streams are being written and
 		 * that the reference counts are correct.  */
@@ -1945,12 +2255,26 @@ prepare_unfiltered_list_of_streams_in_output_wim(WIMStruct *wim,
 	} else {
 		/* Slow case:  Walk through the images being written and
 		 * determine the streams referenced.  */
+		struct wim_lookup_table_entry *lte;
+
 		for_lookup_table_entry(wim->lookup_table,
 				       do_stream_set_not_in_output_wim, NULL);
 		wim->private = stream_list_ret;
 		ret = for_image(wim, image, image_find_streams_to_reference);
 		if (ret)
 			return ret;
+
+		/* Streams written as piece lists also reference their pieces.
+		 * (This loop also visits the pieces appended to the list, but
+		 * pieces are never themselves split.)  */
+		list_for_each_entry(lte, stream_list_ret, write_streams_list) {
+			if (stream_kept_as_piece_list(lte, wim, write_flags)) {
+				ret = reference_pieces_for_write(lte->piece_list,
+								 stream_list_ret);
+				if (ret)
+					return ret;
+			}
+		}
 	}
 
 	return 0;
@@ -1972,6 +2296,161 @@ insert_other_if_hard_filtered(struct wim_lookup_table_entry *lte, void *_ctx)
 	return 0;
 }
 
+/*
+ * Same-size prefilter
+ *
+ * An unhashed stream that has the same size as another stream in the output WIM
+ * is normally checksummed in full before it is written, in case it turns out to
+ * be a duplicate.  For a large stream from a file on disk this means reading
+ * the whole file twice.  But two streams cannot be identical if their first or
+ * last blocks differ, which can be determined by reading only those blocks.
+ * So, when all the streams sharing a size are unhashed and can be read from any
+ * offset cheaply, a fingerprint of the first and last blocks of each is
+ * computed, and each stream whose fingerprint is unique among them is treated
+ * as if it had a unique size.  Only the streams whose fingerprints still
+ * collide are checksummed before being written.
+ */
+
+/* Size of the blocks at the beginning and end of each stream that are
+ * fingerprinted.  */
+#define PREFILTER_BLOCK_SIZE	4096
+
+struct prefilter_entry {
+	u64 size;
+	u64 fingerprint;
+	struct wim_lookup_table_entry *lte;
+};
+
+/* Can the same-size prefilter be applied to the specified stream?  Small
+ * streams are excluded since they are checksummed in batches anyway, and
+ * reading their first and last blocks would read most of their data.  */
+static bool
+stream_can_be_prefiltered(const struct wim_lookup_table_entry *lte)
+{
+	return lte->unhashed &&
+	       lte->size > SHA1_BATCH_MAX_STREAM_SIZE &&
+	       (lte->resource_location == RESOURCE_IN_FILE_ON_DISK ||
+		lte->resource_location == RESOURCE_IN_ATTACHED_BUFFER);
+}
+
+/* Can the same-size prefilter be applied to all the streams in @tab that have
+ * the same size as @lte?  */
+static bool
+size_group_can_be_prefiltered(const struct wim_lookup_table_entry *lte,
+			      const struct stream_size_table *tab)
+{
+	const struct wim_lookup_table_entry *same_size_lte;
+	const struct hlist_node *tmp;
+	size_t pos = hash_u64(lte->size) % tab->capacity;
+
+	hlist_for_each_entry(same_size_lte, tmp, &tab->array[pos], hash_list_2)
+		if (same_size_lte->size == lte->size &&
+		    !stream_can_be_prefiltered(same_size_lte))
+			return false;
+	return true;
+}
+
+static u64
+prefilter_hash(const u8 *p, size_t n, u64 h)
+{
+	/* FNV-1a  */
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ p[i]) * 0x100000001B3ULL;
+	return h;
+}
+
+/* Compute the fingerprint of the first and last blocks of a stream.  */
+static int
+compute_prefilter_fingerprint(const struct wim_lookup_table_entry *lte,
+			      u64 *fingerprint_ret)
+{
+	u8 buf[PREFILTER_BLOCK_SIZE];
+	u64 h = 0xCBF29CE484222325ULL;
+	int ret;
+
+	ret = read_partial_stream_into_buf(lte, sizeof(buf), 0, buf);
+	if (ret)
+		return ret;
+	h = prefilter_hash(buf, sizeof(buf), h);
+
+	ret = read_partial_stream_into_buf(lte, sizeof(buf),
+					   lte->size - sizeof(buf), buf);
+	if (ret)
+		return ret;
+	h = prefilter_hash(buf, sizeof(buf), h);
+
+	*fingerprint_ret = h;
+	return 0;
+}
+
+static int
+cmp_prefilter_entries(const void *p1, const void *p2)
+{
+	const struct prefilter_entry *e1 = p1;
+	const struct prefilter_entry *e2 = p2;
+
+	if (e1->size != e2->size)
+		return cmp_u64(e1->size, e2->size);
+	return cmp_u64(e1->fingerprint, e2->fingerprint);
+}
+
+/* Apply the same-size prefilter to the streams in @stream_list, which have
+ * already been inserted into @tab.  */
+static int
+prefilter_same_size_streams(struct list_head *stream_list,
+			    const struct stream_size_table *tab)
+{
+	struct wim_lookup_table_entry *lte;
+	struct prefilter_entry *entries;
+	size_t num_entries = 0;
+	size_t num_unique = 0;
+	size_t i, j;
+	int ret;
+
+	list_for_each_entry(lte, stream_list, write_streams_list)
+		if (!lte->unique_size && stream_can_be_prefiltered(lte))
+			num_entries++;
+
+	if (num_entries == 0)
+		return 0;
+
+	entries = MALLOC(num_entries * sizeof(entries[0]));
+	if (entries == NULL)
+		return WIMLIB_ERR_NOMEM;
+
+	num_entries = 0;
+	list_for_each_entry(lte, stream_list, write_streams_list) {
+		if (lte->unique_size || !stream_can_be_prefiltered(lte) ||
+		    !size_group_can_be_prefiltered(lte, tab))
+			continue;
+		ret = compute_prefilter_fingerprint(lte,
+						    &entries[num_entries].fingerprint);
+		if (ret)
+			goto out_free_entries;
+		entries[num_entries].size = lte->size;
+		entries[num_entries].lte = lte;
+		num_entries++;
+	}
+
+	qsort(entries, num_entries, sizeof(entries[0]), cmp_prefilter_entries);
+
+	for (i = 0; i < num_entries; i = j) {
+		for (j = i + 1; j < num_entries &&
+		     !cmp_prefilter_entries(&entries[i], &entries[j]); j++)
+			;
+		if (j == i + 1) {
+			entries[i].lte->unique_size = 1;
+			num_unique++;
+		}
+	}
+	DEBUG("Same-size prefilter: %zu of %zu streams need not be "
+	      "checksummed before being written", num_unique, num_entries);
+	ret = 0;
+out_free_entries:
+	FREE(entries);
+	return ret;
+}
+
 static int
 determine_stream_size_uniquity(struct list_head *stream_list,
 			       struct wim_lookup_table *lt,
@@ -1996,8 +2475,10 @@ determine_stream_size_uniquity(struct list_head *stream_list,
 	list_for_each_entry(lte, stream_list, write_streams_list)
 		stream_size_table_insert(lte, &tab);
 
+	ret = prefilter_same_size_streams(stream_list, &tab);
+
 	destroy_stream_size_table(&tab);
-	return 0;
+	return ret;
 }
 
 static void
@@ -2089,7 +2570,10 @@ filter_stream_list_for_write(struct list_head *stream_list,
  * Still furthermore, @unique_size will be set to 1 on all stream entries in
  * @stream_list_ret that have unique size among all stream entries in
  * @stream_list_ret and among all stream entries in the lookup table of @wim
- * that are ineligible for being written due to filtering.
+ * that are ineligible for being written due to filtering.  It will also be set
+ * to 1 on unhashed streams that share their size only with other unhashed
+ * streams from which they differ in their first or last blocks (see the
+ * same-size prefilter above).
  *
  * Returns 0 on success; nonzero on read error, memory allocation error, or
  * otherwise.
@@ -2110,7 +2594,7 @@ prepare_stream_list_for_write(WIMStruct *wim, int image,
 	ret = prepare_unfiltered_list_of_streams_in_output_wim(
 				wim,
 				image,
-				write_flags & WIMLIB_WRITE_FLAG_STREAMS_OK,
+				write_flags,
 				stream_list_ret);
 	if (ret)
 		return ret;
@@ -2130,6 +2614,307 @@ prepare_stream_list_for_write(WIMStruct *wim, int image,
 	return 0;
 }
 
+/* Context for splitting streams into pieces before they are written.  */
+struct piece_dedup_ctx {
+	WIMStruct *wim;
+	struct list_head *stream_list;
+	struct list_head *lookup_table_list;
+	struct filter_context *filter_ctx;
+
+	/* Sizes of the pieces newly included in the output WIM.  */
+	struct stream_size_table piece_size_tab;
+};
+
+/* Can the specified stream be split into pieces when it is written?  */
+static bool
+stream_can_be_split(const struct wim_lookup_table_entry *lte)
+{
+	if (lte->size < PIECE_DEDUP_MIN_STREAM_SIZE)
+		return false;
+
+	switch (lte->resource_location) {
+	case RESOURCE_IN_WIM:
+		/* Each piece would be read separately from the parent stream,
+		 * which would be slow if it is in a solid resource.  */
+		return !(lte->flags & WIM_RESHDR_FLAG_PACKED_STREAMS);
+	case RESOURCE_IN_FILE_ON_DISK:
+	case RESOURCE_IN_ATTACHED_BUFFER:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Add a reference to a piece of a stream being written as a piece list,
+ * including the piece in the output WIM if it isn't already.  */
+static void
+reference_piece_for_write(struct wim_lookup_table_entry *piece,
+			  struct piece_dedup_ctx *ctx)
+{
+	int status;
+
+	if (!piece->will_be_in_output_wim) {
+		status = stream_filtered(piece, ctx->filter_ctx);
+		if (status < 0)
+			return;
+		piece->out_refcnt = 0;
+		piece->will_be_in_output_wim = 1;
+		list_add_tail(&piece->lookup_table_list, ctx->lookup_table_list);
+		if (status == 0)
+			list_add_tail(&piece->write_streams_list,
+				      ctx->stream_list);
+		stream_size_table_insert(piece, &ctx->piece_size_tab);
+	}
+	piece->out_refcnt++;
+}
+
+/* Add references to the pieces of a stream being written as a piece list.  */
+static void
+reference_split_stream_pieces(const struct wim_lookup_table_entry *lte,
+			      struct piece_dedup_ctx *ctx)
+{
+	const struct piece_list *pl = lte->piece_list;
+	struct wim_lookup_table_entry *piece;
+
+	for (u32 i = 0; i < pl->num_pieces; i++) {
+		piece = lookup_stream(pl->table, pl->hashes[i]);
+		if (piece)
+			reference_piece_for_write(piece, ctx);
+	}
+}
+
+/*
+ * Split the stream @lte, which is in the list of streams to write, into pieces
+ * and change it into a stream located in those pieces, creating a lookup table
+ * entry (located in a private copy of @lte) for each piece not already present.
+ * The pieces are added to the list of streams to write, and @lte is moved to
+ * @piece_lists so that its piece list gets written instead of its data.
+ *
+ * If @lte was unhashed and turns out to be a duplicate, it is replaced by the
+ * duplicate stream in the same way as write_stream_begin_read() does.
+ */
+static int
+split_stream_for_write(struct wim_lookup_table_entry *lte,
+		       struct piece_dedup_ctx *ctx,
+		       struct list_head *piece_lists)
+{
+	struct wim_lookup_table *table = ctx->wim->lookup_table;
+	struct wim_lookup_table_entry *target = lte;
+	struct wim_lookup_table_entry *parent;
+	struct wim_lookup_table_entry *piece;
+	struct wim_lookup_table_entry **new_pieces = NULL;
+	struct piece_list *pl;
+	u64 *offsets;
+	u8 hash[SHA1_HASH_SIZE];
+	u32 num_pieces;
+	u32 i;
+	int ret;
+
+	ret = split_stream_into_pieces(lte, hash, &pl, &offsets);
+	if (ret)
+		return ret;
+
+	if (lte->unhashed) {
+		set_unhashed_stream_hash(lte, hash, table, &target);
+		if (target != lte) {
+			/* Duplicate stream detected.  */
+			if (target->will_be_in_output_wim ||
+			    stream_filtered(target, ctx->filter_ctx))
+			{
+				list_del(&lte->write_streams_list);
+				list_del(&lte->lookup_table_list);
+				if (target->will_be_in_output_wim)
+					target->out_refcnt += lte->out_refcnt;
+				ret = 0;
+				goto out_free;
+			}
+			list_replace(&lte->write_streams_list,
+				     &target->write_streams_list);
+			list_replace(&lte->lookup_table_list,
+				     &target->lookup_table_list);
+			target->out_refcnt = lte->out_refcnt;
+			target->will_be_in_output_wim = 1;
+
+			if (target->resource_location == RESOURCE_IN_PIECES) {
+				/* Duplicate of a stream already split.  */
+				if (target->piece_list->table == table) {
+					list_move_tail(&target->write_streams_list,
+						       piece_lists);
+					reference_split_stream_pieces(target, ctx);
+				}
+				ret = 0;
+				goto out_free;
+			}
+		}
+	} else if (!hashes_equal(hash, lte->hash)) {
+		ERROR("The stream is corrupted!");
+		ret = WIMLIB_ERR_INVALID_RESOURCE_HASH;
+		goto out_free;
+	}
+
+	/* Allocate everything first, so that nothing can fail once the pieces
+	 * start being referenced.  */
+	ret = WIMLIB_ERR_NOMEM;
+	parent = clone_lookup_table_entry(lte);
+	if (parent == NULL)
+		goto out_free;
+	parent->refcnt = 0;
+	parent->unhashed = 0;
+	parent->will_be_in_output_wim = 0;
+
+	num_pieces = pl->num_pieces;
+	new_pieces = CALLOC(num_pieces, sizeof(new_pieces[0]));
+	if (new_pieces == NULL)
+		goto out_free_parent;
+	for (i = 0; i < num_pieces; i++) {
+		if (lookup_stream(table, pl->hashes[i]))
+			continue;
+		new_pieces[i] = new_lookup_table_entry();
+		if (new_pieces[i] == NULL)
+			goto out_free_parent;
+	}
+
+	for (i = 0; i < num_pieces; i++) {
+		piece = lookup_stream(table, pl->hashes[i]);
+		if (piece) {
+			/* The piece is already present, possibly as an
+			 * earlier piece of this same stream.  */
+			piece->refcnt++;
+		} else {
+			piece = new_pieces[i];
+			new_pieces[i] = NULL;
+			piece->size = offsets[i + 1] - offsets[i];
+			copy_hash(piece->hash, pl->hashes[i]);
+			piece->resource_location = RESOURCE_IN_PARENT_STREAM;
+			piece->parent = parent;
+			piece->offset_in_parent = offsets[i];
+			parent->refcnt++;
+			lookup_table_insert(table, piece);
+		}
+		reference_piece_for_write(piece, ctx);
+	}
+
+	lte_put_resource(target);
+	target->resource_location = RESOURCE_IN_PIECES;
+	target->flags = 0;
+	pl->table = table;
+	target->piece_list = pl;
+	pl = NULL;
+	list_move_tail(&target->write_streams_list, piece_lists);
+	ret = 0;
+out_free_parent:
+	if (new_pieces)
+		for (i = 0; i < num_pieces; i++)
+			free_lookup_table_entry(new_pieces[i]);
+	if (parent->refcnt == 0)
+		free_lookup_table_entry(parent);
+out_free:
+	if (target != lte)
+		free_lookup_table_entry(lte);
+	FREE(new_pieces);
+	FREE(offsets);
+	FREE(pl);
+	return ret;
+}
+
+/*
+ * Prepare for writing streams as piece lists.
+ *
+ * Streams in @stream_list that are already located in pieces in the lookup
+ * table of @wim are moved to @piece_lists_ret, since only their piece lists
+ * need to be written; their pieces have already been referenced by
+ * prepare_unfiltered_list_of_streams_in_output_wim().
+ *
+ * In addition, if WIMLIB_WRITE_FLAG_PIECE_DEDUP was specified in @write_flags,
+ * each sufficiently large stream in @stream_list is split into pieces.  Each
+ * such stream is moved to @piece_lists_ret, and its pieces not already being
+ * written are added to @stream_list and @lookup_table_list.
+ */
+static int
+prepare_piece_lists_for_write(WIMStruct *wim, int write_flags,
+			      struct list_head *stream_list,
+			      struct list_head *lookup_table_list,
+			      struct filter_context *filter_ctx,
+			      struct list_head *piece_lists_ret)
+{
+	struct piece_dedup_ctx ctx;
+	struct wim_lookup_table_entry *lte, *tmp;
+	bool split;
+	int ret;
+
+	INIT_LIST_HEAD(piece_lists_ret);
+
+	if (write_flags & WIMLIB_WRITE_FLAG_PIPABLE)
+		return 0;
+
+	split = (write_flags & WIMLIB_WRITE_FLAG_PIECE_DEDUP) &&
+		!(write_flags & WIMLIB_WRITE_FLAG_SEND_DONE_WITH_FILE_MESSAGES);
+
+	ctx.wim = wim;
+	ctx.stream_list = stream_list;
+	ctx.lookup_table_list = lookup_table_list;
+	ctx.filter_ctx = filter_ctx;
+	ret = init_stream_size_table(&ctx.piece_size_tab, 9001);
+	if (ret)
+		return ret;
+
+	/* Note: pieces appended to @stream_list are visited too, but they are
+	 * never large enough to be split.  */
+	list_for_each_entry_safe(lte, tmp, stream_list, write_streams_list) {
+		if (stream_kept_as_piece_list(lte, wim, write_flags)) {
+			list_move_tail(&lte->write_streams_list,
+				       piece_lists_ret);
+		} else if (split && stream_can_be_split(lte)) {
+			ret = split_stream_for_write(lte, &ctx,
+						     piece_lists_ret);
+			if (ret)
+				goto out;
+			/* @tmp may have become a piece that is being written
+			 * for the first time, which was appended at the end of
+			 * the list; it remains valid to continue from.  */
+		}
+	}
+
+	/* Unhashed streams that were thought to have a unique size no longer do
+	 * if a piece with the same size is now being written.  */
+	if (ctx.piece_size_tab.num_entries != 0) {
+		list_for_each_entry(lte, stream_list, write_streams_list)
+			if (lte->unhashed && lte->unique_size)
+				stream_size_table_insert(lte, &ctx.piece_size_tab);
+	}
+	ret = 0;
+out:
+	destroy_stream_size_table(&ctx.piece_size_tab);
+	return ret;
+}
+
+/* Write the piece list of each stream in @piece_lists, uncompressed and in a
+ * non-solid resource, at the current offset of the output WIM.  */
+static int
+write_piece_lists(WIMStruct *wim, struct list_head *piece_lists)
+{
+	struct wim_lookup_table_entry *lte;
+	void *buf;
+	size_t size;
+	int ret;
+
+	list_for_each_entry(lte, piece_lists, write_streams_list) {
+		buf = serialize_piece_list(lte->piece_list, lte->size, &size);
+		if (buf == NULL)
+			return WIMLIB_ERR_NOMEM;
+		ret = write_wim_resource_from_buffer(buf, size, 0,
+						     &wim->out_fd,
+						     WIMLIB_COMPRESSION_TYPE_NONE,
+						     wim->out_chunk_size,
+						     &lte->out_reshdr, NULL, 0);
+		FREE(buf);
+		if (ret)
+			return ret;
+		lte->out_reshdr.flags |= WIM_RESHDR_FLAG_PIECE_LIST;
+	}
+	return 0;
+}
+
 static int
 write_wim_streams(WIMStruct *wim, int image, int write_flags,
 		  unsigned num_threads,
@@ -2139,6 +2924,7 @@ write_wim_streams(WIMStruct *wim, int image, int write_flags,
 	int ret;
 	struct list_head _stream_list;
 	struct list_head *stream_list;
+	struct list_head piece_lists;
 	struct wim_lookup_table_entry *lte;
 	struct filter_context _filter_ctx;
 	struct filter_context *filter_ctx;
@@ -2154,6 +2940,13 @@ write_wim_streams(WIMStruct *wim, int image, int write_flags,
 						    filter_ctx);
 		if (ret)
 			return ret;
+		ret = prepare_piece_lists_for_write(wim, write_flags,
+						    stream_list,
+						    lookup_table_list_ret,
+						    filter_ctx,
+						    &piece_lists);
+		if (ret)
+			return ret;
 	} else {
 		/* Currently only as a result of wimlib_split() being called:
 		 * use stream list already explicitly provided.  Use existing
@@ -2167,6 +2960,8 @@ write_wim_streams(WIMStruct *wim, int image, int write_flags,
 			lte->unique_size = 0;
 			list_add_tail(&lte->lookup_table_list, lookup_table_list_ret);
 		}
+		/* Streams split into pieces are written as their full data.  */
+		INIT_LIST_HEAD(&piece_lists);
 	}
 
 	/* If needed, set auxiliary information so that we can detect when
@@ -2180,11 +2975,15 @@ write_wim_streams(WIMStruct *wim, int image, int write_flags,
 				lte->back_inode->num_unread_streams++;
 	}
 
-	return wim_write_stream_list(wim,
-				     stream_list,
-				     write_flags,
-				     num_threads,
-				     filter_ctx);
+	ret = wim_write_stream_list(wim,
+				    stream_list,
+				    write_flags,
+				    num_threads,
+				    filter_ctx);
+	if (ret)
+		return ret;
+
+	return write_piece_lists(wim, &piece_lists);
 }
 
 static int
@@ -2326,6 +3125,11 @@ write_wim_lookup_table(WIMStruct *wim, int image, int write_flags,
 			    lte->rspec->wim == wim)
 			{
 				stream_set_out_reshdr_for_reuse(lte);
+			} else if (lte->resource_location == RESOURCE_IN_PIECES &&
+				   lte->piece_list->wim == wim)
+			{
+				copy_reshdr(&lte->out_reshdr,
+					    &lte->piece_list->reshdr);
 			}
 		}
 	}
@@ -2413,10 +3217,13 @@ write_wim_lookup_table(WIMStruct *wim, int image, int write_flags,
  *	(private) WIMLIB_WRITE_FLAG_OVERWRITE
  *		The existing WIM file is being updated in-place.  The entries
  *		from its integrity table may be re-used.
+ *
+ * num_threads is the number of threads to use to compute the integrity table,
+ * or 0 to use one thread per processor.
  */
 static int
 finish_write(WIMStruct *wim, int image, int write_flags,
-	     struct list_head *lookup_table_list)
+	     unsigned num_threads, struct list_head *lookup_table_list)
 {
 	int ret;
 	off_t hdr_offset;
@@ -2508,7 +3315,8 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 		ret = write_integrity_table(wim,
 					    new_lookup_table_end,
 					    old_lookup_table_end,
-					    old_integrity_table);
+					    old_integrity_table,
+					    num_threads);
 		free_integrity_table(old_integrity_table);
 		if (ret)
 			return ret;
@@ -2827,6 +3635,13 @@ write_wim_part(WIMStruct *wim,
 				    WIMLIB_WRITE_FLAG_NOT_PIPABLE))
 		return WIMLIB_ERR_INVALID_PARAM;
 
+	/* Piece lists cannot be used in pipable WIMs.  */
+	if ((write_flags & (WIMLIB_WRITE_FLAG_PIPABLE |
+			    WIMLIB_WRITE_FLAG_PIECE_DEDUP))
+				== (WIMLIB_WRITE_FLAG_PIPABLE |
+				    WIMLIB_WRITE_FLAG_PIECE_DEDUP))
+		return WIMLIB_ERR_INVALID_PARAM;
+
 	/* Save previous header, then start initializing the new one.  */
 	memcpy(&hdr_save, &wim->hdr, sizeof(struct wim_header));
 
@@ -2979,7 +3794,8 @@ write_wim_part(WIMStruct *wim,
 
 
 	/* Write lookup table, XML data, and (optional) integrity table.  */
-	ret = finish_write(wim, image, write_flags, &lookup_table_list);
+	ret = finish_write(wim, image, write_flags, num_threads,
+			   &lookup_table_list);
 out_restore_hdr:
 	memcpy(&wim->hdr, &hdr_save, sizeof(struct wim_header));
 	(void)close_wim_writable(wim, write_flags);
@@ -3044,6 +3860,11 @@ check_resource_offset(struct wim_lookup_table_entry *lte, void *_wim)
 	if (lte->resource_location == RESOURCE_IN_WIM && lte->rspec->wim == wim &&
 	    lte->rspec->offset_in_wim + lte->rspec->size_in_wim > end_offset)
 		return WIMLIB_ERR_RESOURCE_ORDER;
+	if (lte->resource_location == RESOURCE_IN_PIECES &&
+	    lte->piece_list->wim == wim &&
+	    lte->piece_list->reshdr.offset_in_wim +
+	    lte->piece_list->reshdr.size_in_wim > end_offset)
+		return WIMLIB_ERR_RESOURCE_ORDER;
 	return 0;
 }
 
@@ -3135,6 +3956,7 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 	struct wim_header hdr_save;
 	struct list_head stream_list;
 	struct list_head lookup_table_list;
+	struct list_head piece_lists;
 	struct filter_context filter_ctx;
 
 	DEBUG("Overwriting `%"TS"' in-place", wim->filename);
@@ -3213,6 +4035,12 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 	if (ret)
 		goto out_restore_memory_hdr;
 
+	ret = prepare_piece_lists_for_write(wim, write_flags,
+					    &stream_list, &lookup_table_list,
+					    &filter_ctx, &piece_lists);
+	if (ret)
+		goto out_restore_memory_hdr;
+
 	ret = open_wim_writable(wim, wim->filename, O_RDWR);
 	if (ret)
 		goto out_restore_memory_hdr;
@@ -3243,11 +4071,15 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 	if (ret)
 		goto out_truncate;
 
+	ret = write_piece_lists(wim, &piece_lists);
+	if (ret)
+		goto out_truncate;
+
 	ret = write_wim_metadata_resources(wim, WIMLIB_ALL_IMAGES, write_flags);
 	if (ret)
 		goto out_truncate;
 
-	ret = finish_write(wim, WIMLIB_ALL_IMAGES, write_flags,
+	ret = finish_write(wim, WIMLIB_ALL_IMAGES, write_flags, num_threads,
 			   &lookup_table_list);
 	if (ret)
 		goto out_truncate;
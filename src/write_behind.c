@@ -0,0 +1,318 @@
+/*
+ * write_behind.c
+ *
+ * Write data to the output file from a separate thread, so that the thread
+ * producing the data does not have to wait for each write() to complete.
+ */
+
+/*
+ * Copyright (C) 2014 Eric Biggers
+ *
+ * This file is part of wimlib, a library for working with WIM files.
+ *
+ * wimlib is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * wimlib is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * wimlib; if not, see http://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef ENABLE_MULTITHREADED_COMPRESSION
+
+#include "wimlib/assert.h"
+#include "wimlib/error.h"
+#include "wimlib/spsc_queue.h"
+#include "wimlib/util.h"
+#include "wimlib/write_behind.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+/*
+ * The data passed to write_behind_write() and write_behind_pwrite() is copied
+ * into buffers, which are handed to the writer thread through one queue and
+ * handed back empty through another.  The writer thread writes the buffers in
+ * the order it receives them, so sequential writes and writes at an offset take
+ * effect in the same order as they would have with full_write() and
+ * full_pwrite().
+ *
+ * The offset of the output file descriptor is advanced as soon as sequential
+ * data is queued, so the caller sees the same offset it would have seen had the
+ * data been written immediately.  The position of the underlying file
+ * descriptor only matches it after write_behind_flush().
+ */
+
+struct write_behind_buf {
+	/* Offset at which to write the data, or -1 to write it at the current
+	 * position of the file descriptor.  */
+	off_t offset;
+
+	/* Number of bytes of @data filled in.  */
+	size_t size;
+
+	u8 data[WRITE_BEHIND_BUF_SIZE];
+};
+
+struct write_behind {
+	/* File descriptor given to write_behind_start().  Only its offset is
+	 * updated, by the calling thread.  */
+	struct filedes *out_fd;
+
+	/* Copy of *out_fd used by the writer thread.  */
+	struct filedes thread_fd;
+
+	pthread_t thread;
+	struct spsc_queue filled_bufs;
+	struct spsc_queue empty_bufs;
+
+	/* Buffer being filled with sequential data, or NULL.  */
+	struct write_behind_buf *cur_buf;
+
+	/* Buffers not in use by the writer thread.  */
+	struct write_behind_buf *idle_bufs[WRITE_BEHIND_NUM_BUFS];
+	unsigned num_idle_bufs;
+
+	unsigned num_alloc_bufs;
+	unsigned num_bufs_in_flight;
+
+	/* The first error the writer thread encountered, and the value errno
+	 * had then.  Written by the writer thread before handing back the
+	 * buffer that failed.  */
+	int status;
+	int status_errno;
+};
+
+static void *
+writer_thread_proc(void *_wb)
+{
+	struct write_behind *wb = _wb;
+	struct write_behind_buf *buf;
+	int ret;
+
+	while ((buf = spsc_queue_get(&wb->filled_bufs, NULL)) != NULL) {
+		/* After an error, buffers are just handed back.  */
+		if (!__atomic_load_n(&wb->status, __ATOMIC_RELAXED)) {
+			if (buf->offset < 0)
+				ret = full_write(&wb->thread_fd, buf->data,
+						 buf->size);
+			else
+				ret = full_pwrite(&wb->thread_fd, buf->data,
+						  buf->size, buf->offset);
+			if (ret) {
+				wb->status_errno = errno;
+				__atomic_store_n(&wb->status, ret,
+						 __ATOMIC_RELEASE);
+			}
+		}
+		spsc_queue_put(&wb->empty_bufs, buf);
+	}
+	return NULL;
+}
+
+static int
+write_behind_status(struct write_behind *wb)
+{
+	int status = __atomic_load_n(&wb->status, __ATOMIC_ACQUIRE);
+
+	if (status)
+		errno = wb->status_errno;
+	return status;
+}
+
+/* Get an empty buffer, waiting for the writer thread to finish with one if all
+ * are in use.  */
+static int
+get_empty_buf(struct write_behind *wb, struct write_behind_buf **buf_ret)
+{
+	struct write_behind_buf *buf;
+	int ret;
+
+	if (wb->num_idle_bufs != 0) {
+		buf = wb->idle_bufs[--wb->num_idle_bufs];
+	} else if (wb->num_alloc_bufs < WRITE_BEHIND_NUM_BUFS) {
+		buf = MALLOC(sizeof(*buf));
+		if (!buf)
+			return WIMLIB_ERR_NOMEM;
+		wb->num_alloc_bufs++;
+	} else {
+		buf = spsc_queue_get(&wb->empty_bufs, NULL);
+		wb->num_bufs_in_flight--;
+		ret = write_behind_status(wb);
+		if (ret) {
+			wb->idle_bufs[wb->num_idle_bufs++] = buf;
+			return ret;
+		}
+	}
+	buf->size = 0;
+	*buf_ret = buf;
+	return 0;
+}
+
+static void
+submit_buf(struct write_behind *wb, struct write_behind_buf *buf)
+{
+	wb->num_bufs_in_flight++;
+	spsc_queue_put(&wb->filled_bufs, buf);
+}
+
+static void
+submit_cur_buf(struct write_behind *wb)
+{
+	if (wb->cur_buf) {
+		submit_buf(wb, wb->cur_buf);
+		wb->cur_buf = NULL;
+	}
+}
+
+/* Start a thread to write data to @out_fd.  Until write_behind_finish() is
+ * called, data must only be written to @out_fd through the returned
+ * write_behind, and anything else done with @out_fd must be preceded by
+ * write_behind_flush().  */
+int
+write_behind_start(struct filedes *out_fd, struct write_behind **wb_ret)
+{
+	struct write_behind *wb;
+	int ret;
+
+	wb = CALLOC(1, sizeof(*wb));
+	if (!wb)
+		return WIMLIB_ERR_NOMEM;
+
+	wb->out_fd = out_fd;
+	wb->thread_fd = *out_fd;
+
+	ret = spsc_queue_init(&wb->filled_bufs, WRITE_BEHIND_NUM_BUFS);
+	if (ret)
+		goto err_free_wb;
+	ret = spsc_queue_init(&wb->empty_bufs, WRITE_BEHIND_NUM_BUFS);
+	if (ret)
+		goto err_destroy_filled_bufs;
+
+	ret = pthread_create(&wb->thread, NULL, writer_thread_proc, wb);
+	if (ret) {
+		errno = ret;
+		WARNING_WITH_ERRNO("Failed to create writer thread");
+		ret = WIMLIB_ERR_NOMEM;
+		goto err_destroy_empty_bufs;
+	}
+	*wb_ret = wb;
+	return 0;
+
+err_destroy_empty_bufs:
+	spsc_queue_destroy(&wb->empty_bufs);
+err_destroy_filled_bufs:
+	spsc_queue_destroy(&wb->filled_bufs);
+err_free_wb:
+	FREE(wb);
+	return ret;
+}
+
+/* Queue @count bytes to be written at the current offset of the output file,
+ * like full_write().  Returns WIMLIB_ERR_WRITE, with errno set, if an earlier
+ * write failed.  */
+int
+write_behind_write(struct write_behind *wb, const void *buf, size_t count)
+{
+	const u8 *p = buf;
+	size_t remaining = count;
+	int ret;
+
+	while (remaining != 0) {
+		size_t n;
+
+		if (wb->cur_buf && wb->cur_buf->size == WRITE_BEHIND_BUF_SIZE)
+			submit_cur_buf(wb);
+		if (!wb->cur_buf) {
+			ret = get_empty_buf(wb, &wb->cur_buf);
+			if (ret)
+				return ret;
+			wb->cur_buf->offset = -1;
+		}
+		n = min(remaining, WRITE_BEHIND_BUF_SIZE - wb->cur_buf->size);
+		memcpy(&wb->cur_buf->data[wb->cur_buf->size], p, n);
+		wb->cur_buf->size += n;
+		p += n;
+		remaining -= n;
+	}
+	wb->out_fd->offset += count;
+	return 0;
+}
+
+/* Queue @count bytes to be written at @offset in the output file, like
+ * full_pwrite().  The write happens after that of all data queued earlier.  */
+int
+write_behind_pwrite(struct write_behind *wb, const void *buf, size_t count,
+		    off_t offset)
+{
+	const u8 *p = buf;
+	int ret;
+
+	submit_cur_buf(wb);
+
+	while (count != 0) {
+		struct write_behind_buf *wbuf;
+		size_t n = min(count, WRITE_BEHIND_BUF_SIZE);
+
+		ret = get_empty_buf(wb, &wbuf);
+		if (ret)
+			return ret;
+		memcpy(wbuf->data, p, n);
+		wbuf->size = n;
+		wbuf->offset = offset;
+		submit_buf(wb, wbuf);
+		p += n;
+		offset += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/* Wait for all queued data to be written.  Afterwards, the position of the
+ * output file descriptor is its offset, and the caller may use it directly
+ * until it next queues data.  */
+int
+write_behind_flush(struct write_behind *wb)
+{
+	submit_cur_buf(wb);
+	while (wb->num_bufs_in_flight != 0) {
+		wb->idle_bufs[wb->num_idle_bufs++] =
+			spsc_queue_get(&wb->empty_bufs, NULL);
+		wb->num_bufs_in_flight--;
+	}
+	return write_behind_status(wb);
+}
+
+/* Write all queued data, stop the writer thread, and free the write_behind.
+ * Returns the status of the writes.  */
+int
+write_behind_finish(struct write_behind *wb)
+{
+	int ret;
+	int saved_errno;
+
+	ret = write_behind_flush(wb);
+	saved_errno = errno;
+	spsc_queue_terminate(&wb->filled_bufs);
+	pthread_join(wb->thread, NULL);
+	for (unsigned i = 0; i < wb->num_idle_bufs; i++)
+		FREE(wb->idle_bufs[i]);
+	wimlib_assert(wb->num_idle_bufs == wb->num_alloc_bufs);
+	spsc_queue_destroy(&wb->empty_bufs);
+	spsc_queue_destroy(&wb->filled_bufs);
+	FREE(wb);
+	errno = saved_errno;
+	return ret;
+}
+
+#endif /* ENABLE_MULTITHREADED_COMPRESSION */
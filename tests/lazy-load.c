@@ -0,0 +1,92 @@
+/*
+ * A program to test modifying and exporting a WIM image whose directory tree
+ * has only been partly loaded
+ *
+ * Usage: lazy-load WIMFILE IMAGE PATH OUTFILE [--delete]
+ *
+ * WIMFILE is opened with WIMLIB_OPEN_FLAG_LAZY_METADATA, and the directory PATH
+ * in IMAGE is listed, which loads only the directories from the root to PATH.
+ * The number of entries in PATH and the total of their link counts are printed;
+ * the link counts must include hard links in directories not yet loaded.
+ * If --delete is given, PATH is then deleted from the image.  Finally, the
+ * image is exported to the new WIM file OUTFILE, which requires the rest of the
+ * tree to be loaded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wimlib.h"
+
+static void
+check(int ret, const char *what)
+{
+	if (ret) {
+		fprintf(stderr, "lazy-load: %s: %s\n",
+			what, wimlib_get_error_string(ret));
+		exit(1);
+	}
+}
+
+struct counts {
+	unsigned long entries;
+	unsigned long links;
+};
+
+static int
+count_entry(const struct wimlib_dir_entry *dentry, void *_counts)
+{
+	struct counts *counts = _counts;
+
+	counts->entries++;
+	counts->links += dentry->num_links;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	WIMStruct *wim, *out_wim;
+	struct wimlib_wim_info info;
+	struct wimlib_update_command cmd;
+	struct counts counts = { 0, 0 };
+	int image;
+
+	if (argc != 5 && !(argc == 6 && !strcmp(argv[5], "--delete"))) {
+		fprintf(stderr, "Usage: lazy-load WIMFILE IMAGE PATH OUTFILE "
+			"[--delete]\n");
+		return 2;
+	}
+	image = atoi(argv[2]);
+
+	check(wimlib_global_init(WIMLIB_INIT_FLAG_ASSUME_UTF8), "init");
+	check(wimlib_open_wim(argv[1], WIMLIB_OPEN_FLAG_LAZY_METADATA, &wim),
+	      "open");
+
+	check(wimlib_iterate_dir_tree(wim, image, argv[3],
+				      WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN,
+				      count_entry, &counts),
+	      "list");
+	printf("%lu entries in %s with %lu links\n",
+	       counts.entries, argv[3], counts.links);
+
+	if (argc == 6) {
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.op = WIMLIB_UPDATE_OP_DELETE;
+		cmd.delete_.wim_path = argv[3];
+		cmd.delete_.delete_flags = WIMLIB_DELETE_FLAG_RECURSIVE;
+		check(wimlib_update_image(wim, image, &cmd, 1, 0), "delete");
+	}
+
+	check(wimlib_get_wim_info(wim, &info), "info");
+	check(wimlib_create_new_wim(info.compression_type, &out_wim), "create");
+	check(wimlib_export_image(wim, image, out_wim, NULL, NULL, 0),
+	      "export");
+	check(wimlib_write(out_wim, argv[4], WIMLIB_ALL_IMAGES, 0, 0), "write");
+
+	wimlib_free(out_wim);
+	wimlib_free(wim);
+	wimlib_global_cleanup();
+	return 0;
+}
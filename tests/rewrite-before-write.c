@@ -0,0 +1,86 @@
+/*
+ * A program to test capturing a directory tree in which a file is rewritten
+ * after it has been scanned, but before the WIM is written
+ *
+ * Usage: rewrite-before-write DIR FILE WIMFILE [--pipeline]
+ *
+ * DIR is added as a new image of a new WIM, with WIMLIB_ADD_FLAG_PIPELINE if
+ * --pipeline is given.  Then FILE, which must be in DIR, is rewritten in place
+ * with each of its bytes inverted, so its size stays the same.  Finally the WIM
+ * is written to WIMFILE.  Applying WIMFILE must give the tree as it is after
+ * the rewrite.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wimlib.h"
+
+static void
+check(int ret, const char *what)
+{
+	if (ret) {
+		fprintf(stderr, "rewrite-before-write: %s: %s\n",
+			what, wimlib_get_error_string(ret));
+		exit(1);
+	}
+}
+
+static void
+rewrite_file(const char *path)
+{
+	char buf[65536];
+	off_t offset = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	while ((n = pread(fd, buf, sizeof(buf), offset)) > 0) {
+		for (ssize_t i = 0; i < n; i++)
+			buf[i] = ~buf[i];
+		if (pwrite(fd, buf, n, offset) != n) {
+			perror(path);
+			exit(1);
+		}
+		offset += n;
+	}
+	if (n < 0 || close(fd)) {
+		perror(path);
+		exit(1);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	WIMStruct *wim;
+	int add_flags = 0;
+
+	if (argc != 4 && !(argc == 5 && !strcmp(argv[4], "--pipeline"))) {
+		fprintf(stderr, "Usage: rewrite-before-write DIR FILE WIMFILE "
+			"[--pipeline]\n");
+		return 2;
+	}
+	if (argc == 5)
+		add_flags |= WIMLIB_ADD_FLAG_PIPELINE;
+
+	check(wimlib_global_init(WIMLIB_INIT_FLAG_ASSUME_UTF8), "init");
+	check(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_XPRESS, &wim),
+	      "create");
+	check(wimlib_add_image(wim, argv[1], "1", NULL, add_flags), "add");
+
+	rewrite_file(argv[2]);
+
+	check(wimlib_write(wim, argv[3], WIMLIB_ALL_IMAGES, 0, 0), "write");
+
+	wimlib_free(wim);
+	wimlib_global_cleanup();
+	return 0;
+}